@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <math.h>
 
 typedef float REAL;
 
@@ -2656,7 +2657,7 @@ void rfft(int n,int isign,REAL x[])
     return;
   }
 
-//  newipsize = 2+sqrt(n/2);
+  newipsize = 2+(int)sqrt((double)(n/2));
   if (newipsize > ipsize) {
     ipsize = newipsize;
     ip = (int *)realloc(ip,sizeof(int)*ipsize);
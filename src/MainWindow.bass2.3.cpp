@@ -616,6 +616,7 @@ CMainWindow::CMainWindow(CWnd *pParent /* NULL */ ) :
 CMainWindow::~CMainWindow() {
 	for(int i = 0; i < MAX_ENCODERS; i++) {
 		if(g[i]) {
+			freeupGlobals(g[i]);
 			free(g[i]);
 		}
 	}
@@ -1245,6 +1246,7 @@ void CMainWindow::OnPopupDelete() {
 		if(ret == IDYES) {
 			if(g[iItem]) {
 				deleteConfigFile(g[iItem]);
+				freeupGlobals(g[iItem]);
 				free(g[iItem]);
 			}
 
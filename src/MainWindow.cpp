@@ -7,7 +7,13 @@
 #include "mcaster1dspencoder.h"
 #include "MainWindow.h"
 #include "libmcaster1dspencoder.h"
+#include "reconnect_scheduler.h"
+#include "metrics_server.h"
+#include "pipeline_trace.h"
 #include "config_yaml.h"
+#ifndef MCASTER1_PLUGIN
+#include "relay_input.h"
+#endif
 #include <process.h>
 #include <portaudio.h>
 #include <math.h>
@@ -35,6 +41,9 @@ mcaster1Globals			gMain;
 
 static PaStream			*g_paStream = NULL;
 static int				g_paDeviceIndex = -1;   /* active PortAudio input device */
+#ifndef MCASTER1_PLUGIN
+static RelayInput		g_relay;				/* upstream stream in place of the sound card (RelayURL) */
+#endif
 
 bool					gLiveRecording = false;
 volatile float			g_recVolumeFactor = 1.0f;   /* software input gain: 0.0=silent, 1.0=unity */
@@ -115,45 +124,15 @@ HANDLE hProc = GetCurrentProcess();//Gets the current process handle
 	return(1);
 }
 }
+/* Reconnects run on the library's scheduler pool, this only shows the countdown */
 VOID CALLBACK ReconnectTimer(HWND hwnd, UINT uMsg, UINT idEvent, DWORD dwTime) {
-	time_t	currentTime;
-
-	currentTime = time(&currentTime);
 	for(int i = 0; i < gMain.gNumEncoders; i++) {
-		if(g[i]->forcedDisconnect) {
-			int timeout = getReconnectSecs(g[i]);
-			time_t timediff = currentTime - g[i]->forcedDisconnectSecs;
-			if(timediff > timeout) {
-				g[i]->forcedDisconnect = false;
-				_beginthreadex(NULL,
-							   0,
-							   (unsigned(_stdcall *) (void *)) startSpecificMcaster1Thread,
-							   (void *) i,
-							   0,
-							   &mcaster1Thread);
-//Begin patch multiple cpu
-HANDLE hProc = GetCurrentProcess();//Gets the current process handle
-      DWORD procMask;
-      DWORD sysMask;
-      HANDLE hDup;
-      DuplicateHandle(hProc,
-                    hProc,
-                    hProc,
-                    &hDup,
-                    0,
-                    FALSE,
-                    DUPLICATE_SAME_ACCESS);
+		int wait = getReconnectWait(g[i]);
 
-      GetProcessAffinityMask(hDup,&procMask,&sysMask);//Gets the current process affinity mask
-      DWORD newMask = 2;//new Mask, uses only the first CPU
-      BOOL res = SetProcessAffinityMask(hDup,(DWORD_PTR)newMask);//Set the affinity mask for the process
-//End patch multiple cpu 
-			}
-			else {
-				char	buf[255] = "";
-				sprintf(buf, "Connecting in %d seconds", timeout - timediff);
-				pWindow->outputStatusCallback(i + 1, buf);
-			}
+		if(wait > 0) {
+			char	buf[255] = "";
+			sprintf(buf, "Connecting in %d seconds", wait);
+			pWindow->outputStatusCallback(i + 1, buf);
 		}
 	}
 }
@@ -344,6 +323,55 @@ int handleAllOutput(float *samples, int nsamples, int nchannels, int in_samplera
 	return 1;
 }
 
+/*
+ * 16 bit hosts (Winamp, RadioDJ).  Slots whose codec takes 16 bit input get
+ * the host samples without a float round-trip.  The host buffer is what is
+ * being played, so software gain still goes through the float path.
+ */
+int handleAllOutputInt16(short *samples, int nsamples, int nchannels, int in_samplerate) {
+	if (g_recVolumeFactor < 0.9999f) {
+		float	*float_samples = (float *) malloc(sizeof(float) * nsamples * nchannels);
+
+		if (!float_samples) {
+			return 0;
+		}
+
+		for (int i = 0; i < nsamples * nchannels; i++) {
+			float_samples[i] = samples[i] / 32767.f;
+		}
+
+		int ret = handleAllOutput(float_samples, nsamples, nchannels, in_samplerate);
+		free(float_samples);
+		return ret;
+	}
+
+	long	leftMax = 0;
+	long	rightMax = 0;
+
+	for(int i = 0; i < nsamples; i++) {
+		long	left = abs((int) samples[i * nchannels]);
+		long	right = (nchannels == 2) ? abs((int) samples[i * 2 + 1]) : left;
+
+		if(left > leftMax) {
+			leftMax = left;
+		}
+
+		if(right > rightMax) {
+			rightMax = right;
+		}
+	}
+
+	double	newL = (double) 20 * log10((double) leftMax / 32768.0);
+	double	newR = (double) 20 * log10((double) rightMax / 32768.0);
+
+	UpdatePeak((int) newL + 60, (int) newR + 60);
+	for(int i = 0; i < gMain.gNumEncoders; i++) {
+		handle_output_int16(g[i], samples, nsamples, nchannels, in_samplerate);
+	}
+
+	return 1;
+}
+
 void UpdatePeak(int peakL, int peakR) {
 	/* Apply channel mode: zero out the inactive side so the meter only
 	   shows the selected channel when Left Only or Right Only is chosen. */
@@ -509,15 +537,29 @@ static int paRecordCallback(const void *inputBuffer, void *outputBuffer,
                             const PaStreamCallbackTimeInfo *timeInfo,
                             PaStreamCallbackFlags statusFlags, void *userData)
 {
-	(void)outputBuffer; (void)timeInfo; (void)statusFlags; (void)userData;
+	(void)outputBuffer; (void)userData;
 
 	if (!gLiveRecording || !inputBuffer)
 		return paContinue;
 
+	TRACE_BEGIN("capture", 0);
+	if (statusFlags & (paInputOverflow | paInputUnderflow))
+		metricsCaptureXrun();
+
 	int nch   = 2;
 	int srate = 48000;
 
+	/* when the first frame left the ADC, on the encoders' clock */
+	long long captured = getMonotonicMicros();
+	if (timeInfo && timeInfo->inputBufferAdcTime > 0 && timeInfo->currentTime >= timeInfo->inputBufferAdcTime)
+		captured -= (long long) ((timeInfo->currentTime - timeInfo->inputBufferAdcTime) * 1000000.0);
+	for (int i = 0; i < gMain.gNumEncoders; i++) {
+		if (g[i])
+			stampCapture(g[i], captured);
+	}
+
 	handleAllOutput((float *)inputBuffer, (int)framesPerBuffer, nch, srate);
+	TRACE_END("capture", 0);
 
 	return paContinue;
 }
@@ -550,8 +592,49 @@ static int paRecordCallback(const void *inputBuffer, void *outputBuffer,
     }
  =======================================================================================================================
  */
+#ifndef MCASTER1_PLUGIN
+/* Relay input callbacks, these run on the relay's own threads */
+static int relayFrame(const CompressedFrame *frame) {
+	int needPCM = 0;
+
+	if (!gLiveRecording)
+		return 0;
+
+	/* every slot gets the chance, the frame is only decoded for those that did not take it */
+	for (int i = 0; i < gMain.gNumEncoders; i++) {
+		if (!passthroughFrame(g[i], frame))
+			needPCM = 1;
+	}
+
+	return needPCM;
+}
+
+static void relayGap() {
+	for (int i = 0; i < gMain.gNumEncoders; i++) {
+		if (g[i])
+			passthroughGap(g[i]);
+	}
+}
+
+static void relayAudio(float *samples, int frames, int channels, int samplerate) {
+	if (gLiveRecording)
+		handleAllOutput(samples, frames, channels, samplerate);
+}
+
+static void relayMetadata(const char *title) {
+	setMetadataFromMediaPlayer((char *)title);
+}
+
+static void relayStatus(const char *message) {
+	pWindow->generalStatusCallback((void *)message);
+}
+#endif
+
 void stopRecording() {
 	gLiveRecording = false;
+#ifndef MCASTER1_PLUGIN
+	stopRelayInput(&g_relay);
+#endif
 	if (g_paStream) {
 		Pa_StopStream(g_paStream);
 		Pa_CloseStream(g_paStream);
@@ -563,6 +646,20 @@ int startRecording(int deviceIndex) {
 	/* Stop any existing stream first */
 	stopRecording();
 
+#ifndef MCASTER1_PLUGIN
+	/* A relay URL replaces the sound card; the encoders get silence until it delivers */
+	if (gMain.relayURL[0]) {
+		if (!startRelayInput(&g_relay, gMain.relayURL, gMain.relayBufferMs, relayFrame,
+		                     relayAudio, relayMetadata, relayGap, relayStatus)) {
+			pWindow->generalStatusCallback((char *)"Relay URL not usable, expected http://host:port/mount");
+			return 0;
+		}
+
+		gLiveRecording = true;
+		return 1;
+	}
+#endif
+
 	if (deviceIndex < 0) {
 		deviceIndex = Pa_GetDefaultInputDevice();
 		if (deviceIndex == paNoDevice) {
@@ -585,8 +682,15 @@ int startRecording(int deviceIndex) {
 	inputParams.suggestedLatency          = devInfo->defaultLowInputLatency;
 	inputParams.hostApiSpecificStreamInfo = NULL;
 
+	/* One slot on the low latency profile gets short capture periods for all */
+	unsigned long framesPerBuffer = 512;
+	for (int i = 0; i < gMain.gNumEncoders; i++) {
+		if (g[i] && g[i]->lowLatency)
+			framesPerBuffer = LOWLAT_CAPTURE_FRAMES;
+	}
+
 	PaError err = Pa_OpenStream(&g_paStream, &inputParams, NULL,
-	                            48000.0, 512, paNoFlag,
+	                            48000.0, framesPerBuffer, paNoFlag,
 	                            paRecordCallback, NULL);
 	if (err != paNoError) {
 		char msg[255];
@@ -606,6 +710,15 @@ int startRecording(int deviceIndex) {
 		return 0;
 	}
 
+	/* What the card path adds, for the latency the slots report */
+	const PaStreamInfo *streamInfo = Pa_GetStreamInfo(g_paStream);
+	long captureMs = (streamInfo && streamInfo->inputLatency > 0)
+	                 ? (long) (streamInfo->inputLatency * 1000) : (long) (framesPerBuffer * 1000 / 48000);
+	for (int i = 0; i < gMain.gNumEncoders; i++) {
+		if (g[i])
+			setCaptureLatency(g[i], captureMs);
+	}
+
 	char statusMsg[512];
 	sprintf(statusMsg, "Recording from: %s", devInfo->name);
 	pWindow->generalStatusCallback(statusMsg);
@@ -650,6 +763,7 @@ CMainWindow::CMainWindow(CWnd *pParent /* NULL */ ) :
 CMainWindow::~CMainWindow() {
 	for(int i = 0; i < MAX_ENCODERS; i++) {
 		if(g[i]) {
+			freeupGlobals(g[i]);
 			free(g[i]);
 		}
 	}
@@ -846,12 +960,11 @@ int CMainWindow::startMcaster1(int which) {
 		for(int i = 0; i < gMain.gNumEncoders; i++) {
 			if(!g[i]->weareconnected) {
 				setForceStop(g[i], 0);
-				if(!connectToServer(g[i])) {
-					g[i]->forcedDisconnect = true;
-					continue;
-				}
 			}
 		}
+
+		/* side by side, a slow server no longer holds up the slots after it */
+		connectAllServers(g, gMain.gNumEncoders, gMain.parallelConnects);
 	}
 	else {
 		if(!g[which]->weareconnected) {
@@ -859,7 +972,7 @@ int CMainWindow::startMcaster1(int which) {
 
 			int ret = connectToServer(g[which]);
 			if(ret == 0) {
-				g[which]->forcedDisconnect = true;
+				scheduleReconnect(g[which]);
 			}
 		}
 	}
@@ -988,6 +1101,10 @@ BOOL CMainWindow::OnInitDialog() {
 		mcaster1_init(g[i]);
 	}
 
+	setTraceEnabled(gMain.traceEnable);
+	setGovernorThresholds(gMain.governorHighLoad, gMain.governorLowLoad, gMain.governorHoldMs);
+	startMetricsServer(&gMain);
+
 	/* Enumerate input devices via PortAudio */
 	Pa_Initialize();
 	int numDevices = Pa_GetDeviceCount();
@@ -1351,6 +1468,7 @@ void CMainWindow::OnPopupDelete() {
 		if(ret == IDYES) {
 			if(g[iItem]) {
 				deleteConfigFile(g[iItem]);
+				freeupGlobals(g[iItem]);
 				free(g[iItem]);
 			}
 
@@ -1476,6 +1594,7 @@ void CMainWindow::OnDestroy() {
 
 	stopMcaster1();
 	CleanUp();
+	stopMetricsServer();
 	if(configDialog) {
 		configDialog->DestroyWindow();
 		delete configDialog;
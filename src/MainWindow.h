@@ -24,6 +24,7 @@ int initializeMcaster1();
 bool LiveRecordingCheck();
 void UpdatePeak(int peakL, int peakR);
 int handleAllOutput(float *samples, int nsamples, int nchannels, int in_samplerate);
+int handleAllOutputInt16(short *samples, int nsamples, int nchannels, int in_samplerate);
 void addComment(char *comment);
 void freeComment();
 
@@ -136,6 +136,14 @@ int writeConfigYAML(mcaster1Globals *g)
     EINT("AutomaticReconnect",     g->gAutoReconnect);
     EINT("AutomaticReconnectSecs", g->gReconnectSec);
     EINT("AutoConnect",            g->autoconnect);
+    EINT("ReconnectMaxSecs",       g->reconnectMaxSecs);
+    ESTR("BackupServer",           g->backupServer);
+    ESTR("BackupPort",             g->backupPort);
+    EINT("StandbyEnable",          g->standbyEnabled);
+    EINT("ParallelConnects",       g->parallelConnects);
+    EINT("MetricsPort",            g->metricsPort);
+    ESTR("MetricsAddress",         g->metricsAddress);
+    EINT("TraceEnable",            g->traceEnable);
 
     // ── Encoder ──────────────────────────────────────────────────────────────
     ESTR("Encode",               g->gEncodeType);
@@ -175,11 +183,42 @@ int writeConfigYAML(mcaster1Globals *g)
     EINT("LameMaxBitrate", g->lameMaxBitrate);
 #endif
 
+    // ── Quality governor ─────────────────────────────────────────────────────
+    EINT("GovernorEnable",   g->governorEnabled);
+    EINT("GovernorHighLoad", g->governorHighLoad);
+    EINT("GovernorLowLoad",  g->governorLowLoad);
+    EINT("GovernorHoldMs",   g->governorHoldMs);
+    EINT("GovernorPriority", g->governorPriority);
+
+    // ── Adaptive bitrate ─────────────────────────────────────────────────────
+    EINT("AdaptiveBitrate",    g->abrEnabled);
+    EINT("AdaptiveBitrateMin", g->abrMinBitrate);
+
+    // ── Send pacing ──────────────────────────────────────────────────────────
+    EINT("PacingEnable",          g->pacingEnabled);
+    EINT("PacingHeadroomPercent", g->pacingHeadroom);
+    EINT("PacingBurstKB",         g->pacingBurstKB);
+
+    // ── Reconnect replay ─────────────────────────────────────────────────────
+    EINT("ReplayBufferSecs",   g->replaySecs);
+    EINT("ReplaySpeedPercent", g->replaySpeed);
+    EINT("ReplayBurstSecs",    g->replayBurstSecs);
+
+    // ── Low latency ──────────────────────────────────────────────────────────
+    EINT("LowLatency",        g->lowLatency);
+    EINT("LowLatencyFrameMs", g->lowLatencyFrameMs);
+    EINT("LatencyReportSecs", g->stageReportSecs);
+
+    // ── Passthrough ──────────────────────────────────────────────────────────
+    EINT("PassthroughEnable", g->passthroughEnabled);
+
     // ── Recording ────────────────────────────────────────────────────────────
     ESTR("AdvRecDevice",    g->gAdvRecDevice);
     EINT("LiveInSamplerate", g->gLiveInSamplerate);
     EINT("LineInFlag",       g->gLiveRecordingFlag);
     ESTR("WindowsRecDevice", g->WindowsRecDevice);
+    ESTR("RelayURL",         g->relayURL);
+    EINT("RelayBufferMs",    g->relayBufferMs);
 
     // ── Window position ──────────────────────────────────────────────────────
     EINT("lastX",       g->lastX);
@@ -196,12 +235,19 @@ int writeConfigYAML(mcaster1Globals *g)
     ESTR("MetadataRemoveAfter",  g->metadataRemoveStringAfter);
     ESTR("MetadataWindowClass",  g->metadataWindowClass);
     EINT("MetadataWindowClassInd", (int)g->metadataWindowClassInd);
+    EINT("MetadataCoalesceMs",   g->metadataCoalesceMs);
 
     // ── Advanced ─────────────────────────────────────────────────────────────
     ESTR("SaveDirectory",    g->gSaveDirectory);
     EINT("SaveDirectoryFlag", g->gSaveDirectoryFlag);
     EINT("LogLevel",         g->gLogLevel);
     EINT("SaveAsWAV",        g->gSaveAsWAV);
+    EINT("ArchiveRotateMinutes", g->archiveRotateMinutes);
+    EINT("ArchiveRotateMB",  g->archiveRotateMB);
+    EINT("ArchivePreallocMB", g->archivePreallocMB);
+    EINT("ArchiveQueueKB",   g->archiveQueueKB);
+    EINT("ArchiveCheckpointSeconds", g->archiveCheckpointSeconds);
+    EINT("ArchiveIndexEnable", g->archiveIndexEnabled);
     ESTR("LogFile",          g->gLogFile);
     EINT("NumEncoders",      g->gNumEncoders);
     ESTR("OutputControl",    g->outputControl);
@@ -20,10 +20,22 @@ oddsock@oddsock.org
 //
 //////////////////////////////////////////////////////////////////////
 
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#endif
 #include <stdio.h>
+#include "libmcaster1dspencoder.h"
 #include "libmcaster1dspencoder_socket.h"
+#include "net_resolver.h"
 
 #define MAX_LEN 256
+#define CONNECT_TIMEOUT_MS 10000
+#define CONNECT_ATTEMPT_DELAY_MS 250
 
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
@@ -126,12 +138,33 @@ SOCKET CMySocket::DoSocketAccept(SOCKET s)
     return(t);
 }
 
+static int setSocketBlocking(SOCKET s, int blocking)
+{
+#ifdef WIN32
+    u_long nonBlocking = !blocking;
+
+    return ioctlsocket(s, FIONBIO, &nonBlocking) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+
+    if (flags == -1)
+        return 0;
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return fcntl(s, F_SETFL, flags) != -1;
+#endif
+}
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // DoSocketConnect
 //
 // Description
-//   Performs a generic socket() and connect()
+//   Performs a generic socket() and connect().  The host name goes through
+//   the lookup cache (net_resolver.h), so a slow resolver costs at most
+//   RESOLVE_TIMEOUT_MS and usually nothing.  IPv4 and IPv6 addresses are
+//   raced happy eyeballs style: the next address is tried every
+//   CONNECT_ATTEMPT_DELAY_MS (or as soon as one fails) and the first
+//   socket to connect is returned, blocking, with the usual timeouts.
 //
 // Parameters
 //   hostname - host to connect() to.
@@ -139,40 +172,111 @@ SOCKET CMySocket::DoSocketAccept(SOCKET s)
 //
 SOCKET CMySocket::DoSocketConnect(char *hostname, unsigned short portnum)
 {
-	struct sockaddr_in sa;
-	struct hostent     *hp;
-	SOCKET s;
-
+	ResolvedAddresses addresses;
+	SOCKET attempts[RESOLVE_MAX_ADDRESSES];
+	int attemptCount = 0;
+	int next = 0;
+	SOCKET s = -1;
 
-	if ((hp= gethostbyname(hostname)) == NULL) { /* do we know the host's */
+	if (!resolveHost(hostname, portnum, &addresses, RESOLVE_TIMEOUT_MS)) { /* do we know the host's */
 
 #ifdef WIN32
 		SetLastError(WSAECONNREFUSED);
 #else
-		fprintf(stderr, "cannot find host %s", hostname);
+		fprintf(stderr, "cannot find host %s: %s", hostname, addresses.error);
 #endif
 		return(-1);                                /* no */
 	}
 
-	memset(&sa,0,sizeof(sa));
-	memcpy((char *)&sa.sin_addr,hp->h_addr,hp->h_length);     /* set address */
-	sa.sin_family= hp->h_addrtype;
-	sa.sin_port= htons((u_short)portnum);
+	long long giveUp = getMonotonicMicros() + (long long) CONNECT_TIMEOUT_MS * 1000;
+
+	while (s == -1) {
+		long long now = getMonotonicMicros();
+
+		if (now >= giveUp)
+			break;
+
+		/* one more address each pass */
+		if (next < addresses.count) {
+			ResolvedAddress *address = &addresses.address[next++];
+			SOCKET t = socket(address->family, SOCK_STREAM, 0);
+
+			if (t != -1 && setSocketBlocking(t, 0)) {
+				if (connect(t, (struct sockaddr *) address->storage, address->length) == 0) {
+					s = t;
+					break;
+				}
+#ifdef WIN32
+				if (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+				if (errno == EINPROGRESS)
+#endif
+				{
+					attempts[attemptCount++] = t;
+					t = -1;
+				}
+			}
+			if (t != -1)
+				closesocket(t);
+		}
+
+		if (!attemptCount) {
+			if (next < addresses.count)
+				continue;
+			break;
+		}
+
+		long long wait = giveUp - now;
+
+		if (next < addresses.count && wait > CONNECT_ATTEMPT_DELAY_MS * 1000)
+			wait = CONNECT_ATTEMPT_DELAY_MS * 1000;
+
+		fd_set writable;
+		fd_set failed;
+		struct timeval tv;
+		int maxfd = 0;
+
+		FD_ZERO(&writable);
+		FD_ZERO(&failed);
+		for (int i = 0; i < attemptCount; i++) {
+			FD_SET(attempts[i], &writable);
+			FD_SET(attempts[i], &failed);
+			if ((int) attempts[i] > maxfd)
+				maxfd = (int) attempts[i];
+		}
+		tv.tv_sec = (long) (wait / 1000000);
+		tv.tv_usec = (long) (wait % 1000000);
+		if (select(maxfd + 1, NULL, &writable, &failed, &tv) <= 0)
+			continue;
+
+		for (int i = attemptCount - 1; i >= 0; i--) {
+			if (!FD_ISSET(attempts[i], &writable) && !FD_ISSET(attempts[i], &failed))
+				continue;
+
+			int error = 0;
+			socklen_t length = sizeof(error);
+
+			getsockopt(attempts[i], SOL_SOCKET, SO_ERROR, (char *) &error, &length);
+			if (s == -1 && !error && FD_ISSET(attempts[i], &writable))
+				s = attempts[i];
+			else
+				closesocket(attempts[i]);
+			attempts[i] = attempts[--attemptCount];
+		}
+	}
+
+	while (attemptCount)
+		closesocket(attempts[--attemptCount]);
 
-	if ((s= socket(hp->h_addrtype,SOCK_STREAM,0)) < 0)     /* get socket */
+	if (s == -1)
 		return(-1);
-	
+
+	setSocketBlocking(s, 1);
+
 	int optval = 10000;
 	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&optval, sizeof(optval)); 
 	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&optval, sizeof(optval)); 
 
-	if (connect(s,(struct sockaddr *)&sa,sizeof sa) < 0) { /* connect */
-#ifdef WIN32
-		long err = WSAGetLastError();
-#endif
-		closesocket(s);
-		return(-1);
-	}
 	return(s);
 }
 
@@ -0,0 +1,271 @@
+/*
+ * archive_format.cpp - archive file headers and the index sidecar
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "archive_format.h"
+
+#define WAV_DS64_BYTES	28
+
+static unsigned char *putTag(unsigned char *p, const char *tag) {
+	memcpy(p, tag, 4);
+	return p + 4;
+}
+
+static unsigned char *putLE16(unsigned char *p, unsigned int value) {
+	p[0] = (unsigned char) value;
+	p[1] = (unsigned char) (value >> 8);
+	return p + 2;
+}
+
+static unsigned char *putLE32(unsigned char *p, unsigned int value) {
+	p = putLE16(p, value & 0xFFFF);
+	return putLE16(p, value >> 16);
+}
+
+static unsigned char *putLE64(unsigned char *p, unsigned long long value) {
+	p = putLE32(p, (unsigned int) (value & 0xFFFFFFFF));
+	return putLE32(p, (unsigned int) (value >> 32));
+}
+
+int buildWavHeader(unsigned char *header, int samplerate, int channels, long long dataBytes) {
+	unsigned char	*p = header;
+	long long		riffSize = WAV_HEADER_BYTES - 8 + dataBytes;
+	int				rf64 = (riffSize > 0xFFFFFFFFLL);
+	int				blockAlign = channels * (WAV_BITS / 8);
+
+	p = putTag(p, rf64 ? "RF64" : "RIFF");
+	p = putLE32(p, rf64 ? 0xFFFFFFFF : (unsigned int) riffSize);
+	p = putTag(p, "WAVE");
+
+	/* room for ds64, a reader skips it as JUNK until it is needed */
+	p = putTag(p, rf64 ? "ds64" : "JUNK");
+	p = putLE32(p, WAV_DS64_BYTES);
+	if(rf64) {
+		p = putLE64(p, riffSize);
+		p = putLE64(p, dataBytes);
+		p = putLE64(p, dataBytes / blockAlign);
+		p = putLE32(p, 0);		// no table entries
+	}
+	else {
+		memset(p, 0, WAV_DS64_BYTES);
+		p += WAV_DS64_BYTES;
+	}
+
+	p = putTag(p, "fmt ");
+	p = putLE32(p, 16);
+	p = putLE16(p, 1);			// PCM
+	p = putLE16(p, channels);
+	p = putLE32(p, samplerate);
+	p = putLE32(p, samplerate * blockAlign);
+	p = putLE16(p, blockAlign);
+	p = putLE16(p, WAV_BITS);
+
+	p = putTag(p, "data");
+	putLE32(p, rf64 ? 0xFFFFFFFF : (unsigned int) dataBytes);
+	return rf64;
+}
+
+/*
+ =======================================================================================================================
+    Index
+ =======================================================================================================================
+ */
+FILE *createArchiveIndex(const char *archiveName) {
+	char			name[1100];
+	unsigned char	header[8];
+	FILE			*fp;
+
+	snprintf(name, sizeof(name), "%s%s", archiveName, ARCHIVE_INDEX_SUFFIX);
+	fp = fopen(name, "wb");
+	if(!fp) {
+		return NULL;
+	}
+
+	putLE32(putTag(header, ARCHIVE_INDEX_MAGIC), ARCHIVE_INDEX_VERSION);
+	if(fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+		fclose(fp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+int writeIndexFormat(FILE *fp, int samplerate, int channels) {
+	unsigned char	record[9];
+
+	record[0] = ARCHIVE_INDEX_FORMAT;
+	putLE32(putLE32(record + 1, samplerate), channels);
+	return fwrite(record, 1, sizeof(record), fp) == sizeof(record);
+}
+
+int writeIndexTitle(FILE *fp, const char *title) {
+	unsigned char	record[3];
+	size_t			length = strlen(title);
+
+	if(length > 0xFFFF) {
+		length = 0xFFFF;
+	}
+
+	record[0] = ARCHIVE_INDEX_TITLE;
+	putLE16(record + 1, (unsigned int) length);
+	return (fwrite(record, 1, sizeof(record), fp) == sizeof(record)) && (fwrite(title, 1, length, fp) == length);
+}
+
+int writeIndexEntry(FILE *fp, int type, long long wallMillis, long long sample, long long offset) {
+	unsigned char	record[25];
+
+	record[0] = (unsigned char) type;
+	putLE64(putLE64(putLE64(record + 1, wallMillis), sample), offset);
+	return fwrite(record, 1, sizeof(record), fp) == sizeof(record);
+}
+
+static unsigned long long getLE(const unsigned char *p, int bytes) {
+	unsigned long long	value = 0;
+
+	while(bytes--) {
+		value = (value << 8) | p[bytes];
+	}
+
+	return value;
+}
+
+static int addIndexEntry(ArchiveIndex *index, int *allocated, const ArchiveIndexEntry *entry) {
+	if(index->count == *allocated) {
+		int					grow = *allocated ? *allocated * 2 : 4096;
+		ArchiveIndexEntry	*entries = (ArchiveIndexEntry *) realloc(index->entries, grow * sizeof(ArchiveIndexEntry));
+
+		if(!entries) {
+			return 0;
+		}
+
+		index->entries = entries;
+		*allocated = grow;
+	}
+
+	index->entries[index->count++] = *entry;
+	return 1;
+}
+
+static int addIndexTitle(ArchiveIndex *index, const unsigned char *text, int length) {
+	char	**titles = (char **) realloc(index->titles, (index->titleCount + 1) * sizeof(char *));
+	char	*title = (char *) malloc(length + 1);
+
+	if(titles) {
+		index->titles = titles;
+	}
+
+	if(!titles || !title) {
+		free(title);
+		return 0;
+	}
+
+	memcpy(title, text, length);
+	title[length] = '\000';
+	index->titles[index->titleCount++] = title;
+	return 1;
+}
+
+int loadArchiveIndex(const char *archiveName, ArchiveIndex *index) {
+	char				name[1100];
+	unsigned char		record[25];
+	unsigned char		text[0x10000];
+	ArchiveIndexEntry	entry;
+	int					allocated = 0;
+	int					samplerate = 0;
+	FILE				*fp;
+
+	memset(index, '\000', sizeof(*index));
+	snprintf(name, sizeof(name), "%s%s", archiveName, ARCHIVE_INDEX_SUFFIX);
+	fp = fopen(name, "rb");
+	if(!fp) {
+		return 0;
+	}
+
+	if((fread(record, 1, 8, fp) != 8) || memcmp(record, ARCHIVE_INDEX_MAGIC, 4) || (getLE(record + 4, 4) != ARCHIVE_INDEX_VERSION)) {
+		fclose(fp);
+		return 0;
+	}
+
+	for(;;) {
+		int type = fgetc(fp);
+		int ok = 0;
+
+		if(type == ARCHIVE_INDEX_FORMAT) {
+			if(fread(record, 1, 8, fp) == 8) {
+				samplerate = (int) getLE(record, 4);
+				index->channels = (int) getLE(record + 4, 4);
+				ok = 1;
+			}
+		}
+		else if(type == ARCHIVE_INDEX_TITLE) {
+			if(fread(record, 1, 2, fp) == 2) {
+				int length = (int) getLE(record, 2);
+
+				ok = (fread(text, 1, length, fp) == (size_t) length) && addIndexTitle(index, text, length);
+			}
+		}
+		else if((type == ARCHIVE_INDEX_ENTRY) || (type == ARCHIVE_INDEX_HEADER)) {
+			if(fread(record, 1, 24, fp) == 24) {
+				entry.wallMillis = (long long) getLE(record, 8);
+				entry.sample = (long long) getLE(record + 8, 8);
+				entry.offset = (long long) getLE(record + 16, 8);
+				entry.header = (type == ARCHIVE_INDEX_HEADER);
+				entry.title = index->titleCount - 1;
+				entry.samplerate = samplerate;
+				ok = addIndexEntry(index, &allocated, &entry);
+			}
+		}
+
+		if(!ok) {
+			break;
+		}
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+void freeArchiveIndex(ArchiveIndex *index) {
+	for(int i = 0; i < index->titleCount; i++) {
+		free(index->titles[i]);
+	}
+
+	free(index->titles);
+	free(index->entries);
+	memset(index, '\000', sizeof(*index));
+}
+
+int findIndexEntry(const ArchiveIndex *index, long long wallMillis) {
+	int found = -1;
+	int low = 0;
+	int high = index->count - 1;
+
+	/* wall clock only grows within a file, header entries included */
+	while(low <= high) {
+		int middle = (low + high) / 2;
+
+		if(index->entries[middle].wallMillis <= wallMillis) {
+			found = middle;
+			low = middle + 1;
+		}
+		else {
+			high = middle - 1;
+		}
+	}
+
+	if(found < 0) {
+		found = 0;
+	}
+
+	while((found < index->count) && index->entries[found].header) {
+		found++;
+	}
+
+	while((found > 0) && (found < index->count) && index->entries[found - 1].wallMillis == index->entries[found].wallMillis &&
+		  !index->entries[found - 1].header) {
+		found--;
+	}
+
+	return (found < index->count) ? found : -1;
+}
@@ -0,0 +1,72 @@
+#ifndef __ARCHIVE_FORMAT_H__
+#define __ARCHIVE_FORMAT_H__
+
+#include <stdio.h>
+
+/*
+ * On-disk layouts for the archive writer.
+ *
+ * WAV archives start with a fixed WAV_HEADER_BYTES header.  Up to 4 GB it
+ * is a plain RIFF/WAVE with a 28 byte JUNK chunk in front of "fmt "; past
+ * that the same bytes become an RF64 header (EBU Tech 3306), the JUNK chunk
+ * turning into "ds64" with the 64 bit sizes.  The data never moves, so the
+ * header can be rewritten in place at any time.
+ */
+#define WAV_HEADER_BYTES	80
+#define WAV_BITS			16
+
+/* Header for dataBytes of 16 bit PCM, 1 = RF64 was needed */
+int		buildWavHeader(unsigned char *header, int samplerate, int channels, long long dataBytes);
+
+/*
+ * Index sidecar, <archive>.idx next to an MP3, AAC or Ogg archive, so a
+ * time range can be cut out by byte offsets without decoding.  After the
+ * "MCIX" magic and a 4 byte version come tagged little endian records:
+ *
+ *   'F'  samplerate (4), channels (4)
+ *   'T'  length (2), title; it holds for the entries after it
+ *   'E'  wall clock ms (8), sample (8), byte offset (8); one per MP3/ADTS
+ *        frame or Ogg audio page, the sample counted from the file start
+ *   'H'  as 'E', an Ogg header page its logical stream cannot play without
+ *
+ * An entry is 25 bytes, about 1 KB per second of MP3.
+ */
+#define ARCHIVE_INDEX_MAGIC		"MCIX"
+#define ARCHIVE_INDEX_VERSION	1
+#define ARCHIVE_INDEX_SUFFIX	".idx"
+
+#define ARCHIVE_INDEX_FORMAT	'F'
+#define ARCHIVE_INDEX_TITLE		'T'
+#define ARCHIVE_INDEX_ENTRY		'E'
+#define ARCHIVE_INDEX_HEADER	'H'
+
+typedef struct tagArchiveIndexEntry {
+	long long	wallMillis;		// since the epoch, when the encoder sent it
+	long long	sample;
+	long long	offset;
+	int			header;			// ARCHIVE_INDEX_HEADER page
+	int			title;			// in ArchiveIndex.titles, -1 = none yet
+	int			samplerate;
+} ArchiveIndexEntry;
+
+typedef struct tagArchiveIndex {
+	ArchiveIndexEntry	*entries;
+	int					count;
+	char				**titles;
+	int					titleCount;
+	int					channels;	// of the last format record
+} ArchiveIndex;
+
+/* Writing, the FILE is plain buffered stdio.  1 = ok */
+FILE	*createArchiveIndex(const char *archiveName);
+int		writeIndexFormat(FILE *fp, int samplerate, int channels);
+int		writeIndexTitle(FILE *fp, const char *title);
+int		writeIndexEntry(FILE *fp, int type, long long wallMillis, long long sample, long long offset);
+
+/* Reading.  A record cut short at the end (crash) is ignored */
+int		loadArchiveIndex(const char *archiveName, ArchiveIndex *index);
+void	freeArchiveIndex(ArchiveIndex *index);
+/* the last audio entry at or before wallMillis, else the first, -1 = no entries */
+int		findIndexEntry(const ArchiveIndex *index, long long wallMillis);
+
+#endif //__ARCHIVE_FORMAT_H__
@@ -0,0 +1,884 @@
+/*
+ * archive_writer.cpp - per slot archive files written off the encoder thread
+ *
+ * The ring holds records: an ArchiveRecord header and its payload, padded to
+ * 8 bytes.  Positions only grow; the encoder thread alone moves writePos and
+ * the writer thread alone moves readPos, so neither side takes a lock.
+ *
+ * File offsets are written a block at a time.  A partial block (after
+ * ARCHIVE_FLUSH_MS, or at close) is written in place and stays in memory;
+ * once it fills up it is written again whole, so every write starts on an
+ * ARCHIVE_WRITE_BLOCK boundary.
+ *
+ * MP3, AAC and Ogg archives get an index sidecar (archive_format.h) with an
+ * entry per frame or page: the bytes are run through a FrameParser, Ogg
+ * pages are recognised as they come since each arrives as its own record.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <atomic>
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#include "archive_writer.h"
+#include "archive_format.h"
+#include "frame_parser.h"
+#include "pipeline_trace.h"
+
+#ifdef WIN32
+#define FILE_SEPARATOR		"\\"
+#define archiveSeek(fp, offset)	_fseeki64(fp, offset, SEEK_SET)
+#else
+#define FILE_SEPARATOR		"/"
+#define archiveSeek(fp, offset)	fseeko(fp, (off_t) (offset), SEEK_SET)
+#endif
+
+#define ARCHIVE_RECORD_DATA		1	// stream bytes as sent, one or more whole frames, or an Ogg page header or body
+#define ARCHIVE_RECORD_PCM		2	// float, interleaved
+#define ARCHIVE_RECORD_PCM16	3	// short, interleaved
+#define ARCHIVE_RECORD_TITLE	4	// the new song title, for the index
+
+#define ARCHIVE_PAD(n)	(((n) + 7) & ~7)
+
+typedef struct tagArchiveRecord {
+	int		type;
+	int		length;			// payload bytes
+	int		channels;
+	int		samplerate;
+	long long	wallMillis;		// data and title records
+} ArchiveRecord;
+
+struct tagArchiveWriter {
+	mcaster1Globals	*g;
+	char_t		directory[1024];
+	char_t		serverDesc[1024];
+	char_t		extension[16];
+	int			wav;
+	int			rotateSeconds;
+	long long	rotateBytes;
+	long long	preallocBytes;
+	long long	checkpointMicros;		// WAV header rewrite interval, 0 = at close only
+	int			indexEnabled;
+
+	char				*ring;
+	size_t				ringSize;
+	std::atomic<size_t>	writePos;
+	std::atomic<size_t>	readPos;
+	std::atomic<int>	running;
+	pthread_t			thread;
+	char_t				queuedTitle[1024];	// encoder thread, last title sent to the writer
+
+	// Writer thread only
+	char			*payload;
+	int				payloadSize;
+	short			*pcm16;
+	int				pcm16Size;
+	FILE			*fp;
+	char_t			fileName[1024];
+	time_t			fileStarted;
+	long long		fileBytes;			// data handed to the file, header included
+	long long		reserved;			// preallocated up to here
+	unsigned char	*block;
+	int				blockFill;
+	long long		blockOffset;
+	long long		lastFlush;
+	unsigned char	wavHeader[WAV_HEADER_BYTES];
+	long long		wavData;			// PCM bytes after the header
+	int				wavRate;
+	int				wavChannels;
+	int				wavRF64;
+	long long		lastCheckpoint;
+	int				ogg;				// the stream is Ogg, rotate on page starts only
+	int				oggCapturing;		// header pages of the current logical stream
+	unsigned char	*oggHeaders;		// replayed at the start of a rotated file
+	int				oggHeadersLength;
+	FILE			*index;				// sidecar of the open file, NULL = none
+	FrameParser		frames;				// MP3/ADTS, frame boundaries for the index
+	long long		indexBias;			// file offset minus parser stream offset
+	long long		indexSamples;		// from the start of the file
+	long long		indexWallMillis;	// of the record being indexed
+	int				indexRate;
+	int				indexChannels;
+	int				oggRate;			// granule positions count at this rate
+	int				oggChannels;
+	long long		oggGranule;			// last audio page of the current logical stream
+	long long		oggSampleBase;		// earlier chained streams in this file
+	char_t			title[1024];
+	int				titlePending;		// goes into the index before the next entry
+
+	// Stats
+	std::atomic<long>		queuePeak;
+	std::atomic<long long>	dropped;
+	std::atomic<long long>	written;
+	std::atomic<long>		writes;
+	std::atomic<long>		writeLast;
+	std::atomic<long>		writeMax;
+	std::atomic<long long>	writeTotal;
+	std::atomic<int>		files;
+};
+
+/* Wall clock for the index, unlike getMonotonicMicros */
+static long long archiveWallMillis(void) {
+#ifdef WIN32
+	FILETIME		now;
+	ULARGE_INTEGER	ticks;
+
+	GetSystemTimeAsFileTime(&now);
+	ticks.LowPart = now.dwLowDateTime;
+	ticks.HighPart = now.dwHighDateTime;
+	return (long long) (ticks.QuadPart / 10000) - 11644473600000LL;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void archiveSleep(int ms) {
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/*
+ =======================================================================================================================
+    Ring
+ =======================================================================================================================
+ */
+static void ringCopyIn(ArchiveWriter *w, size_t pos, const void *data, size_t length) {
+	size_t	at = pos % w->ringSize;
+	size_t	first = w->ringSize - at;
+
+	if(first > length) {
+		first = length;
+	}
+
+	memcpy(w->ring + at, data, first);
+	memcpy(w->ring, (const char *) data + first, length - first);
+}
+
+static void ringCopyOut(ArchiveWriter *w, size_t pos, void *data, size_t length) {
+	size_t	at = pos % w->ringSize;
+	size_t	first = w->ringSize - at;
+
+	if(first > length) {
+		first = length;
+	}
+
+	memcpy(data, w->ring + at, first);
+	memcpy((char *) data + first, w->ring, length - first);
+}
+
+static int queueRecord(ArchiveWriter *w, int type, const void *data, int length, int channels, int samplerate, long long wallMillis) {
+	ArchiveRecord	record;
+	size_t			need = sizeof(record) + ARCHIVE_PAD(length);
+	size_t			write = w->writePos.load(std::memory_order_relaxed);
+	size_t			read = w->readPos.load(std::memory_order_acquire);
+
+	if((length <= 0) || !w->running.load()) {
+		return 0;
+	}
+
+	if(w->ringSize - (write - read) < need) {
+		w->dropped += length;
+		return 0;
+	}
+
+	record.type = type;
+	record.length = length;
+	record.channels = channels;
+	record.samplerate = samplerate;
+	record.wallMillis = wallMillis;
+	ringCopyIn(w, write, &record, sizeof(record));
+	ringCopyIn(w, write + sizeof(record), data, length);
+	w->writePos.store(write + need, std::memory_order_release);
+
+	long	queued = (long) (write + need - read);
+
+	if(queued > w->queuePeak.load(std::memory_order_relaxed)) {
+		w->queuePeak.store(queued, std::memory_order_relaxed);
+	}
+
+	return 1;
+}
+
+int archiveData(ArchiveWriter *w, const char_t *data, int length) {
+	if(!w->indexEnabled) {
+		return queueRecord(w, ARCHIVE_RECORD_DATA, data, length, 0, 0, 0);
+	}
+
+	/* a title change goes in ahead of the data sent under it */
+	if(strcmp(w->queuedTitle, w->g->gSongTitle)) {
+		snprintf(w->queuedTitle, sizeof(w->queuedTitle), "%s", w->g->gSongTitle);
+		queueRecord(w, ARCHIVE_RECORD_TITLE, w->queuedTitle, (int) strlen(w->queuedTitle) + 1, 0, 0, 0);
+	}
+
+	return queueRecord(w, ARCHIVE_RECORD_DATA, data, length, 0, 0, archiveWallMillis());
+}
+
+int archivePCM(ArchiveWriter *w, const float *samples, int frames, int channels, int samplerate) {
+	return queueRecord(w, ARCHIVE_RECORD_PCM, samples, frames * channels * (int) sizeof(float), channels, samplerate, 0);
+}
+
+int archivePCM16(ArchiveWriter *w, const short *samples, int frames, int channels, int samplerate) {
+	return queueRecord(w, ARCHIVE_RECORD_PCM16, samples, frames * channels * (int) sizeof(short), channels, samplerate, 0);
+}
+
+/*
+ =======================================================================================================================
+    Files
+ =======================================================================================================================
+ */
+
+/* <server description>_<asctime> with the characters file systems refuse taken out, in one pass */
+static void archiveFileName(ArchiveWriter *w, char_t *path, int pathSize) {
+	char_t		name[1024];
+	char_t		clean[1024];
+	time_t		now = time(NULL);
+	int			n = 0;
+
+	snprintf(name, sizeof(name), "%s_%s", w->serverDesc, asctime(localtime(&now)));
+	for(char_t *p = name; *p && (n < (int) sizeof(clean) - 1); p++) {
+		if(*p == '"') {
+			clean[n++] = '\'';
+		}
+		else if(!strchr("\\/:*?<>|\n", *p)) {
+			clean[n++] = *p;
+		}
+	}
+
+	clean[n] = '\000';
+	snprintf(path, pathSize, "%s%s%s.%s", w->directory, FILE_SEPARATOR, clean, w->extension);
+
+	/* rotating by size can come round within the same second */
+	for(int part = 2; part < 100; part++) {
+		FILE	*existing = fopen(path, "rb");
+
+		if(!existing) {
+			break;
+		}
+
+		fclose(existing);
+		snprintf(path, pathSize, "%s%s%s (%d).%s", w->directory, FILE_SEPARATOR, clean, part, w->extension);
+	}
+}
+
+/* Reserve disk ahead of the data so a long archive is not spread in small extents */
+static void preallocateArchive(ArchiveWriter *w, long long upTo) {
+#ifdef WIN32
+	FILE_ALLOCATION_INFO	info;
+
+	info.AllocationSize.QuadPart = upTo;
+	SetFileInformationByHandle((HANDLE) _get_osfhandle(_fileno(w->fp)), FileAllocationInfo, &info, sizeof(info));
+#elif defined(__linux__)
+	/* this extends the file, closeArchive cuts it back to the data */
+	posix_fallocate(fileno(w->fp), 0, (off_t) upTo);
+#endif
+	w->reserved = upTo;
+}
+
+static int writeArchiveBlock(ArchiveWriter *w) {
+	if(!w->fp || !w->blockFill) {
+		return 1;
+	}
+
+	if(w->preallocBytes && (w->blockOffset + ARCHIVE_WRITE_BLOCK > w->reserved)) {
+		preallocateArchive(w, w->reserved + w->preallocBytes);
+	}
+
+	TRACE_BEGIN("archive_write", w->g->encoderNumber);
+
+	long long	started = getMonotonicMicros();
+	int			ok = (archiveSeek(w->fp, w->blockOffset) == 0) &&
+		(fwrite(w->block, 1, w->blockFill, w->fp) == (size_t) w->blockFill);
+	long		micros = (long) (getMonotonicMicros() - started);
+
+	TRACE_END("archive_write", w->g->encoderNumber);
+
+	w->writes++;
+	w->writeLast = micros;
+	w->writeTotal += micros;
+	if(micros > w->writeMax) {
+		w->writeMax = micros;
+	}
+
+	if(micros > ARCHIVE_SLOW_WRITE_MS * 1000) {
+		LogMessage(w->g, LOG_INFO, "Archive write to %s took %ld ms, %ld KB queued", w->fileName, micros / 1000,
+					(long) ((w->writePos.load() - w->readPos.load()) / 1024));
+	}
+
+	if(!ok) {
+		LogMessage(w->g, LOG_ERROR, "Cannot write archive %s: %s", w->fileName, strerror(errno));
+		return 0;
+	}
+
+	/* keep the index about as far along on disk as the data */
+	if(w->index) {
+		fflush(w->index);
+	}
+
+	w->lastFlush = getMonotonicMicros();
+	if(w->blockFill == ARCHIVE_WRITE_BLOCK) {
+		w->blockOffset += ARCHIVE_WRITE_BLOCK;
+		w->blockFill = 0;
+	}
+
+	return 1;
+}
+
+static void writeArchiveBytes(ArchiveWriter *w, const void *data, int length) {
+	const char	*p = (const char *) data;
+
+	while(length > 0) {
+		int take = ARCHIVE_WRITE_BLOCK - w->blockFill;
+
+		if(take > length) {
+			take = length;
+		}
+
+		memcpy(w->block + w->blockFill, p, take);
+		w->blockFill += take;
+		w->fileBytes += take;
+		w->written += take;
+		p += take;
+		length -= take;
+
+		if(w->blockFill == ARCHIVE_WRITE_BLOCK) {
+			writeArchiveBlock(w);
+		}
+	}
+}
+
+/*
+ * Rewrite the WAV header for the data on disk so far, so a file cut short
+ * by a crash or power loss plays up to here.  The header also lives in the
+ * block buffer while the file is smaller than a block.
+ */
+static void checkpointWav(ArchiveWriter *w) {
+	if(!writeArchiveBlock(w)) {
+		return;
+	}
+
+	int rf64 = buildWavHeader(w->wavHeader, w->wavRate, w->wavChannels, w->wavData);
+
+	if(rf64 && !w->wavRF64) {
+		w->wavRF64 = 1;
+		LogMessage(w->g, LOG_INFO, "Archive %s passed 4 GB, header is now RF64", w->fileName);
+	}
+
+	if(w->blockOffset == 0) {
+		memcpy(w->block, w->wavHeader, WAV_HEADER_BYTES);
+	}
+
+	if((archiveSeek(w->fp, 0) != 0) || (fwrite(w->wavHeader, 1, WAV_HEADER_BYTES, w->fp) != WAV_HEADER_BYTES)) {
+		LogMessage(w->g, LOG_ERROR, "Cannot update the header of %s: %s", w->fileName, strerror(errno));
+	}
+
+	w->lastCheckpoint = getMonotonicMicros();
+}
+
+/*
+ =======================================================================================================================
+    Index
+ =======================================================================================================================
+ */
+static void writeIndexPoint(ArchiveWriter *w, int type, long long sample, long long offset, int samplerate, int channels) {
+	if(!w->index) {
+		return;
+	}
+
+	int ok = 1;
+
+	if((samplerate != w->indexRate) || (channels != w->indexChannels)) {
+		w->indexRate = samplerate;
+		w->indexChannels = channels;
+		ok = writeIndexFormat(w->index, samplerate, channels);
+	}
+
+	if(w->titlePending) {
+		w->titlePending = 0;
+		ok = ok && writeIndexTitle(w->index, w->title);
+	}
+
+	if(!ok || !writeIndexEntry(w->index, type, w->indexWallMillis, sample, offset)) {
+		LogMessage(w->g, LOG_ERROR, "Cannot write the index of %s: %s", w->fileName, strerror(errno));
+		fclose(w->index);
+		w->index = NULL;
+	}
+}
+
+static void indexFrame(const CompressedFrame *frame, void *user) {
+	ArchiveWriter	*w = (ArchiveWriter *) user;
+	long long		offset = w->indexBias + w->frames.position + (frame->data - w->frames.buffer);
+
+	writeIndexPoint(w, ARCHIVE_INDEX_ENTRY, w->indexSamples, offset, frame->samplerate, frame->channels);
+	w->indexSamples += frame->samples;
+}
+
+/* The first packet of a logical stream, the codec identification header */
+static void indexOggFormat(ArchiveWriter *w, const unsigned char *p, int length) {
+	if((length >= 16) && !memcmp(p, "\001vorbis", 7)) {
+		w->oggChannels = p[11];
+		w->oggRate = p[12] | (p[13] << 8) | (p[14] << 16) | (p[15] << 24);
+	}
+	else if((length >= 10) && !memcmp(p, "OpusHead", 8)) {
+		/* Opus granule positions count at 48 kHz whatever the input rate */
+		w->oggChannels = p[9];
+		w->oggRate = 48000;
+	}
+	else if((length >= 30) && !memcmp(p, "\177FLAC", 5)) {
+		/* mapping header (9), "fLaC" (4), block header (4), then STREAMINFO */
+		w->oggRate = (p[27] << 12) | (p[28] << 4) | (p[29] >> 4);
+		w->oggChannels = ((p[29] >> 1) & 7) + 1;
+	}
+}
+
+/*
+ * Called with each data record before it is written.  Ogg page entries
+ * carry the granule position where the page starts, counted from the start
+ * of this file across chained streams.
+ */
+static void indexArchiveData(ArchiveWriter *w, const unsigned char *data, int length) {
+	if(!w->ogg) {
+		if(w->index) {
+			w->indexBias = w->fileBytes - (w->frames.position + w->frames.fill);
+			feedFrameParser(&w->frames, data, length, indexFrame, w);
+		}
+
+		return;
+	}
+
+	if((length < 27) || memcmp(data, "OggS", 4)) {
+		if(w->oggCapturing) {
+			indexOggFormat(w, data, length);
+		}
+
+		return;
+	}
+
+	long long	granule = 0;
+
+	for(int i = 13; i >= 6; i--) {
+		granule = (granule << 8) | data[i];
+	}
+
+	if(data[5] & 0x02) {
+		w->oggSampleBase += w->oggGranule;
+		w->oggGranule = 0;
+	}
+
+	writeIndexPoint(w, w->oggCapturing ? ARCHIVE_INDEX_HEADER : ARCHIVE_INDEX_ENTRY, w->oggSampleBase + w->oggGranule, w->fileBytes,
+					w->oggRate, w->oggChannels);
+
+	/* -1 = no packet ends on this page */
+	if(!w->oggCapturing && (granule > 0)) {
+		w->oggGranule = granule;
+	}
+}
+
+static void openArchiveIndex(ArchiveWriter *w) {
+	if(!w->indexEnabled || w->wav || (!w->ogg && !w->frames.codec)) {
+		return;
+	}
+
+	w->index = createArchiveIndex(w->fileName);
+	if(!w->index) {
+		LogMessage(w->g, LOG_ERROR, "Cannot create the index of %s: %s", w->fileName, strerror(errno));
+		return;
+	}
+
+	initFrameParser(&w->frames, w->frames.codec);
+	w->indexSamples = 0;
+	w->indexRate = 0;
+	w->indexChannels = 0;
+	w->titlePending = (w->title[0] != '\000');
+
+	/* Ogg granules run on from the previous file */
+	w->oggSampleBase = -w->oggGranule;
+}
+
+static void closeArchiveIndex(ArchiveWriter *w) {
+	if(!w->index) {
+		return;
+	}
+
+	/* rotation and close come between records, the last frame is whole */
+	if(!w->ogg) {
+		flushFrameParser(&w->frames, indexFrame, w);
+	}
+
+	if(w->index) {
+		fclose(w->index);
+		w->index = NULL;
+	}
+}
+
+static void closeArchive(ArchiveWriter *w) {
+	if(!w->fp) {
+		return;
+	}
+
+	closeArchiveIndex(w);
+
+	if(w->wav) {
+		checkpointWav(w);
+	}
+	else {
+		writeArchiveBlock(w);
+	}
+
+#if !defined(WIN32) && defined(__linux__)
+	if(w->reserved > w->fileBytes) {
+		fflush(w->fp);
+		if(ftruncate(fileno(w->fp), (off_t) w->fileBytes) != 0) {
+			LogMessage(w->g, LOG_ERROR, "Cannot trim archive %s: %s", w->fileName, strerror(errno));
+		}
+	}
+#endif
+	fclose(w->fp);
+	w->fp = NULL;
+
+	long	writes = w->writes.load();
+
+	LogMessage(w->g, LOG_INFO, "Archive %s closed, %lld KB, write latency avg %ld ms max %ld ms, queue peak %ld of %ld KB, %lld bytes dropped so far",
+				w->fileName, w->fileBytes / 1024, writes ? (long) (w->writeTotal.load() / writes / 1000) : 0L,
+				w->writeMax.load() / 1000, w->queuePeak.load() / 1024, (long) (w->ringSize / 1024), w->dropped.load());
+}
+
+static int openArchive(ArchiveWriter *w) {
+	archiveFileName(w, w->fileName, sizeof(w->fileName));
+
+	w->fp = fopen(w->fileName, "wb");
+	if(!w->fp) {
+		LogMessage(w->g, LOG_ERROR, "Cannot open archive %s: %s", w->fileName, strerror(errno));
+		return 0;
+	}
+
+	/* the blocks are the buffering */
+	setvbuf(w->fp, NULL, _IONBF, 0);
+
+	w->fileStarted = time(NULL);
+	w->fileBytes = 0;
+	w->reserved = 0;
+	w->blockFill = 0;
+	w->blockOffset = 0;
+	w->lastFlush = getMonotonicMicros();
+	w->wavData = 0;
+	w->wavRF64 = 0;
+	w->lastCheckpoint = w->lastFlush;
+	w->files++;
+
+	if(w->preallocBytes) {
+		preallocateArchive(w, w->preallocBytes);
+	}
+
+	if(w->wav) {
+		buildWavHeader(w->wavHeader, w->wavRate, w->wavChannels, 0);
+		writeArchiveBytes(w, w->wavHeader, WAV_HEADER_BYTES);
+	}
+	else {
+		openArchiveIndex(w);
+		if(w->ogg && w->oggHeadersLength) {
+			/* a rotated Ogg file starts with the headers of the stream it continues, one index entry covers them */
+			writeIndexPoint(w, ARCHIVE_INDEX_HEADER, 0, 0, w->oggRate, w->oggChannels);
+			writeArchiveBytes(w, w->oggHeaders, w->oggHeadersLength);
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Ogg pages arrive as a header record and a body record.  The pages of a
+ * logical stream up to its first audio page (granule position above 0) are
+ * its headers; a new BOS page (chained stream after a title change) starts
+ * a new set.
+ */
+static void trackOggHeaders(ArchiveWriter *w, const unsigned char *data, int length) {
+	int pageStart = (length >= 27) && !memcmp(data, "OggS", 4);
+
+	if(pageStart && (data[5] & 0x02)) {
+		w->oggCapturing = 1;
+		w->oggHeadersLength = 0;
+	}
+	else if(pageStart && w->oggCapturing) {
+		long long	granule = 0;
+
+		for(int i = 13; i >= 6; i--) {
+			granule = (granule << 8) | data[i];
+		}
+
+		if(granule > 0) {
+			w->oggCapturing = 0;
+		}
+	}
+
+	if(w->oggCapturing && (w->oggHeadersLength + length <= ARCHIVE_OGG_HEADERS)) {
+		memcpy(w->oggHeaders + w->oggHeadersLength, data, length);
+		w->oggHeadersLength += length;
+	}
+}
+
+/* Only called where a new file may start: a frame boundary, or an Ogg audio page */
+static void rotateArchiveIfDue(ArchiveWriter *w) {
+	int due = 0;
+
+	if(w->rotateSeconds && (time(NULL) - w->fileStarted >= w->rotateSeconds)) {
+		due = 1;
+	}
+
+	if(w->rotateBytes && (w->fileBytes >= w->rotateBytes)) {
+		due = 1;
+	}
+
+	if(due) {
+		closeArchive(w);
+		openArchive(w);
+	}
+}
+
+static void checkpointWavIfDue(ArchiveWriter *w) {
+	if(w->fp && w->checkpointMicros && (getMonotonicMicros() - w->lastCheckpoint >= w->checkpointMicros)) {
+		checkpointWav(w);
+	}
+}
+
+static short archiveSample(float sample) {
+	if(sample >= 1.f) {
+		return 32767;
+	}
+
+	if(sample <= -1.f) {
+		return -32767;
+	}
+
+	return (short) (sample * 32767.f);
+}
+
+static void writeArchiveRecord(ArchiveWriter *w, const ArchiveRecord *record, const char *payload) {
+	const unsigned char *data = (const unsigned char *) payload;
+
+	if(record->type == ARCHIVE_RECORD_TITLE) {
+		snprintf(w->title, sizeof(w->title), "%s", payload);
+		w->titlePending = 1;
+		return;
+	}
+
+	if(record->type == ARCHIVE_RECORD_DATA) {
+		if(w->wav) {
+			return;
+		}
+
+		w->indexWallMillis = record->wallMillis;
+
+		if(!w->fp && !w->fileBytes && (record->length >= 4) && !memcmp(data, "OggS", 4)) {
+			w->ogg = 1;
+		}
+
+		int boundary = !w->ogg || ((record->length >= 27) && !memcmp(data, "OggS", 4));
+
+		if(w->ogg) {
+			trackOggHeaders(w, data, record->length);
+		}
+
+		if(w->fp && boundary && !w->oggCapturing) {
+			rotateArchiveIfDue(w);
+		}
+
+		if(w->fp || openArchive(w)) {
+			indexArchiveData(w, data, record->length);
+			writeArchiveBytes(w, data, record->length);
+		}
+
+		return;
+	}
+
+	if(!w->wav) {
+		return;
+	}
+
+	/* the header has one format, a new one starts a new file */
+	if(w->fp && ((record->channels != w->wavChannels) || (record->samplerate != w->wavRate))) {
+		closeArchive(w);
+	}
+
+	if(w->fp) {
+		rotateArchiveIfDue(w);
+	}
+
+	if(!w->fp) {
+		w->wavRate = record->samplerate;
+		w->wavChannels = record->channels;
+		if(!openArchive(w)) {
+			return;
+		}
+	}
+
+	if(record->type == ARCHIVE_RECORD_PCM16) {
+		writeArchiveBytes(w, data, record->length);
+		w->wavData += record->length;
+		checkpointWavIfDue(w);
+		return;
+	}
+
+	/* float to 16 bit here, not on the audio thread */
+	int			count = record->length / (int) sizeof(float);
+	const float *samples = (const float *) payload;
+
+	if(count > w->pcm16Size) {
+		short	*pcm16 = (short *) realloc(w->pcm16, sizeof(short) * count);
+
+		if(!pcm16) {
+			return;
+		}
+
+		w->pcm16 = pcm16;
+		w->pcm16Size = count;
+	}
+
+	for(int i = 0; i < count; i++) {
+		w->pcm16[i] = archiveSample(samples[i]);
+	}
+
+	writeArchiveBytes(w, w->pcm16, count * (int) sizeof(short));
+	w->wavData += count * (int) sizeof(short);
+	checkpointWavIfDue(w);
+}
+
+static void *archiveWriterThread(void *arg) {
+	ArchiveWriter	*w = (ArchiveWriter *) arg;
+
+	for(;;) {
+		size_t	read = w->readPos.load(std::memory_order_relaxed);
+		size_t	write = w->writePos.load(std::memory_order_acquire);
+
+		if(read == write) {
+			if(!w->running.load()) {
+				break;
+			}
+
+			if(w->fp && w->blockFill && (getMonotonicMicros() - w->lastFlush > ARCHIVE_FLUSH_MS * 1000)) {
+				writeArchiveBlock(w);
+			}
+
+			if(w->wav) {
+				checkpointWavIfDue(w);
+			}
+
+			archiveSleep(ARCHIVE_POLL_MS);
+			continue;
+		}
+
+		ArchiveRecord	record;
+
+		ringCopyOut(w, read, &record, sizeof(record));
+		if(record.length > w->payloadSize) {
+			char	*payload = (char *) realloc(w->payload, record.length);
+
+			if(!payload) {
+				w->readPos.store(read + sizeof(record) + ARCHIVE_PAD(record.length), std::memory_order_release);
+				continue;
+			}
+
+			w->payload = payload;
+			w->payloadSize = record.length;
+		}
+
+		ringCopyOut(w, read + sizeof(record), w->payload, record.length);
+		w->readPos.store(read + sizeof(record) + ARCHIVE_PAD(record.length), std::memory_order_release);
+
+		writeArchiveRecord(w, &record, w->payload);
+	}
+
+	closeArchive(w);
+	return NULL;
+}
+
+/*
+ =======================================================================================================================
+    Start/stop
+ =======================================================================================================================
+ */
+static void freeArchiveWriter(ArchiveWriter *w) {
+	free(w->ring);
+	free(w->block);
+	free(w->payload);
+	free(w->pcm16);
+	free(w->oggHeaders);
+	delete w;
+}
+
+ArchiveWriter *startArchiveWriter(mcaster1Globals *g) {
+	ArchiveWriter	*w = new ArchiveWriter();
+	const char_t	*extension = getEncoderExtension(g);
+	int				queueKB = (g->archiveQueueKB > 0) ? g->archiveQueueKB : ARCHIVE_DEFAULT_QUEUE_KB;
+
+	w->g = g;
+	snprintf(w->directory, sizeof(w->directory), "%s", g->gSaveDirectory);
+	snprintf(w->serverDesc, sizeof(w->serverDesc), "%s", g->gServDesc);
+	w->wav = g->gSaveAsWAV;
+	snprintf(w->extension, sizeof(w->extension), "%s", w->wav ? "wav" : (extension ? extension : "raw"));
+	w->rotateSeconds = (g->archiveRotateMinutes > 0) ? g->archiveRotateMinutes * 60 : 0;
+	w->rotateBytes = (g->archiveRotateMB > 0) ? (long long) g->archiveRotateMB * 1024 * 1024 : 0;
+	w->preallocBytes = (g->archivePreallocMB > 0) ? (long long) g->archivePreallocMB * 1024 * 1024 : 0;
+	w->checkpointMicros = (g->archiveCheckpointSeconds > 0) ? (long long) g->archiveCheckpointSeconds * 1000000 : 0;
+	w->indexEnabled = g->archiveIndexEnabled;
+	snprintf(w->title, sizeof(w->title), "%s", g->gSongTitle);
+	snprintf(w->queuedTitle, sizeof(w->queuedTitle), "%s", g->gSongTitle);
+
+	if(!w->wav && extension && !strcmp(extension, "mp3")) {
+		initFrameParser(&w->frames, FRAME_CODEC_MP3);
+	}
+	else if(!w->wav && extension && !strcmp(extension, "aac")) {
+		initFrameParser(&w->frames, FRAME_CODEC_ADTS);
+	}
+
+	w->ringSize = (size_t) queueKB * 1024;
+	w->ring = (char *) malloc(w->ringSize);
+	w->block = (unsigned char *) malloc(ARCHIVE_WRITE_BLOCK);
+	w->oggHeaders = (unsigned char *) malloc(ARCHIVE_OGG_HEADERS);
+	w->running = 1;
+
+	if(!w->ring || !w->block || !w->oggHeaders || (pthread_create(&w->thread, NULL, archiveWriterThread, w) != 0)) {
+		LogMessage(g, LOG_ERROR, "Cannot start the archive writer");
+		freeArchiveWriter(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+void stopArchiveWriter(ArchiveWriter *w) {
+	if(!w) {
+		return;
+	}
+
+	w->running = 0;
+	pthread_join(w->thread, NULL);
+	freeArchiveWriter(w);
+}
+
+void getArchiveWriterStats(ArchiveWriter *w, ArchiveStats *stats) {
+	long	writes = w->writes.load();
+
+	stats->queueSize = (long) w->ringSize;
+	stats->queuedBytes = (long) (w->writePos.load() - w->readPos.load());
+	stats->queuePeakBytes = w->queuePeak.load();
+	stats->droppedBytes = w->dropped.load();
+	stats->bytesWritten = w->written.load();
+	stats->writes = writes;
+	stats->writeMicrosLast = w->writeLast.load();
+	stats->writeMicrosMax = w->writeMax.load();
+	stats->writeMicrosAvg = writes ? (long) (w->writeTotal.load() / writes) : 0;
+	stats->files = w->files.load();
+}
@@ -0,0 +1,52 @@
+#ifndef __ARCHIVE_WRITER_H__
+#define __ARCHIVE_WRITER_H__
+
+#include "libmcaster1dspencoder.h"
+
+/*
+ * Background archive writer, one per slot.  The encoder thread only copies
+ * into a single producer/single consumer ring, never touches the disk and
+ * never waits: when the ring is full the data is dropped and counted.  The
+ * writer thread opens the files, converts PCM for WAV archives, writes in
+ * ARCHIVE_WRITE_BLOCK sized blocks at block aligned offsets, preallocates
+ * ahead of the data and rotates to a new file by time or size at a codec
+ * frame (or Ogg page) boundary.  WAV archives carry the real rate and
+ * channels, turn RF64 past 4 GB and get their header rewritten every
+ * ArchiveCheckpointSeconds (archive_format.h).  Compressed archives
+ * get a <file>.idx index of their frames or pages for mcaster1_extract.
+ */
+#define ARCHIVE_WRITE_BLOCK			(256 * 1024)
+#define ARCHIVE_DEFAULT_QUEUE_KB	4096
+#define ARCHIVE_DEFAULT_PREALLOC_MB	64
+#define ARCHIVE_DEFAULT_CHECKPOINT	10		// seconds
+#define ARCHIVE_FLUSH_MS			5000	// a partial block is written after this long
+#define ARCHIVE_POLL_MS				20
+#define ARCHIVE_SLOW_WRITE_MS		500		// a write this slow is logged
+#define ARCHIVE_OGG_HEADERS			(256 * 1024)
+
+typedef struct tagArchiveStats {
+	long		queueSize;			// bytes
+	long		queuedBytes;		// waiting for the writer now
+	long		queuePeakBytes;
+	long long	droppedBytes;		// the ring was full
+	long long	bytesWritten;		// all files
+	long		writes;
+	long		writeMicrosLast;
+	long		writeMicrosMax;
+	long		writeMicrosAvg;
+	int			files;				// opened, rotation included
+} ArchiveStats;
+
+/* Settings (directory, name, rotation) are taken from the slot once, here */
+ArchiveWriter	*startArchiveWriter(mcaster1Globals *g);
+/* Writes out what is queued, closes the file and frees the writer */
+void			stopArchiveWriter(ArchiveWriter *writer);
+
+/* Encoder thread side.  1 = queued, 0 = dropped */
+int				archiveData(ArchiveWriter *writer, const char_t *data, int length);
+int				archivePCM(ArchiveWriter *writer, const float *samples, int frames, int channels, int samplerate);
+int				archivePCM16(ArchiveWriter *writer, const short *samples, int frames, int channels, int samplerate);
+
+void			getArchiveWriterStats(ArchiveWriter *writer, ArchiveStats *stats);
+
+#endif //__ARCHIVE_WRITER_H__
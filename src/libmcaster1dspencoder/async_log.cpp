@@ -0,0 +1,621 @@
+/*
+ * async_log.cpp - per thread log rings and the thread that writes them out
+ *
+ * A ring has one producer, its thread, which moves head, and one consumer
+ * at a time, which moves tail; both only grow.  A record never wraps: when
+ * it does not fit before the end of the ring a padding record fills the
+ * rest and the record starts again at the front.
+ *
+ * logMutex guards the ring table and is held while records are written
+ * out, so logFlush and the log thread never drain a ring at the same time.
+ * A slot's log file is opened, written and flushed only from here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <wchar.h>
+#include <atomic>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "async_log.h"
+
+#define LOG_PADDING			-1			// the rest of the ring is unused
+
+/* How an argument went through the ... */
+#define LOG_ARG_NONE		0			// %%
+#define LOG_ARG_INT			1
+#define LOG_ARG_LONG		2
+#define LOG_ARG_LLONG		3
+#define LOG_ARG_SIZE		4
+#define LOG_ARG_DOUBLE		5
+#define LOG_ARG_LDOUBLE		6
+#define LOG_ARG_PTR			7
+#define LOG_ARG_STRING		8
+#define LOG_ARG_WSTRING		9
+#define LOG_ARG_COUNT		10			// %n, takes a pointer and prints nothing
+#define LOG_ARG_BAD			11			// not a conversion, the rest of the format is dropped
+
+typedef struct tagLogRecord {
+	int				size;				// the whole record, a multiple of 8
+	int				type;				// LM_xxx or LOG_PADDING
+	int				line;
+	int				fmtBytes;			// the format follows the header, padded, then the arguments
+	mcaster1Globals	*g;
+	const char		*source;
+	long long		when;				// time()
+} LogRecord;
+
+typedef struct tagLogSpec {
+	int		length;						// '%' to the conversion, both included
+	int		stars;						// '*' width and precision, an int argument each
+	int		kind;
+} LogSpec;
+
+typedef struct tagLogRing {
+	alignas(8) char			data[LOG_RING_BYTES];
+	std::atomic<long long>	head;
+	std::atomic<long long>	tail;
+	std::atomic<int>		live;		// its thread is still running
+	std::atomic<long>		dropped;	// not reported yet
+	mcaster1Globals			*lastG;		// drops are reported in this slot's log
+} LogRing;
+
+/* Hands the ring back when the thread ends */
+struct LogThread {
+	LogRing	*ring;
+	int		full;						// no ring was free, do not ask again
+	~LogThread() {
+		if(ring) {
+			ring->live.store(0, std::memory_order_release);
+		}
+	}
+};
+
+static pthread_mutex_t			logMutex = PTHREAD_MUTEX_INITIALIZER;
+static LogRing					*logRings[LOG_MAX_THREADS];
+static int						logThreadStarted = 0;
+static std::atomic<long long>	logDrops(0);
+static thread_local LogThread	logThread;
+
+#define LOG_PAD(n)	(((n) + 7) & ~7)
+
+/*
+ =======================================================================================================================
+    Format specifications, read the same way on both sides
+ =======================================================================================================================
+ */
+static void parseSpec(const char *p, LogSpec *spec) {
+	const char	*start = p++;
+	int			size = 0;				// 'l' long, 'L' long long, 'z' size_t, 'D' long double
+
+	spec->stars = 0;
+	while(*p && strchr("-+ #0'", *p)) {
+		p++;
+	}
+
+	if(*p == '*') {
+		spec->stars++;
+		p++;
+	}
+
+	while(isdigit((unsigned char) *p)) {
+		p++;
+	}
+
+	if(*p == '.') {
+		p++;
+		if(*p == '*') {
+			spec->stars++;
+			p++;
+		}
+
+		while(isdigit((unsigned char) *p)) {
+			p++;
+		}
+	}
+
+	if(*p == 'h') {
+		p += (p[1] == 'h') ? 2 : 1;
+	}
+	else if(*p == 'l') {
+		size = (p[1] == 'l') ? 'L' : 'l';
+		p += (p[1] == 'l') ? 2 : 1;
+	}
+	else if((*p == 'q') || (*p == 'j')) {
+		size = 'L';
+		p++;
+	}
+	else if((*p == 'z') || (*p == 't')) {
+		size = 'z';
+		p++;
+	}
+	else if(*p == 'L') {
+		size = 'D';
+		p++;
+	}
+	else if(!strncmp(p, "I64", 3)) {
+		size = 'L';
+		p += 3;
+	}
+	else if(!strncmp(p, "I32", 3)) {
+		p += 3;
+	}
+	else if(*p == 'I') {
+		size = 'z';
+		p++;
+	}
+
+	switch(*p) {
+		case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+			spec->kind = (size == 'l') ? LOG_ARG_LONG : (size == 'L') ? LOG_ARG_LLONG : (size == 'z') ? LOG_ARG_SIZE : LOG_ARG_INT;
+			break;
+
+		case 'c': case 'C':
+			spec->kind = LOG_ARG_INT;
+			break;
+
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			spec->kind = (size == 'D') ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+			break;
+
+		case 's':
+			spec->kind = (size == 'l') ? LOG_ARG_WSTRING : LOG_ARG_STRING;
+			break;
+
+		case 'S':
+			spec->kind = LOG_ARG_WSTRING;
+			break;
+
+		case 'p':
+			spec->kind = LOG_ARG_PTR;
+			break;
+
+		case 'n':
+			spec->kind = LOG_ARG_COUNT;
+			break;
+
+		case '%':
+			spec->kind = LOG_ARG_NONE;
+			break;
+
+		default:
+			spec->kind = LOG_ARG_BAD;
+			break;
+	}
+
+	if(*p) {
+		p++;
+	}
+
+	spec->length = (int) (p - start);
+}
+
+/*
+ =======================================================================================================================
+    Calling thread
+ =======================================================================================================================
+ */
+static int putBytes(char *out, int room, int *used, const void *data, int length) {
+	if(*used + LOG_PAD(length) > room) {
+		return 0;
+	}
+
+	memcpy(out + *used, data, length);
+	*used += LOG_PAD(length);
+	return 1;
+}
+
+/* A string with its length in front, cut to what is left of the record */
+static int putString(char *out, int room, int *used, const void *data, int units, int unitBytes) {
+	int avail = ((room - *used - 8) & ~7) / unitBytes - 1;
+
+	if(avail < 0) {
+		return 0;
+	}
+
+	if(units > avail) {
+		units = avail;
+	}
+
+	int bytes = LOG_PAD((units + 1) * unitBytes);
+
+	putBytes(out, room, used, &units, sizeof(units));
+	memcpy(out + *used, data, units * unitBytes);
+	memset(out + *used + units * unitBytes, '\000', bytes - units * unitBytes);
+	*used += bytes;
+	return 1;
+}
+
+/* The arguments fmt takes, in their own types.  Stops at the first one that does not fit */
+static void captureArgs(char *out, int room, int *used, const char *fmt, va_list args) {
+	for(const char *p = fmt; *p; p++) {
+		LogSpec spec;
+
+		if(*p != '%') {
+			continue;
+		}
+
+		parseSpec(p, &spec);
+		if(spec.kind == LOG_ARG_BAD) {
+			return;
+		}
+
+		for(int s = 0; s < spec.stars; s++) {
+			int star = va_arg(args, int);
+
+			if(!putBytes(out, room, used, &star, sizeof(star))) {
+				return;
+			}
+		}
+
+		int ok = 1;
+
+		switch(spec.kind) {
+			case LOG_ARG_INT:		{ int v = va_arg(args, int); ok = putBytes(out, room, used, &v, sizeof(v)); } break;
+			case LOG_ARG_LONG:		{ long v = va_arg(args, long); ok = putBytes(out, room, used, &v, sizeof(v)); } break;
+			case LOG_ARG_LLONG:		{ long long v = va_arg(args, long long); ok = putBytes(out, room, used, &v, sizeof(v)); } break;
+			case LOG_ARG_SIZE:		{ size_t v = va_arg(args, size_t); ok = putBytes(out, room, used, &v, sizeof(v)); } break;
+			case LOG_ARG_DOUBLE:	{ double v = va_arg(args, double); ok = putBytes(out, room, used, &v, sizeof(v)); } break;
+			case LOG_ARG_LDOUBLE:	{ long double v = va_arg(args, long double); ok = putBytes(out, room, used, &v, sizeof(v)); } break;
+			case LOG_ARG_PTR:
+			case LOG_ARG_COUNT:		{ void *v = va_arg(args, void *); ok = putBytes(out, room, used, &v, sizeof(v)); } break;
+
+			case LOG_ARG_STRING:
+				{
+					const char	*v = va_arg(args, const char *);
+
+					v = v ? v : "(null)";
+					ok = putString(out, room, used, v, (int) strlen(v), 1);
+				}
+				break;
+
+			case LOG_ARG_WSTRING:
+				{
+					const wchar_t	*v = va_arg(args, const wchar_t *);
+
+					v = v ? v : L"(null)";
+					ok = putString(out, room, used, v, (int) wcslen(v), sizeof(wchar_t));
+				}
+				break;
+		}
+
+		if(!ok) {
+			return;
+		}
+
+		p += spec.length - 1;
+	}
+}
+
+static void *logThreadMain(void *arg);
+
+static LogRing *logAttach(void) {
+	LogRing *ring = NULL;
+
+	pthread_mutex_lock(&logMutex);
+	for(int i = 0; (i < LOG_MAX_THREADS) && !ring; i++) {
+		if(!logRings[i]) {
+			logRings[i] = (LogRing *) calloc(1, sizeof(LogRing));
+			ring = logRings[i];
+		}
+		else if(!logRings[i]->live.load(std::memory_order_acquire)
+				&& (logRings[i]->tail.load(std::memory_order_relaxed) == logRings[i]->head.load(std::memory_order_acquire))) {
+			/* left by a thread that ended, and written out */
+			ring = logRings[i];
+		}
+	}
+
+	if(ring) {
+		ring->live.store(1, std::memory_order_relaxed);
+	}
+
+	if(!logThreadStarted) {
+		pthread_t	thread;
+
+		if(pthread_create(&thread, NULL, logThreadMain, NULL) == 0) {
+			pthread_detach(thread);
+			logThreadStarted = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&logMutex);
+
+	logThread.ring = ring;
+	logThread.full = !ring;
+	return ring;
+}
+
+void logEnqueue(mcaster1Globals *g, int type, const char *source, int line, const char *fmt, va_list args) {
+	LogRing		*ring = logThread.ring;
+	long long	buffer[LOG_RECORD_MAX / sizeof(long long)];
+	LogRecord	*r = (LogRecord *) buffer;
+	int			used = LOG_PAD(sizeof(LogRecord));
+	int			fmtBytes = (int) strlen(fmt) + 1;
+
+	if(!ring && (logThread.full || !(ring = logAttach()))) {
+		logDrops.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	/* a format too long for the record is cut, its arguments are read against what is kept */
+	if(fmtBytes > LOG_RECORD_MAX / 2) {
+		fmtBytes = LOG_RECORD_MAX / 2;
+	}
+
+	char	*storedFmt = (char *) buffer + used;
+
+	memcpy(storedFmt, fmt, fmtBytes - 1);
+	storedFmt[fmtBytes - 1] = '\000';
+	used += LOG_PAD(fmtBytes);
+	captureArgs((char *) buffer, LOG_RECORD_MAX, &used, storedFmt, args);
+
+	r->size = used;
+	r->type = type;
+	r->line = line;
+	r->fmtBytes = fmtBytes;
+	r->g = g;
+	r->source = source;
+	r->when = (long long) time(NULL);
+
+	long long	head = ring->head.load(std::memory_order_relaxed);
+	long long	tail = ring->tail.load(std::memory_order_acquire);
+	int			offset = (int) (head % LOG_RING_BYTES);
+	int			skip = (offset + used > LOG_RING_BYTES) ? LOG_RING_BYTES - offset : 0;
+
+	if(head + skip + used - tail > LOG_RING_BYTES) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		logDrops.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	if(skip) {
+		LogRecord	*padding = (LogRecord *) (ring->data + offset);
+
+		padding->size = skip;
+		padding->type = LOG_PADDING;
+	}
+
+	memcpy(ring->data + (head + skip) % LOG_RING_BYTES, buffer, used);
+	ring->head.store(head + skip + used, std::memory_order_release);
+}
+
+long long getLogDrops(void) {
+	return logDrops.load(std::memory_order_relaxed);
+}
+
+/*
+ =======================================================================================================================
+    Log thread
+ =======================================================================================================================
+ */
+static int takeBytes(const char **arg, const char *end, void *value, int length) {
+	if(*arg + LOG_PAD(length) > end) {
+		return 0;
+	}
+
+	memcpy(value, *arg, length);
+	*arg += LOG_PAD(length);
+	return 1;
+}
+
+#define LOG_FORMAT(value) \
+	((spec.stars == 0) ? snprintf(out + at, room, specText, value) : \
+	 (spec.stars == 1) ? snprintf(out + at, room, specText, star[0], value) : \
+	 snprintf(out + at, room, specText, star[0], star[1], value))
+
+/* The message of a record, as vsnprintf would have made it from the original arguments */
+static void formatRecord(const LogRecord *r, char *out, int size) {
+	const char	*fmt = (const char *) r + LOG_PAD(sizeof(LogRecord));
+	const char	*arg = fmt + LOG_PAD(r->fmtBytes);
+	const char	*end = (const char *) r + r->size;
+	int			at = 0;
+
+	for(const char *p = fmt; *p && (at < size - 1);) {
+		LogSpec spec;
+		char	specText[64];
+		int		star[2] = { 0, 0 };
+		int		room = size - at;
+		int		n = 0;
+
+		if(*p != '%') {
+			out[at++] = *p++;
+			continue;
+		}
+
+		parseSpec(p, &spec);
+		if((spec.kind == LOG_ARG_BAD) || (spec.length >= (int) sizeof(specText))) {
+			break;
+		}
+
+		memcpy(specText, p, spec.length);
+		specText[spec.length] = '\000';
+		for(int s = 0; s < spec.stars; s++) {
+			if(!takeBytes(&arg, end, &star[s], sizeof(int))) {
+				goto done;
+			}
+		}
+
+		switch(spec.kind) {
+			case LOG_ARG_NONE:		out[at] = '%'; n = 1; break;
+			case LOG_ARG_INT:		{ int v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; n = LOG_FORMAT(v); } break;
+			case LOG_ARG_LONG:		{ long v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; n = LOG_FORMAT(v); } break;
+			case LOG_ARG_LLONG:		{ long long v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; n = LOG_FORMAT(v); } break;
+			case LOG_ARG_SIZE:		{ size_t v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; n = LOG_FORMAT(v); } break;
+			case LOG_ARG_DOUBLE:	{ double v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; n = LOG_FORMAT(v); } break;
+			case LOG_ARG_LDOUBLE:	{ long double v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; n = LOG_FORMAT(v); } break;
+			case LOG_ARG_PTR:		{ void *v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; n = LOG_FORMAT(v); } break;
+			case LOG_ARG_COUNT:		{ void *v; if(!takeBytes(&arg, end, &v, sizeof(v))) goto done; } break;
+
+			case LOG_ARG_STRING:
+			case LOG_ARG_WSTRING:
+				{
+					int unitBytes = (spec.kind == LOG_ARG_STRING) ? 1 : sizeof(wchar_t);
+					int units;
+
+					if(!takeBytes(&arg, end, &units, sizeof(units)) || (arg + LOG_PAD((units + 1) * unitBytes) > end)) {
+						goto done;
+					}
+
+					const void	*v = arg;
+
+					arg += LOG_PAD((units + 1) * unitBytes);
+					n = LOG_FORMAT(v);
+				}
+				break;
+		}
+
+		if(n < 0) {
+			break;
+		}
+
+		at += (n < room) ? n : room - 1;
+		p += spec.length;
+	}
+
+done:
+	out[at] = '\000';
+}
+
+/* Opened on first use, like the synchronous logger did */
+static FILE *openLogFile(mcaster1Globals *g, char *logfile, int size) {
+	snprintf(logfile, size, "%s.log", g->gLogFile);
+	if(!g->logFilep) {
+		g->logFilep = fopen(logfile, "a");
+	}
+
+	return g->logFilep;
+}
+
+static void writeLine(mcaster1Globals *g, int type, const char *source, int line, long long when, const char *message, FILE **touched, int *touchedCount) {
+	const char	*errortype = "Unknown";
+	const char	*sourceLine = source;
+	char		timeStamp[255] = "";
+	char		logfile[1024] = "";
+	time_t		t = (time_t) when;
+	struct tm	*tp = localtime(&t);
+	const char	*newline = (message[0] && (message[strlen(message) - 1] == '\n')) ? "" : "\n";
+
+#ifdef WIN32
+	const char	*p1 = strrchr(source, '\\');
+#else
+	const char	*p1 = strrchr(source, '/');
+#endif
+	if(p1) {
+		sourceLine = p1 + 1;
+	}
+
+	if(tp) {
+		strftime(timeStamp, sizeof(timeStamp), "%m/%d/%y %H:%M:%S", tp);
+	}
+
+	switch(type) {
+		case LM_ERROR:	errortype = "Error"; break;
+		case LM_INFO:	errortype = "Info"; break;
+		case LM_DEBUG:	errortype = "Debug"; break;
+	}
+
+	FILE	*fp = openLogFile(g, logfile, sizeof(logfile));
+
+	if(!fp) {
+		fprintf(stdout, "Cannot open logfile: %s(%s:%d): %s%s", logfile, sourceLine, line, message, newline);
+		return;
+	}
+
+	fprintf(fp, "%s %s(%s:%d): %s%s", timeStamp, errortype, sourceLine, line, message, newline);
+
+	/* flushed once the pass is over */
+	for(int i = 0; i < *touchedCount; i++) {
+		if(touched[i] == fp) {
+			return;
+		}
+	}
+
+	if(*touchedCount < LOG_MAX_THREADS) {
+		touched[(*touchedCount)++] = fp;
+	}
+	else {
+		fflush(fp);
+	}
+}
+
+/* Called with logMutex held, 1 = there was something to write */
+static int drainRing(LogRing *ring, FILE **touched, int *touchedCount) {
+	long long	head = ring->head.load(std::memory_order_acquire);
+	long long	tail = ring->tail.load(std::memory_order_relaxed);
+	int			wrote = (tail < head);
+
+	while(tail < head) {
+		const LogRecord *r = (const LogRecord *) (ring->data + tail % LOG_RING_BYTES);
+
+		if(r->type != LOG_PADDING) {
+			char	message[LOG_RECORD_MAX];
+
+			formatRecord(r, message, sizeof(message));
+			writeLine(r->g, r->type, r->source, r->line, r->when, message, touched, touchedCount);
+			ring->lastG = r->g;
+		}
+
+		tail += r->size;
+		ring->tail.store(tail, std::memory_order_release);
+	}
+
+	long	dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+
+	if(dropped && ring->lastG) {
+		char	message[128];
+
+		snprintf(message, sizeof(message), "%ld log messages dropped, the log thread fell behind", dropped);
+		writeLine(ring->lastG, LM_INFO, __FILE__, __LINE__, (long long) time(NULL), message, touched, touchedCount);
+	}
+
+	return wrote;
+}
+
+static int drainAll(void) {
+	FILE	*touched[LOG_MAX_THREADS];
+	int		touchedCount = 0;
+	int		wrote = 0;
+
+	pthread_mutex_lock(&logMutex);
+	for(int i = 0; i < LOG_MAX_THREADS; i++) {
+		if(logRings[i]) {
+			wrote |= drainRing(logRings[i], touched, &touchedCount);
+		}
+	}
+
+	for(int i = 0; i < touchedCount; i++) {
+		fflush(touched[i]);
+	}
+
+	pthread_mutex_unlock(&logMutex);
+	return wrote;
+}
+
+static void logSleep(int ms) {
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static void *logThreadMain(void *arg) {
+	(void) arg;
+
+	for(;;) {
+		if(!drainAll()) {
+			logSleep(LOG_POLL_MS);
+		}
+	}
+
+	return NULL;
+}
+
+void logFlush(void) {
+	drainAll();
+}
@@ -0,0 +1,29 @@
+#ifndef __ASYNC_LOG_H__
+#define __ASYNC_LOG_H__
+
+#include <stdarg.h>
+#include "libmcaster1dspencoder.h"
+
+/*
+ * Backend of LogMessage.  The calling thread only copies the format and
+ * its arguments, as they are, into a ring of its own; no formatting, no
+ * clock other than time(), no lock, no file.  The log thread turns the
+ * records into lines and writes them to the slot's log file.  A record
+ * that does not fit in the ring is dropped and counted, the caller never
+ * waits for the log thread.
+ *
+ * Strings are copied, so a %s argument may be a buffer on the caller's
+ * stack.  The source file name must be a literal (__FILE__).
+ */
+#define LOG_RING_BYTES		(64 * 1024)		// per thread
+#define LOG_MAX_THREADS		64
+#define LOG_RECORD_MAX		4096			// a longer message is cut short
+#define LOG_POLL_MS			20
+
+void		logEnqueue(mcaster1Globals *g, int type, const char *source, int line, const char *fmt, va_list args);
+/* Writes out everything queued before the call, on the calling thread.  Before a slot's log file is closed or g freed */
+void		logFlush(void);
+/* Records dropped because a ring was full */
+long long	getLogDrops(void);
+
+#endif //__ASYNC_LOG_H__
@@ -0,0 +1,213 @@
+/*
+ * frame_parser.cpp - MP3 and ADTS frame splitting for passthrough and the archive index
+ */
+#include <string.h>
+#include "frame_parser.h"
+
+static const int	mp3Bitrates[2][16] = {
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },	// MPEG-1
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }		// MPEG-2 and 2.5
+};
+static const int	mp3Samplerates[4] = { 44100, 48000, 32000, 0 };
+static const int	adtsSamplerates[16] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0, 0, 0
+};
+
+/* Layer III only, free format bitrates are not supported */
+static int parseMP3Header(const unsigned char *p, int available, CompressedFrame *frame) {
+	if((available < 4) || (p[0] != 0xFF) || ((p[1] & 0xE0) != 0xE0)) {
+		return 0;
+	}
+
+	int version = (p[1] >> 3) & 3;		// 0 = MPEG-2.5, 1 = reserved, 2 = MPEG-2, 3 = MPEG-1
+	int layer = (p[1] >> 1) & 3;		// 1 = Layer III
+	int crc = !(p[1] & 1);
+	int bitrateIndex = p[2] >> 4;
+	int rateIndex = (p[2] >> 2) & 3;
+	int padding = (p[2] >> 1) & 1;
+
+	if((version == 1) || (layer != 1) || (bitrateIndex == 0) || (bitrateIndex == 15) || (rateIndex == 3)) {
+		return 0;
+	}
+
+	int mpeg1 = (version == 3);
+
+	frame->codec = FRAME_CODEC_MP3;
+	frame->bitrate = mp3Bitrates[mpeg1 ? 0 : 1][bitrateIndex];
+	frame->samplerate = mp3Samplerates[rateIndex] >> (mpeg1 ? 0 : ((version == 2) ? 1 : 2));
+	frame->channels = ((p[3] >> 6) == 3) ? 1 : 2;
+	frame->samples = mpeg1 ? 1152 : 576;
+	frame->length = (mpeg1 ? 144000 : 72000) * frame->bitrate / frame->samplerate + padding;
+
+	/* main_data_begin opens the side info: 9 bits for MPEG-1, 8 for MPEG-2 */
+	int side = 4 + (crc ? 2 : 0);
+
+	frame->selfContained = 0;
+	if(available >= side + 2) {
+		int begin = mpeg1 ? ((p[side] << 1) | (p[side + 1] >> 7)) : p[side];
+
+		frame->selfContained = (begin == 0);
+	}
+
+	return 1;
+}
+
+static int parseADTSHeader(const unsigned char *p, int available, CompressedFrame *frame) {
+	if((available < 7) || (p[0] != 0xFF) || ((p[1] & 0xF6) != 0xF0)) {
+		return 0;
+	}
+
+	int samplerate = adtsSamplerates[(p[2] >> 2) & 0x0F];
+	int channels = ((p[2] & 1) << 2) | (p[3] >> 6);
+	int length = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
+	int headerLength = (p[1] & 1) ? 7 : 9;
+
+	/* channel configuration 0 is described in the payload, not supported */
+	if(!samplerate || !channels || (length < headerLength)) {
+		return 0;
+	}
+
+	frame->codec = FRAME_CODEC_ADTS;
+	frame->bitrate = 0;
+	frame->samplerate = samplerate;
+	frame->channels = channels;
+	frame->samples = 1024 * ((p[6] & 3) + 1);
+	frame->length = length;
+	frame->selfContained = 1;
+	return 1;
+}
+
+int parseFrameHeader(int codec, const unsigned char *data, int available, CompressedFrame *frame) {
+	switch(codec) {
+		case FRAME_CODEC_MP3:
+			return parseMP3Header(data, available, frame);
+
+		case FRAME_CODEC_ADTS:
+			return parseADTSHeader(data, available, frame);
+	}
+
+	return 0;
+}
+
+void initFrameParser(FrameParser *parser, int codec) {
+	memset(parser, '\000', sizeof(*parser));
+	parser->codec = codec;
+}
+
+/*
+ * Hand out every complete frame in the buffer.  Without final a frame also
+ * needs the next header to be there and agree with it.
+ */
+static void scanFrames(FrameParser *parser, frameParserCallback callback, void *user, int final) {
+	int headerLength = (parser->codec == FRAME_CODEC_ADTS) ? 7 : 4;
+	int pos = 0;
+
+	while(pos < parser->fill) {
+		const unsigned char *p = parser->buffer + pos;
+		int					available = parser->fill - pos;
+
+		if((available < 10) && !final) {
+			break;
+		}
+
+		/* ID3v2: 10 byte header, syncsafe size, optional 10 byte footer */
+		if((available >= 10) && !memcmp(p, "ID3", 3)) {
+			long	size = 10 + ((p[6] & 0x7F) << 21) + ((p[7] & 0x7F) << 14) + ((p[8] & 0x7F) << 7) + (p[9] & 0x7F);
+
+			if(p[5] & 0x10) {
+				size += 10;
+			}
+
+			if(size > available) {
+				parser->skip = size - available;
+				pos = parser->fill;
+				break;
+			}
+
+			pos += (int) size;
+			continue;
+		}
+
+		CompressedFrame frame;
+		CompressedFrame next;
+
+		if(!parseFrameHeader(parser->codec, p, available, &frame)) {
+			pos++;
+			parser->droppedBytes++;
+			continue;
+		}
+
+		if(frame.length > available) {
+			if(final) {
+				pos = parser->fill;
+			}
+			break;
+		}
+
+		if(available - frame.length < headerLength) {
+			if(!final) {
+				break;
+			}
+		}
+		else if(!parseFrameHeader(parser->codec, p + frame.length, available - frame.length, &next) ||
+				(next.samplerate != frame.samplerate) || (next.channels != frame.channels)) {
+			/* a sync word inside the audio data */
+			pos++;
+			parser->droppedBytes++;
+			continue;
+		}
+
+		if(parser->codec == FRAME_CODEC_MP3) {
+			if(parser->lastBitrate && (frame.bitrate != parser->lastBitrate)) {
+				parser->variableBitrate = 1;
+			}
+
+			parser->lastBitrate = frame.bitrate;
+			if(parser->variableBitrate) {
+				frame.bitrate = 0;
+			}
+		}
+
+		frame.data = p;
+		parser->frames++;
+		callback(&frame, user);
+		pos += frame.length;
+	}
+
+	memmove(parser->buffer, parser->buffer + pos, parser->fill - pos);
+	parser->fill -= pos;
+	parser->position += pos;
+}
+
+void feedFrameParser(FrameParser *parser, const unsigned char *data, int length, frameParserCallback callback, void *user) {
+	while(length > 0) {
+		if(parser->skip > 0) {
+			int drop = (parser->skip < length) ? (int) parser->skip : length;
+
+			parser->skip -= drop;
+			parser->position += drop;
+			data += drop;
+			length -= drop;
+			continue;
+		}
+
+		int take = FRAME_PARSER_BUFFER - parser->fill;
+
+		if(take > length) {
+			take = length;
+		}
+
+		memcpy(parser->buffer + parser->fill, data, take);
+		parser->fill += take;
+		data += take;
+		length -= take;
+
+		scanFrames(parser, callback, user, 0);
+	}
+}
+
+void flushFrameParser(FrameParser *parser, frameParserCallback callback, void *user) {
+	scanFrames(parser, callback, user, 1);
+	parser->position += parser->fill;
+	parser->fill = 0;
+}
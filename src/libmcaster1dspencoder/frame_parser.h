@@ -0,0 +1,35 @@
+#ifndef __FRAME_PARSER_H
+#define __FRAME_PARSER_H
+
+/*
+ * Splits an MP3 (Layer III) or ADTS AAC byte stream into whole frames for
+ * passthrough and the archive index.  A header only counts once the header after it agrees, so
+ * stray sync words in the audio data do not cut frames.  ID3v2 tags are
+ * skipped.
+ */
+#include "libmcaster1dspencoder.h"
+
+#define FRAME_PARSER_BUFFER		(3 * 8192)	// two of the largest ADTS frames plus room to append
+
+typedef void (*frameParserCallback) (const CompressedFrame *frame, void *user);
+
+typedef struct tagFrameParser {
+	int				codec;				// FRAME_CODEC_xxx
+	unsigned char	buffer[FRAME_PARSER_BUFFER];
+	int				fill;
+	long long		position;			// stream offset of buffer[0]
+	long			skip;				// bytes of an ID3 tag still to drop
+	int				lastBitrate;		// MP3, header bitrate of the previous frame
+	int				variableBitrate;	// MP3, frames with different bitrates were seen
+	long			frames;
+	long			droppedBytes;		// skipped while looking for sync
+} FrameParser;
+
+void	initFrameParser(FrameParser *parser, int codec);
+void	feedFrameParser(FrameParser *parser, const unsigned char *data, int length, frameParserCallback callback, void *user);
+/* end of input, hands out a last frame that has no header after it */
+void	flushFrameParser(FrameParser *parser, frameParserCallback callback, void *user);
+/* 1 = a valid header of the codec starts at data */
+int		parseFrameHeader(int codec, const unsigned char *data, int available, CompressedFrame *frame);
+
+#endif
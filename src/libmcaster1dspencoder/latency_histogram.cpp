@@ -0,0 +1,79 @@
+/*
+ * latency_histogram.cpp - log bucketed latency histograms
+ */
+#include <string.h>
+#include "latency_histogram.h"
+
+/* 0..3 exact, then four buckets to each power of two */
+static int bucketOf(long long micros) {
+	int top = 2;
+
+	if(micros < 4) {
+		return (micros > 0) ? (int) micros : 0;
+	}
+
+	while((top < 62) && (micros >> (top + 1))) {
+		top++;
+	}
+
+	int bucket = (top - 1) * 4 + (int) ((micros >> (top - 2)) & 3);
+
+	return (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS - 1;
+}
+
+long long latencyBucketFloor(int bucket) {
+	if(bucket < 4) {
+		return bucket;
+	}
+
+	return (long long) (4 + (bucket & 3)) << (bucket / 4 - 1);
+}
+
+void latencyRecord(LatencyHistogram *h, long long micros) {
+	if(micros < 0) {
+		micros = 0;
+	}
+
+	h->buckets[bucketOf(micros)]++;
+	h->sumMicros += micros;
+	if(micros > h->maxMicros) {
+		h->maxMicros = micros;
+	}
+
+	h->count++;
+}
+
+void latencyReset(LatencyHistogram *h) {
+	memset(h, '\000', sizeof(LatencyHistogram));
+}
+
+long long latencyPercentile(const LatencyHistogram *h, double percentile) {
+	long long	total = 0;
+	long long	seen = 0;
+
+	for(int i = 0; i < LATENCY_BUCKETS; i++) {
+		total += h->buckets[i];
+	}
+
+	if(!total) {
+		return 0;
+	}
+
+	long long	rank = (long long) (total * percentile / 100.0);
+
+	if(rank >= total) {
+		rank = total - 1;
+	}
+
+	for(int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if(seen > rank) {
+			/* middle of the bucket, never past the largest sample */
+			long long	value = (i + 1 < LATENCY_BUCKETS) ? (latencyBucketFloor(i) + latencyBucketFloor(i + 1)) / 2 : latencyBucketFloor(i);
+
+			return (value < h->maxMicros) ? value : h->maxMicros;
+		}
+	}
+
+	return h->maxMicros;
+}
@@ -0,0 +1,28 @@
+#ifndef __LATENCY_HISTOGRAM_H__
+#define __LATENCY_HISTOGRAM_H__
+
+/*
+ * Latency histograms for the pipeline stages of a slot.  Buckets are
+ * logarithmic, four to a power of two of microseconds, so a percentile is
+ * good to about 25% from a microsecond up to minutes and recording is a
+ * few shifts and an add.  One thread records into a histogram, others may
+ * read it at any time; a percentile read during a record can be one sample
+ * off, nothing worse.
+ */
+#define LATENCY_BUCKETS		112		// up to 2^28 us, about 4.5 minutes
+
+typedef struct tagLatencyHistogram {
+	long long	count;
+	long long	sumMicros;
+	long long	maxMicros;
+	long long	buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+void		latencyRecord(LatencyHistogram *h, long long micros);
+void		latencyReset(LatencyHistogram *h);
+/* Microseconds below which percentile (0..100) of the samples fall, 0 = no samples */
+long long	latencyPercentile(const LatencyHistogram *h, double percentile);
+/* Smallest value bucket holds, the next bucket's is its upper bound */
+long long	latencyBucketFloor(int bucket);
+
+#endif //__LATENCY_HISTOGRAM_H__
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/timeb.h>
 #include <time.h>
 #include <stdarg.h>
@@ -13,14 +14,21 @@
 
 #include "libmcaster1dspencoder.h"
 #include "libmcaster1dspencoder_socket.h"
+#include "archive_writer.h"
+#include "net_reactor.h"
+#include "metadata_dispatcher.h"
+#include "reconnect_scheduler.h"
+#include "metrics_server.h"
+#include "pipeline_trace.h"
+#include "async_log.h"
 #ifdef WIN32
 #include <bass.h>
 #else
 #ifdef HAVE_LAME
 #include <lame/lame.h>
 #endif
-#include <errno.h>
 #endif
+#include <errno.h>
 #ifndef LAME_MAXMP3BUFFER
 #define LAME_MAXMP3BUFFER	16384
 #endif
@@ -117,10 +125,16 @@ typedef struct tagConfigFileValue
 	char_t	Description[1024];
 } configFileValue;
 
-static configFileValue	configFileValues[100];
+/* Grows as keys are added, every key the slot registers plus whatever the file holds */
+static configFileValue	*configFileValues = NULL;
 static int				numConfigValues = 0;
+static int				configValuesSize = 0;
 
 static int				greconnectFlag = 0;
+
+static void				resetAdaptiveBitrate(mcaster1Globals *g);
+static void				replayResume(mcaster1Globals *g);
+static void				replayDrop(mcaster1Globals *g);
 char_t	defaultLogFileName[1024] = "mcaster1dspencoder.log";
 
 void setDefaultLogFileName(char_t *filename) {
@@ -172,10 +186,6 @@ void setAutoConnect(mcaster1Globals *g, int flag) {
 	g->autoconnect = flag;
 }
 
-FILE *getSaveFileP(mcaster1Globals *g) {
-	return g->gSaveFile;
-}
-
 int getLiveRecordingSetFlag(mcaster1Globals *g) {
 	return g->gLiveRecordingFlag;
 }
@@ -444,110 +454,33 @@ char_t *util_base64_decode(unsigned char_t *input) {
 #define HEADER_TYPE 1
 #define CODEC_TYPE	2
 
+/*
+ * The archive is written by a background thread (archive_writer.cpp), the
+ * send and audio paths only queue to it.
+ */
 void closeArchiveFile(mcaster1Globals *g) {
-	if(g->gSaveFile) {
-		if(g->gSaveAsWAV) {
-			wav_header.length = GUINT32_TO_LE(g->written + sizeof(struct wavhead) - 8);
-			wav_header.data_length = GUINT32_TO_LE(g->written);
-			fseek(g->gSaveFile, 0, SEEK_SET);
-			fwrite(&wav_header, sizeof(struct wavhead), 1, g->gSaveFile);
-			g->written = 0;
-		}
+	ArchiveWriter	*archive = g->archive;
 
-		fclose(g->gSaveFile);
-		g->gSaveFile = 0;
+	if(archive) {
+		g->archive = NULL;
+		stopArchiveWriter(archive);
 	}
 }
 
 int openArchiveFile(mcaster1Globals *g) {
-	char_t		outFilename[1024] = "";
-	char_t		outputFile[1024] = "";
-	struct tm	*newtime;
-	time_t		aclock;
-
-	time(&aclock);
-	newtime = localtime(&aclock);
-
-	sprintf(outFilename, "%s_%s", g->gServDesc, asctime(newtime));
-
-	memset(outputFile, '\000', sizeof(outputFile));
-
-	memset(outputFile, '\000', sizeof(outputFile));
-	ReplaceString(outFilename, outputFile, "\"", "'");
-	memset(outFilename, '\000', sizeof(outFilename));
-	ReplaceString(outputFile, outFilename, FILE_SEPARATOR, "");
-	memset(outputFile, '\000', sizeof(outputFile));
-	ReplaceString(outFilename, outputFile, "/", "");
-	memset(outFilename, '\000', sizeof(outFilename));
-	ReplaceString(outputFile, outFilename, ":", "");
-	memset(outputFile, '\000', sizeof(outputFile));
-	ReplaceString(outFilename, outputFile, "*", "");
-	memset(outFilename, '\000', sizeof(outFilename));
-	ReplaceString(outputFile, outFilename, "?", "");
-	memset(outputFile, '\000', sizeof(outputFile));
-	ReplaceString(outFilename, outputFile, "<", "");
-	memset(outFilename, '\000', sizeof(outFilename));
-	ReplaceString(outputFile, outFilename, ">", "");
-	memset(outputFile, '\000', sizeof(outputFile));
-	ReplaceString(outFilename, outputFile, "|", "");
-	memset(outFilename, '\000', sizeof(outFilename));
-	ReplaceString(outputFile, outFilename, "\n", "");
-
-	memset(outputFile, '\000', sizeof(outputFile));
-	strcpy(outputFile, outFilename);
-
-	if(g->gSaveAsWAV) {
-		strcat(outputFile, ".wav");
+	if(!g->archive) {
+		g->archive = startArchiveWriter(g);
 	}
-	else {
-		if(g->gOggFlag) {
-			strcat(outputFile, ".ogg");
-		}
-
-		if(g->gLAMEFlag) {
-			strcat(outputFile, ".mp3");
-		}
-
-		if(g->gAACFlag) {
-			strcat(outputFile, ".aac");
-		}
-
-		if(g->gAACPFlag) {
-			strcat(outputFile, ".aac");
-		}
-	}
-
-	sprintf(outFilename, "%s%s%s", g->gSaveDirectory, FILE_SEPARATOR, outputFile);
 
-	g->gSaveFile = fopen(outFilename, "wb");
-	if(!g->gSaveFile) {
-		char_t	buff[1024] = "";
+	return g->archive != NULL;
+}
 
-		sprintf(buff, "Cannot open %s", outputFile);
-		LogMessage(g,LOG_ERROR, buff);
+int getArchiveStats(mcaster1Globals *g, ArchiveStats *stats) {
+	if(!g->archive) {
 		return 0;
 	}
 
-	if(g->gSaveAsWAV) {
-		int nch = 2;
-		int rate = 44100;
-
-		memcpy(&wav_header.main_chunk, "RIFF", 4);
-		wav_header.length = GUINT32_TO_LE(0);
-		memcpy(&wav_header.chunk_type, "WAVE", 4);
-		memcpy(&wav_header.sub_chunk, "fmt ", 4);
-		wav_header.sc_len = GUINT32_TO_LE(16);
-		wav_header.format = GUINT16_TO_LE(1);
-		wav_header.modus = GUINT16_TO_LE(nch);
-		wav_header.sample_fq = GUINT32_TO_LE(rate);
-		wav_header.bit_p_spl = GUINT16_TO_LE(16);
-		wav_header.byte_p_sec = GUINT32_TO_LE(rate * wav_header.modus * (GUINT16_FROM_LE(wav_header.bit_p_spl) / 8));
-		wav_header.byte_p_spl = GUINT16_TO_LE((GUINT16_FROM_LE(wav_header.bit_p_spl) / (8 / nch)));
-		memcpy(&wav_header.data_chunk, "data", 4);
-		wav_header.data_length = GUINT32_TO_LE(0);
-		fwrite(&wav_header, sizeof(struct wavhead), 1, g->gSaveFile);
-	}
-
+	getArchiveWriterStats(g->archive, stats);
 	return 1;
 }
 
@@ -555,8 +488,22 @@ int sendToServer(mcaster1Globals *g, int sd, char_t *data, int length, int type)
 	int ret = 0;
 	int sendflags = 0;
 
+	/* Transcoder front end, the stream goes to a file instead of a server */
+	if(g->outputFile) {
+		if(fwrite(data, 1, length, g->outputFile) != (size_t) length) {
+			LogMessage(g,LOG_ERROR, "Cannot write to output file: %s", strerror(errno));
+			return -1;
+		}
+
+		if(g->writeBytesCallback) {
+			g->writeBytesCallback((void *) g, (void *) (intptr_t) length);
+		}
+
+		return length;
+	}
+
 	if(g->gSaveDirectoryFlag) {
-		if(!g->gSaveFile) {
+		if(!g->archive) {
 			openArchiveFile(g);
 		}
 	}
@@ -570,18 +517,51 @@ int sendToServer(mcaster1Globals *g, int sd, char_t *data, int length, int type)
 			break;
 
 		case CODEC_TYPE:
-			ret = send(sd, data, length, sendflags);
-			if(g->gSaveDirectoryFlag) {
-				if(g->gSaveFile) {
-					if(!g->gSaveAsWAV) {
-						fwrite(data, length, 1, g->gSaveFile);
+			{
+				long long	sendStarted = getMonotonicMicros();
+
+				TRACE_BEGIN("send", g->encoderNumber);
+
+				/* the reactor queue only blocks when it is full */
+				if(g->connection) {
+					ret = netSend(g->connection, data, length);
+
+					/* a logged in standby takes over where the failed connection stopped */
+					if((ret < 0) && failoverToStandby(g)) {
+						ret = netSend(g->connection, data, length);
+					}
+
+					if(ret > 0) {
+						mirrorToStandby(g, data, length);
 					}
 				}
+				else {
+					ret = send(sd, data, length, sendflags);
+				}
+				TRACE_END("send", g->encoderNumber);
+				g->blockSendMicros += getMonotonicMicros() - sendStarted;
+			}
+			if((ret > 0) && g->awaitingFirstByte) {
+				g->awaitingFirstByte = 0;
+				g->lastTimeToFirstByteMs = (long) ((getMonotonicMicros() - g->connectStarted) / 1000);
+				LogMessage(g, LOG_INFO, "Encoder %d first audio byte %ld ms after connect (network %ld ms, codec %ld ms, %s)",
+							g->encoderNumber,
+							g->lastTimeToFirstByteMs,
+							(long) ((g->connectReady - g->connectStarted) / 1000),
+							(long) ((g->codecReady - g->connectReady) / 1000),
+							g->warmEncoderReuse ? "codec reused" : "codec rebuilt");
+			}
+			if((ret > 0) && (g->replayState == REPLAY_RUNNING)) {
+				g->replayBytes += ret;
+			}
+			if(g->archive && !g->gSaveAsWAV) {
+				archiveData(g->archive, data, length);
 			}
 			break;
 	}
 
 	if(ret > 0) {
+		metricsCount(g, METRIC_BYTES_SENT, ret);
 		if(g->writeBytesCallback) {
 			g->writeBytesCallback((void *) g, (void *) ret);
 		}
@@ -597,14 +577,37 @@ int sendToServer(mcaster1Globals *g, int sd, char_t *data, int length, int type)
  * ───────────────────────────────────────────────────────────────────────────── */
 void configReset(void) {
 	numConfigValues = 0;
-	memset(&configFileValues, '\000', sizeof(configFileValues));
+}
+
+/* A cleared entry at the end of the store, NULL when it cannot grow */
+static configFileValue *configAppend(void) {
+	if(numConfigValues >= configValuesSize) {
+		int				size = configValuesSize ? configValuesSize * 2 : 128;
+		configFileValue *values = (configFileValue *) realloc(configFileValues, sizeof(configFileValue) * size);
+
+		if(!values) {
+			return NULL;
+		}
+
+		configFileValues = values;
+		configValuesSize = size;
+	}
+
+	configFileValue *v = &configFileValues[numConfigValues++];
+
+	memset(v, '\000', sizeof(configFileValue));
+	return v;
 }
 
 void configAddKeyValue(const char *key, const char *value) {
-	if (numConfigValues >= 99) return;
-	strncpy(configFileValues[numConfigValues].Variable, key,   255);
-	strncpy(configFileValues[numConfigValues].Value,    value, 255);
-	numConfigValues++;
+	configFileValue *v = configAppend();
+
+	if(!v) {
+		return;
+	}
+
+	strncpy(v->Variable, key, sizeof(v->Variable) - 1);
+	strncpy(v->Value, value, sizeof(v->Value) - 1);
 }
 
 int readConfigFile(mcaster1Globals *g, int readOnly) {
@@ -614,8 +617,7 @@ int readConfigFile(mcaster1Globals *g, int readOnly) {
 	char_t	defaultConfigName[] = "Mcaster1 DSP Encoder";
 
 
-	numConfigValues = 0;
-	memset(&configFileValues, '\000', sizeof(configFileValues));
+	configReset();
 
 	if(readOnly) {
 		sprintf(configFile, "%s", g->gConfigFileName);
@@ -657,10 +659,9 @@ int readConfigFile(mcaster1Globals *g, int readOnly) {
 				char_t	*p1 = strchr(buffer, '=');
 
 				if(p1) {
-					strncpy(configFileValues[numConfigValues].Variable, buffer, p1 - buffer);
+					*p1 = '\000';
 					p1++;	/* Get past the = */
-					strcpy(configFileValues[numConfigValues].Value, p1);
-					numConfigValues++;
+					configAddKeyValue(buffer, p1);
 				}
 			}
 		}
@@ -779,14 +780,18 @@ void GetConfigVariable(mcaster1Globals *g, char_t *appName, char_t *paramName, c
 		}
 	}
 
-	strcpy(configFileValues[numConfigValues].Variable, paramName);
-	strcpy(configFileValues[numConfigValues].Value, defaultvalue);
-	if (desc) {
-		strcpy(configFileValues[numConfigValues].Description, desc);
+	strcpy(destValue, defaultvalue);
+
+	configFileValue *v = configAppend();
+
+	if(v) {
+		strncpy(v->Variable, paramName, sizeof(v->Variable) - 1);
+		strncpy(v->Value, defaultvalue, sizeof(v->Value) - 1);
+		if (desc) {
+			strncpy(v->Description, desc, sizeof(v->Description) - 1);
+		}
 	}
 
-	strcpy(destValue, configFileValues[numConfigValues].Value);
-	numConfigValues++;
 	return;
 }
 
@@ -823,10 +828,13 @@ void PutConfigVariable(mcaster1Globals *g, char_t *appName, char_t *paramName, c
 		}
 	}
 
-	strcpy(configFileValues[numConfigValues].Variable, paramName);
-	strcpy(configFileValues[numConfigValues].Value, destValue);
-	strcpy(configFileValues[numConfigValues].Description, "");
-	numConfigValues++;
+	configFileValue *v = configAppend();
+
+	if(v) {
+		strncpy(v->Variable, paramName, sizeof(v->Variable) - 1);
+		strncpy(v->Value, destValue, sizeof(v->Value) - 1);
+	}
+
 	return;
 }
 
@@ -977,7 +985,64 @@ void initializeGlobals(mcaster1Globals *g) {
 	g->gCurrentlyEncoding = 0;
 	g->gShoutcastFlag = 0;
 	g->gIcecastFlag = 0;
-	g->gSaveFile = 0;
+	g->archive = NULL;
+	g->connection = NULL;
+	g->standby = NULL;
+	g->reconnectMaxSecs = RECONNECT_DEFAULT_MAX_SECS;
+	g->reconnectAttempts = 0;
+	g->reconnectDue = 0;
+	g->reconnectToBackup = 0;
+	g->reconnectRunning = 0;
+	memset(g->backupServer, '\000', sizeof(g->backupServer));
+	memset(g->backupPort, '\000', sizeof(g->backupPort));
+	g->standbyEnabled = 0;
+	g->onBackup = 0;
+	g->standbyAttempts = 0;
+	g->standbyDue = 0;
+	g->failovers = 0;
+	g->parallelConnects = STARTUP_DEFAULT_PARALLEL;
+	g->metricsPort = 0;
+	strcpy(g->metricsAddress, METRICS_DEFAULT_ADDRESS);
+	g->metrics = NULL;
+	g->metricsRegistered = 0;
+	g->traceEnable = 0;
+	g->abrEnabled = 0;
+	g->abrMinBitrate = ABR_DEFAULT_MIN_KBPS;
+	g->abrBitrate = 0;
+	g->abrBacklogMs = 0;
+	g->abrLastCheck = 0;
+	g->abrLastChange = 0;
+	g->abrCalmSince = 0;
+	g->abrChanges = 0;
+	g->pacingEnabled = 0;
+	g->pacingHeadroom = PACE_DEFAULT_HEADROOM;
+	g->pacingBurstKB = PACE_DEFAULT_BURST_KB;
+	g->replaySecs = 0;
+	g->replaySpeed = REPLAY_DEFAULT_SPEED;
+	g->replayBurstSecs = REPLAY_DEFAULT_BURST;
+	g->replayRing = NULL;
+	g->replayCapacity = 0;
+	g->replayWritten = 0;
+	g->replayRead = 0;
+	g->replayState = REPLAY_IDLE;
+	g->replayBurstFrames = 0;
+	g->replayFrames = 0;
+	g->replayBytes = 0;
+	g->replayLostFrames = 0;
+	g->replayedMsTotal = 0;
+	g->replayedBytesTotal = 0;
+	g->lowLatency = 0;
+	g->lowLatencyFrameMs = LOWLAT_DEFAULT_FRAME_MS;
+	g->captureLatencyMs = 0;
+	g->latencyEncodeMicros = 0;
+	g->latencyLastReport = 0;
+	g->latencyTheoreticalMs = 0;
+	g->latencyMeasuredMs = 0;
+	g->pendingCaptureMicros = 0;
+	g->blockCaptureMicros = 0;
+	memset(g->stageLatency, '\000', sizeof(g->stageLatency));
+	g->stageReportSecs = LATENCY_DEFAULT_REPORT_SECS;
+	g->stageLastReport = 0;
 	g->destURLCallback = NULL;
 	g->sourceURLCallback = NULL;
 	g->serverStatusCallback = NULL;
@@ -1013,6 +1078,7 @@ void initializeGlobals(mcaster1Globals *g) {
 
 	g->ReconnectTrigger = 0;
 
+	g->passthroughConfirmFrames = PASSTHROUGH_CONFIRM_FRAMES;
 }
 
 char_t *getCurrentlyPlaying(mcaster1Globals *g) {
@@ -1169,13 +1235,22 @@ void URLize(char_t *input, char_t *output, int inputlen, int outputlen) {
 }
 
 int updateSongTitle(mcaster1Globals *g, int forceURL) {
-	char_t	contentString[2056] = "";
+	char_t	path[2056] = "";
+	char_t	authorization[1024] = "";
 	char_t	URLPassword[255] = "";
 	char_t	URLSong[1024] = "";
 	char_t	Song[1024] = "";
+	int		inBandMetadata = g->gOggFlag;
+
+#ifdef WIN32
+	/* Ogg Opus carries the title in-band, just like Vorbis */
+	if(g->gOpusFlag) {
+		inBandMetadata = 1;
+	}
+#endif
 
 	if(getIsConnected(g)) {
-		if((!g->gOggFlag) || (forceURL)) {
+		if((!inBandMetadata) || (forceURL)) {
 			if((g->gSCFlag) || (g->gIcecastFlag) || (g->gIcecast2Flag) || forceURL) {
 				URLize(g->gPassword, URLPassword, sizeof(g->gPassword), sizeof(URLPassword));
 
@@ -1191,44 +1266,46 @@ int updateSongTitle(mcaster1Globals *g, int forceURL) {
 					char_t	*puserAuthbase64 = util_base64_encode(userAuth);
 
 					if(puserAuthbase64) {
-						sprintf(contentString,
-								"GET /admin/metadata?pass=%s&mode=updinfo&mount=%s&song=%s HTTP/1.0\r\nAuthorization: Basic %s\r\nUser-Agent: (Mozilla Compatible)\r\n\r\n",
+						sprintf(path,
+								"/admin/metadata?pass=%s&mode=updinfo&mount=%s&song=%s",
 							URLPassword,
 								g->gMountpoint,
-								URLSong,
-								puserAuthbase64);
+								URLSong);
+						snprintf(authorization, sizeof(authorization), "%s", puserAuthbase64);
 						free(puserAuthbase64);
 					}
 				}
 
 				if(g->gIcecastFlag) {
-					sprintf(contentString,
-							"GET /admin.cgi?pass=%s&mode=updinfo&mount=%s&song=%s HTTP/1.0\r\nUser-Agent: (Mozilla Compatible)\r\n\r\n",
+					sprintf(path,
+							"/admin.cgi?pass=%s&mode=updinfo&mount=%s&song=%s",
 						URLPassword,
 							g->gMountpoint,
 							URLSong);
 				}
 
 				if(g->gSCFlag) {
-					sprintf(contentString,
-							"GET /admin.cgi?pass=%s&mode=updinfo&song=%s HTTP/1.0\r\nUser-Agent: (Mozilla Compatible)\r\n\r\n",
+					sprintf(path,
+							"/admin.cgi?pass=%s&mode=updinfo&song=%s",
 						URLPassword,
 							URLSong);
 				}
 
-				g->gSCSocketControl = g->controlChannel.DoSocketConnect(g->gServer, atoi(g->gPort));
-				if(g->gSCSocketControl != -1) {
-					int sent = send(g->gSCSocketControl, contentString, strlen(contentString), 0);
-					//int sent = sendToServer(g, g->gSCSocketControl, contentString, strlen(contentString), HEADER_TYPE);
-
-					closesocket(g->gSCSocketControl);
-				}
-				else {
-					LogMessage(g,LOG_ERROR, "Cannot connect to server");
+				/* sent by the server's metadata worker, a newer title within the window replaces this one */
+				if(path[0]) {
+					queueMetadataUpdate(g, getTargetServer(g, g->onBackup), atoi(getTargetPort(g, g->onBackup)), path, authorization, g->metadataCoalesceMs);
 				}
 			}
 		}
 		else {
+#ifdef WIN32
+			if(g->gOpusFlag) {
+				/* picked up by do_encoding on the encoder thread */
+				g->opusChainRequested = getMonotonicMicros();
+				g->opusChainPending.store(1, std::memory_order_release);
+			}
+			else
+#endif
 			g->ice2songChange = true;
 		}
 		return 1;
@@ -1312,9 +1389,31 @@ int disconnectFromServer(mcaster1Globals *g) {
 #endif
 	}
 
+	/* A clean stop gets the codec's buffered tail, a dead socket does not */
+	if(!g->connectionLost && g->gSCSocket && g->codec && g->codec->flush) {
+		g->codec->flush(g);
+	}
+	/* only a lost connection is replayed, a stop starts afresh */
+	if(!g->connectionLost) {
+		replayDrop(g);
+	}
+
+	g->connectionLost = 0;
+
 	/* Close all open sockets */
-	closesocket(g->gSCSocket);
-	closesocket(g->gSCSocketControl);
+	if(g->connection) {
+		if(g->pacingEnabled) {
+			NetStats	stats;
+
+			netGetStats(g->connection, &stats);
+			LogMessage(g, LOG_INFO, "Encoder %d: pacing held the stream back %ld times, %ld ms in all",
+						g->encoderNumber, stats.pacingHolds, stats.pacingDelayMs);
+		}
+
+		netClose(g->connection);
+	}
+
+	closeStandby(g);
 
 	/*
 	 * Reset the Status to Disconnected, and reenable the config ;
@@ -1330,32 +1429,12 @@ int disconnectFromServer(mcaster1Globals *g) {
 	vorbis_info_clear(&g->vi);
 	memset(&(g->vi), '\000', sizeof(g->vi));
 #endif
-#ifdef HAVE_LAME
-#ifndef WIN32
-	if(g->gf) {
-		lame_close(g->gf);
-		g->gf = NULL;
-	}
-#endif
-#endif
-#ifdef WIN32
-	if(g->lameGF) {
-		lame_close(g->lameGF);
-		g->lameGF = NULL;
-	}
-	if(g->fdkAacEncoder) {
-		aacEncClose(&g->fdkAacEncoder);
-		g->fdkAacEncoder = NULL;
-	}
-	if(g->opusEncoder) {
-		ope_encoder_destroy(g->opusEncoder);
-		g->opusEncoder = NULL;
-	}
-	if(g->opusComments) {
-		ope_comments_destroy(g->opusComments);
-		g->opusComments = NULL;
-	}
-#endif
+	/*
+	 * Codecs with a reset entry (LAME, fdk-aac, Opus) are left alive on ;
+	 * purpose, the next initializeencoder resets them if the settings have ;
+	 * not changed.
+	 */
+	g->awaitingFirstByte = 0;
 	if(g->serverStatusCallback) {
 		g->serverStatusCallback(g, (void *) "Disconnected");
 	}
@@ -1367,75 +1446,245 @@ int disconnectFromServer(mcaster1Globals *g) {
 
 /*
  =======================================================================================================================
-    This funciton will connect to a server (Shoutcast/Icecast/Icecast2) ;
-    and send the appropriate password info and check to make sure things ;
-    are connected....
+    Send pacing rate, bytes per second: the nominal bitrate plus PacingHeadroomPercent.
+    The ceiling of a managed VBR range is the nominal rate, and FLAC, which has no
+    bitrate, is paced against the PCM it compresses, which it never exceeds.
  =======================================================================================================================
  */
-int connectToServer(mcaster1Globals *g) {
-	int		s_socket = 0;
-	char_t	buffer[1024] = "";
-	char_t	contentString[1024] = "";
-	char_t	brate[25] = "";
-	char_t	ypbrate[25] = "";
+static long pacingBytesPerSecond(mcaster1Globals *g) {
+	long	kbps = (g->currentBitrateMax > g->currentBitrate) ? g->currentBitrateMax : g->currentBitrate;
 
-	LogMessage(g,LOG_DEBUG, "Connecting encoder %d", g->encoderNumber);
+	if(g->gFLACFlag) {
+		kbps = (g->currentSamplerate * g->currentChannels * 16) / 1000;
+	}
 
-	sprintf(brate, "%d", g->currentBitrate);
+	if(kbps <= 0) {
+		return 0;
+	}
+
+	return (kbps * 125 * (100 + ((g->pacingHeadroom > 0) ? g->pacingHeadroom : 0))) / 100;
+}
+
+/*
+ =======================================================================================================================
+    Low latency profile.  LowLatency takes the delay out of each layer between the
+    sound card and the server: the host opens the card with LOWLAT_CAPTURE_FRAMES
+    periods, Opus runs LowLatencyFrameMs frames with no muxing or decision delay,
+    Vorbis gets a page per packet, and the connection runs without Nagle, with
+    little unsent data in the kernel and a send queue of LOWLAT_QUEUE_MS.  The
+    theoretical latency adds up what each layer holds by design; the measured
+    one replaces the page fill with what a block really takes and what is
+    really waiting to be sent.
+ =======================================================================================================================
+ */
+static long lowLatencyQueueBytes(mcaster1Globals *g) {
+	long	bytes = ((long) g->currentBitrate * LOWLAT_QUEUE_MS) / 8;
+
+	return (bytes > 8192) ? bytes : 8192;
+}
+
+/* What the codec holds by design: its frame and lookahead, roughly */
+static long codecDelayMs(mcaster1Globals *g) {
+	long	rate = (g->currentSamplerate > 0) ? g->currentSamplerate : 44100;
+
+#ifdef WIN32
+	if(g->gOpusFlag) {
+		return (g->lowLatency ? g->lowLatencyFrameMs : 20) + 7;	// 6.5 ms lookahead
+	}
+
+	if(g->gAACPlusFlag || g->gAAC2Flag) {
+		return (4096 * 1000) / rate;		// SBR works on twice the frame
+	}
+
+	if(g->gAACLCFlag) {
+		return (2048 * 1000) / rate;
+	}
+#endif
+	if(g->gFLACFlag) {
+		return (4096 * 1000) / rate;
+	}
 
 	if(g->gOggFlag) {
-		if(!g->gOggBitQualFlag) {
-			sprintf(ypbrate, "Quality %s", g->gOggQuality);
-		}
-		else {
-			strcpy(ypbrate, brate);
-		}
+		return (2048 * 1000) / rate;		// long Vorbis block
 	}
-	else {
-		strcpy(ypbrate, brate);
+
+	if(g->gLAMEFlag) {
+		return ((1152 + 576) * 1000) / rate;
 	}
 
-	g->gSCFlag = 0;
+	if(g->gAACFlag || g->gAACPFlag) {
+		return (2048 * 1000) / rate;
+	}
 
-	greconnectFlag = 0;
+	return 0;
+}
 
-	if(g->serverStatusCallback) {
-		g->serverStatusCallback(g, (void *) "Connecting");
+/* Filling an Ogg page before it goes out */
+static long pageDelayMs(mcaster1Globals *g) {
+	if(g->lowLatency) {
+		return 0;
 	}
 
 #ifdef WIN32
-	g->dataChannel.initWinsockLib();
+	if(g->gOpusFlag) {
+		return 1000;						// libopusenc's default muxing delay
+	}
 #endif
+	if(g->gOggFlag && !g->gFLACFlag && (g->currentBitrate > 0)) {
+		return (4096L * 8) / g->currentBitrate;	// about 4 KB a page
+	}
 
-	/* If we are Icecast/Icecast2, then connect to specified port */
-	if(g->gIcecastFlag || g->gIcecast2Flag) {
-		g->gSCSocket = g->dataChannel.DoSocketConnect(g->gServer, atoi(g->gPort));
+	return 0;
+}
+
+/* From connectToServer once the slot streams */
+static void reportLatencyProfile(mcaster1Globals *g) {
+	g->latencyTheoreticalMs = g->captureLatencyMs + codecDelayMs(g) + pageDelayMs(g);
+	g->latencyEncodeMicros = 0;
+	g->latencyLastReport = getMonotonicMicros();
+	if(g->lowLatency) {
+		LogMessage(g, LOG_INFO, "Encoder %d low latency: %ld ms theoretical (capture %ld, codec %ld, page %ld), send queue %ld bytes",
+					g->encoderNumber, g->latencyTheoreticalMs, g->captureLatencyMs, codecDelayMs(g), pageDelayMs(g),
+					lowLatencyQueueBytes(g));
 	}
-	else {
+}
 
-		/*
-		 * If we are Shoutcast, then the control socket (used for password) ;
-		 * is port+1.
-		 */
-		g->gSCSocket = g->dataChannel.DoSocketConnect(g->gServer, atoi(g->gPort) + 1);
+/* From encodeBlock with the wall time of the block */
+static void measureLatency(mcaster1Globals *g, long long blockMicros) {
+	long long	now = getMonotonicMicros();
+
+	g->latencyEncodeMicros += (blockMicros - g->latencyEncodeMicros) / 8;
+	if((now - g->latencyLastReport) < (long long) LATENCY_REPORT_MS * 1000) {
+		return;
 	}
 
-	/* Check to see if we connected okay */
-	if(g->gSCSocket == -1) {
-		if(g->serverStatusCallback) {
-			g->serverStatusCallback(g, (void *) "Unable to connect to socket");
+	/* bytes * 8 / kbps is milliseconds */
+	long	backlogMs = (getAdaptiveBitrate(g) > 0) ? (long) (((long long) netGetBacklog(g->connection) * 8) / getAdaptiveBitrate(g)) : 0;
+
+	g->latencyLastReport = now;
+	g->latencyMeasuredMs = g->captureLatencyMs + codecDelayMs(g) + (long) (g->latencyEncodeMicros / 1000) + backlogMs;
+	LogMessage(g, LOG_INFO, "Encoder %d latency: %ld ms measured (capture %ld, codec %ld, block %ld, send backlog %ld), %ld ms theoretical",
+				g->encoderNumber, g->latencyMeasuredMs, g->captureLatencyMs, codecDelayMs(g),
+				(long) (g->latencyEncodeMicros / 1000), backlogMs, g->latencyTheoreticalMs);
+}
+
+void setCaptureLatency(mcaster1Globals *g, long ms) {
+	g->captureLatencyMs = ms;
+}
+
+long getTheoreticalLatencyMs(mcaster1Globals *g) {
+	return g->latencyTheoreticalMs;
+}
+
+long getMeasuredLatencyMs(mcaster1Globals *g) {
+	return g->latencyMeasuredMs;
+}
+
+/*
+ =======================================================================================================================
+    Capture to wire.  The host stamps each block with the monotonic time its
+    first frame was captured (stampCapture, before handle_output); a block it
+    did not stamp counts from when handle_output got it.  The stamp goes with
+    it to the codec, and after the codec the connection carries it along the
+    send queue to send() (netMarkTime).
+    The stages go into per slot histograms; percentiles are logged every
+    LatencyReportSecs.  Replayed blocks are left out, their delay is the gap.
+ =======================================================================================================================
+ */
+static const char	*stageNames[LATENCY_STAGES] = { "queue_wait", "encode", "send", "capture_to_wire" };
+
+void stampCapture(mcaster1Globals *g, long long captureMicros) {
+	g->pendingCaptureMicros = captureMicros;
+}
+
+/* From handle_output, a block arrived */
+static void beginBlock(mcaster1Globals *g) {
+	g->blockCaptureMicros = g->pendingCaptureMicros ? g->pendingCaptureMicros : getMonotonicMicros();
+	g->pendingCaptureMicros = 0;
+}
+
+static void resetStageLatency(mcaster1Globals *g) {
+	for(int i = 0; i < LATENCY_STAGES; i++) {
+		/* the reactor thread records the wire stage under the connection's lock */
+		if((i == LATENCY_STAGE_WIRE) && g->connection) {
+			netResetLatencyHistogram(g->connection);
+		}
+		else {
+			latencyReset(&g->stageLatency[i]);
 		}
+	}
 
-		return 0;
+	g->stageLastReport = getMonotonicMicros();
+}
+
+static char *formatPercentiles(char *out, size_t size, const LatencyHistogram *h) {
+	snprintf(out, size, "%.1f/%.1f/%.1f",
+			 latencyPercentile(h, 50) / 1000.0,
+			 latencyPercentile(h, 99) / 1000.0,
+			 latencyPercentile(h, 99.9) / 1000.0);
+	return out;
+}
+
+static void reportStageLatency(mcaster1Globals *g) {
+	long long	now = getMonotonicMicros();
+	char		stage[LATENCY_STAGES][64];
+
+	if((g->stageReportSecs <= 0) || ((now - g->stageLastReport) < (long long) g->stageReportSecs * 1000000)) {
+		return;
 	}
 
-	int pswdok = 1;
+	g->stageLastReport = now;
+	for(int i = 0; i < LATENCY_STAGES; i++) {
+		formatPercentiles(stage[i], sizeof(stage[i]), &g->stageLatency[i]);
+	}
 
-	/* Yup, we did. */
-	if(g->serverStatusCallback) {
-		g->serverStatusCallback(g, (void *) "Socket connected");
+	LogMessage(g, LOG_INFO, "Encoder %d latency p50/p99/p99.9 ms: capture to wire %s, queue wait %s, encode %s, send %s (%lld blocks)",
+				g->encoderNumber,
+				stage[LATENCY_STAGE_WIRE],
+				stage[LATENCY_STAGE_QUEUE_WAIT],
+				stage[LATENCY_STAGE_ENCODE],
+				stage[LATENCY_STAGE_SEND],
+				g->stageLatency[LATENCY_STAGE_ENCODE].count);
+}
+
+const LatencyHistogram *getStageLatency(mcaster1Globals *g, int stage) {
+	return ((stage >= 0) && (stage < LATENCY_STAGES)) ? &g->stageLatency[stage] : NULL;
+}
+
+const char *getStageName(int stage) {
+	return ((stage >= 0) && (stage < LATENCY_STAGES)) ? stageNames[stage] : "";
+}
+
+/*
+ =======================================================================================================================
+    Queues the login for this slot's server type on conn and starts ;
+    connecting it to server:port.  The reconnect scheduler uses it for ;
+    the standby connection as well.
+ =======================================================================================================================
+ */
+int openSourceConnection(mcaster1Globals *g, NetConnection *conn, const char_t *server, const char_t *port) {
+	char_t	buffer[1024] = "";
+	char_t	contentString[1024] = "";
+	char_t	brate[25] = "";
+	char_t	ypbrate[25] = "";
+
+	sprintf(brate, "%d", g->currentBitrate);
+
+	if(g->gOggFlag) {
+		if(!g->gOggBitQualFlag) {
+			sprintf(ypbrate, "Quality %s", g->gOggQuality);
+		}
+		else {
+			strcpy(ypbrate, brate);
+		}
+	}
+	else {
+		strcpy(ypbrate, brate);
 	}
 
+	/* Left over from a connection that failed without a disconnect */
+	netClose(conn);
+
 	char_t	contentType[255] = "";
 
 	if(g->gOggFlag) {
@@ -1462,7 +1711,9 @@ int connectToServer(mcaster1Globals *g) {
 
 	/*
 	 * Here are all the variations of sending the password to ;
-	 * a server..This if statement really is ugly...must fix.
+	 * a server..This if statement really is ugly...must fix. ;
+	 * They are queued as login steps, the reactor sends each one ;
+	 * and checks the reply before the next.
 	 */
 	if(g->gIcecastFlag || g->gIcecast2Flag) {
 
@@ -1479,6 +1730,13 @@ int connectToServer(mcaster1Globals *g) {
 					brate,
 					g->gPubServ,
 					g->gServDesc);
+
+			/*
+			 * Here we are checking the response from Icecast ;
+			 * from when we sent in the password...OK means we are good..if the ;
+			 * password is bad, Icecast just disconnects the socket.
+			 */
+			netAddHandshake(conn, contentString, strlen(contentString), g->gOggFlag ? "OK" : NULL);
 		}
 
 		if(g->gIcecast2Flag) {
@@ -1512,44 +1770,22 @@ int connectToServer(mcaster1Globals *g) {
 						audioInfo);
 				free(puserAuthbase64);
 			}
+
+			netAddHandshake(conn, contentString, strlen(contentString), NULL);
 		}
 	}
 	else {
 
-		/* The Shoutcast way */
-		sendToServer(g, g->gSCSocket, g->gPassword, strlen(g->gPassword), HEADER_TYPE);
-		sendToServer(g, g->gSCSocket, "\r\n", strlen("\r\n"), HEADER_TYPE);
-
-		recv(g->gSCSocket, buffer, sizeof(buffer), (int) 0);
-
 		/*
+		 * The Shoutcast way. ;
 		 * if we get an OK, then we are not a Shoutcast server ;
 		 * (could be live365 or other variant)..And OK2 means it's ;
 		 * Shoutcast and we can safely send in metadata via the ;
 		 * admin.cgi interface.
 		 */
-		if(!strncmp(buffer, "OK", strlen("OK"))) {
-			if(!strncmp(buffer, "OK2", strlen("OK2"))) {
-				g->gSCFlag = 1;
-			}
-			else {
-				g->gSCFlag = 0;
-			}
-
-			if(g->serverStatusCallback) {
-				g->serverStatusCallback(g, (void *) "Password OK");
-			}
-		}
-		else {
-			if(g->serverStatusCallback) {
-				g->serverStatusCallback(g, (void *) "Password Failed");
-			}
-
-			closesocket(g->gSCSocket);
-			return 0;
-		}
+		sprintf(buffer, "%s\r\n", g->gPassword);
+		netAddHandshake(conn, buffer, strlen(buffer), "OK");
 
-		memset(contentString, '\000', sizeof(contentString));
 		if(strlen(g->gServICQ) == 0) {
 			strcpy(g->gServICQ, "N/A");
 		}
@@ -1573,42 +1809,95 @@ int connectToServer(mcaster1Globals *g) {
 				g->gServICQ,
 				g->gServAIM,
 				brate);
+		netAddHandshake(conn, contentString, strlen(contentString), NULL);
 	}
 
-	sendToServer(g, g->gSCSocket, contentString, strlen(contentString), HEADER_TYPE);
+	/*
+	 * If we are Icecast/Icecast2, then connect to specified port. ;
+	 * If we are Shoutcast, then the control socket (used for password) ;
+	 * is port+1.
+	 */
+	netSetPacing(conn, g->pacingEnabled ? pacingBytesPerSecond(g) : 0, g->pacingBurstKB * 1024L);
+	netSetLowLatency(conn, g->lowLatency ? lowLatencyQueueBytes(g) : 0);
+	netSetLatencyHistogram(conn, &g->stageLatency[LATENCY_STAGE_WIRE]);
+	return netOpen(conn, server, atoi(port) + ((g->gIcecastFlag || g->gIcecast2Flag) ? 0 : 1));
+}
 
-	if(g->gIcecastFlag) {
+/*
+ =======================================================================================================================
+    This funciton will connect to a server (Shoutcast/Icecast/Icecast2) ;
+    and send the appropriate password info and check to make sure things ;
+    are connected....
+ =======================================================================================================================
+ */
+int connectToServer(mcaster1Globals *g) {
+	/* one attempt at the backup, the scheduler sets it per attempt */
+	g->onBackup = g->reconnectToBackup && g->backupServer[0];
+	g->reconnectToBackup = 0;
 
-		/*
-		 * Here we are checking the response from Icecast/Icecast2 ;
-		 * from when we sent in the password...OK means we are good..if the ;
-		 * password is bad, Icecast just disconnects the socket.
-		 */
-		if(g->gOggFlag) {
-			recv(g->gSCSocket, buffer, sizeof(buffer), 0);
-			if(!strncmp(buffer, "OK", strlen("OK"))) {
+	const char_t	*server = getTargetServer(g, g->onBackup);
+	const char_t	*port = getTargetPort(g, g->onBackup);
 
-				/* I don't think this check is needed.. */
-				if(!strncmp(buffer, "OK2", strlen("OK2"))) {
-					g->gSCFlag = 1;
-				}
-				else {
-					g->gSCFlag = 0;
-				}
+	LogMessage(g,LOG_DEBUG, "Connecting encoder %d to %s:%s", g->encoderNumber, server, port);
+	g->connectStarted = getMonotonicMicros();
+	g->connectReady = g->connectStarted;
+	g->codecReady = g->connectStarted;
+	g->awaitingFirstByte = 0;
 
-				if(g->serverStatusCallback) {
-					g->serverStatusCallback(g, (void *) "Password OK");
-				}
+	g->gSCFlag = 0;
+
+	greconnectFlag = 0;
+
+	if(g->serverStatusCallback) {
+		g->serverStatusCallback(g, (void *) "Connecting");
+	}
+
+#ifdef WIN32
+	g->dataChannel.initWinsockLib();
+#endif
+
+	if(!g->connection) {
+		g->connection = createNetConnection();
+	}
+
+	if(!g->connection) {
+		LogMessage(g, LOG_ERROR, "Encoder %d: out of memory for the connection", g->encoderNumber);
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) "Unable to connect to socket");
+		}
+
+		return 0;
+	}
+
+	if(!openSourceConnection(g, g->connection, server, port) || (netWaitOpen(g->connection) != NET_STREAMING)) {
+		LogMessage(g, LOG_ERROR, "Encoder %d: %s (after %ld ms)", g->encoderNumber, netGetError(g->connection),
+					(long) ((getMonotonicMicros() - g->connectStarted) / 1000));
+		if(g->serverStatusCallback) {
+			if(netGetFailedState(g->connection) == NET_HANDSHAKE) {
+				g->serverStatusCallback(g, (void *) "Socket connected");
+				g->serverStatusCallback(g, (void *) "Password Failed");
 			}
 			else {
-				if(g->serverStatusCallback) {
-					g->serverStatusCallback(g, (void *) "Password Failed");
-				}
-
-				closesocket(g->gSCSocket);
-				return 0;
+				g->serverStatusCallback(g, (void *) "Unable to connect to socket");
 			}
 		}
+
+		netClose(g->connection);
+		return 0;
+	}
+
+	g->gSCSocket = (int) netGetSocket(g->connection);
+
+	/* Yup, we did. */
+	if(g->serverStatusCallback) {
+		g->serverStatusCallback(g, (void *) "Socket connected");
+	}
+
+	if(!g->gIcecast2Flag && (!g->gIcecastFlag || g->gOggFlag)) {
+		g->gSCFlag = !strncmp(netGetReply(g->connection, 0), "OK2", strlen("OK2"));
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) "Password OK");
+		}
 	}
 
 	/* We are connected */
@@ -1622,11 +1911,37 @@ int connectToServer(mcaster1Globals *g) {
 
 	int ret = 0;
 
+	g->connectReady = getMonotonicMicros();
 	ret = initializeencoder(g);
-	g->forcedDisconnect = false;
+	g->codecReady = getMonotonicMicros();
 	if(ret) {
+		NetStats	phases;
+
+		/* where the time to come up went, for slow starts with many slots */
+		netGetStats(g->connection, &phases);
+		LogMessage(g, LOG_INFO, "Encoder %d up on %s:%s in %ld ms: resolve %ld ms, connect %ld ms, login %ld ms, codec init %ld ms",
+					g->encoderNumber,
+					server,
+					port,
+					(long) ((g->codecReady - g->connectStarted) / 1000),
+					phases.resolveMs,
+					phases.connectMs,
+					phases.loginMs,
+					(long) ((g->codecReady - g->connectReady) / 1000));
+		g->forcedDisconnect = false;
+		resetAdaptiveBitrate(g);
+		replayResume(g);
+		reportLatencyProfile(g);
+		resetStageLatency(g);
+		g->awaitingFirstByte = 1;
+		g->governorShed = 0;
+		g->governorShedRequest = 0;
+		g->passthroughActive = 0;
+		g->passthroughMatched = 0;
+		g->passthroughFrames = 0;
 		g->weareconnected = 1;
 		g->automaticconnect = 1;
+		reconnectSucceeded(g);
 
 		if(g->serverStatusCallback) {
 			g->serverStatusCallback(g, (void *) "Success");
@@ -1636,6 +1951,7 @@ int connectToServer(mcaster1Globals *g) {
 	}
 	else {
 		disconnectFromServer(g);
+		releaseEncoders(g);
 		if(g->serverStatusCallback)
 		{
 #ifdef WIN32
@@ -1705,7 +2021,10 @@ int ogg_encode_dataout(mcaster1Globals *g)
 			int eos = 0;
 
 			while(!eos) {
-				int result = ogg_stream_pageout(&g->os, &og);
+				/* low latency sends every packet in a page of its own */
+				TRACE_BEGIN("ogg_page", g->encoderNumber);
+				int result = g->lowLatency ? ogg_stream_flush(&g->os, &og) : ogg_stream_pageout(&g->os, &og);
+				TRACE_END("ogg_page", g->encoderNumber);
 
 				if(!result) break;
 
@@ -1773,6 +2092,15 @@ int ocConvertAudio(mcaster1Globals *g, float *in_samples, float *out_samples, in
 static int opus_write_callback(void *user_data, const unsigned char *ptr, opus_int32 len)
 {
 	mcaster1Globals *g = (mcaster1Globals *)user_data;
+
+	if(g->opusAwaitBOS) {
+		/* Tail of the link that belonged to the previous connection */
+		if((len < 6) || memcmp(ptr, "OggS", 4) || !(ptr[5] & 0x02)) {
+			return 0;
+		}
+		g->opusAwaitBOS = 0;
+	}
+
 	int ret = sendToServer(g, g->gSCSocket, (char *)ptr, (int)len, CODEC_TYPE);
 	return (ret >= 0) ? 0 : 1;   /* libopusenc: 0 = success, non-zero = error */
 }
@@ -1782,987 +2110,2511 @@ static int opus_close_callback(void *user_data)
 	(void)user_data;
 	return 0;   /* socket lifecycle is managed separately */
 }
-#endif
-
-int initializeencoder(mcaster1Globals *g) {
-	int		ret = 0;
-	char_t	outFilename[1024] = "";
-	char_t	message[1024] = "";
-
-	resetResampler(g);
 
-	if(g->gLAMEFlag)
-	{
-#ifdef HAVE_LAME
-#ifdef WIN32
-		// Native LAME MP3 init
-		if(g->lameGF) {
-			lame_close(g->lameGF);
-			g->lameGF = NULL;
-		}
-		g->lameGF = lame_init();
-		lame_set_num_channels(g->lameGF, g->currentChannels);
-		lame_set_in_samplerate(g->lameGF, g->currentSamplerate);
-		lame_set_out_samplerate(g->lameGF, g->currentSamplerate);
-
-		if (g->lameVBRMode == 1) {        // VBR
-			lame_set_VBR(g->lameGF, vbr_mtrh);
-			lame_set_VBR_q(g->lameGF, g->lameVBRQuality);
-			if (g->lameMinBitrate > 0) lame_set_VBR_min_bitrate_kbps(g->lameGF, g->lameMinBitrate);
-			if (g->lameMaxBitrate > 0) lame_set_VBR_max_bitrate_kbps(g->lameGF, g->lameMaxBitrate);
-		} else if (g->lameVBRMode == 2) { // ABR
-			lame_set_VBR(g->lameGF, vbr_abr);
-			lame_set_VBR_mean_bitrate_kbps(g->lameGF, g->lameABRMean > 0 ? g->lameABRMean : g->currentBitrate);
-			if (g->lameMinBitrate > 0) lame_set_VBR_min_bitrate_kbps(g->lameGF, g->lameMinBitrate);
-			if (g->lameMaxBitrate > 0) lame_set_VBR_max_bitrate_kbps(g->lameGF, g->lameMaxBitrate);
-		} else {                           // CBR (default)
-			lame_set_VBR(g->lameGF, vbr_off);
-			lame_set_brate(g->lameGF, g->currentBitrate);
-		}
-		lame_set_quality(g->lameGF, 5);   // encode quality 0(best)-9(fast)
-		lame_set_mode(g->lameGF, g->currentChannels == 1 ? MONO : JOINT_STEREO);
-		lame_init_params(g->lameGF);
+static void opusCommentAdd(OggOpusComments *comments, const char_t *tag, char_t *value)
+{
+	wchar_t	widestring[4096];
+	char_t	tempstring[4096];
 
-#else
-		g->gf = lame_init();
-		lame_set_errorf(g->gf, oddsock_error_handler_function);
-		lame_set_debugf(g->gf, oddsock_error_handler_function);
-		lame_set_msgf(g->gf, oddsock_error_handler_function);
+	/* Opus tags are UTF-8, titles arrive in the ANSI code page */
+	MultiByteToWideChar(CP_ACP, 0, value, strlen(value) + 1, widestring, 4096);
+	memset(tempstring, '\000', sizeof(tempstring));
+	WideCharToMultiByte(CP_UTF8, 0, widestring, wcslen(widestring) + 1, tempstring, sizeof(tempstring), 0, NULL);
+	ope_comments_add(comments, tag, tempstring);
+}
 
-		lame_set_brate(g->gf, g->currentBitrate);
-		lame_set_quality(g->gf, g->gLAMEOptions.quality);
+/* Build the OpusTags block for the current song - used at init and on chain */
+static OggOpusComments *buildOpusComments(mcaster1Globals *g)
+{
+	char_t	SongTitle[1024] = "";
+	char_t	Artist[1024] = "";
+	char_t	FullTitle[1024] = "";
+	OggOpusComments *comments = ope_comments_create();
 
-		lame_set_num_channels(g->gf, 2);
+	if(!comments) {
+		return NULL;
+	}
 
-		if(g->currentChannels == 1) {
-			lame_set_mode(g->gf, MONO);
+	ope_comments_add(comments, "ENCODER", "mcaster1dspencoder");
 
-			/*
-			 * lame_set_num_channels(g->gf, 1);
-			 */
-		}
-		else {
-			lame_set_mode(g->gf, STEREO);
+	getCurrentSongTitle(g, SongTitle, Artist, FullTitle);
+	if((strlen(SongTitle) == 0) && (strlen(Artist) == 0)) {
+		if(strlen(FullTitle)) {
+			opusCommentAdd(comments, "TITLE", FullTitle);
 		}
-
-		/*
-		 * Make the input sample rate the same as output..i.e. don't make lame do ;
-		 * any resampling->..cause we are handling it ourselves...
-		 */
-		lame_set_in_samplerate(g->gf, g->currentSamplerate);
-		lame_set_out_samplerate(g->gf, g->currentSamplerate);
-		lame_set_copyright(g->gf, g->gLAMEOptions.copywrite);
-		lame_set_strict_ISO(g->gf, g->gLAMEOptions.strict_ISO);
-		lame_set_disable_reservoir(g->gf, g->gLAMEOptions.disable_reservoir);
-
-		if(!g->gLAMEOptions.cbrflag) {
-			if(!strcmp(g->gLAMEOptions.VBR_mode, "vbr_rh")) {
-				lame_set_VBR(g->gf, vbr_rh);
-			}
-
-			if(!strcmp(g->gLAMEOptions.VBR_mode, "vbr_mtrh")) {
-				lame_set_VBR(g->gf, vbr_mtrh);
-			}
-
-			if(!strcmp(g->gLAMEOptions.VBR_mode, "vbr_abr")) {
-				lame_set_VBR(g->gf, vbr_abr);
-			}
-
-			lame_set_VBR_mean_bitrate_kbps(g->gf, g->currentBitrate);
-			lame_set_VBR_min_bitrate_kbps(g->gf, g->currentBitrateMin);
-			lame_set_VBR_max_bitrate_kbps(g->gf, g->currentBitrateMax);
+	}
+	else {
+		opusCommentAdd(comments, "TITLE", SongTitle);
+		if(strlen(Artist)) {
+			opusCommentAdd(comments, "ARTIST", Artist);
 		}
+	}
 
-		if(strlen(g->gLAMEbasicpreset) > 0) {
-			if(!strcmp(g->gLAMEbasicpreset, "r3mix")) {
+	return comments;
+}
 
-				/*
-				 * presets_set_r3mix(g->gf, g->gLAMEbasicpreset, stdout);
-				 */
-			}
-			else {
+/*
+ * Start a new chained Ogg Opus stream carrying the new title.  libopusenc
+ * closes the current link on the next packet boundary and carries on with
+ * the same encoder state, so there is no re-init and no gap.
+ */
+static int opusChainSongTitle(mcaster1Globals *g)
+{
+	OggOpusComments *comments = buildOpusComments(g);
 
-				/*
-				 * presets_set_basic(g->gf, g->gLAMEbasicpreset, stdout);
-				 */
-			}
-		}
+	g->opusChainPending.store(0, std::memory_order_relaxed);
+	if(!comments) {
+		return 0;
+	}
 
-		if(strlen(g->gLAMEaltpreset) > 0) {
-			int altbitrate = atoi(g->gLAMEaltpreset);
+	int chain_err = ope_encoder_chain_current(g->opusEncoder, comments);
+	if(chain_err != OPE_OK) {
+		LogMessage(g, LOG_ERROR, "Opus chain failed (err %d): %s", chain_err, ope_strerror(chain_err));
+		ope_comments_destroy(comments);
+		return 0;
+	}
 
-			/*
-			 * dm_presets(g->gf, 0, altbitrate, g->gLAMEaltpreset, "Mcaster1 DSP Encoder");
-			 */
-		}
+	/* libopusenc keeps its own copy, but hold on to the current tags */
+	if(g->opusComments) {
+		ope_comments_destroy(g->opusComments);
+	}
+	g->opusComments = comments;
 
-		/* do internal inits... */
-		lame_set_lowpassfreq(g->gf, g->gLAMEOptions.lowpassfreq);
-		lame_set_highpassfreq(g->gf, g->gLAMEOptions.highpassfreq);
+	g->opusChainCount++;
+	g->opusChainLastMs = (long) ((getMonotonicMicros() - g->opusChainRequested) / 1000);
+	LogMessage(g, LOG_INFO, "Opus stream chained for new title (chain %ld, %ld ms)", g->opusChainCount, g->opusChainLastMs);
+	return 1;
+}
+#endif
 
-		int lame_ret = lame_init_params(g->gf);
+long getLastTimeToFirstByteMs(mcaster1Globals *g) {
+	return g->lastTimeToFirstByteMs;
+}
 
-		if(lame_ret != 0) {
-			printf("Error initializing LAME");
-		}
-#endif
+long getOpusChainCount(mcaster1Globals *g) {
+#ifdef WIN32
+	return g->opusChainCount;
 #else
-		if(g->serverStatusCallback) {
-			g->serverStatusCallback(g, (void *) "Not compiled with LAME support");
-		}
-
-		LogMessage(g,LOG_ERROR, "Not compiled with LAME support");
-		return 0;
+	(void) g;
+	return 0;
 #endif
-	}
+}
 
-	if(g->gAACFlag)
-	{
+long getOpusChainLastMs(mcaster1Globals *g) {
 #ifdef WIN32
-		// fdk-aac init (handles AAC-LC, AAC+, AAC++)
-		if(g->fdkAacEncoder) {
-			aacEncClose(&g->fdkAacEncoder);
-			g->fdkAacEncoder = NULL;
-		}
-		aacEncOpen(&g->fdkAacEncoder, 0, g->currentChannels);
-		aacEncoder_SetParam(g->fdkAacEncoder, AACENC_AOT,
-			g->fdkAacProfile == 29 ? AOT_PS :
-			g->fdkAacProfile == 5  ? AOT_SBR : AOT_AAC_LC);
-		aacEncoder_SetParam(g->fdkAacEncoder, AACENC_SAMPLERATE,  g->currentSamplerate);
-		aacEncoder_SetParam(g->fdkAacEncoder, AACENC_CHANNELMODE, g->currentChannels == 1 ? MODE_1 : MODE_2);
-		aacEncoder_SetParam(g->fdkAacEncoder, AACENC_BITRATE,     g->currentBitrate * 1000);
-		aacEncoder_SetParam(g->fdkAacEncoder, AACENC_TRANSMUX,    TT_MP4_ADTS);
-		aacEncoder_SetParam(g->fdkAacEncoder, AACENC_AFTERBURNER, 1);
-		aacEncEncode(g->fdkAacEncoder, NULL, NULL, NULL, NULL); // flush/init
+	return g->opusChainLastMs;
 #else
-		if(g->serverStatusCallback) {
-			g->serverStatusCallback(g, (void *) "Not compiled with AAC support");
-		}
-
-		LogMessage(g,LOG_ERROR, "Not compiled with AAC support");
-		return 0;
+	(void) g;
+	return 0;
 #endif
-	}
+}
 
-	if(g->gAACPFlag)
-	{
-#ifdef HAVE_AACP
+/*
+ =======================================================================================================================
+    PCM block layouts.  The pipeline hands do_encoding one block of stereo
+    interleaved samples, float or (from an int16 host) int16.  The active
+    codec asks for the layout it declared and getPCMLayout builds it at most
+    once per block, into scratch buffers owned by the encoder slot.
+ =======================================================================================================================
+ */
+static short floatToInt16(float sample) {
+	float	scaled = sample * 32767.f;
 
-#ifdef WIN32
-		g->hAACPDLL = LoadLibrary("enc_aacplus.dll");
-		if(g->hAACPDLL == NULL) {
-			g->hAACPDLL = LoadLibrary("plugins\\enc_aacplus.dll");
-		}
+	if(scaled > 32767.f) {
+		return 32767;
+	}
 
-		if(g->hAACPDLL == NULL) {
-			sprintf(message, "Unable to load AAC Plus DLL (enc_aacplus.dll)");
-			LogMessage(g,LOG_ERROR, message);
-			if(g->serverStatusCallback) {
-				g->serverStatusCallback(g, (void *) "can't find enc_aacplus.dll");
-			}
+	if(scaled < -32768.f) {
+		return -32768;
+	}
 
-			return 0;
-		}
+	return (short) scaled;
+}
 
-		g->CreateAudio3 = (CREATEAUDIO3TYPE) GetProcAddress(g->hAACPDLL, "CreateAudio3");
-		if(!g->CreateAudio3) {
-			sprintf(message, "Invalid DLL (enc_aacplus.dll)");
-			LogMessage(g,LOG_ERROR, message);
-			if(g->serverStatusCallback) {
-				g->serverStatusCallback(g, (void *) "invalid enc_aacplus.dll");
-			}
+/* The layout buffers only, handle_output's scratch may be the block being encoded */
+static void freePCMLayouts(PCMBlock *block) {
+	free(block->floatInterleaved);
+	free(block->floatPlanar[0]);
+	free(block->floatPlanar[1]);
+	free(block->int16Interleaved);
+	free(block->int16Planar[0]);
+	free(block->int16Planar[1]);
+	free(block->int32Interleaved);
+	free(block->int16Stereo);
+	block->floatInterleaved = NULL;
+	block->floatPlanar[0] = block->floatPlanar[1] = NULL;
+	block->int16Interleaved = NULL;
+	block->int16Planar[0] = block->int16Planar[1] = NULL;
+	block->int32Interleaved = NULL;
+	block->int16Stereo = NULL;
+	block->capacity = 0;
+}
 
-			return 0;
+void freePCMBlock(PCMBlock *block) {
+	freePCMLayouts(block);
+	free(block->floatStereo);
+	free(block->resampled);
+	memset(block, '\000', sizeof(PCMBlock));
+}
+
+/* Stereo interleaved float scratch of at least frames, grown and never shrunk */
+static float *reserveStereoFloats(float **buffer, int *capacity, int frames) {
+	if(!*buffer || (frames > *capacity)) {
+		if(frames < 1) {
+			frames = 1;
 		}
 
-		g->GetAudioTypes3 = (GETAUDIOTYPES3TYPE) GetProcAddress(g->hAACPDLL, "GetAudioTypes3");
-		*(void **) &(g->finishAudio3) = (void *) GetProcAddress(g->hAACPDLL, "FinishAudio3");
-		*(void **) &(g->PrepareToFinish) = (void *) GetProcAddress(g->hAACPDLL, "PrepareToFinish");
+		free(*buffer);
+		*buffer = (float *) malloc(sizeof(float) * frames * 2);
+		*capacity = *buffer ? frames : 0;
+	}
+
+	return *buffer;
+}
 
-		/*
-		 * FreeLibrary(g->hAACPDLL);
-		 */
-#endif
-		if(g->aacpEncoder) {
-			delete g->aacpEncoder;
-			g->aacpEncoder = NULL;
-		}
+static int reservePCMBlock(PCMBlock *block, int frames) {
+	if(frames <= block->capacity) {
+		return 1;
+	}
 
-		unsigned int	outt = 1346584897;
-		char_t			*conf_file = "mcaster1_aacp.ini";	/* Default ini file */
+	freePCMLayouts(block);
+	block->floatInterleaved = (float *) malloc(sizeof(float) * frames * 2);
+	block->floatPlanar[0] = (float *) malloc(sizeof(float) * frames);
+	block->floatPlanar[1] = (float *) malloc(sizeof(float) * frames);
+	block->int16Interleaved = (short *) malloc(sizeof(short) * frames * 2);
+	block->int16Planar[0] = (short *) malloc(sizeof(short) * frames);
+	block->int16Planar[1] = (short *) malloc(sizeof(short) * frames);
+	block->int32Interleaved = (int *) malloc(sizeof(int) * frames * 2);
+	block->int16Stereo = (short *) malloc(sizeof(short) * frames * 2);
+	if(!block->floatInterleaved || !block->floatPlanar[0] || !block->floatPlanar[1] || !block->int16Interleaved ||
+	   !block->int16Planar[0] || !block->int16Planar[1] || !block->int32Interleaved || !block->int16Stereo) {
+		freePCMLayouts(block);
+		return 0;
+	}
 
-		/* 1 - Mono 2 - Stereo 3 - Stereo Independent 4 - Parametric 5 - Dual Channel */
-		char_t			sampleRate[255] = "";
-		char_t			channelMode[255] = "";
-		char_t			bitrateValue[255] = "";
-		char_t			aacpV2Enable[255] = "1";
-		long			bitrateLong = g->currentBitrate * 1000;
+	block->capacity = frames;
+	return 1;
+}
 
-		sprintf(bitrateValue, "%d", bitrateLong);
-		if(bitrateLong >= 64000) {
-			if(g->currentChannels == 2) {
-				strcpy(channelMode, "2");
-			}
-			else {
-				strcpy(channelMode, "1");
+/*
+ * Both sources are stereo interleaved - for a mono codec the pipeline has
+ * already folded the channels together, so channel 0 is the mono signal.
+ * Planar layouts always fill both channels, LAME reads the right one even
+ * in mono mode on some builds.
+ */
+static void buildPCMLayout(PCMBlock *block, int layout) {
+	float	*fsrc = block->floatSource;
+	short	*isrc = block->int16Source;
+	int		frames = block->frames;
+	int		channels = block->channels;
+	int		i;
+	int		c;
+
+	switch(layout) {
+		case PCM_FLOAT_INTERLEAVED:
+			for(i = 0; i < frames; i++) {
+				for(c = 0; c < channels; c++) {
+					block->floatInterleaved[i * channels + c] = fsrc ? fsrc[i * 2 + c] : isrc[i * 2 + c] / 32767.f;
+				}
 			}
-		}
+			break;
 
-		if((bitrateLong <= 48000) && (bitrateLong >= 16000)) {
-			if(g->currentChannels == 2) {
-				strcpy(channelMode, "4");
+		case PCM_FLOAT_PLANAR:
+			for(i = 0; i < frames; i++) {
+				block->floatPlanar[0][i] = fsrc ? fsrc[i * 2] : isrc[i * 2] / 32767.f;
+				block->floatPlanar[1][i] = fsrc ? fsrc[i * 2 + 1] : isrc[i * 2 + 1] / 32767.f;
 			}
-			else {
-				strcpy(channelMode, "1");
+			break;
+
+		case PCM_INT16_INTERLEAVED:
+			for(i = 0; i < frames; i++) {
+				for(c = 0; c < channels; c++) {
+					block->int16Interleaved[i * channels + c] = fsrc ? floatToInt16(fsrc[i * 2 + c]) : isrc[i * 2 + c];
+				}
 			}
-		}
+			break;
 
-		if(bitrateLong <= 12000) {
-			strcpy(channelMode, "1");
-		}
+		case PCM_INT16_PLANAR:
+			for(i = 0; i < frames; i++) {
+				block->int16Planar[0][i] = fsrc ? floatToInt16(fsrc[i * 2]) : isrc[i * 2];
+				block->int16Planar[1][i] = fsrc ? floatToInt16(fsrc[i * 2 + 1]) : isrc[i * 2 + 1];
+			}
+			break;
 
-		sprintf(sampleRate, "%d", g->currentSamplerate);
-
-		WritePrivateProfileString("audio_aacplus", "samplerate", sampleRate, conf_file);
-		WritePrivateProfileString("audio_aacplus", "channelmode", channelMode, conf_file);
-		WritePrivateProfileString("audio_aacplus", "bitrate", bitrateValue, conf_file);
-		WritePrivateProfileString("audio_aacplus", "v2enable", aacpV2Enable, conf_file);
-		WritePrivateProfileString("audio_aacplus", "bitstream", "0", conf_file);
-		WritePrivateProfileString("audio_aacplus", "nsignallingmode", "0", conf_file);
-
-		g->aacpEncoder = g->CreateAudio3((int) g->currentChannels,
-										 (int) g->currentSamplerate,
-										 16,
-										 mmioFOURCC('P', 'C', 'M', ' '),
-										 &outt,
-										 conf_file);
-		if(!g->aacpEncoder) {
-			if(g->serverStatusCallback) {
-				g->serverStatusCallback(g, (void *) "Invalid AAC+ settings");
+		case PCM_INT32_INTERLEAVED:
+			for(i = 0; i < frames; i++) {
+				for(c = 0; c < channels; c++) {
+					block->int32Interleaved[i * channels + c] = fsrc ? floatToInt16(fsrc[i * 2 + c]) : isrc[i * 2 + c];
+				}
 			}
+			break;
+	}
+}
 
-			LogMessage(g,LOG_ERROR, "Invalid AAC+ settings");
-			return 0;
+/*
+ * Returns the block in the requested layout.  Interleaved layouts come back
+ * as a flat array, planar ones as an array of two channel pointers.
+ */
+void *getPCMLayout(PCMBlock *block, int layout) {
+	/* stereo in the source's own format needs no copy at all */
+	if(block->channels == 2) {
+		if((layout == PCM_FLOAT_INTERLEAVED) && block->floatSource) {
+			return block->floatSource;
 		}
 
-#else
-		if(g->serverStatusCallback) {
-			g->serverStatusCallback(g, (void *) "Not compiled with AAC Plus support");
+		if((layout == PCM_INT16_INTERLEAVED) && block->int16Source) {
+			return block->int16Source;
 		}
+	}
 
-		LogMessage(g,LOG_ERROR, "Not compiled with AAC Plus support");
-		return 0;
-#endif
+	if(!(block->built & (1 << layout))) {
+		buildPCMLayout(block, layout);
+		block->built |= (1 << layout);
 	}
 
-#ifdef WIN32
-	if(g->gOpusFlag)
-	{
-		/* Destroy any previous instance */
-		if(g->opusEncoder) {
-			ope_encoder_destroy(g->opusEncoder);
-			g->opusEncoder = NULL;
-		}
-		if(g->opusComments) {
-			ope_comments_destroy(g->opusComments);
-			g->opusComments = NULL;
-		}
-
-		/* Build Ogg comments block */
-		g->opusComments = ope_comments_create();
-		ope_comments_add(g->opusComments, "ENCODER", "mcaster1dspencoder");
-		if(g->gCurrentSong[0]) {
-			ope_comments_add(g->opusComments, "TITLE", g->gCurrentSong);
-		}
-
-		/* Callback struct — write goes straight to the server socket */
-		static const OpusEncCallbacks opus_callbacks = {
-			opus_write_callback,
-			opus_close_callback
-		};
-
-		/* Opus accepts 8000/12000/16000/24000/48000 Hz.
-		 * PortAudio is opened at 48 kHz, so always pass 48000. */
-		int opus_channels = (g->currentChannels >= 1 && g->currentChannels <= 2)
-		                    ? g->currentChannels : 2;
-		int opus_error    = OPE_OK;
-
-		g->opusEncoder = ope_encoder_create_callbacks(
-			&opus_callbacks, (void *)g,
-			g->opusComments,
-			48000,          /* input rate — must match PortAudio stream rate */
-			opus_channels,
-			0,              /* mapping family 0 = mono / stereo */
-			&opus_error
-		);
-
-		if(!g->opusEncoder) {
-			char errmsg[128];
-			snprintf(errmsg, sizeof(errmsg),
-			         "Opus encoder init failed (err %d): %s",
-			         opus_error, ope_strerror(opus_error));
-			LogMessage(g, LOG_ERROR, errmsg);
-		} else {
-			/* Bitrate: currentBitrate stored in kbps, Opus wants bps */
-			ope_encoder_ctl(g->opusEncoder,
-			                OPUS_SET_BITRATE(g->currentBitrate * 1000));
-			/* Complexity 10 = highest quality — appropriate for live streaming */
-			int complexity = (g->opusComplexity > 0) ? g->opusComplexity : 10;
-			ope_encoder_ctl(g->opusEncoder, OPUS_SET_COMPLEXITY(complexity));
-			LogMessage(g, LOG_INFO, "Opus encoder initialized OK");
-		}
+	switch(layout) {
+		case PCM_FLOAT_INTERLEAVED:
+			return block->floatInterleaved;
+
+		case PCM_FLOAT_PLANAR:
+			return block->floatPlanar;
+
+		case PCM_INT16_INTERLEAVED:
+			return block->int16Interleaved;
+
+		case PCM_INT16_PLANAR:
+			return block->int16Planar;
+
+		case PCM_INT32_INTERLEAVED:
+			return block->int32Interleaved;
 	}
-#endif
 
-	if(g->gOggFlag)
-	{
+	return NULL;
+}
+
+/*
+ =======================================================================================================================
+    Codec table.  Each output format is an EncoderCodec: which flag selects
+    it, the input layout it wants, and init/encode/flush/reset/close entry
+    points.  initializeencoder and do_encoding only ever go through the
+    table, so adding a format means adding an entry here.
+ =======================================================================================================================
+ */
 #ifdef HAVE_VORBIS
-		/* Ogg Vorbis Initialization */
-		ogg_stream_clear(&g->os);
-		vorbis_block_clear(&g->vb);
-		vorbis_dsp_clear(&g->vd);
-		vorbis_info_clear(&g->vi);
+static int vorbisActive(mcaster1Globals *g) {
+	return g->gOggFlag;
+}
 
-		int bitrate = 0;
+static int vorbisInit(mcaster1Globals *g) {
+	int		ret = 0;
 
-		vorbis_info_init(&g->vi);
+	int bitrate = 0;
 
-		int encode_ret = 0;
+	vorbis_info_init(&g->vi);
 
-		if(!g->gOggBitQualFlag) {
-			encode_ret = vorbis_encode_setup_vbr(&g->vi,
-												 g->currentChannels,
-												 g->currentSamplerate,
-												 ((float) atof(g->gOggQuality) * (float) .1));
-			if(encode_ret) {
-				vorbis_info_clear(&g->vi);
-			}
+	int encode_ret = 0;
+
+	if(!g->gOggBitQualFlag) {
+		encode_ret = vorbis_encode_setup_vbr(&g->vi,
+											 g->currentChannels,
+											 g->currentSamplerate,
+											 ((float) atof(g->gOggQuality) * (float) .1));
+		if(encode_ret) {
+			vorbis_info_clear(&g->vi);
 		}
-		else {
-			int maxbit = -1;
-			int minbit = -1;
+	}
+	else {
+		int maxbit = -1;
+		int minbit = -1;
 
-			if(g->currentBitrateMax > 0) {
-				maxbit = g->currentBitrateMax;
-			}
+		if(g->currentBitrateMax > 0) {
+			maxbit = g->currentBitrateMax;
+		}
 
-			if(g->currentBitrateMin > 0) {
-				minbit = g->currentBitrateMin;
-			}
+		if(g->currentBitrateMin > 0) {
+			minbit = g->currentBitrateMin;
+		}
 
-			encode_ret = vorbis_encode_setup_managed(&g->vi,
-													 g->currentChannels,
-													 g->currentSamplerate,
-													 g->currentBitrate * 1000,
-													 g->currentBitrate * 1000,
-													 g->currentBitrate * 1000);
+		encode_ret = vorbis_encode_setup_managed(&g->vi,
+												 g->currentChannels,
+												 g->currentSamplerate,
+												 g->currentBitrate * 1000,
+												 g->currentBitrate * 1000,
+												 g->currentBitrate * 1000);
 
-			if(encode_ret) {
-				vorbis_info_clear(&g->vi);
-			}
+		if(encode_ret) {
+			vorbis_info_clear(&g->vi);
 		}
+	}
 
-		if(encode_ret == OV_EIMPL) {
-			LogMessage(g,LOG_ERROR, "Sorry, but this vorbis mode is not supported currently...");
-			return 0;
-		}
+	if(encode_ret == OV_EIMPL) {
+		LogMessage(g,LOG_ERROR, "Sorry, but this vorbis mode is not supported currently...");
+		return 0;
+	}
 
-		if(encode_ret == OV_EINVAL) {
-			LogMessage(g,LOG_ERROR, "Sorry, but this is an illegal vorbis mode...");
-			return 0;
-		}
+	if(encode_ret == OV_EINVAL) {
+		LogMessage(g,LOG_ERROR, "Sorry, but this is an illegal vorbis mode...");
+		return 0;
+	}
 
-		ret = vorbis_encode_setup_init(&g->vi);
+	ret = vorbis_encode_setup_init(&g->vi);
 
-		/*
-		 * Now, set up the analysis engine, stream encoder, and other preparation before
-		 * the encoding begins
-		 */
-		ret = vorbis_analysis_init(&g->vd, &g->vi);
-		ret = vorbis_block_init(&g->vd, &g->vb);
+	/*
+	 * Now, set up the analysis engine, stream encoder, and other preparation before
+	 * the encoding begins
+	 */
+	ret = vorbis_analysis_init(&g->vd, &g->vi);
+	ret = vorbis_block_init(&g->vd, &g->vb);
 
-		g->serialno = 0;
-		srand(time(0));
-		ret = ogg_stream_init(&g->os, rand());
+	g->serialno = 0;
+	srand(time(0));
+	ret = ogg_stream_init(&g->os, rand());
 
-		/*
-		 * Now, build the three header packets and send through to the stream output stage
-		 * (but defer actual file output until the main encode loop)
-		 */
-		ogg_packet		header_main;
-		ogg_packet		header_comments;
-		ogg_packet		header_codebooks;
-		vorbis_comment	vc;
-		char_t			title[1024] = "";
-		char_t			artist[1024] = "";
-		char_t			FullTitle[1024] = "";
-		char_t			SongTitle[1024] = "";
-		char_t			Artist[1024] = "";
-		char_t			Streamed[1024] = "";
-		wchar_t			widestring[4096];
-		char			tempstring[4096];
-
-		memset(Artist, '\000', sizeof(Artist));
-		memset(SongTitle, '\000', sizeof(SongTitle));
-		memset(FullTitle, '\000', sizeof(FullTitle));
-		memset(Streamed, '\000', sizeof(Streamed));
-
-		vorbis_comment_init(&vc);
-
-		bool	bypass = false;
-
-		if(!getLockedMetadataFlag(g)) {
-			if(g->numVorbisComments) {
-				for(int i = 0; i < g->numVorbisComments; i++)
-				{
+	/*
+	 * Now, build the three header packets and send through to the stream output stage
+	 * (but defer actual file output until the main encode loop)
+	 */
+	ogg_packet		header_main;
+	ogg_packet		header_comments;
+	ogg_packet		header_codebooks;
+	vorbis_comment	vc;
+	char_t			title[1024] = "";
+	char_t			artist[1024] = "";
+	char_t			FullTitle[1024] = "";
+	char_t			SongTitle[1024] = "";
+	char_t			Artist[1024] = "";
+	char_t			Streamed[1024] = "";
+	wchar_t			widestring[4096];
+	char			tempstring[4096];
+
+	memset(Artist, '\000', sizeof(Artist));
+	memset(SongTitle, '\000', sizeof(SongTitle));
+	memset(FullTitle, '\000', sizeof(FullTitle));
+	memset(Streamed, '\000', sizeof(Streamed));
+
+	vorbis_comment_init(&vc);
+
+	bool	bypass = false;
+
+	if(!getLockedMetadataFlag(g)) {
+		if(g->numVorbisComments) {
+			for(int i = 0; i < g->numVorbisComments; i++)
+			{
 #ifdef WIN32
-					MultiByteToWideChar(CP_ACP,
-										0,
-										g->vorbisComments[i],
-										strlen(g->vorbisComments[i]) + 1,
-										widestring,
-										4096);
-					memset(tempstring, '\000', sizeof(tempstring));
-					WideCharToMultiByte(CP_UTF8,
-										0,
-										widestring,
-										wcslen(widestring) + 1,
-										tempstring,
-										sizeof(tempstring),
-										0,
-										NULL);
-					vorbis_comment_add(&vc, tempstring);
+				MultiByteToWideChar(CP_ACP,
+									0,
+									g->vorbisComments[i],
+									strlen(g->vorbisComments[i]) + 1,
+									widestring,
+									4096);
+				memset(tempstring, '\000', sizeof(tempstring));
+				WideCharToMultiByte(CP_UTF8,
+									0,
+									widestring,
+									wcslen(widestring) + 1,
+									tempstring,
+									sizeof(tempstring),
+									0,
+									NULL);
+				vorbis_comment_add(&vc, tempstring);
 #else
-					vorbis_comment_add(&vc, g->vorbisComments[i]);
+				vorbis_comment_add(&vc, g->vorbisComments[i]);
 #endif
-				}
-
-				bypass = true;
 			}
+
+			bypass = true;
 		}
+	}
 
-		if(!bypass) {
-			getCurrentSongTitle(g, SongTitle, Artist, FullTitle);
-			if((strlen(SongTitle) == 0) && (strlen(Artist) == 0)) {
-				sprintf(title, "TITLE=%s", FullTitle);
-			}
-			else {
-				sprintf(title, "TITLE=%s", SongTitle);
-			}
+	if(!bypass) {
+		getCurrentSongTitle(g, SongTitle, Artist, FullTitle);
+		if((strlen(SongTitle) == 0) && (strlen(Artist) == 0)) {
+			sprintf(title, "TITLE=%s", FullTitle);
+		}
+		else {
+			sprintf(title, "TITLE=%s", SongTitle);
+		}
 
 #ifdef WIN32
-			MultiByteToWideChar(CP_ACP, 0, title, strlen(title) + 1, widestring, 4096);
-			memset(tempstring, '\000', sizeof(tempstring));
-			WideCharToMultiByte(CP_UTF8,
-								0,
-								widestring,
-								wcslen(widestring) + 1,
-								tempstring,
-								sizeof(tempstring),
-								0,
-								NULL);
-			vorbis_comment_add(&vc, tempstring);
+		MultiByteToWideChar(CP_ACP, 0, title, strlen(title) + 1, widestring, 4096);
+		memset(tempstring, '\000', sizeof(tempstring));
+		WideCharToMultiByte(CP_UTF8,
+							0,
+							widestring,
+							wcslen(widestring) + 1,
+							tempstring,
+							sizeof(tempstring),
+							0,
+							NULL);
+		vorbis_comment_add(&vc, tempstring);
 #else
-			vorbis_comment_add(&vc, title);
+		vorbis_comment_add(&vc, title);
 #endif
-			sprintf(artist, "ARTIST=%s", Artist);
+		sprintf(artist, "ARTIST=%s", Artist);
 #ifdef WIN32
-			MultiByteToWideChar(CP_ACP, 0, artist, strlen(artist) + 1, widestring, 4096);
-			memset(tempstring, '\000', sizeof(tempstring));
-			WideCharToMultiByte(CP_UTF8,
-								0,
-								widestring,
-								wcslen(widestring) + 1,
-								tempstring,
-								sizeof(tempstring),
-								0,
-								NULL);
-			vorbis_comment_add(&vc, tempstring);
+		MultiByteToWideChar(CP_ACP, 0, artist, strlen(artist) + 1, widestring, 4096);
+		memset(tempstring, '\000', sizeof(tempstring));
+		WideCharToMultiByte(CP_UTF8,
+							0,
+							widestring,
+							wcslen(widestring) + 1,
+							tempstring,
+							sizeof(tempstring),
+							0,
+							NULL);
+		vorbis_comment_add(&vc, tempstring);
 #else
-			vorbis_comment_add(&vc, artist);
+		vorbis_comment_add(&vc, artist);
 #endif
-		}
+	}
+
+	sprintf(Streamed, "ENCODEDBY=mcaster1dspencoder");
+	vorbis_comment_add(&vc, Streamed);
+	if(strlen(g->sourceDescription) > 0) {
+		sprintf(Streamed, "TRANSCODEDFROM=%s", g->sourceDescription);
+		vorbis_comment_add(&vc, Streamed);
+	}
+
+	/* Build the packets */
+	memset(&header_main, '\000', sizeof(header_main));
+	memset(&header_comments, '\000', sizeof(header_comments));
+	memset(&header_codebooks, '\000', sizeof(header_codebooks));
+
+	vorbis_analysis_headerout(&g->vd, &vc, &header_main, &header_comments, &header_codebooks);
+
+	ogg_stream_packetin(&g->os, &header_main);
+	ogg_stream_packetin(&g->os, &header_comments);
+	ogg_stream_packetin(&g->os, &header_codebooks);
+
+	g->in_header = 1;
+
+	ogg_page	og;
+	int			eos = 0;
+	int			sentbytes = 0;
+
+	while(!eos) {
+		int result = ogg_stream_flush(&g->os, &og);
+
+		if(result == 0) break;
+		sentbytes += sendToServer(g, g->gSCSocket, (char *) og.header, og.header_len, CODEC_TYPE);
+		sentbytes += sendToServer(g, g->gSCSocket, (char *) og.body, og.body_len, CODEC_TYPE);
+	}
+
+	vorbis_comment_clear(&vc);
+	if(g->numVorbisComments) {
+		freeVorbisComments(g);
+	}
+	return 1;
+}
+
+static int vorbisEncode(mcaster1Globals *g, PCMBlock *block) {
+	float	**planar = (float **) getPCMLayout(block, PCM_FLOAT_PLANAR);
+	int		sentbytes = 0;
+
+	/*
+	 * If a song change was detected, close the stream and resend new ;
+	 * vorbis headers (with new comments) - all done by icecast2SendMetadata();
+	 */
+	if(g->ice2songChange) {
+		LogMessage(g,LOG_DEBUG, "Song change processing...");
+		g->ice2songChange = false;
+		icecast2SendMetadata(g);
+	}
+
+	LogMessage(g,LOG_DEBUG, "vorbis_analysis_buffer...");
+
+	float	**buffer = vorbis_analysis_buffer(&g->vd, block->frames);
+
+	memcpy(buffer[0], planar[0], sizeof(float) * block->frames);
+	if(g->currentChannels == 2) {
+		memcpy(buffer[1], planar[1], sizeof(float) * block->frames);
+	}
+
+	LogMessage(g,LOG_DEBUG, "vorbis_analysis_wrote...");
+	vorbis_analysis_wrote(&g->vd, block->frames);
+
+	pthread_mutex_lock(&(g->mutex));
+	LogMessage(g,LOG_DEBUG, "ogg_encode_dataout...");
+	/* Stream out what we just prepared for Vorbis... */
+	sentbytes = ogg_encode_dataout(g);
+	LogMessage(g,LOG_DEBUG, "done ogg_ecndoe_dataout...");
+	pthread_mutex_unlock(&(g->mutex));
+
+	return sentbytes;
+}
+
+/* Signal end of stream, the last page carries the EOS flag */
+static int vorbisFinish(mcaster1Globals *g) {
+	int sentbytes = 0;
+
+	pthread_mutex_lock(&(g->mutex));
+	vorbis_analysis_wrote(&g->vd, 0);
+	sentbytes = ogg_encode_dataout(g);
+	pthread_mutex_unlock(&(g->mutex));
+	return sentbytes;
+}
+
+static void vorbisClose(mcaster1Globals *g) {
+	ogg_stream_clear(&g->os);
+	vorbis_block_clear(&g->vb);
+	vorbis_dsp_clear(&g->vd);
+	vorbis_info_clear(&g->vi);
+	memset(&(g->vi), '\000', sizeof(g->vi));
+}
+
+static const EncoderCodec vorbisCodec = {
+	"Ogg Vorbis", "ogg", PCM_FLOAT_PLANAR, vorbisActive, vorbisInit, vorbisEncode, NULL, NULL, vorbisClose, NULL, vorbisFinish, NULL
+};
+#endif
+
+#ifdef HAVE_LAME
+#ifdef WIN32
+#define LAME_HANDLE(g)	((g)->lameGF)
+#else
+#define LAME_HANDLE(g)	((g)->gf)
+#endif
+
+/* lame_encode_buffer wants 1.25 * frames + 7200 bytes of room */
+#define LAME_ENCODE_CHUNK	4096
+
+static int lameActive(mcaster1Globals *g) {
+	return g->gLAMEFlag;
+}
+
+/* Each governor step trades two LAME quality points for speed */
+static int governedLAMEQuality(mcaster1Globals *g, int quality) {
+	if(g->encoderEffort <= 0) {
+		return quality;
+	}
+
+	if(quality < 0) {
+		quality = 5;	/* LAME's own default */
+	}
+
+	quality += 2 * g->encoderEffort;
+	return (quality > 9) ? 9 : quality;
+}
+
+static int lameInit(mcaster1Globals *g) {
+#ifdef WIN32
+	// Native LAME MP3 init
+	g->lameGF = lame_init();
+	lame_set_num_channels(g->lameGF, g->currentChannels);
+	lame_set_in_samplerate(g->lameGF, g->currentSamplerate);
+	lame_set_out_samplerate(g->lameGF, g->currentSamplerate);
+
+	if (g->lameVBRMode == 1) {        // VBR
+		lame_set_VBR(g->lameGF, vbr_mtrh);
+		lame_set_VBR_q(g->lameGF, g->lameVBRQuality);
+		if (g->lameMinBitrate > 0) lame_set_VBR_min_bitrate_kbps(g->lameGF, g->lameMinBitrate);
+		if (g->lameMaxBitrate > 0) lame_set_VBR_max_bitrate_kbps(g->lameGF, g->lameMaxBitrate);
+	} else if (g->lameVBRMode == 2) { // ABR
+		lame_set_VBR(g->lameGF, vbr_abr);
+		lame_set_VBR_mean_bitrate_kbps(g->lameGF, g->lameABRMean > 0 ? g->lameABRMean : g->currentBitrate);
+		if (g->lameMinBitrate > 0) lame_set_VBR_min_bitrate_kbps(g->lameGF, g->lameMinBitrate);
+		if (g->lameMaxBitrate > 0) lame_set_VBR_max_bitrate_kbps(g->lameGF, g->lameMaxBitrate);
+	} else {                           // CBR (default)
+		lame_set_VBR(g->lameGF, vbr_off);
+		lame_set_brate(g->lameGF, g->currentBitrate);
+	}
+	lame_set_quality(g->lameGF, governedLAMEQuality(g, 5));   // encode quality 0(best)-9(fast)
+	lame_set_mode(g->lameGF, g->currentChannels == 1 ? MONO : JOINT_STEREO);
+	lame_init_params(g->lameGF);
+#else
+	g->gf = lame_init();
+	lame_set_errorf(g->gf, oddsock_error_handler_function);
+	lame_set_debugf(g->gf, oddsock_error_handler_function);
+	lame_set_msgf(g->gf, oddsock_error_handler_function);
+
+	lame_set_brate(g->gf, g->currentBitrate);
+	lame_set_quality(g->gf, governedLAMEQuality(g, g->gLAMEOptions.quality));
+
+	lame_set_num_channels(g->gf, 2);
+
+	if(g->currentChannels == 1) {
+		lame_set_mode(g->gf, MONO);
+
+		/*
+		 * lame_set_num_channels(g->gf, 1);
+		 */
+	}
+	else {
+		lame_set_mode(g->gf, STEREO);
+	}
+
+	/*
+	 * Make the input sample rate the same as output..i.e. don't make lame do ;
+	 * any resampling->..cause we are handling it ourselves...
+	 */
+	lame_set_in_samplerate(g->gf, g->currentSamplerate);
+	lame_set_out_samplerate(g->gf, g->currentSamplerate);
+	lame_set_copyright(g->gf, g->gLAMEOptions.copywrite);
+	lame_set_strict_ISO(g->gf, g->gLAMEOptions.strict_ISO);
+	lame_set_disable_reservoir(g->gf, g->gLAMEOptions.disable_reservoir);
+
+	if(!g->gLAMEOptions.cbrflag) {
+		if(!strcmp(g->gLAMEOptions.VBR_mode, "vbr_rh")) {
+			lame_set_VBR(g->gf, vbr_rh);
+		}
+
+		if(!strcmp(g->gLAMEOptions.VBR_mode, "vbr_mtrh")) {
+			lame_set_VBR(g->gf, vbr_mtrh);
+		}
+
+		if(!strcmp(g->gLAMEOptions.VBR_mode, "vbr_abr")) {
+			lame_set_VBR(g->gf, vbr_abr);
+		}
+
+		lame_set_VBR_mean_bitrate_kbps(g->gf, g->currentBitrate);
+		lame_set_VBR_min_bitrate_kbps(g->gf, g->currentBitrateMin);
+		lame_set_VBR_max_bitrate_kbps(g->gf, g->currentBitrateMax);
+	}
+
+	if(strlen(g->gLAMEbasicpreset) > 0) {
+		if(!strcmp(g->gLAMEbasicpreset, "r3mix")) {
+
+			/*
+			 * presets_set_r3mix(g->gf, g->gLAMEbasicpreset, stdout);
+			 */
+		}
+		else {
+
+			/*
+			 * presets_set_basic(g->gf, g->gLAMEbasicpreset, stdout);
+			 */
+		}
+	}
+
+	if(strlen(g->gLAMEaltpreset) > 0) {
+		int altbitrate = atoi(g->gLAMEaltpreset);
+
+		/*
+		 * dm_presets(g->gf, 0, altbitrate, g->gLAMEaltpreset, "Mcaster1 DSP Encoder");
+		 */
+	}
+
+	/* do internal inits... */
+	lame_set_lowpassfreq(g->gf, g->gLAMEOptions.lowpassfreq);
+	lame_set_highpassfreq(g->gf, g->gLAMEOptions.highpassfreq);
+
+	int lame_ret = lame_init_params(g->gf);
+
+	if(lame_ret != 0) {
+		printf("Error initializing LAME");
+	}
+#endif
+	return 1;
+}
+
+static int lameEncode(mcaster1Globals *g, PCMBlock *block) {
+	unsigned char	mp3buffer[LAME_MAXMP3BUFFER];
+	short			**planar = (short **) getPCMLayout(block, PCM_INT16_PLANAR);
+	int				sentbytes = 0;
+
+	if(!LAME_HANDLE(g)) {
+		return 0;
+	}
+
+	for(int done = 0; done < block->frames; done += LAME_ENCODE_CHUNK) {
+		int n = block->frames - done;
+
+		if(n > LAME_ENCODE_CHUNK) {
+			n = LAME_ENCODE_CHUNK;
+		}
+
+		int imp3 = lame_encode_buffer(LAME_HANDLE(g), planar[0] + done, planar[1] + done, n, mp3buffer, sizeof(mp3buffer));
+
+		if(imp3 < 0) {
+			LogMessage(g,LOG_ERROR, "mp3 buffer is not big enough!");
+			return 0;
+		}
+
+		/* Send out the encoded buffer */
+		sentbytes = sendToServer(g, g->gSCSocket, (char *) mp3buffer, imp3, CODEC_TYPE);
+		if(sentbytes < 0) {
+			return sentbytes;
+		}
+	}
+
+	return sentbytes;
+}
+
+/* Push out the last partial frame before a clean disconnect */
+static int lameFlush(mcaster1Globals *g) {
+	unsigned char	mp3buffer[LAME_MAXMP3BUFFER];
+
+	if(!LAME_HANDLE(g)) {
+		return 0;
+	}
+
+	int imp3 = lame_encode_flush_nogap(LAME_HANDLE(g), mp3buffer, sizeof(mp3buffer));
+
+	if(imp3 > 0) {
+		return sendToServer(g, g->gSCSocket, (char *) mp3buffer, imp3, CODEC_TYPE);
+	}
+
+	return 0;
+}
+
+static int lameReset(mcaster1Globals *g) {
+	unsigned char	mp3buffer[LAME_MAXMP3BUFFER];
+
+	if(!LAME_HANDLE(g)) {
+		return 0;
+	}
+
+	/* drain what belongs to the old connection, output is discarded */
+	lame_encode_flush_nogap(LAME_HANDLE(g), mp3buffer, sizeof(mp3buffer));
+	return 1;
+}
+
+/* Unlike lameFlush this pads the final frame, nothing follows it */
+static int lameFinish(mcaster1Globals *g) {
+	unsigned char	mp3buffer[LAME_MAXMP3BUFFER];
+
+	if(!LAME_HANDLE(g)) {
+		return 0;
+	}
+
+	int imp3 = lame_encode_flush(LAME_HANDLE(g), mp3buffer, sizeof(mp3buffer));
+
+	if(imp3 > 0) {
+		return sendToServer(g, g->gSCSocket, (char *) mp3buffer, imp3, CODEC_TYPE);
+	}
+
+	return 0;
+}
+
+static void lameClose(mcaster1Globals *g) {
+	if(LAME_HANDLE(g)) {
+		lame_close(LAME_HANDLE(g));
+		LAME_HANDLE(g) = NULL;
+	}
+}
+
+/*
+ * lame_init_params fixes the quality, so the instance is rebuilt.  The
+ * nogap flush ends the old instance on a frame boundary and its tail is
+ * sent, the listener hears a continuous MP3 stream.
+ */
+static int lameSetEffort(mcaster1Globals *g) {
+	unsigned char	mp3buffer[LAME_MAXMP3BUFFER];
+
+	if(!LAME_HANDLE(g)) {
+		return 0;
+	}
+
+	int imp3 = lame_encode_flush_nogap(LAME_HANDLE(g), mp3buffer, sizeof(mp3buffer));
+
+	if((imp3 > 0) && g->weareconnected) {
+		sendToServer(g, g->gSCSocket, (char *) mp3buffer, imp3, CODEC_TYPE);
+	}
+
+	lameClose(g);
+	return lameInit(g);
+}
+
+static const EncoderCodec lameCodec = {
+	"LAME", "mp3", PCM_INT16_PLANAR, lameActive, lameInit, lameEncode, lameFlush, lameReset, lameClose, lameSetEffort, lameFinish, NULL
+};
+#endif
+
+#ifdef WIN32
+static int fdkAacActive(mcaster1Globals *g) {
+	return g->gAACFlag;
+}
+
+static int fdkAacInit(mcaster1Globals *g) {
+	// fdk-aac init (handles AAC-LC, AAC+, AAC++)
+	if(aacEncOpen(&g->fdkAacEncoder, 0, g->currentChannels) != AACENC_OK) {
+		g->fdkAacEncoder = NULL;
+		return 0;
+	}
+	aacEncoder_SetParam(g->fdkAacEncoder, AACENC_AOT,
+		g->fdkAacProfile == 29 ? AOT_PS :
+		g->fdkAacProfile == 5  ? AOT_SBR : AOT_AAC_LC);
+	aacEncoder_SetParam(g->fdkAacEncoder, AACENC_SAMPLERATE,  g->currentSamplerate);
+	aacEncoder_SetParam(g->fdkAacEncoder, AACENC_CHANNELMODE, g->currentChannels == 1 ? MODE_1 : MODE_2);
+	aacEncoder_SetParam(g->fdkAacEncoder, AACENC_BITRATE,     g->currentBitrate * 1000);
+	aacEncoder_SetParam(g->fdkAacEncoder, AACENC_TRANSMUX,    TT_MP4_ADTS);
+	aacEncoder_SetParam(g->fdkAacEncoder, AACENC_AFTERBURNER, (g->encoderEffort > 0) ? 0 : 1);
+	aacEncEncode(g->fdkAacEncoder, NULL, NULL, NULL, NULL); // flush/init
+	return 1;
+}
+
+/* fdk-aac takes 16 bit interleaved PCM (INT_PCM) and emits one ADTS frame per call */
+static int fdkAacEncode(mcaster1Globals *g, PCMBlock *block) {
+	short	*pcm = (short *) getPCMLayout(block, PCM_INT16_INTERLEAVED);
+	int		remaining = block->frames * block->channels;
+	int		sentbytes = 0;
+
+	if(!g->fdkAacEncoder) {
+		return 0;
+	}
+
+	unsigned char outBuf[8192];
+	void *outBufPtr = outBuf;
+	INT outBufSize = (INT)sizeof(outBuf);
+	INT outBufId = OUT_BITSTREAM_DATA;
+	INT outBufElSize = 1;
+	AACENC_BufDesc outBufDesc = { 0 };
+	outBufDesc.numBufs           = 1;
+	outBufDesc.bufs              = &outBufPtr;
+	outBufDesc.bufferIdentifiers = &outBufId;
+	outBufDesc.bufSizes          = &outBufSize;
+	outBufDesc.bufElSizes        = &outBufElSize;
+
+	while(remaining > 0) {
+		void *inBuf = pcm;
+		INT inBufDesc_bufferIdentifiers = IN_AUDIO_DATA;
+		INT inBufDesc_bufSizes = remaining * (INT)sizeof(short);
+		INT inBufDesc_bufElSizes = (INT)sizeof(short);
+		AACENC_BufDesc inBufDesc = { 0 };
+		inBufDesc.numBufs           = 1;
+		inBufDesc.bufs              = &inBuf;
+		inBufDesc.bufferIdentifiers = &inBufDesc_bufferIdentifiers;
+		inBufDesc.bufSizes          = &inBufDesc_bufSizes;
+		inBufDesc.bufElSizes        = &inBufDesc_bufElSizes;
+
+		AACENC_InArgs inArgs  = { remaining, 0 };
+		AACENC_OutArgs outArgs = { 0 };
+
+		if (aacEncEncode(g->fdkAacEncoder, &inBufDesc, &outBufDesc, &inArgs, &outArgs) != AACENC_OK) {
+			LogMessage(g, LOG_ERROR, "fdk-aac encode error");
+			break;
+		}
+
+		if (outArgs.numOutBytes > 0) {
+			sentbytes = sendToServer(g, g->gSCSocket, (char*)outBuf, outArgs.numOutBytes, CODEC_TYPE);
+			if(sentbytes < 0) {
+				return sentbytes;
+			}
+		}
+
+		if((outArgs.numInSamples <= 0) && (outArgs.numOutBytes <= 0)) {
+			break;
+		}
+
+		pcm += outArgs.numInSamples;
+		remaining -= outArgs.numInSamples;
+	}
+
+	return sentbytes;
+}
+
+/* numInSamples of -1 makes the encoder drain its delay line */
+static int fdkAacFinish(mcaster1Globals *g) {
+	int		sentbytes = 0;
+
+	if(!g->fdkAacEncoder) {
+		return 0;
+	}
+
+	unsigned char outBuf[8192];
+	void *outBufPtr = outBuf;
+	INT outBufSize = (INT)sizeof(outBuf);
+	INT outBufId = OUT_BITSTREAM_DATA;
+	INT outBufElSize = 1;
+	AACENC_BufDesc outBufDesc = { 0 };
+	outBufDesc.numBufs           = 1;
+	outBufDesc.bufs              = &outBufPtr;
+	outBufDesc.bufferIdentifiers = &outBufId;
+	outBufDesc.bufSizes          = &outBufSize;
+	outBufDesc.bufElSizes        = &outBufElSize;
+
+	AACENC_BufDesc inBufDesc = { 0 };
+	AACENC_InArgs inArgs  = { -1, 0 };
+
+	for(;;) {
+		AACENC_OutArgs outArgs = { 0 };
+
+		if(aacEncEncode(g->fdkAacEncoder, &inBufDesc, &outBufDesc, &inArgs, &outArgs) != AACENC_OK) {
+			break;	/* AACENC_ENCODE_EOF once drained */
+		}
+
+		if(outArgs.numOutBytes <= 0) {
+			break;
+		}
+
+		sentbytes = sendToServer(g, g->gSCSocket, (char*)outBuf, outArgs.numOutBytes, CODEC_TYPE);
+		if(sentbytes < 0) {
+			return sentbytes;
+		}
+	}
+
+	return sentbytes;
+}
+
+static int fdkAacReset(mcaster1Globals *g) {
+	if(!g->fdkAacEncoder) {
+		return 0;
+	}
+
+	aacEncoder_SetParam(g->fdkAacEncoder, AACENC_CONTROL_STATE, AACENC_INIT_STATES | AACENC_RESET_INBUFFER);
+	return (aacEncEncode(g->fdkAacEncoder, NULL, NULL, NULL, NULL) == AACENC_OK);
+}
+
+static void fdkAacClose(mcaster1Globals *g) {
+	if(g->fdkAacEncoder) {
+		aacEncClose(&g->fdkAacEncoder);
+		g->fdkAacEncoder = NULL;
+	}
+}
+
+/* Afterburner is the only effort knob, it goes off at the first step */
+static int fdkAacSetEffort(mcaster1Globals *g) {
+	if(!g->fdkAacEncoder) {
+		return 0;
+	}
+
+	return (aacEncoder_SetParam(g->fdkAacEncoder, AACENC_AFTERBURNER, (g->encoderEffort > 0) ? 0 : 1) == AACENC_OK);
+}
+
+/* Reconfigures at the next aacEncEncode, the ADTS stream goes on */
+static int fdkAacSetBitrate(mcaster1Globals *g) {
+	if(!g->fdkAacEncoder) {
+		return 0;
+	}
+
+	return (aacEncoder_SetParam(g->fdkAacEncoder, AACENC_BITRATE, g->abrBitrate * 1000) == AACENC_OK);
+}
+
+static const EncoderCodec fdkAacCodec = {
+	"fdk-aac", "aac", PCM_INT16_INTERLEAVED, fdkAacActive, fdkAacInit, fdkAacEncode, NULL, fdkAacReset, fdkAacClose, fdkAacSetEffort, fdkAacFinish,
+	fdkAacSetBitrate
+};
+#endif
+
+#ifdef HAVE_AACP
+static int aacpActive(mcaster1Globals *g) {
+	return g->gAACPFlag;
+}
+
+static int aacpInit(mcaster1Globals *g) {
+	char_t	message[1024] = "";
+
+#ifdef WIN32
+	g->hAACPDLL = LoadLibrary("enc_aacplus.dll");
+	if(g->hAACPDLL == NULL) {
+		g->hAACPDLL = LoadLibrary("plugins\\enc_aacplus.dll");
+	}
+
+	if(g->hAACPDLL == NULL) {
+		sprintf(message, "Unable to load AAC Plus DLL (enc_aacplus.dll)");
+		LogMessage(g,LOG_ERROR, message);
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) "can't find enc_aacplus.dll");
+		}
+
+		return 0;
+	}
+
+	g->CreateAudio3 = (CREATEAUDIO3TYPE) GetProcAddress(g->hAACPDLL, "CreateAudio3");
+	if(!g->CreateAudio3) {
+		sprintf(message, "Invalid DLL (enc_aacplus.dll)");
+		LogMessage(g,LOG_ERROR, message);
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) "invalid enc_aacplus.dll");
+		}
+
+		return 0;
+	}
+
+	g->GetAudioTypes3 = (GETAUDIOTYPES3TYPE) GetProcAddress(g->hAACPDLL, "GetAudioTypes3");
+	*(void **) &(g->finishAudio3) = (void *) GetProcAddress(g->hAACPDLL, "FinishAudio3");
+	*(void **) &(g->PrepareToFinish) = (void *) GetProcAddress(g->hAACPDLL, "PrepareToFinish");
+
+	/*
+	 * FreeLibrary(g->hAACPDLL);
+	 */
+#endif
+	if(g->aacpEncoder) {
+		delete g->aacpEncoder;
+		g->aacpEncoder = NULL;
+	}
+
+	unsigned int	outt = 1346584897;
+	char_t			*conf_file = "mcaster1_aacp.ini";	/* Default ini file */
+
+	/* 1 - Mono 2 - Stereo 3 - Stereo Independent 4 - Parametric 5 - Dual Channel */
+	char_t			sampleRate[255] = "";
+	char_t			channelMode[255] = "";
+	char_t			bitrateValue[255] = "";
+	char_t			aacpV2Enable[255] = "1";
+	long			bitrateLong = g->currentBitrate * 1000;
+
+	sprintf(bitrateValue, "%d", bitrateLong);
+	if(bitrateLong >= 64000) {
+		if(g->currentChannels == 2) {
+			strcpy(channelMode, "2");
+		}
+		else {
+			strcpy(channelMode, "1");
+		}
+	}
+
+	if((bitrateLong <= 48000) && (bitrateLong >= 16000)) {
+		if(g->currentChannels == 2) {
+			strcpy(channelMode, "4");
+		}
+		else {
+			strcpy(channelMode, "1");
+		}
+	}
+
+	if(bitrateLong <= 12000) {
+		strcpy(channelMode, "1");
+	}
+
+	sprintf(sampleRate, "%d", g->currentSamplerate);
+
+	WritePrivateProfileString("audio_aacplus", "samplerate", sampleRate, conf_file);
+	WritePrivateProfileString("audio_aacplus", "channelmode", channelMode, conf_file);
+	WritePrivateProfileString("audio_aacplus", "bitrate", bitrateValue, conf_file);
+	WritePrivateProfileString("audio_aacplus", "v2enable", aacpV2Enable, conf_file);
+	WritePrivateProfileString("audio_aacplus", "bitstream", "0", conf_file);
+	WritePrivateProfileString("audio_aacplus", "nsignallingmode", "0", conf_file);
+
+	g->aacpEncoder = g->CreateAudio3((int) g->currentChannels,
+									 (int) g->currentSamplerate,
+									 16,
+									 mmioFOURCC('P', 'C', 'M', ' '),
+									 &outt,
+									 conf_file);
+	if(!g->aacpEncoder) {
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) "Invalid AAC+ settings");
+		}
+
+		LogMessage(g,LOG_ERROR, "Invalid AAC+ settings");
+		return 0;
+	}
+	return 1;
+}
+
+static int aacpEncode(mcaster1Globals *g, PCMBlock *block) {
+	static char outbuffer[32768];
+	int			len = block->frames * block->channels * sizeof(short);
+	char		*bufcounter = (char *) getPCMLayout(block, PCM_INT16_INTERLEAVED);
+	int			sentbytes = 0;
+
+	for(;;) {
+		int in_used = 0;
+
+		if(len <= 0) break;
+
+		int enclen = g->aacpEncoder->Encode(in_used, bufcounter, len, &in_used, outbuffer, sizeof(outbuffer));
+
+		if(enclen > 0) {
+			sentbytes = sendToServer(g, g->gSCSocket, (char *) outbuffer, enclen, CODEC_TYPE);
+		}
+		else {
+			break;
+		}
+
+		if(in_used > 0) {
+			bufcounter += in_used;
+			len -= in_used;
+		}
+	}
+
+	return sentbytes;
+}
+
+static void aacpClose(mcaster1Globals *g) {
+	if(g->aacpEncoder) {
+		delete g->aacpEncoder;
+		g->aacpEncoder = NULL;
+	}
+}
+
+static const EncoderCodec aacpCodec = {
+	"AAC Plus", "aac", PCM_INT16_INTERLEAVED, aacpActive, aacpInit, aacpEncode, NULL, NULL, aacpClose, NULL, NULL, NULL
+};
+#endif
+
+#ifdef HAVE_FLAC
+static int flacActive(mcaster1Globals *g) {
+	return g->gFLACFlag;
+}
+
+static int flacInit(mcaster1Globals *g) {
+	char			FullTitle[1024] = "";
+	char			SongTitle[1024] = "";
+	char			Artist[1024] = "";
+	char			Streamed[1024] = "";
+
+	memset(Artist, '\000', sizeof(Artist));
+	memset(SongTitle, '\000', sizeof(SongTitle));
+	memset(FullTitle, '\000', sizeof(FullTitle));
+	memset(Streamed, '\000', sizeof(Streamed));
+
+	if(g->flacEncoder) {
+		FLAC__stream_encoder_finish(g->flacEncoder);
+		FLAC__stream_encoder_delete(g->flacEncoder);
+		FLAC__metadata_object_delete(g->flacMetadata);
+		g->flacEncoder = NULL;
+		g->flacMetadata = NULL;
+	}
+
+	g->flacEncoder = FLAC__stream_encoder_new();
+	g->flacMetadata = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+
+	FLAC__stream_encoder_set_streamable_subset(g->flacEncoder, false);
+//		FLAC__stream_encoder_set_client_data(g->flacEncoder, (void*)g);
+
+	FLAC__stream_encoder_set_channels(g->flacEncoder, g->currentChannels);
+
+	
+/*
+	FLAC__stream_encoder_set_write_callback(g->flacEncoder,(FLAC__StreamEncoderWriteCallback) FLACWriteCallback,
+											   (FLAC__StreamEncoderWriteCallback) FLACWriteCallback);
+	FLAC__stream_encoder_set_metadata_callback(g->flacEncoder,
+											   (FLAC__StreamEncoderMetadataCallback) FLACMetadataCallback);
+											   */
+	srand(time(0));
+
+
+	if(!getLockedMetadataFlag(g)) {
+		FLAC__StreamMetadata_VorbisComment_Entry entry;
+		FLAC__StreamMetadata_VorbisComment_Entry entry3;
+		FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry, "ENCODEDBY", "Mcaster1 DSP Encoder");
+		FLAC__metadata_object_vorbiscomment_append_comment(g->flacMetadata, entry, true);
+		if(strlen(g->sourceDescription) > 0) {
+			FLAC__StreamMetadata_VorbisComment_Entry entry2;
+			FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry2, "TRANSCODEDFROM", g->sourceDescription);
+			FLAC__metadata_object_vorbiscomment_append_comment(g->flacMetadata, entry2, true);
+		}
+		getCurrentSongTitle(g, SongTitle, Artist, FullTitle);
+		FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry3, "TITLE", FullTitle);
+		FLAC__metadata_object_vorbiscomment_append_comment(g->flacMetadata, entry3, true);
+
+	}
+	FLAC__stream_encoder_set_ogg_serial_number(g->flacEncoder, rand());
+
+	FLAC__StreamEncoderInitStatus ret = FLAC__stream_encoder_init_ogg_stream(g->flacEncoder, NULL, (FLAC__StreamEncoderWriteCallback) FLACWriteCallback, NULL, NULL, (FLAC__StreamEncoderMetadataCallback) FLACMetadataCallback, (void*)g);
+	if(ret == FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) "FLAC initialized");
+		}
+	}
+	else {
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) "Error Initializing FLAC");
+		}
+
+		LogMessage(g,LOG_ERROR, "Error Initializing FLAC");
+		return 0;
+	}
+	return 1;
+}
+
+static int flacEncode(mcaster1Globals *g, PCMBlock *block) {
+	INT32	*int32_samples = (INT32 *) getPCMLayout(block, PCM_INT32_INTERLEAVED);
+
+	FLAC__stream_encoder_process_interleaved(g->flacEncoder, int32_samples, block->frames);
+
+	if(g->flacFailure) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int flacFinish(mcaster1Globals *g) {
+	if(!g->flacEncoder) {
+		return 0;
+	}
+
+	FLAC__stream_encoder_finish(g->flacEncoder);
+	return g->flacFailure ? -1 : 1;
+}
+
+static void flacClose(mcaster1Globals *g) {
+	if(g->flacEncoder) {
+		FLAC__stream_encoder_finish(g->flacEncoder);
+		FLAC__stream_encoder_delete(g->flacEncoder);
+		FLAC__metadata_object_delete(g->flacMetadata);
+		g->flacEncoder = NULL;
+		g->flacMetadata = NULL;
+	}
+}
+
+static const EncoderCodec flacCodec = {
+	"Ogg FLAC", "oga", PCM_INT32_INTERLEAVED, flacActive, flacInit, flacEncode, NULL, NULL, flacClose, NULL, flacFinish, NULL
+};
+#endif
+
+#ifdef WIN32
+static int opusActive(mcaster1Globals *g) {
+	return g->gOpusFlag;
+}
+
+/* Configured complexity (10 if unset) less three per governor step */
+static int governedOpusComplexity(mcaster1Globals *g) {
+	int complexity = (g->opusComplexity > 0) ? g->opusComplexity : 10;
+
+	complexity -= 3 * g->encoderEffort;
+	return (complexity < 0) ? 0 : complexity;
+}
+
+static int opusInit(mcaster1Globals *g) {
+	/* Build Ogg comments block */
+	g->opusComments = buildOpusComments(g);
+	g->opusChainPending.store(0, std::memory_order_relaxed);
+	g->opusChainCount = 0;
+	g->opusChainLastMs = 0;
+	g->opusAwaitBOS = 0;
+
+	/* Callback struct — write goes straight to the server socket */
+	static const OpusEncCallbacks opus_callbacks = {
+		opus_write_callback,
+		opus_close_callback
+	};
+
+	/* Opus accepts 8000/12000/16000/24000/48000 Hz.
+	 * PortAudio is opened at 48 kHz, so always pass 48000. */
+	int opus_channels = (g->currentChannels >= 1 && g->currentChannels <= 2)
+	                    ? g->currentChannels : 2;
+	int opus_error    = OPE_OK;
+
+	g->opusEncoder = ope_encoder_create_callbacks(
+		&opus_callbacks, (void *)g,
+		g->opusComments,
+		48000,          /* input rate — must match PortAudio stream rate */
+		opus_channels,
+		0,              /* mapping family 0 = mono / stereo */
+		&opus_error
+	);
+
+	if(!g->opusEncoder) {
+		char errmsg[128];
+		snprintf(errmsg, sizeof(errmsg),
+		         "Opus encoder init failed (err %d): %s",
+		         opus_error, ope_strerror(opus_error));
+		LogMessage(g, LOG_ERROR, errmsg);
+	} else {
+		/* Bitrate: currentBitrate stored in kbps, Opus wants bps */
+		ope_encoder_ctl(g->opusEncoder,
+		                OPUS_SET_BITRATE(g->currentBitrate * 1000));
+		/* Complexity 10 = highest quality — appropriate for live streaming */
+		ope_encoder_ctl(g->opusEncoder, OPUS_SET_COMPLEXITY(governedOpusComplexity(g)));
+		/* short frames, a page per packet and no buffering for encoder decisions */
+		if(g->lowLatency) {
+			ope_encoder_ctl(g->opusEncoder,
+			                OPUS_SET_EXPERT_FRAME_DURATION((g->lowLatencyFrameMs <= 10) ? OPUS_FRAMESIZE_10_MS : OPUS_FRAMESIZE_20_MS));
+			ope_encoder_ctl(g->opusEncoder, OPE_SET_MUXING_DELAY(0));
+			ope_encoder_ctl(g->opusEncoder, OPE_SET_DECISION_DELAY(0));
+		}
+		LogMessage(g, LOG_INFO, "Opus encoder initialized OK");
+	}
+	return (g->opusEncoder != NULL);
+}
+
+static int opusEncode(mcaster1Globals *g, PCMBlock *block) {
+	if(!g->opusEncoder) {
+		return 0;
+	}
+
+	/* Song title changes go in-band as a chained stream,
+	 * starting with the samples written below */
+	if(g->opusChainPending.load(std::memory_order_acquire)) {
+		opusChainSongTitle(g);
+	}
+
+	/* ope_encoder_write_float triggers opus_write_callback
+	 * with complete Ogg pages as they become ready */
+	int opus_err = ope_encoder_write_float(g->opusEncoder,
+		(float *) getPCMLayout(block, PCM_FLOAT_INTERLEAVED), block->frames);
+	if(opus_err != OPE_OK) {
+		LogMessage(g, LOG_ERROR, "Opus encode error");
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * A new chained link gives the new connection its own headers, ;
+ * the rest of the old link is dropped in opus_write_callback.
+ */
+static int opusReset(mcaster1Globals *g) {
+	if(!g->opusEncoder) {
+		return 0;
+	}
+
+	OggOpusComments *comments = buildOpusComments(g);
+
+	if(!comments) {
+		return 0;
+	}
+
+	if(ope_encoder_chain_current(g->opusEncoder, comments) != OPE_OK) {
+		ope_comments_destroy(comments);
+		return 0;
+	}
+
+	if(g->opusComments) {
+		ope_comments_destroy(g->opusComments);
+	}
+	g->opusComments = comments;
+	g->opusChainPending.store(0, std::memory_order_relaxed);
+	g->opusAwaitBOS = 1;
+	return 1;
+}
+
+static void opusClose(mcaster1Globals *g) {
+	if(g->opusEncoder) {
+		ope_encoder_destroy(g->opusEncoder);
+		g->opusEncoder = NULL;
+	}
+	if(g->opusComments) {
+		ope_comments_destroy(g->opusComments);
+		g->opusComments = NULL;
+	}
+	g->opusAwaitBOS = 0;
+}
+
+/* Encodes the remaining samples and writes the final page, the encoder cannot be fed after this */
+static int opusFinish(mcaster1Globals *g) {
+	if(!g->opusEncoder) {
+		return 0;
+	}
+
+	return (ope_encoder_drain(g->opusEncoder) == OPE_OK) ? 1 : -1;
+}
+
+static int opusSetEffort(mcaster1Globals *g) {
+	if(!g->opusEncoder) {
+		return 0;
+	}
+
+	return (ope_encoder_ctl(g->opusEncoder, OPUS_SET_COMPLEXITY(governedOpusComplexity(g))) == OPE_OK);
+}
+
+static int opusSetBitrate(mcaster1Globals *g) {
+	if(!g->opusEncoder) {
+		return 0;
+	}
+
+	return (ope_encoder_ctl(g->opusEncoder, OPUS_SET_BITRATE(g->abrBitrate * 1000)) == OPE_OK);
+}
+
+static const EncoderCodec opusCodec = {
+	"Opus", "opus", PCM_FLOAT_INTERLEAVED, opusActive, opusInit, opusEncode, NULL, opusReset, opusClose, opusSetEffort, opusFinish,
+	opusSetBitrate
+};
+#endif
+
+static const EncoderCodec *encoderCodecs[] = {
+#ifdef HAVE_VORBIS
+	&vorbisCodec,
+#endif
+#ifdef HAVE_LAME
+	&lameCodec,
+#endif
+#ifdef WIN32
+	&fdkAacCodec,
+#endif
+#ifdef HAVE_AACP
+	&aacpCodec,
+#endif
+#ifdef HAVE_FLAC
+	&flacCodec,
+#endif
+#ifdef WIN32
+	&opusCodec,
+#endif
+	NULL
+};
+
+const EncoderCodec *findEncoderCodec(mcaster1Globals *g) {
+	for(int i = 0; encoderCodecs[i]; i++) {
+		if(encoderCodecs[i]->active(g)) {
+			return encoderCodecs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ =======================================================================================================================
+    Codec instances are kept across reconnects.  The key captures every setting
+    the codec instance is built from, if it still matches at the next connect
+    the codec is reset instead of torn down and rebuilt.
+ =======================================================================================================================
+ */
+static void buildEncoderKey(mcaster1Globals *g, char_t *key, int keylen) {
+	snprintf(key, keylen, "%s|%d|%d|%d|%ld|%d|%s|%d|%d|%d|%s|%d|%d",
+			 g->gEncodeType,
+			 g->currentBitrate,
+			 g->currentBitrateMin,
+			 g->currentBitrateMax,
+			 g->currentSamplerate,
+			 g->currentChannels,
+			 g->gOggQuality,
+			 g->LAMEJointStereoFlag,
+			 g->gLAMEOptions.quality,
+			 g->gLAMEOptions.cbrflag,
+			 g->gLAMEOptions.VBR_mode,
+			 g->gLAMEOptions.lowpassfreq,
+			 g->gLAMEOptions.highpassfreq);
+
+#ifdef WIN32
+	int used = (int) strlen(key);
+
+	if(used < keylen - 1) {
+		snprintf(key + used, keylen - used, "|%d|%d|%d|%d|%d|%d|%d",
+				 g->lameVBRMode,
+				 g->lameVBRQuality,
+				 g->lameABRMean,
+				 g->lameMinBitrate,
+				 g->lameMaxBitrate,
+				 g->fdkAacProfile,
+				 g->opusComplexity);
+	}
+#endif
+}
+
+void releaseEncoders(mcaster1Globals *g) {
+	for(int i = 0; encoderCodecs[i]; i++) {
+		if(encoderCodecs[i]->close) {
+			encoderCodecs[i]->close(g);
+		}
+	}
+
+	g->codec = NULL;
+	memset(g->warmEncoderKey, '\000', sizeof(g->warmEncoderKey));
+}
+
+int initializeencoder(mcaster1Globals *g) {
+	char_t	encoderKey[512] = "";
+	const EncoderCodec *codec = findEncoderCodec(g);
+
+	resetResampler(g);
+
+	if(!codec) {
+		char_t	message[1024] = "";
+
+		sprintf(message, "Not compiled with %s support", g->gEncodeType);
+		if(g->serverStatusCallback) {
+			g->serverStatusCallback(g, (void *) message);
+		}
+
+		LogMessage(g,LOG_ERROR, message);
+		return 0;
+	}
+
+	buildEncoderKey(g, encoderKey, sizeof(encoderKey));
+	g->warmEncoderReuse = 0;
+	if(codec->reset && (g->codec == codec) && !strcmp(encoderKey, g->warmEncoderKey)) {
+		g->warmEncoderReuse = codec->reset(g);
+	}
+
+	if(g->warmEncoderReuse) {
+		LogMessage(g, LOG_DEBUG, "Reusing %s encoder", codec->name);
+		return 1;
+	}
+
+	releaseEncoders(g);
+	strcpy(g->warmEncoderKey, encoderKey);
+	g->codec = codec;
+	return codec->init(g);
+}
+
+/*
+ =======================================================================================================================
+    Output to a file instead of a server, used by the transcoder front end.  The
+    codec is set up exactly as connectToServer would, closeOutputFile ends the
+    stream properly so the file is complete.
+ =======================================================================================================================
+ */
+const char_t *getEncoderExtension(mcaster1Globals *g) {
+	const EncoderCodec *codec = findEncoderCodec(g);
+
+	return codec ? codec->extension : NULL;
+}
+
+int openOutputFile(mcaster1Globals *g, char_t *filename) {
+	g->outputFile = fopen(filename, "wb");
+	if(!g->outputFile) {
+		LogMessage(g,LOG_ERROR, "Cannot open output file %s: %s", filename, strerror(errno));
+		return 0;
+	}
+
+	/* faster than real time, the encode load says nothing about the CPU budget */
+	g->governorEnabled = 0;
+	g->gSaveDirectoryFlag = 0;
+	g->resampleInRate = 0;
+	g->passthroughActive = 0;
+	g->passthroughMatched = 0;
+	g->passthroughFrames = 0;
+
+	if(!initializeencoder(g)) {
+		fclose(g->outputFile);
+		g->outputFile = NULL;
+		return 0;
+	}
+
+	g->weareconnected = 1;
+	return 1;
+}
+
+int closeOutputFile(mcaster1Globals *g) {
+	int ret = 1;
+
+	if(!g->outputFile) {
+		return 0;
+	}
+
+	g->weareconnected = 0;
+
+	/* a passed through stream ends with its last input frame */
+	if(g->codec && g->codec->finish && !g->passthroughActive && (g->codec->finish(g) < 0)) {
+		ret = 0;
+	}
+
+	releaseEncoders(g);
+	resetResampler(g);
+	if(fclose(g->outputFile) != 0) {
+		ret = 0;
+	}
 
-		sprintf(Streamed, "ENCODEDBY=mcaster1dspencoder");
-		vorbis_comment_add(&vc, Streamed);
-		if(strlen(g->sourceDescription) > 0) {
-			sprintf(Streamed, "TRANSCODEDFROM=%s", g->sourceDescription);
-			vorbis_comment_add(&vc, Streamed);
-		}
+	g->outputFile = NULL;
+	return ret;
+}
+
+void FloatScale(float *destination, float *source, int numsamples, int destchannels) {
+	int i;
 
-		/* Build the packets */
-		memset(&header_main, '\000', sizeof(header_main));
-		memset(&header_comments, '\000', sizeof(header_comments));
-		memset(&header_codebooks, '\000', sizeof(header_codebooks));
+	if(destchannels == 2) {
+		for(i = 0; i < numsamples; i++) {
+			*destination++ = *source++ *32767.f;
+		}
+	}
+	else {
+		for(i = 0; i < numsamples >> 1; i++) {
+			*destination++ = (*source++ +*source++) * 16383.f;
+		}
+	}
+}
 
-		vorbis_analysis_headerout(&g->vd, &vc, &header_main, &header_comments, &header_codebooks);
+void ExtractFromFIFO(float *destination, float *source, int numsamples) {
+	for(int i = 0; i < numsamples; i++) {
+		*destination++ = *source++;
+	}
+}
 
-		ogg_stream_packetin(&g->os, &header_main);
-		ogg_stream_packetin(&g->os, &header_comments);
-		ogg_stream_packetin(&g->os, &header_codebooks);
+/*
+ =======================================================================================================================
+    Adaptive quality governor.  Every block the encode cost of a slot (codec time
+    without the socket sends) is measured against the real-time duration of the
+    block.  The smoothed load of all connected slots is summed, since the host
+    runs them back to back on one audio thread.  Above GovernorHighLoad codec
+    effort is stepped down, lowest priority slot first; when every slot is
+    already at the cheapest setting, the lowest priority slot that allows it is
+    shed.  Below GovernorLowLoad shed slots are readmitted first, then effort is
+    stepped back up.  GovernorHoldMs between decisions gives the hysteresis.
+    The thresholds are the main config's, one set for all slots.  Each slot
+    publishes its load to its table entry under governorMutex, and decisions
+    are made from the table.
+ =======================================================================================================================
+ */
+struct tagGovernedSlot {
+	mcaster1Globals	*g;				// NULL = free
+	long			load;			// the slot's encodeLoad as of its last block
+	const char		*codecName;
+	int				canSetEffort;
+};
 
-		g->in_header = 1;
+static pthread_mutex_t	governorMutex = PTHREAD_MUTEX_INITIALIZER;
+static GovernedSlot		governedSlots[GOVERNOR_MAX_SLOTS];
+static long long		governorLastDecision = 0;
+static long				governorTotalLoad = 0;
+static long				governorDecisions = 0;
 
-		ogg_page	og;
-		int			eos = 0;
-		int			sentbytes = 0;
-		int			ret = 0;
+/* one set for all slots, setGovernorThresholds takes them from the main config */
+static long				governorHigh = GOVERNOR_DEFAULT_HIGH_LOAD;
+static long				governorLow = GOVERNOR_DEFAULT_LOW_LOAD;
+static long long		governorHoldMicros = (long long) GOVERNOR_DEFAULT_HOLD_MS * 1000;
 
-		while(!eos) {
-			int result = ogg_stream_flush(&g->os, &og);
+static void governorRegister(mcaster1Globals *g) {
+	GovernedSlot	*entry = NULL;
 
-			if(result == 0) break;
-			sentbytes += sendToServer(g, g->gSCSocket, (char *) og.header, og.header_len, CODEC_TYPE);
-			sentbytes += sendToServer(g, g->gSCSocket, (char *) og.body, og.body_len, CODEC_TYPE);
+	pthread_mutex_lock(&governorMutex);
+	for(int i = 0; (i < GOVERNOR_MAX_SLOTS) && !entry; i++) {
+		if(governedSlots[i].g == g) {
+			entry = &governedSlots[i];
 		}
+	}
 
-		vorbis_comment_clear(&vc);
-		if(g->numVorbisComments) {
-			freeVorbisComments(g);
+	for(int i = 0; (i < GOVERNOR_MAX_SLOTS) && !entry; i++) {
+		if(!governedSlots[i].g) {
+			entry = &governedSlots[i];
+			memset(entry, '\000', sizeof(GovernedSlot));
+			entry->g = g;
 		}
+	}
 
-#else
-		if(g->serverStatusCallback) {
-			g->serverStatusCallback(g, (void *) "Not compiled with Ogg Vorbis support");
+	/* a full table leaves the slot out rather than trying again every block */
+	if(!entry) {
+		LogMessage(g, LOG_ERROR, "Encoder %d: the governor already has %d slots, this one is not governed", g->encoderNumber, GOVERNOR_MAX_SLOTS);
+	}
+
+	g->governorEntry = entry;
+	g->governorRegistered = 1;
+	pthread_mutex_unlock(&governorMutex);
+}
+
+static void governorUnregister(mcaster1Globals *g) {
+	pthread_mutex_lock(&governorMutex);
+	for(int i = 0; i < GOVERNOR_MAX_SLOTS; i++) {
+		if(governedSlots[i].g == g) {
+			governedSlots[i].g = NULL;
 		}
+	}
 
-		LogMessage(g,LOG_ERROR, "Not compiled with Ogg Vorbis support");
-		return 0;
-#endif
+	g->governorEntry = NULL;
+	g->governorRegistered = 0;
+	pthread_mutex_unlock(&governorMutex);
+}
+
+/* a slot whose effort can still go down */
+static int governorCanStepDown(GovernedSlot *slot) {
+	return slot->g->weareconnected && !slot->g->governorShed && slot->canSetEffort
+		&& (slot->g->encoderEffortTarget < GOVERNOR_EFFORT_LEVELS - 1);
+}
+
+/* lower priority first, the more expensive slot when priorities tie */
+static int governorBefore(GovernedSlot *a, GovernedSlot *b) {
+	if(a->g->governorPriority != b->g->governorPriority) {
+		return a->g->governorPriority < b->g->governorPriority;
 	}
 
-	if(g->gFLACFlag)
-	{
-#ifdef HAVE_FLAC
-		char			FullTitle[1024] = "";
-		char			SongTitle[1024] = "";
-		char			Artist[1024] = "";
-		char			Streamed[1024] = "";
+	return a->load > b->load;
+}
+
+/*
+ * called with governorMutex held.  Of the other slots it only reads what they
+ * published under the same lock, plus their connection and shed flags.
+ */
+static void governorDecide(mcaster1Globals *g, long long now) {
+	GovernedSlot	*pick = NULL;
+	long			total = 0;
 
-		memset(Artist, '\000', sizeof(Artist));
-		memset(SongTitle, '\000', sizeof(SongTitle));
-		memset(FullTitle, '\000', sizeof(FullTitle));
-		memset(Streamed, '\000', sizeof(Streamed));
+	for(int i = 0; i < GOVERNOR_MAX_SLOTS; i++) {
+		GovernedSlot	*slot = &governedSlots[i];
 
-		if(g->flacEncoder) {
-			FLAC__stream_encoder_finish(g->flacEncoder);
-			FLAC__stream_encoder_delete(g->flacEncoder);
-			FLAC__metadata_object_delete(g->flacMetadata);
-			g->flacEncoder = NULL;
-			g->flacMetadata = NULL;
+		if(slot->g && slot->g->weareconnected && !slot->g->governorShed) {
+			total += slot->load;
 		}
+	}
 
-		g->flacEncoder = FLAC__stream_encoder_new();
-		g->flacMetadata = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+	governorTotalLoad = total;
 
-		FLAC__stream_encoder_set_streamable_subset(g->flacEncoder, false);
-//		FLAC__stream_encoder_set_client_data(g->flacEncoder, (void*)g);
+	if(total > governorHigh) {
+		for(int i = 0; i < GOVERNOR_MAX_SLOTS; i++) {
+			GovernedSlot	*slot = &governedSlots[i];
+
+			if(slot->g && governorCanStepDown(slot) && (!pick || governorBefore(slot, pick))) {
+				pick = slot;
+			}
+		}
 
-		FLAC__stream_encoder_set_channels(g->flacEncoder, g->currentChannels);
+		if(pick) {
+			pick->g->encoderEffortTarget++;
+			LogMessage(g, LOG_INFO, "Governor: load %ld%% of real time, encoder %d (%s) effort down to step %d",
+						total / 10, pick->g->encoderNumber, pick->codecName, pick->g->encoderEffortTarget);
+		}
+		else {
+			for(int i = 0; i < GOVERNOR_MAX_SLOTS; i++) {
+				GovernedSlot	*slot = &governedSlots[i];
 
-		
-/*
-		FLAC__stream_encoder_set_write_callback(g->flacEncoder,(FLAC__StreamEncoderWriteCallback) FLACWriteCallback,
-												   (FLAC__StreamEncoderWriteCallback) FLACWriteCallback);
-		FLAC__stream_encoder_set_metadata_callback(g->flacEncoder,
-												   (FLAC__StreamEncoderMetadataCallback) FLACMetadataCallback);
-												   */
-		srand(time(0));
-
-
-		if(!getLockedMetadataFlag(g)) {
-			FLAC__StreamMetadata_VorbisComment_Entry entry;
-			FLAC__StreamMetadata_VorbisComment_Entry entry3;
-			FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry, "ENCODEDBY", "Mcaster1 DSP Encoder");
-			FLAC__metadata_object_vorbiscomment_append_comment(g->flacMetadata, entry, true);
-			if(strlen(g->sourceDescription) > 0) {
-				FLAC__StreamMetadata_VorbisComment_Entry entry2;
-				FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry2, "TRANSCODEDFROM", g->sourceDescription);
-				FLAC__metadata_object_vorbiscomment_append_comment(g->flacMetadata, entry2, true);
+				if(slot->g && slot->g->weareconnected && !slot->g->governorShed && !slot->g->governorShedRequest
+				&& (slot->g->governorPriority > 0) && (!pick || governorBefore(slot, pick))) {
+					pick = slot;
+				}
 			}
-			getCurrentSongTitle(g, SongTitle, Artist, FullTitle);
-			FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry3, "TITLE", FullTitle);
-			FLAC__metadata_object_vorbiscomment_append_comment(g->flacMetadata, entry3, true);
 
+			if(pick) {
+				pick->g->governorShedRequest = 1;
+				LogMessage(g, LOG_INFO, "Governor: load %ld%% of real time at lowest effort, shedding encoder %d (priority %d)",
+							total / 10, pick->g->encoderNumber, pick->g->governorPriority);
+			}
 		}
-		FLAC__stream_encoder_set_ogg_serial_number(g->flacEncoder, rand());
+	}
+	else if(total < governorLow) {
+		for(int i = 0; i < GOVERNOR_MAX_SLOTS; i++) {
+			GovernedSlot	*slot = &governedSlots[i];
 
-		FLAC__StreamEncoderInitStatus ret = FLAC__stream_encoder_init_ogg_stream(g->flacEncoder, NULL, (FLAC__StreamEncoderWriteCallback) FLACWriteCallback, NULL, NULL, (FLAC__StreamEncoderMetadataCallback) FLACMetadataCallback, (void*)g);
-		if(ret == FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
-			if(g->serverStatusCallback) {
-				g->serverStatusCallback(g, (void *) "FLAC initialized");
+			if(slot->g && slot->g->governorShed && !slot->g->gForceStop && (!pick || governorBefore(pick, slot))) {
+				pick = slot;
 			}
 		}
+
+		if(pick) {
+			/* the reconnect scheduler brings it back */
+			pick->g->governorShed = 0;
+			scheduleReconnect(pick->g);
+			LogMessage(g, LOG_INFO, "Governor: load %ld%% of real time, readmitting encoder %d", total / 10, pick->g->encoderNumber);
+		}
 		else {
-			if(g->serverStatusCallback) {
-				g->serverStatusCallback(g, (void *) "Error Initializing FLAC");
+			for(int i = 0; i < GOVERNOR_MAX_SLOTS; i++) {
+				GovernedSlot	*slot = &governedSlots[i];
+
+				if(slot->g && slot->g->weareconnected && (slot->g->encoderEffortTarget > 0) && (!pick || governorBefore(pick, slot))) {
+					pick = slot;
+				}
 			}
 
-			LogMessage(g,LOG_ERROR, "Error Initializing FLAC");
-			return 0;
+			if(pick) {
+				pick->g->encoderEffortTarget--;
+				LogMessage(g, LOG_INFO, "Governor: load %ld%% of real time, encoder %d (%s) effort up to step %d",
+							total / 10, pick->g->encoderNumber, pick->codecName, pick->g->encoderEffortTarget);
+			}
 		}
-#endif
 	}
 
-	return 1;
+	if(pick) {
+		governorDecisions++;
+		governorLastDecision = now;
+	}
 }
 
+static void governorUpdate(mcaster1Globals *g, int frames, long long encodeMicros) {
+	long long	now;
+	long long	blockMicros;
+	long		load;
 
-void FloatScale(float *destination, float *source, int numsamples, int destchannels) {
-	int i;
+	if(!g->governorEnabled || (frames <= 0) || (g->currentSamplerate <= 0)) {
+		return;
+	}
 
-	if(destchannels == 2) {
-		for(i = 0; i < numsamples; i++) {
-			*destination++ = *source++ *32767.f;
+	if(!g->governorRegistered) {
+		governorRegister(g);
+	}
+
+	blockMicros = ((long long) frames * 1000000) / g->currentSamplerate;
+	if(blockMicros <= 0) {
+		return;
+	}
+
+	load = (long) ((encodeMicros * 1000) / blockMicros);
+	if(load > 1000) {
+		g->deadlineMisses++;
+		LogMessage(g, LOG_DEBUG, "%s took %ld us for a %ld us block", g->codec->name, (long) encodeMicros, (long) blockMicros);
+	}
+
+	g->encodeLoad += (load - g->encodeLoad) / 8;
+	if(!g->governorEntry) {
+		return;
+	}
+
+	now = getMonotonicMicros();
+	pthread_mutex_lock(&governorMutex);
+	g->governorEntry->load = g->encodeLoad;
+	g->governorEntry->codecName = g->codec ? g->codec->name : "none";
+	g->governorEntry->canSetEffort = g->codec && g->codec->setEffort;
+	if((now - governorLastDecision) >= governorHoldMicros) {
+		governorDecide(g, now);
+	}
+
+	pthread_mutex_unlock(&governorMutex);
+}
+
+/* Runs on the slot's own encoder thread, between two blocks */
+static void applyEncoderEffort(mcaster1Globals *g) {
+	int previous = g->encoderEffort;
+
+	g->encoderEffort = g->encoderEffortTarget;
+	if(g->codec && g->codec->setEffort && g->codec->setEffort(g)) {
+		g->effortChanges++;
+		LogMessage(g, LOG_INFO, "%s effort step %d -> %d", g->codec->name, previous, g->encoderEffort);
+	}
+	else {
+		/* the governor steps encoderEffortTarget under its lock */
+		pthread_mutex_lock(&governorMutex);
+		g->encoderEffort = previous;
+		g->encoderEffortTarget = previous;
+		pthread_mutex_unlock(&governorMutex);
+	}
+}
+
+/* Last resort of the governor, a clean disconnect that the reconnect timer ignores */
+static void governorShedSlot(mcaster1Globals *g) {
+	g->governorShedRequest = 0;
+	g->governorShed = 1;
+	disconnectFromServer(g);
+	if(g->serverStatusCallback) {
+		g->serverStatusCallback(g, (void *) "Paused by CPU governor");
+	}
+
+	LogMessage(g, LOG_INFO, "Encoder %d shed by the CPU governor", g->encoderNumber);
+}
+
+long getEncodeLoad(mcaster1Globals *g) {
+	return g->encodeLoad;
+}
+
+int getEncoderEffort(mcaster1Globals *g) {
+	return g->encoderEffort;
+}
+
+long getDeadlineMisses(mcaster1Globals *g) {
+	return g->deadlineMisses;
+}
+
+long getEffortChanges(mcaster1Globals *g) {
+	return g->effortChanges;
+}
+
+int getGovernorShed(mcaster1Globals *g) {
+	return g->governorShed;
+}
+
+long getGovernorTotalLoad(void) {
+	return governorTotalLoad;
+}
+
+long getGovernorDecisions(void) {
+	return governorDecisions;
+}
+
+void setGovernorThresholds(long highLoad, long lowLoad, long holdMs) {
+	pthread_mutex_lock(&governorMutex);
+	if((highLoad > 0) && (lowLoad >= 0) && (lowLoad < highLoad)) {
+		governorHigh = highLoad;
+		governorLow = lowLoad;
+	}
+
+	if(holdMs >= 0) {
+		governorHoldMicros = (long long) holdMs * 1000;
+	}
+
+	pthread_mutex_unlock(&governorMutex);
+}
+
+/*
+ =======================================================================================================================
+    Adaptive bitrate.  Every ABR_CHECK_MS the encoder thread measures the slot's
+    send backlog, the reactor queue plus the kernel send queue where the system
+    tells, as milliseconds of audio at the current bitrate.  Above
+    ABR_HIGH_BACKLOG_MS the link is not keeping up and the bitrate is cut by a
+    quarter, down to abrMinBitrate.  After ABR_RECOVER_MS below
+    ABR_LOW_BACKLOG_MS it goes back up an eighth of the configured bitrate at a
+    time.  Only codecs with a setBitrate entry take part; the rest keep sending
+    at their configured rate until the link gives out.
+ =======================================================================================================================
+ */
+static void adaptBitrate(mcaster1Globals *g) {
+	long long	now = getMonotonicMicros();
+
+	if((now - g->abrLastCheck) < (long long) ABR_CHECK_MS * 1000) {
+		return;
+	}
+
+	g->abrLastCheck = now;
+	if(g->abrBitrate <= 0) {
+		g->abrBitrate = g->currentBitrate;
+	}
+
+	/* bytes * 8 / kbps is milliseconds */
+	g->abrBacklogMs = (g->abrBitrate > 0) ? (long) (((long long) netGetBacklog(g->connection) * 8) / g->abrBitrate) : 0;
+
+	int target = g->abrBitrate;
+	int floor = (g->abrMinBitrate > 0) ? g->abrMinBitrate : ABR_DEFAULT_MIN_KBPS;
+
+	if(floor > g->currentBitrate) {
+		floor = g->currentBitrate;
+	}
+
+	if(g->abrBacklogMs > ABR_HIGH_BACKLOG_MS) {
+		g->abrCalmSince = 0;
+		if((now - g->abrLastChange) >= (long long) ABR_DOWN_HOLD_MS * 1000) {
+			target = (g->abrBitrate * 3) / 4;
+			if(target < floor) {
+				target = floor;
+			}
+		}
+	}
+	else if(g->abrBacklogMs < ABR_LOW_BACKLOG_MS) {
+		if(!g->abrCalmSince) {
+			g->abrCalmSince = now;
+		}
+		else if((now - g->abrCalmSince) >= (long long) ABR_RECOVER_MS * 1000) {
+			int step = g->currentBitrate / 8;
+
+			target = g->abrBitrate + ((step > 8) ? step : 8);
+			if(target > g->currentBitrate) {
+				target = g->currentBitrate;
+			}
 		}
 	}
 	else {
-		for(i = 0; i < numsamples >> 1; i++) {
-			*destination++ = (*source++ +*source++) * 16383.f;
+		g->abrCalmSince = 0;
+	}
+
+	if(target == g->abrBitrate) {
+		return;
+	}
+
+	int previous = g->abrBitrate;
+
+	g->abrBitrate = target;
+	if(g->codec->setBitrate(g)) {
+		g->abrChanges++;
+		g->abrLastChange = now;
+		g->abrCalmSince = 0;
+		LogMessage(g, LOG_INFO, "Encoder %d: send backlog %ld ms, %s bitrate %d -> %d kbps",
+					g->encoderNumber, g->abrBacklogMs, g->codec->name, previous, target);
+	}
+	else {
+		g->abrBitrate = previous;
+	}
+}
+
+/* A new connection starts at the configured bitrate, a reused codec is set back to it */
+static void resetAdaptiveBitrate(mcaster1Globals *g) {
+	int previous = g->abrBitrate;
+
+	g->abrBitrate = g->currentBitrate;
+	g->abrBacklogMs = 0;
+	g->abrCalmSince = 0;
+	g->abrLastChange = 0;
+	if(previous && (previous != g->currentBitrate) && g->codec && g->codec->setBitrate) {
+		g->codec->setBitrate(g);
+	}
+}
+
+int getAdaptiveBitrate(mcaster1Globals *g) {
+	return g->abrBitrate ? g->abrBitrate : g->currentBitrate;
+}
+
+long getSendBacklogMs(mcaster1Globals *g) {
+	return g->abrBacklogMs;
+}
+
+long getBitrateChanges(mcaster1Globals *g) {
+	return g->abrChanges;
+}
+
+/* Milliseconds the pacing has held data back on the current connection */
+long getPacingDelayMs(mcaster1Globals *g) {
+	NetStats	stats;
+
+	if(!g->connection) {
+		return 0;
+	}
+
+	netGetStats(g->connection, &stats);
+	return stats.pacingDelayMs;
+}
+
+/* Bytes waiting in the reactor for the current connection */
+long getSendQueueBytes(mcaster1Globals *g) {
+	NetStats	stats;
+
+	if(!g->connection) {
+		return 0;
+	}
+
+	netGetStats(g->connection, &stats);
+	return stats.queuedBytes;
+}
+
+/* Mean absolute level of each channel of the host block, 0..32767, for the VU meters */
+void meterPCMBlock(const PCMBlock *block, int numsamples, long *left, long *right) {
+	long	leftMax = 0;
+	long	rightMax = 0;
+
+	if(block->floatSource) {
+		for(int i = 0; i < numsamples * 2; i = i + 2) {
+			leftMax += abs((int) ((float) block->floatSource[i] * 32767.f));
+			rightMax += abs((int) ((float) block->floatSource[i + 1] * 32767.f));
+		}
+	}
+	else {
+		for(int i = 0; i < numsamples * 2; i = i + 2) {
+			leftMax += abs((int) block->int16Source[i]);
+			rightMax += abs((int) block->int16Source[i + 1]);
+		}
+	}
+
+	if(numsamples > 0) {
+		leftMax = leftMax / (numsamples * 2);
+		rightMax = rightMax / (numsamples * 2);
+	}
+
+	*left = leftMax;
+	*right = rightMax;
+}
+
+/*
+ * Shared by do_encoding and do_encoding_int16 once g->pcm points at the
+ * host block: meters, hands the block to the active codec and turns
+ * socket errors into a disconnect.
+ */
+static int encodeBlock(mcaster1Globals *g, int numsamples) {
+	PCMBlock	*block = &(g->pcm);
+	int			sentbytes = 0;
+
+	if(!reservePCMBlock(block, numsamples)) {
+		LogMessage(g,LOG_ERROR, "Cannot allocate %d sample encode buffers", numsamples);
+		return 1;
+	}
+
+	block->frames = numsamples;
+	block->channels = (g->currentChannels == 1) ? 1 : 2;
+	block->built = 0;
+
+	long	leftMax = 0;
+	long	rightMax = 0;
+
+	LogMessage(g,LOG_DEBUG, "determining left/right max...");
+	TRACE_BEGIN("metering", g->encoderNumber);
+	meterPCMBlock(block, numsamples, &leftMax, &rightMax);
+	if((numsamples > 0) && g->VUCallback) {
+		g->VUCallback(leftMax, rightMax);
+	}
+
+	TRACE_END("metering", g->encoderNumber);
+
+	if(g->codec) {
+		if(g->encoderEffortTarget != g->encoderEffort) {
+			applyEncoderEffort(g);
+		}
+
+		if(g->abrEnabled && g->codec->setBitrate && g->connection) {
+			adaptBitrate(g);
+		}
+
+		long long	encodeStarted = getMonotonicMicros();
+		int			live = g->blockCaptureMicros && (g->replayState != REPLAY_RUNNING);
+
+		if(live) {
+			latencyRecord(&g->stageLatency[LATENCY_STAGE_QUEUE_WAIT], encodeStarted - g->blockCaptureMicros);
+		}
+
+		g->blockSendMicros = 0;
+		TRACE_BEGIN(g->codec->name, g->encoderNumber);
+		sentbytes = g->codec->encode(g, block);
+		TRACE_END(g->codec->name, g->encoderNumber);
+
+		long long	encodeMicros = getMonotonicMicros() - encodeStarted;
+
+		governorUpdate(g, numsamples, encodeMicros - g->blockSendMicros);
+		metricsCount(g, METRIC_BLOCKS, 1);
+		metricsCount(g, METRIC_ENCODE_MICROS, encodeMicros);
+		latencyRecord(&g->stageLatency[LATENCY_STAGE_ENCODE], encodeMicros - g->blockSendMicros);
+		latencyRecord(&g->stageLatency[LATENCY_STAGE_SEND], g->blockSendMicros);
+		if(live && (sentbytes >= 0) && g->connection && !g->outputFile) {
+			netMarkTime(g->connection, g->blockCaptureMicros);
+		}
+
+		if(g->lowLatency && g->connection) {
+			measureLatency(g, encodeMicros);
+		}
+
+		reportStageLatency(g);
+	}
+
+	/*
+	 * Generic error checking, if there are any socket problems, the trigger ;
+	 * a disconnection handling->..
+	 */
+	if(sentbytes < 0) {
+		return triggerDisconnect(g);
+	}
+
+	return 1;
+}
+
+/*
+ =======================================================================================================================
+    Reconnect replay.  With ReplayBufferSecs every block a slot gets, connected or
+    not, also goes into a ring holding the last seconds of its PCM (stereo
+    interleaved float at the encoder rate).  When a send error drops the
+    connection the ring marks where the server's copy stopped: the audio still in
+    the send queue and the block that failed.  The ring keeps filling while the
+    slot is down.  Once the slot is back, with a rebuilt codec and so with fresh
+    Ogg headers, the encoder takes its input from the mark until it has caught up
+    with the live input: ReplaySpeedPercent of real time plus ReplayBurstSecs,
+    about what a server bursts to a listener that joins.  The burst goes out at
+    REPLAY_BURST_BLOCKS host blocks per block, the capture thread is shared by
+    every slot.  Of a gap longer than the ring only the last ReplayBufferSecs are
+    replayed.  The ring is sized when the config is read, never on the audio
+    thread.
+ =======================================================================================================================
+ */
+static void replayReserve(mcaster1Globals *g) {
+	long	capacity = (g->replaySecs > 0) ? (long) g->replaySecs * g->currentSamplerate : 0;
+
+	if(capacity == g->replayCapacity) {
+		return;
+	}
+
+	free(g->replayRing);
+	g->replayRing = (capacity > 0) ? (float *) malloc(capacity * 2 * sizeof(float)) : NULL;
+	g->replayCapacity = g->replayRing ? capacity : 0;
+	g->replayWritten = 0;
+	g->replayRead = 0;
+	g->replayState = REPLAY_IDLE;
+	if(capacity && !g->replayRing) {
+		LogMessage(g, LOG_ERROR, "Encoder %d: no memory for %d seconds of replay, replay is off", g->encoderNumber, g->replaySecs);
+	}
+}
+
+static void replayCapture(mcaster1Globals *g, const float *floatSamples, const short *int16Samples, int frames) {
+	if(!g->replayCapacity) {
+		return;
+	}
+
+	for(int i = 0; i < frames;) {
+		long	at = (long) (g->replayWritten % g->replayCapacity);
+		long	chunk = ((frames - i) < (g->replayCapacity - at)) ? (frames - i) : (g->replayCapacity - at);
+		float	*to = g->replayRing + at * 2;
+
+		if(floatSamples) {
+			memcpy(to, floatSamples + i * 2, chunk * 2 * sizeof(float));
 		}
+		else {
+			for(long n = 0; n < chunk * 2; n++) {
+				to[n] = int16Samples[i * 2 + n] / 32767.f;
+			}
+		}
+
+		i += chunk;
+		g->replayWritten += chunk;
+	}
+
+	/* the oldest of what is waiting to be replayed was overwritten */
+	if((g->replayState != REPLAY_IDLE) && (g->replayWritten - g->replayRead > g->replayCapacity)) {
+		g->replayLostFrames += g->replayWritten - g->replayCapacity - g->replayRead;
+		metricsCount(g, METRIC_REPLAY_LOST_FRAMES, g->replayWritten - g->replayCapacity - g->replayRead);
+		g->replayRead = g->replayWritten - g->replayCapacity;
+	}
+}
+
+/* First frame the server did not get, -1 = nothing to replay.  Before the connection is closed */
+static long long replayDisconnectPoint(mcaster1Globals *g) {
+	NetStats	stats;
+	long long	missed = g->pcm.frames;		// the block whose send failed
+	long long	from;
+
+	if(!g->replayCapacity || !g->connection) {
+		return -1;
+	}
+
+	/* bytes * 8 / kbps is milliseconds */
+	netGetStats(g->connection, &stats);
+	if(getAdaptiveBitrate(g) > 0) {
+		missed += (((long long) stats.queuedBytes * 8) / getAdaptiveBitrate(g)) * g->currentSamplerate / 1000;
+	}
+
+	from = g->replayWritten - missed;
+	if(from < g->replayWritten - g->replayCapacity) {
+		from = g->replayWritten - g->replayCapacity;
+	}
+
+	/* still behind from the last reconnect */
+	if((g->replayState == REPLAY_RUNNING) && (g->replayRead < from)) {
+		from = g->replayRead;
+	}
+
+	return (from > 0) ? from : 0;
+}
+
+static void replayHold(mcaster1Globals *g, long long from) {
+	if(from < 0) {
+		return;
 	}
+
+	g->replayRead = from;
+	g->replayState = REPLAY_HELD;
 }
 
-void ExtractFromFIFO(float *destination, float *source, int numsamples) {
-	for(int i = 0; i < numsamples; i++) {
-		*destination++ = *source++;
+static void replayResume(mcaster1Globals *g) {
+	if(g->replayState != REPLAY_HELD) {
+		return;
 	}
+
+	g->replayState = REPLAY_RUNNING;
+	g->replayBurstFrames = (long) g->replayBurstSecs * g->currentSamplerate;
+	LogMessage(g, LOG_INFO, "Encoder %d: replaying %ld ms from where the server lost the stream",
+				g->encoderNumber, (long) ((g->replayWritten - g->replayRead) * 1000 / g->currentSamplerate));
 }
 
-int do_encoding(mcaster1Globals *g, float *samples, int numsamples, int nch) {
-	g->gCurrentlyEncoding = 1;
+static void replayDrop(mcaster1Globals *g) {
+	g->replayState = REPLAY_IDLE;
+	g->replayFrames = 0;
+	g->replayBytes = 0;
+	g->replayLostFrames = 0;
+}
 
-	int				s;
-	int				count = 0;
-	unsigned char	mp3buffer[LAME_MAXMP3BUFFER];
-	int				imp3;
-	short int		*int_samples;
-	int				eos = 0;
-	int				ret = 0;
-	int				sentbytes = 0;
-	char			buf[255] = "";
+/* Encodes from the ring in place of the host block, 0 = stopped */
+static int replayEncode(mcaster1Globals *g, int numsamples) {
+	long		burst = (long) numsamples * REPLAY_BURST_BLOCKS;
+	long long	budget = ((long long) numsamples * ((g->replaySpeed > 100) ? g->replaySpeed : 100)) / 100;
 
-	g->gCurrentlyEncoding = 1;
+	/* the rest of the burst goes out with the next blocks */
+	if(burst > g->replayBurstFrames) {
+		burst = g->replayBurstFrames;
+	}
 
-	if(g->weareconnected) {
-		s = numsamples * nch;
+	g->replayBurstFrames -= burst;
+	budget += burst;
+	while((budget > 0) && (g->replayRead < g->replayWritten)) {
+		long		at = (long) (g->replayRead % g->replayCapacity);
+		long long	chunk = g->replayWritten - g->replayRead;
 
-		long	leftMax = 0;
-		long	rightMax = 0;
-		int		samplecounter = 0;
+		if(chunk > budget) {
+			chunk = budget;
+		}
 
-		LogMessage(g,LOG_DEBUG, "determining left/right max...");
-		for(int i = 0; i < numsamples * 2; i = i + 2) {
-			leftMax += abs((int) ((float) samples[i] * 32767.f));
-			rightMax += abs((int) ((float) samples[i + 1] * 32767.f));
+		if(chunk > g->replayCapacity - at) {
+			chunk = g->replayCapacity - at;
 		}
 
-		if(numsamples > 0) {
-			leftMax = leftMax / (numsamples * 2);
-			rightMax = rightMax / (numsamples * 2);
-			if(g->VUCallback) {
-				g->VUCallback(leftMax, rightMax);
-			}
+		if(chunk > REPLAY_CHUNK_FRAMES) {
+			chunk = REPLAY_CHUNK_FRAMES;
 		}
 
-		if(g->gOggFlag)
-		{
-#ifdef HAVE_VORBIS
-			/*
-			 * If a song change was detected, close the stream and resend new ;
-			 * vorbis headers (with new comments) - all done by icecast2SendMetadata();
-			 */
-			if(g->ice2songChange) {
-				LogMessage(g,LOG_DEBUG, "Song change processing...");
-				g->ice2songChange = false;
-				icecast2SendMetadata(g);
-			}
+		g->pcm.floatSource = g->replayRing + at * 2;
+		g->pcm.int16Source = NULL;
+		if(!encodeBlock(g, (int) chunk)) {
+			return 0;
+		}
 
-			LogMessage(g,LOG_DEBUG, "vorbis_analysis_buffer...");
+		/* lost again, triggerDisconnect has marked it */
+		if(g->replayState != REPLAY_RUNNING) {
+			return 1;
+		}
 
-			float	**buffer = vorbis_analysis_buffer(&g->vd, numsamples);
-			int		samplecount = 0;
-			int		i;
+		g->replayRead += chunk;
+		g->replayFrames += chunk;
+		budget -= chunk;
+	}
 
-			samplecounter = 0;
+	if(g->replayRead >= g->replayWritten) {
+		long long	ms = g->replayFrames * 1000 / g->currentSamplerate;
 
-			for(i = 0; i < numsamples * 2; i = i + 2) {
-				buffer[0][samplecounter] = samples[i];
-				if(g->currentChannels == 2) {
-					buffer[1][samplecounter] = samples[i + 1];
-				}
+		g->replayedMsTotal += ms;
+		g->replayedBytesTotal += g->replayBytes;
+		LogMessage(g, LOG_INFO, "Encoder %d: live again after replaying %ld ms, %ld bytes (%ld ms did not fit in the ring)",
+					g->encoderNumber, (long) ms, (long) g->replayBytes, (long) (g->replayLostFrames * 1000 / g->currentSamplerate));
+		replayDrop(g);
+	}
 
-				samplecounter++;
-			}
-			LogMessage(g,LOG_DEBUG, "vorbis_analysis_wrote...");
+	return 1;
+}
 
-			ret = vorbis_analysis_wrote(&g->vd, numsamples);
+long long getReplayedMs(mcaster1Globals *g) {
+	return g->replayedMsTotal;
+}
 
-			pthread_mutex_lock(&(g->mutex));
-			LogMessage(g,LOG_DEBUG, "ogg_encode_dataout...");
-			/* Stream out what we just prepared for Vorbis... */
-			sentbytes = ogg_encode_dataout(g);
-			LogMessage(g,LOG_DEBUG, "done ogg_ecndoe_dataout...");
-			pthread_mutex_unlock(&(g->mutex));
-#endif
-		}
+long long getReplayedBytes(mcaster1Globals *g) {
+	return g->replayedBytesTotal;
+}
 
-		if(g->gAACFlag)
-		{
-#ifdef WIN32
-			// fdk-aac encode
-			if (g->fdkAacEncoder) {
-				float *inBuf = samples;
-				INT inBufDesc_bufferIdentifiers = IN_AUDIO_DATA;
-				INT inBufDesc_bufSizes = numsamples * nch * (INT)sizeof(float);
-				INT inBufDesc_bufElSizes = (INT)sizeof(float);
-				AACENC_BufDesc inBufDesc = { 0 };
-				inBufDesc.numBufs           = 1;
-				inBufDesc.bufs              = (void**) &inBuf;
-				inBufDesc.bufferIdentifiers = &inBufDesc_bufferIdentifiers;
-				inBufDesc.bufSizes          = &inBufDesc_bufSizes;
-				inBufDesc.bufElSizes        = &inBufDesc_bufElSizes;
-
-				unsigned char outBuf[8192];
-				void *outBufPtr = outBuf;
-				INT outBufSize = (INT)sizeof(outBuf);
-				INT outBufId = OUT_BITSTREAM_DATA;
-				INT outBufElSize = 1;
-				AACENC_BufDesc outBufDesc = { 0 };
-				outBufDesc.numBufs           = 1;
-				outBufDesc.bufs              = &outBufPtr;
-				outBufDesc.bufferIdentifiers = &outBufId;
-				outBufDesc.bufSizes          = &outBufSize;
-				outBufDesc.bufElSizes        = &outBufElSize;
-
-				AACENC_InArgs inArgs  = { numsamples * nch, 0 };
-				AACENC_OutArgs outArgs = { 0 };
-
-				if (aacEncEncode(g->fdkAacEncoder, &inBufDesc, &outBufDesc, &inArgs, &outArgs) == AACENC_OK) {
-					if (outArgs.numOutBytes > 0)
-						sentbytes = sendToServer(g, g->gSCSocket, (char*)outBuf, outArgs.numOutBytes, CODEC_TYPE);
-				}
-			}
-#endif
-		}
+/* samples is always stereo interleaved float, numsamples is per channel */
+int do_encoding(mcaster1Globals *g, float *samples, int numsamples, int nch) {
+	int ret = 1;
 
-		if(g->gAACPFlag)
-		{
-#ifdef HAVE_AACP
-			static char outbuffer[32768];
-			static char inbuffer[32768];
-			static int	inbufferused = 0;
-			int			len = numsamples * g->currentChannels * sizeof(short);
+	(void) nch;	/* already stereo, the encoder reads its own channel count */
 
-			int_samples = (short *) malloc(len);
+	/* before gCurrentlyEncoding, or disconnectFromServer waits a second on the audio thread every slot shares */
+	if(g->governorShedRequest && g->weareconnected) {
+		governorShedSlot(g);
+	}
 
-			int samplecount = 0;
+	g->gCurrentlyEncoding = 1;
 
-			if(g->currentChannels == 1) {
-				for(int i = 0; i < numsamples * 2; i = i + 2) {
-					int_samples[samplecount] = (short int) (samples[i] * 32767.0);
-					samplecount++;
-				}
-			}
-			else {
-				for(int i = 0; i < numsamples * 2; i++) {
-					int_samples[i] = (short int) (samples[i] * 32767.0);
-					samplecount++;
-				}
-			}
+	if((g->replaySecs > 0) && !g->outputFile) {
+		replayCapture(g, samples, NULL, numsamples);
+	}
 
-			char	*bufcounter = (char *) int_samples;
+	if(g->weareconnected) {
+		if(g->replayState == REPLAY_RUNNING) {
+			ret = replayEncode(g, numsamples);
+		}
+		else {
+			g->pcm.floatSource = samples;
+			g->pcm.int16Source = NULL;
+			ret = encodeBlock(g, numsamples);
+		}
+	}
 
-			for(;;) {
-				int in_used = 0;
+	/* cleared on every way out, left set it makes each later disconnect wait a second */
+	g->gCurrentlyEncoding = 0;
+	return ret ? 1 : 0;
+}
 
-				if(len <= 0) break;
+/* Same as do_encoding for hosts that deliver 16 bit stereo interleaved PCM */
+int do_encoding_int16(mcaster1Globals *g, short *samples, int numsamples, int nch) {
+	int ret = 1;
 
-				int enclen = g->aacpEncoder->Encode(in_used, bufcounter, len, &in_used, outbuffer, sizeof(outbuffer));
+	(void) nch;
 
-				if(enclen > 0) {
-					sentbytes = sendToServer(g, g->gSCSocket, (char *) outbuffer, enclen, CODEC_TYPE);
-				}
-				else {
-					break;
-				}
+	if(g->governorShedRequest && g->weareconnected) {
+		governorShedSlot(g);
+	}
 
-				if(in_used > 0) {
-					bufcounter += in_used;
-					len -= in_used;
-				}
-			}
+	g->gCurrentlyEncoding = 1;
 
-			if(int_samples) {
-				free(int_samples);
-			}
-#endif
+	if((g->replaySecs > 0) && !g->outputFile) {
+		replayCapture(g, NULL, samples, numsamples);
+	}
+
+	if(g->weareconnected) {
+		if(g->replayState == REPLAY_RUNNING) {
+			ret = replayEncode(g, numsamples);
+		}
+		else {
+			g->pcm.floatSource = NULL;
+			g->pcm.int16Source = samples;
+			ret = encodeBlock(g, numsamples);
 		}
+	}
 
-		if(g->gLAMEFlag)
-		{
-#ifdef HAVE_LAME
-			/* Lame encoding is simple, we are passing it interleaved samples */
-			int_samples = (short int *) malloc(numsamples * 2 * sizeof(short int));
+	/* cleared on every way out, left set it makes each later disconnect wait a second */
+	g->gCurrentlyEncoding = 0;
+	return ret ? 1 : 0;
+}
 
-			int samplecount = 0;
+/*
+ =======================================================================================================================
+    Passthrough.  When the input already carries what a slot would produce (same codec, rate, channels and
+    constant bitrate) its frames are sent as they are: no decode, no re-encode, no generation loss.  The
+    slot's encoder stays open and takes over again whenever the input has no matching frames.
+ =======================================================================================================================
+ */
+int passthroughMatches(mcaster1Globals *g, const CompressedFrame *frame) {
+	if(!g->passthroughEnabled || (frame->bitrate != g->currentBitrate)) {
+		return 0;
+	}
 
-			if(g->currentChannels == 1) {
-				for(int i = 0; i < numsamples * 2; i = i + 2) {
-					int_samples[samplecount] = (int) (samples[i] * 32767.0);
-					samplecount++;
-				}
-			}
-			else {
-				for(int i = 0; i < numsamples * 2; i++) {
-					int_samples[i] = (int) (samples[i] * 32767.0);
-					samplecount++;
-				}
+	switch(frame->codec) {
+		case FRAME_CODEC_MP3:
+			if(!g->gLAMEFlag) {
+				return 0;
 			}
 
 #ifdef WIN32
-			// Native LAME encode
-			if (g->lameGF) {
-				short int_left[8192], int_right[8192];
-				int n = numsamples > 8192 ? 8192 : numsamples;
-				for (int i = 0; i < n; i++) {
-					int_left[i]  = (short)(samples[i * nch]                  * 32767.0f);
-					int_right[i] = (short)(samples[i * nch + (nch > 1 ? 1 : 0)] * 32767.0f);
-				}
-				imp3 = lame_encode_buffer(g->lameGF, int_left, int_right, n,
-				                          mp3buffer, sizeof(mp3buffer));
+			if(g->lameVBRMode != 0) {
+				return 0;
 			}
 #else
-			float	*samples_left;
-			float	*samples_right;
-
-			samples_left = (float *) malloc(numsamples * (sizeof(float)));
-			samples_right = (float *) malloc(numsamples * (sizeof(float)));
-
-			for(int i = 0; i < numsamples; i++) {
-				samples_left[i] = samples[2 * i] * 32767.0;
-				samples_right[i] = samples[2 * i + 1] * 32767.0;
+			if(!g->gLAMEOptions.cbrflag) {
+				return 0;
 			}
+#endif
+			return (frame->samplerate == getCurrentSamplerate(g)) && (frame->channels == getCurrentChannels(g));
 
-			imp3 = lame_encode_buffer_float(g->gf,
-											(float *) samples_left,
-											(float *) samples_right,
-											numsamples,
-											mp3buffer,
-											sizeof(mp3buffer));
-			if(samples_left) {
-				free(samples_left);
+#ifdef WIN32
+		case FRAME_CODEC_ADTS:
+			if(!g->gAACFlag || !g->fdkAacProfile) {
+				return 0;
 			}
 
-			if(samples_right) {
-				free(samples_right);
+			if(g->fdkAacProfile == 2) {
+				return (frame->samplerate == getCurrentSamplerate(g)) && (frame->channels == getCurrentChannels(g));
 			}
-#endif
-			if(int_samples) {
-				free(int_samples);
+
+			/* HE-AAC headers carry the core rate, v2 also a mono core */
+			if(frame->samplerate * 2 != getCurrentSamplerate(g)) {
+				return 0;
 			}
 
-			if(imp3 == -1) {
-				LogMessage(g,LOG_ERROR, "mp3 buffer is not big enough!");
-				return -1;
+			if(g->fdkAacProfile == 29) {
+				return (frame->channels == 1) && (getCurrentChannels(g) == 2);
 			}
 
-			/* Send out the encoded buffer */
-			sentbytes = sendToServer(g, g->gSCSocket, (char *) mp3buffer, imp3, CODEC_TYPE);
+			return frame->channels == getCurrentChannels(g);
 #endif
-		}
-
-		if(g->gFLACFlag)
-		{
-#ifdef HAVE_FLAC
-			INT32		*int32_samples;
-
-			int32_samples = (INT32 *) malloc(numsamples * 2 * sizeof(INT32));
-
-			int samplecount = 0;
+	}
 
-			if(g->currentChannels == 1) {
-				for(int i = 0; i < numsamples * 2; i = i + 2) {
-					int32_samples[samplecount] = (INT32) (samples[i] * 32767.0);
-					samplecount++;
-				}
-			}
-			else {
-				for(int i = 0; i < numsamples * 2; i++) {
-					int32_samples[i] = (INT32) (samples[i] * 32767.0);
-					samplecount++;
-				}
-			}
+	return 0;
+}
 
-			FLAC__stream_encoder_process_interleaved(g->flacEncoder, int32_samples, numsamples);
+/* 1 = the frame went out for this slot, 0 = the slot needs the PCM */
+int passthroughFrame(mcaster1Globals *g, const CompressedFrame *frame) {
+	if(!g) {
+		return 0;
+	}
 
-			if(int32_samples) {
-				free(int32_samples);
-			}
+	if(!g->weareconnected || !passthroughMatches(g, frame)) {
+		passthroughGap(g);
+		return 0;
+	}
 
-			if(g->flacFailure) {
-				sentbytes = 0;
-			}
-			else {
-				sentbytes = 1;
-			}
-#endif
+	if(!g->passthroughActive) {
+		if(g->passthroughMatched < g->passthroughConfirmFrames) {
+			g->passthroughMatched++;
+			return 0;
 		}
 
-#ifdef WIN32
-		if(g->gOpusFlag)
-		{
-			/* Song title changes are delivered via Icecast metadata API,
-			 * same mechanism as OggVorbis — no need to restart the stream */
-			if(g->ice2songChange) {
-				g->ice2songChange = false;
-				icecast2SendMetadata(g);
-			}
-
-			if(g->opusEncoder) {
-				/* ope_encoder_write_float triggers opus_write_callback
-				 * with complete Ogg pages as they become ready */
-				int opus_err = ope_encoder_write_float(
-					g->opusEncoder, samples, numsamples);
-				if(opus_err == OPE_OK) {
-					sentbytes = 1;
-				} else {
-					LogMessage(g, LOG_ERROR, "Opus encode error");
-					sentbytes = -1;
-				}
-			}
+		/* the first frame must not lean on a bit reservoir the listeners never got */
+		if(!frame->selfContained) {
+			return 0;
 		}
-#endif
 
-		/*
-		 * Generic error checking, if there are any socket problems, the trigger ;
-		 * a disconnection handling->..
-		 */
-		if(sentbytes < 0) {
-			int rret = triggerDisconnect(g);
-			if (rret == 0) {
-				return 0;
-			}
+		/* what the encoder still holds goes out first, the input follows on */
+		if(g->codec && g->codec->flush && (g->codec->flush(g) < 0)) {
+			triggerDisconnect(g);
+			return 1;
 		}
+
+		g->passthroughActive = 1;
+		LogMessage(g, LOG_INFO, "Encoder %d: input matches, passing %s frames through", g->encoderNumber,
+					(frame->codec == FRAME_CODEC_MP3) ? "MP3" : "AAC");
 	}
 
-	g->gCurrentlyEncoding = 0;
+	if(sendToServer(g, g->gSCSocket, (char_t *) frame->data, frame->length, CODEC_TYPE) < 0) {
+		triggerDisconnect(g);
+		return 1;
+	}
+
+	g->passthroughFrames++;
+	governorUpdate(g, frame->samples, 0);
 	return 1;
 }
 
+/* No matching frames for what follows, the slot encodes PCM again */
+void passthroughGap(mcaster1Globals *g) {
+	g->passthroughMatched = 0;
+	if(!g->passthroughActive) {
+		return;
+	}
+
+	g->passthroughActive = 0;
+
+	/* drop what the encoder held from before the passthrough */
+	if(g->codec && g->codec->reset) {
+		g->codec->reset(g);
+	}
+
+	LogMessage(g, LOG_INFO, "Encoder %d: passthrough ended after %ld frames, encoding again", g->encoderNumber, g->passthroughFrames);
+}
+
 int triggerDisconnect(mcaster1Globals *g) {
 	char buf[2046] = "";
+	long long	replayFrom = replayDisconnectPoint(g);
 
+	g->connectionLost = 1;
+	metricsCount(g, METRIC_CONNECTION_LOSSES, 1);
 	disconnectFromServer(g);
 	if(g->gForceStop) {
 		g->gForceStop = 0;
+		replayDrop(g);
 		return 0;
 	}
 
+	replayHold(g, replayFrom);
+
 
 	sprintf(buf, "Disconnected from server");
-	g->forcedDisconnect = true;
-	g->forcedDisconnectSecs = time(&(g->forcedDisconnectSecs));
+	scheduleReconnect(g);
 	g->serverStatusCallback(g, (void *) buf);
 	return 1;
 }
@@ -2817,6 +4669,26 @@ void config_read(mcaster1Globals *g) {
 //	sprintf(desc, "How long it will wait (in seconds) between reconnect attempts. (example: 10)");
 	g->gReconnectSec = GetConfigVariableLong(g, g->gAppName, "AutomaticReconnectSecs", 10, NULL);
 
+	sprintf(desc, "The wait before a reconnect doubles after every failed attempt, starting at AutomaticReconnectSecs, up to this many seconds");
+	g->reconnectMaxSecs = GetConfigVariableLong(g, g->gAppName, "ReconnectMaxSecs", RECONNECT_DEFAULT_MAX_SECS, desc);
+
+	sprintf(desc, "Secondary server of the same type and password.  Reconnects alternate between it and Server; blank for none");
+	GetConfigVariable(g, g->gAppName, "BackupServer", "", g->backupServer, sizeof(g->backupServer), desc);
+	GetConfigVariable(g, g->gAppName, "BackupPort", "", g->backupPort, sizeof(g->backupPort), NULL);
+
+	sprintf(desc, "Keep a logged in standby connection to the other server, fed the same stream, and switch to it when the connection fails (not for Ogg, FLAC or Opus)");
+	g->standbyEnabled = GetConfigVariableLong(g, g->gAppName, "StandbyEnable", 0, desc);
+
+	sprintf(desc, "How many encoders connect at the same time when all are started");
+	g->parallelConnects = GetConfigVariableLong(g, g->gAppName, "ParallelConnects", STARTUP_DEFAULT_PARALLEL, desc);
+
+	sprintf(desc, "Port of the local metrics endpoint (Prometheus text at /metrics), 0 for none");
+	g->metricsPort = GetConfigVariableLong(g, g->gAppName, "MetricsPort", 0, desc);
+	sprintf(desc, "Address the metrics endpoint listens on.  127.0.0.1 keeps it to this machine, 0.0.0.0 opens it to the network");
+	GetConfigVariable(g, g->gAppName, "MetricsAddress", METRICS_DEFAULT_ADDRESS, g->metricsAddress, sizeof(g->metricsAddress), desc);
+	sprintf(desc, "Record the pipeline trace from startup.  /trace/start and /trace/stop on the metrics port switch it, /trace dumps it");
+	g->traceEnable = GetConfigVariableLong(g, g->gAppName, "TraceEnable", 0, desc);
+
 	g->autoconnect = GetConfigVariableLong(g, g->gAppName, "AutoConnect", 0, NULL);
 
 
@@ -3132,6 +5004,18 @@ void config_read(mcaster1Globals *g) {
 
 	sprintf(desc, "Save Archives in WAV format");
 	g->gSaveAsWAV = GetConfigVariableLong(g, g->gAppName, "SaveAsWAV", 0, desc);
+	sprintf(desc, "Start a new archive file after this many minutes (0 = one file per connection)");
+	g->archiveRotateMinutes = GetConfigVariableLong(g, g->gAppName, "ArchiveRotateMinutes", 0, desc);
+	sprintf(desc, "Start a new archive file after this many MB (0 = no limit)");
+	g->archiveRotateMB = GetConfigVariableLong(g, g->gAppName, "ArchiveRotateMB", 0, desc);
+	sprintf(desc, "Disk space reserved ahead of the archive data, in MB (0 = none)");
+	g->archivePreallocMB = GetConfigVariableLong(g, g->gAppName, "ArchivePreallocMB", ARCHIVE_DEFAULT_PREALLOC_MB, desc);
+	sprintf(desc, "Archive queue between the encoder and the disk, in KB");
+	g->archiveQueueKB = GetConfigVariableLong(g, g->gAppName, "ArchiveQueueKB", ARCHIVE_DEFAULT_QUEUE_KB, desc);
+	sprintf(desc, "Rewrite the WAV archive header this often, in seconds, so a cut off file stays playable (0 = at close only)");
+	g->archiveCheckpointSeconds = GetConfigVariableLong(g, g->gAppName, "ArchiveCheckpointSeconds", ARCHIVE_DEFAULT_CHECKPOINT, desc);
+	sprintf(desc, "Write a time index next to MP3, AAC and Ogg archives so mcaster1_extract can cut ranges out (1 = yes)");
+	g->archiveIndexEnabled = GetConfigVariableLong(g, g->gAppName, "ArchiveIndexEnable", 1, desc);
 
 
 	sprintf(desc, "Append this string to all metadata");
@@ -3141,6 +5025,8 @@ void config_read(mcaster1Globals *g) {
 	GetConfigVariable(g, g->gAppName, "MetadataRemoveAfter", "", g->metadataRemoveStringAfter, sizeof(g->metadataRemoveStringAfter), desc);
 	sprintf(desc,"Remove this string (and everything before) from the window title of the window class the metadata is coming from");
 	GetConfigVariable(g, g->gAppName, "MetadataRemoveBefore", "", g->metadataRemoveStringBefore,  sizeof(g->metadataRemoveStringBefore), desc);
+	sprintf(desc, "Wait this long (ms) before sending a title update to the server, a newer title in the meantime replaces it");
+	g->metadataCoalesceMs = GetConfigVariableLong(g, g->gAppName, "MetadataCoalesceMs", METADATA_DEFAULT_COALESCE_MS, desc);
 	sprintf(desc, "Window classname to grab metadata from (uses window title)");
 	GetConfigVariable(g, g->gAppName, "MetadataWindowClass", "", g->metadataWindowClass, sizeof(g->metadataWindowClass), desc);
 	sprintf(desc, "Indicator which tells mcaster1dspencoder to grab metadata from a defined window class");
@@ -3281,6 +5167,11 @@ void config_read(mcaster1Globals *g) {
 	sprintf(desc, "Advanced setting");
 	GetConfigVariable(g, g->gAppName, "OutputControl", "", g->outputControl, sizeof(g->outputControl), desc);
 
+	sprintf(desc, "Upstream stream to relay instead of the sound card (http://host:port/mount, MP3 or AAC)");
+	GetConfigVariable(g, g->gAppName, "RelayURL", "", g->relayURL, sizeof(g->relayURL), desc);
+	sprintf(desc, "Relay jitter buffer in milliseconds, silence is sent while it refills");
+	g->relayBufferMs = GetConfigVariableLong(g, g->gAppName, "RelayBufferMs", 3000, desc);
+
 	sprintf(desc, "Windows Recording Device");
 	GetConfigVariable(g, g->gAppName, "WindowsRecDevice", "", buf, sizeof(buf), desc);
 	strcpy(g->WindowsRecDevice, buf);
@@ -3288,6 +5179,47 @@ void config_read(mcaster1Globals *g) {
 	sprintf(desc, "LAME Joint Stereo Flag");
 	g->LAMEJointStereoFlag = GetConfigVariableLong(g, g->gAppName, "LAMEJointStereo", 1, desc);
 
+	sprintf(desc, "Lower codec effort when encoding falls behind real time (0 = disabled)");
+	g->governorEnabled = GetConfigVariableLong(g, g->gAppName, "GovernorEnable", 1, desc);
+	sprintf(desc, "Total encode load (permille of real time) above which codec effort is lowered, main config only");
+	g->governorHighLoad = GetConfigVariableLong(g, g->gAppName, "GovernorHighLoad", GOVERNOR_DEFAULT_HIGH_LOAD, desc);
+	sprintf(desc, "Total encode load (permille of real time) below which codec effort is raised again, main config only");
+	g->governorLowLoad = GetConfigVariableLong(g, g->gAppName, "GovernorLowLoad", GOVERNOR_DEFAULT_LOW_LOAD, desc);
+	sprintf(desc, "Minimum milliseconds between two governor decisions, main config only");
+	g->governorHoldMs = GetConfigVariableLong(g, g->gAppName, "GovernorHoldMs", GOVERNOR_DEFAULT_HOLD_MS, desc);
+	sprintf(desc, "Shed priority under overload, lowest is disconnected first (0 = never shed)");
+	g->governorPriority = GetConfigVariableLong(g, g->gAppName, "GovernorPriority", 0, desc);
+
+	sprintf(desc, "Lower the bitrate while the link to the server cannot keep up, raise it again when it recovers (Opus and fdk-aac only)");
+	g->abrEnabled = GetConfigVariableLong(g, g->gAppName, "AdaptiveBitrate", 0, desc);
+	sprintf(desc, "Lowest bitrate (kbps) the adaptive bitrate goes down to, the configured bitrate is the highest");
+	g->abrMinBitrate = GetConfigVariableLong(g, g->gAppName, "AdaptiveBitrateMin", ABR_DEFAULT_MIN_KBPS, desc);
+
+	sprintf(desc, "Pace the stream out at the bitrate plus headroom instead of in the bursts the codec produces");
+	g->pacingEnabled = GetConfigVariableLong(g, g->gAppName, "PacingEnable", 0, desc);
+	sprintf(desc, "Percent above the nominal bitrate the pacing allows, room for VBR peaks and catching up");
+	g->pacingHeadroom = GetConfigVariableLong(g, g->gAppName, "PacingHeadroomPercent", PACE_DEFAULT_HEADROOM, desc);
+	sprintf(desc, "Largest burst (KB) the pacing lets out at once");
+	g->pacingBurstKB = GetConfigVariableLong(g, g->gAppName, "PacingBurstKB", PACE_DEFAULT_BURST_KB, desc);
+
+	sprintf(desc, "Seconds of audio kept to replay what the server missed while the connection was down (0 = no replay)");
+	g->replaySecs = GetConfigVariableLong(g, g->gAppName, "ReplayBufferSecs", 0, desc);
+	sprintf(desc, "Speed (percent of real time) the replay catches up with the live input at");
+	g->replaySpeed = GetConfigVariableLong(g, g->gAppName, "ReplaySpeedPercent", REPLAY_DEFAULT_SPEED, desc);
+	sprintf(desc, "Seconds of the replay sent ahead of real time on reconnect, keep within what the server bursts to a new listener");
+	g->replayBurstSecs = GetConfigVariableLong(g, g->gAppName, "ReplayBurstSecs", REPLAY_DEFAULT_BURST, desc);
+	replayReserve(g);
+
+	sprintf(desc, "Low latency profile for live talk and sports: short capture periods and frames, a page per packet, no Nagle, short send queue");
+	g->lowLatency = GetConfigVariableLong(g, g->gAppName, "LowLatency", 0, desc);
+	sprintf(desc, "Opus frame length (ms) on the low latency profile, 10 or 20");
+	g->lowLatencyFrameMs = GetConfigVariableLong(g, g->gAppName, "LowLatencyFrameMs", LOWLAT_DEFAULT_FRAME_MS, desc);
+	sprintf(desc, "Seconds between two log lines with the capture to wire latency percentiles (0 = none)");
+	g->stageReportSecs = GetConfigVariableLong(g, g->gAppName, "LatencyReportSecs", LATENCY_DEFAULT_REPORT_SECS, desc);
+
+	sprintf(desc, "Forward compressed input frames untouched when the input already matches this encoder (relay, transcoder)");
+	g->passthroughEnabled = GetConfigVariableLong(g, g->gAppName, "PassthroughEnable", 1, desc);
+
 }
 
 void config_write(mcaster1Globals *g) {
@@ -3321,6 +5253,14 @@ void config_write(mcaster1Globals *g) {
 	PutConfigVariable(g, g->gAppName, "ServerGenre", g->gServGenre);
 	PutConfigVariableLong(g, g->gAppName, "AutomaticReconnect", g->gAutoReconnect);
 	PutConfigVariableLong(g, g->gAppName, "AutomaticReconnectSecs", g->gReconnectSec);
+	PutConfigVariableLong(g, g->gAppName, "ReconnectMaxSecs", g->reconnectMaxSecs);
+	PutConfigVariable(g, g->gAppName, "BackupServer", g->backupServer);
+	PutConfigVariable(g, g->gAppName, "BackupPort", g->backupPort);
+	PutConfigVariableLong(g, g->gAppName, "StandbyEnable", g->standbyEnabled);
+	PutConfigVariableLong(g, g->gAppName, "ParallelConnects", g->parallelConnects);
+	PutConfigVariableLong(g, g->gAppName, "MetricsPort", g->metricsPort);
+	PutConfigVariable(g, g->gAppName, "MetricsAddress", g->metricsAddress);
+	PutConfigVariableLong(g, g->gAppName, "TraceEnable", g->traceEnable);
 	PutConfigVariableLong(g, g->gAppName, "AutoConnect", g->autoconnect);
 	PutConfigVariable(g, g->gAppName, "Encode", g->gEncodeType);
 
@@ -3368,6 +5308,12 @@ void config_write(mcaster1Globals *g) {
 	PutConfigVariableLong(g, g->gAppName, "SaveDirectoryFlag", g->gSaveDirectoryFlag);
 	PutConfigVariableLong(g, g->gAppName, "LogLevel", g->gLogLevel);
 	PutConfigVariableLong(g, g->gAppName, "SaveAsWAV", g->gSaveAsWAV);
+	PutConfigVariableLong(g, g->gAppName, "ArchiveRotateMinutes", g->archiveRotateMinutes);
+	PutConfigVariableLong(g, g->gAppName, "ArchiveRotateMB", g->archiveRotateMB);
+	PutConfigVariableLong(g, g->gAppName, "ArchivePreallocMB", g->archivePreallocMB);
+	PutConfigVariableLong(g, g->gAppName, "ArchiveQueueKB", g->archiveQueueKB);
+	PutConfigVariableLong(g, g->gAppName, "ArchiveCheckpointSeconds", g->archiveCheckpointSeconds);
+	PutConfigVariableLong(g, g->gAppName, "ArchiveIndexEnable", g->archiveIndexEnabled);
 	PutConfigVariable(g, g->gAppName, "LogFile", g->gLogFile);
 
 	PutConfigVariableLong(g, g->gAppName, "NumEncoders", g->gNumEncoders);
@@ -3379,15 +5325,38 @@ void config_write(mcaster1Globals *g) {
 
 	PutConfigVariable(g, g->gAppName, "OutputControl", g->outputControl);
 
+	PutConfigVariable(g, g->gAppName, "RelayURL", g->relayURL);
+	PutConfigVariableLong(g, g->gAppName, "RelayBufferMs", g->relayBufferMs);
+
 	PutConfigVariable(g, g->gAppName, "MetadataAppend", g->metadataAppendString);
 	PutConfigVariable(g, g->gAppName, "MetadataRemoveBefore", g->metadataRemoveStringBefore);
 	PutConfigVariable(g, g->gAppName, "MetadataRemoveAfter", g->metadataRemoveStringAfter);
 	PutConfigVariable(g, g->gAppName, "MetadataWindowClass", g->metadataWindowClass);
 	PutConfigVariableLong(g, g->gAppName, "MetadataWindowClassInd", g->metadataWindowClassInd);
+	PutConfigVariableLong(g, g->gAppName, "MetadataCoalesceMs", g->metadataCoalesceMs);
 
 	PutConfigVariable(g, g->gAppName, "WindowsRecDevice", g->WindowsRecDevice);
 	PutConfigVariableLong(g, g->gAppName, "LAMEJointStereo", g->LAMEJointStereoFlag);
 
+	PutConfigVariableLong(g, g->gAppName, "GovernorEnable", g->governorEnabled);
+	PutConfigVariableLong(g, g->gAppName, "GovernorHighLoad", g->governorHighLoad);
+	PutConfigVariableLong(g, g->gAppName, "GovernorLowLoad", g->governorLowLoad);
+	PutConfigVariableLong(g, g->gAppName, "GovernorHoldMs", g->governorHoldMs);
+	PutConfigVariableLong(g, g->gAppName, "GovernorPriority", g->governorPriority);
+	PutConfigVariableLong(g, g->gAppName, "AdaptiveBitrate", g->abrEnabled);
+	PutConfigVariableLong(g, g->gAppName, "AdaptiveBitrateMin", g->abrMinBitrate);
+	PutConfigVariableLong(g, g->gAppName, "PacingEnable", g->pacingEnabled);
+	PutConfigVariableLong(g, g->gAppName, "PacingHeadroomPercent", g->pacingHeadroom);
+	PutConfigVariableLong(g, g->gAppName, "PacingBurstKB", g->pacingBurstKB);
+	PutConfigVariableLong(g, g->gAppName, "ReplayBufferSecs", g->replaySecs);
+	PutConfigVariableLong(g, g->gAppName, "ReplaySpeedPercent", g->replaySpeed);
+	PutConfigVariableLong(g, g->gAppName, "ReplayBurstSecs", g->replayBurstSecs);
+	PutConfigVariableLong(g, g->gAppName, "LowLatency", g->lowLatency);
+	PutConfigVariableLong(g, g->gAppName, "LowLatencyFrameMs", g->lowLatencyFrameMs);
+	PutConfigVariableLong(g, g->gAppName, "LatencyReportSecs", g->stageReportSecs);
+
+	PutConfigVariableLong(g, g->gAppName, "PassthroughEnable", g->passthroughEnabled);
+
 }
 
 /*
@@ -3397,8 +5366,6 @@ void config_write(mcaster1Globals *g) {
  */
 int handle_output(mcaster1Globals *g, float *samples, int nsamples, int nchannels, int in_samplerate) {
 	int			ret = 1;
-	static int	current_insamplerate = 0;
-	static int	current_nchannels = 0;
 	long		out_samplerate = 0;
 	long		out_nch = 0;
 	int			samplecount = 0;
@@ -3408,54 +5375,36 @@ int handle_output(mcaster1Globals *g, float *samples, int nsamples, int nchannel
 	nchannels = 2;
 
 	float	*samples_resampled = NULL;
-	short	*samples_resampled_int = NULL;
 	float	*samples_rechannel = NULL;
 
 	if(g == NULL) {
 		return 1;
 	}
 
-	if(g->weareconnected) {
+	/* the input's own frames are going out */
+	if(g->passthroughActive) {
+		return 1;
+	}
+
+	/* while the connection is down the block still goes to the replay ring */
+	if(g->weareconnected || (g->replayState == REPLAY_HELD)) {
+		beginBlock(g);
 	//	LogMessage(g,LOG_DEBUG, "%d Calling handle output", g->encoderNumber);
 		out_samplerate = getCurrentSamplerate(g);
 		out_nch = getCurrentChannels(g);
-		if (g->gSaveFile) {
-			if(g->gSaveAsWAV) {
-				int			sizeofData = nsamples * nchannels * sizeof(short int);
-				short int	*int_samples;
-
-				int_samples = (short int *) malloc(sizeofData);
-
-				for(int i = 0; i < nsamples * nchannels; i = i + 1) {
-					int_samples[i] = (short int) (samples[i] * 32767.f);
-				}
-
-				fwrite(int_samples, sizeofData, 1, g->gSaveFile);
-				g->written += sizeofData;
-				free(int_samples);
-
-				/*
-				 * int sizeofData = nsamples*nchannels*sizeof(float);
-				 * fwrite(samples, sizeofData, 1, g->gSaveFile);
-				 * g->written += sizeofData;
-				 * ;
-				 * Write to WAV file
-				 */
-			}
-		}
-		if(current_insamplerate != in_samplerate) {
+		/* Per slot, slots can be fed from different sources at different rates */
+		if(g->resampleInRate != in_samplerate) {
 			resetResampler(g);
-			current_insamplerate = in_samplerate;
+			g->resampleInRate = in_samplerate;
 		}
 
-		if(current_nchannels != nchannels) {
-			resetResampler(g);
-			current_nchannels = nchannels;
+		/* every branch below writes all of it */
+		samples_rechannel = reserveStereoFloats(&(g->pcm.floatStereo), &(g->pcm.floatStereoCapacity), nsamples);
+		if(!samples_rechannel) {
+			LogMessage(g,LOG_ERROR, "Cannot allocate %d sample rechannel buffer", nsamples);
+			return 1;
 		}
 
-		samples_rechannel = (float *) malloc(sizeof(float) * nsamples * nchannels);
-		memset(samples_rechannel, '\000', sizeof(float) * nsamples * nchannels);
-
 		samplePtr = samples;
 
 		int make_mono = 0;
@@ -3497,8 +5446,14 @@ int handle_output(mcaster1Globals *g, float *samples, int nsamples, int nchannel
 			}
 		}
 
+		/* folded to stereo like the 16 bit path, so the header says what the data is */
+		if(g->archive && g->gSaveAsWAV) {
+			archivePCM(g->archive, samples_rechannel, nsamples, nchannels, in_samplerate);
+		}
+
 		LogMessage(g,LOG_DEBUG, "In samplerate = %d, Out = %d", in_samplerate, out_samplerate);
 		samplePtr = samples_rechannel;
+		metricsCount(g, (in_samplerate != out_samplerate) ? METRIC_INPUT_RESAMPLED : METRIC_INPUT_FLOAT, 1);
 		if(in_samplerate != out_samplerate) {
 			nchannels = 2;
 
@@ -3509,18 +5464,20 @@ int handle_output(mcaster1Globals *g, float *samples, int nsamples, int nchannel
 
 			initializeResampler(g, in_samplerate, nchannels);
 
-			samples_resampled = (float *) malloc(sizeof(float) * buf_samples * nchannels);
-			memset(samples_resampled, '\000', sizeof(float) * buf_samples * nchannels);
+			samples_resampled = reserveStereoFloats(&(g->pcm.resampled), &(g->pcm.resampledCapacity), buf_samples);
+			if(!samples_resampled) {
+				LogMessage(g,LOG_ERROR, "Cannot allocate %d sample resampler buffer", buf_samples);
+				return 1;
+			}
 
 			LogMessage(g,LOG_DEBUG, "calling ocConvertAudio");
+			TRACE_BEGIN("resample", g->encoderNumber);
 			long	out_samples = ocConvertAudio(g,
 												 (float *) samplePtr,
 												 (float *) samples_resampled,
 												 nsamples,
 												 buf_samples);
-
-			samples_resampled_int = (short *) malloc(sizeof(short) * out_samples * nchannels);
-			memset(samples_resampled_int, '\000', sizeof(short) * out_samples * nchannels);
+			TRACE_END("resample", g->encoderNumber);
 
 			LogMessage(g,LOG_DEBUG, "ready to do encoding");
 
@@ -3532,16 +5489,6 @@ int handle_output(mcaster1Globals *g, float *samples, int nsamples, int nchannel
 				ret = do_encoding(g, (float *) (samples_resampled), out_samples, out_nch);
 				LogMessage(g,LOG_DEBUG, "do_encoding end (%d)", ret);
 			}
-
-			if(samples_resampled_int) {
-				free(samples_resampled_int);
-				samples_resampled_int = NULL;
-			}
-
-			if(samples_resampled) {
-				free(samples_resampled);
-				samples_resampled = NULL;
-			}
 		}
 		else {
 			LogMessage(g,LOG_DEBUG, "do_encoding start");
@@ -3549,45 +5496,104 @@ int handle_output(mcaster1Globals *g, float *samples, int nsamples, int nchannel
 			LogMessage(g,LOG_DEBUG, "do_encoding end (%d)", ret);
 		}
 
-		if(samples_rechannel) {
-			free(samples_rechannel);
-			samples_rechannel = NULL;
-		}
 		LogMessage(g,LOG_DEBUG, "%d Calling handle output - Ret = %d", g->encoderNumber, ret);
 	}
 
 	return ret;
 }
 
-#ifdef WIN32
-void freeupGlobals(mcaster1Globals *g) {
-	if(g->lameGF) {
-		lame_close(g->lameGF);
-		g->lameGF = NULL;
+/*
+ =======================================================================================================================
+    Entry point for hosts that deliver 16 bit PCM (Winamp, RadioDJ).  When the
+    slot needs no resampling and its codec takes 16 bit input the samples go
+    straight to the codec, otherwise they are widened and take the float path.
+ =======================================================================================================================
+ */
+int handle_output_int16(mcaster1Globals *g, short *samples, int nsamples, int nchannels, int in_samplerate) {
+	int		ret = 1;
+
+	if(g == NULL) {
+		return 1;
 	}
 
-	if(g->fdkAacEncoder) {
-		aacEncClose(&g->fdkAacEncoder);
-		g->fdkAacEncoder = NULL;
+	if((!g->weareconnected && (g->replayState != REPLAY_HELD)) || g->passthroughActive) {
+		return 1;
 	}
 
-	if(g->opusEncoder) {
-		ope_encoder_destroy(g->opusEncoder);
-		g->opusEncoder = NULL;
+	int	int16Codec = g->codec &&
+		((g->codec->inputLayout == PCM_INT16_INTERLEAVED) || (g->codec->inputLayout == PCM_INT16_PLANAR));
+
+	if(!int16Codec || (in_samplerate != getCurrentSamplerate(g)) || (nchannels < 1) || (nchannels > 2)) {
+		float	*float_samples = (float *) malloc(sizeof(float) * nsamples * nchannels);
+
+		if(float_samples) {
+			for(int i = 0; i < nsamples * nchannels; i++) {
+				float_samples[i] = samples[i] / 32767.f;
+			}
+
+			ret = handle_output(g, float_samples, nsamples, nchannels, in_samplerate);
+			free(float_samples);
+		}
+
+		return ret;
 	}
 
-	if(g->opusComments) {
-		ope_comments_destroy(g->opusComments);
-		g->opusComments = NULL;
+	if(!reservePCMBlock(&(g->pcm), nsamples)) {
+		return 1;
+	}
+
+	/* Same channel folding as handle_output, into stereo interleaved */
+	short	*stereo = samples;
+
+	if((nchannels == 1) || (getCurrentChannels(g) == 1)) {
+		stereo = g->pcm.int16Stereo;
+		for(int i = 0; i < nsamples; i++) {
+			short	sample = (nchannels == 1) ? samples[i] : (short) ((samples[2 * i] + samples[2 * i + 1]) / 2);
+
+			stereo[2 * i] = sample;
+			stereo[2 * i + 1] = sample;
+		}
+	}
+
+	if(g->archive && g->gSaveAsWAV) {
+		archivePCM16(g->archive, stereo, nsamples, 2, in_samplerate);
 	}
+
+	beginBlock(g);
+	metricsCount(g, METRIC_INPUT_INT16, 1);
+	ret = do_encoding_int16(g, stereo, nsamples, 2);
+	return ret;
+}
+
+/* Detaches the slot from every shared thread and frees what it owns; call before free(g) */
+void freeupGlobals(mcaster1Globals *g) {
+	governorUnregister(g);
+	metricsUnregister(g);
+	reconnectUnregister(g);
+	dropMetadataUpdates(g);
+	releaseEncoders(g);
+	freePCMBlock(&(g->pcm));
+	free(g->replayRing);
+	g->replayRing = NULL;
+	g->replayCapacity = 0;
+
+	/* the log thread may still have lines for this slot */
+	logFlush();
 }
-#endif
 
 void addUISettings(mcaster1Globals *g) {
 
 
 	addConfigVariable(g, "AutomaticReconnect");
 	addConfigVariable(g, "AutomaticReconnectSecs");
+	addConfigVariable(g, "ReconnectMaxSecs");
+	addConfigVariable(g, "BackupServer");
+	addConfigVariable(g, "BackupPort");
+	addConfigVariable(g, "StandbyEnable");
+	addConfigVariable(g, "ParallelConnects");
+	addConfigVariable(g, "MetricsPort");
+	addConfigVariable(g, "MetricsAddress");
+	addConfigVariable(g, "TraceEnable");
 	addConfigVariable(g, "AutoConnect");
 	addConfigVariable(g, "AdvRecDevice");
 	addConfigVariable(g, "LiveInSamplerate");
@@ -3603,6 +5609,12 @@ void addUISettings(mcaster1Globals *g) {
 	addConfigVariable(g, "SaveDirectoryFlag");
 	addConfigVariable(g, "LogLevel");
 	addConfigVariable(g, "SaveAsWAV");
+	addConfigVariable(g, "ArchiveRotateMinutes");
+	addConfigVariable(g, "ArchiveRotateMB");
+	addConfigVariable(g, "ArchivePreallocMB");
+	addConfigVariable(g, "ArchiveQueueKB");
+	addConfigVariable(g, "ArchiveCheckpointSeconds");
+	addConfigVariable(g, "ArchiveIndexEnable");
 	addConfigVariable(g, "LogFile");
 	addConfigVariable(g, "NumEncoders");
 	addConfigVariable(g, "ExternalMetadata");
@@ -3615,7 +5627,10 @@ void addUISettings(mcaster1Globals *g) {
 	addConfigVariable(g, "MetadataRemoveAfter");
 	addConfigVariable(g, "MetadataWindowClass");
 	addConfigVariable(g, "MetadataWindowClassInd");
+	addConfigVariable(g, "MetadataCoalesceMs");
 	addConfigVariable(g, "WindowsRecDevice");
+	addConfigVariable(g, "RelayURL");
+	addConfigVariable(g, "RelayBufferMs");
 
 }
 
@@ -3635,6 +5650,10 @@ void addBasicEncoderSettings(mcaster1Globals *g) {
     addConfigVariable(g, "ServerGenre");
 //    addConfigVariable(g, "AutomaticReconnect");
     addConfigVariable(g, "AutomaticReconnectSecs");
+    addConfigVariable(g, "ReconnectMaxSecs");
+    addConfigVariable(g, "BackupServer");
+    addConfigVariable(g, "BackupPort");
+    addConfigVariable(g, "StandbyEnable");
     addConfigVariable(g, "AutoConnect");
     addConfigVariable(g, "Encode");
     addConfigVariable(g, "BitrateNominal");
@@ -3662,89 +5681,58 @@ void addBasicEncoderSettings(mcaster1Globals *g) {
 	addConfigVariable(g, "SaveDirectory");
 	addConfigVariable(g, "SaveDirectoryFlag");
 	addConfigVariable(g, "SaveAsWAV");
-}
-
-void LogMessage(mcaster1Globals *g, int type, char *source, int line, char *fmt, ...) {
-	va_list parms;
-	char	errortype[25] = "";
-	int	addNewline = 1;
-	struct tm *tp;
-	time_t t;
-	int parseableOutput = 0;
-	char    timeStamp[255];
-
-	char	sourceLine[1024] = "";
-
-	char *p1 = NULL;
-
+	addConfigVariable(g, "ArchiveRotateMinutes");
+	addConfigVariable(g, "ArchiveRotateMB");
+	addConfigVariable(g, "ArchivePreallocMB");
+	addConfigVariable(g, "ArchiveQueueKB");
+	addConfigVariable(g, "ArchiveCheckpointSeconds");
+	addConfigVariable(g, "ArchiveIndexEnable");
+	addConfigVariable(g, "GovernorEnable");
+	addConfigVariable(g, "GovernorHighLoad");
+	addConfigVariable(g, "GovernorLowLoad");
+	addConfigVariable(g, "GovernorHoldMs");
+	addConfigVariable(g, "GovernorPriority");
+	addConfigVariable(g, "AdaptiveBitrate");
+	addConfigVariable(g, "AdaptiveBitrateMin");
+	addConfigVariable(g, "PacingEnable");
+	addConfigVariable(g, "PacingHeadroomPercent");
+	addConfigVariable(g, "PacingBurstKB");
+	addConfigVariable(g, "ReplayBufferSecs");
+	addConfigVariable(g, "ReplaySpeedPercent");
+	addConfigVariable(g, "ReplayBurstSecs");
+	addConfigVariable(g, "LowLatency");
+	addConfigVariable(g, "LowLatencyFrameMs");
+	addConfigVariable(g, "LatencyReportSecs");
+	addConfigVariable(g, "PassthroughEnable");
+}
+
+/* Monotonic clock for latency measurements - not wall-clock time */
+long long getMonotonicMicros(void) {
 #ifdef WIN32
-	p1 = strrchr(source, '\\');
-#else
-	p1 = strrchr(source, '/');
-#endif
-
-	if (p1) {
-		strcpy(sourceLine, p1+1);
-	}
-	else {
-		strcpy(sourceLine, source);
-	}
-	memset(timeStamp, '\000', sizeof(timeStamp));
-
-	time(&t);
-	tp = localtime(&t);
-	strftime(timeStamp, sizeof(timeStamp), "%m/%d/%y %H:%M:%S", tp);
-
-	
-	switch (type) {
-		case LM_ERROR:
-			strcpy(errortype, "Error");
-			break;
-		case LM_INFO:
-			strcpy(errortype, "Info");
-			break;
-		case LM_DEBUG:
-			strcpy(errortype, "Debug");
-			break;
-		default:
-			strcpy(errortype, "Unknown");
-			break;
-	}
+	static LARGE_INTEGER	frequency;
+	LARGE_INTEGER			counter;
 
-	if (fmt[strlen(fmt)-1] == '\n') {
-		addNewline = 0;
+	if(frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
 	}
+	QueryPerformanceCounter(&counter);
+	return (long long) (counter.QuadPart / frequency.QuadPart) * 1000000 +
+		(long long) (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
 
-	if (type <= g->gLogLevel) {
-		va_start(parms, fmt);
-		char_t	logfile[1024] = "";
-
-		if (g->logFilep == 0) {
-			sprintf(logfile, "%s.log", g->gLogFile);
-			g->logFilep = fopen(logfile, "a");
-		}
-		
-		if (!g->logFilep) {
-			fprintf(stdout, "Cannot open logfile: %s(%s:%d): ", logfile, sourceLine, line);
-			vfprintf(stdout, fmt, parms);
-			va_end(parms);
-			if (addNewline) {
-				fprintf(stdout, "\n");
-			}
-		}
-		else {
-			fprintf(g->logFilep,  "%s %s(%s:%d): ", timeStamp, errortype, sourceLine, line);
-			vfprintf(g->logFilep, fmt, parms);
-			va_end(parms);
-			if (addNewline) {
-				fprintf(g->logFilep, "\n");
-			}
-			fflush(g->logFilep);
-		}
-
-	}
+/* Behind the LogMessage macro, which has checked the level already */
+void logMessageAt(mcaster1Globals *g, int type, const char *source, int line, const char *fmt, ...) {
+	va_list parms;
 
+	va_start(parms, fmt);
+	logEnqueue(g, type, source, line, fmt, parms);
+	va_end(parms);
 }
 
 
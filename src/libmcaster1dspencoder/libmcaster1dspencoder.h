@@ -2,8 +2,10 @@
 #define __DSP_MCASTER1_H
 
 #include <pthread.h>
+#include <atomic>
 
 #include "cbuffer.h"
+#include "latency_histogram.h"
 
 #include "libmcaster1dspencoder_socket.h"
 #ifdef HAVE_VORBIS
@@ -76,6 +78,20 @@ typedef unsigned int (*GETAUDIOTYPES3TYPE)(int, char_t *);
 #define LOG_DEBUG LM_DEBUG, __FILE__, __LINE__
 #endif
 
+/*
+ * LogMessage(g, LOG_xxx, fmt, ...) compares the level before anything else
+ * is evaluated, at the call site.  Levels above LOG_COMPILED_LEVEL are not
+ * compiled in at all (build with LOG_COMPILED_LEVEL=LM_INFO to drop the
+ * debug calls).  What passes goes to the log thread, see async_log.h.
+ */
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LM_DEBUG
+#endif
+#define LOG_EXPAND(x) x
+#define LOG_AT(g, type, source, line, ...) \
+	do { if(((type) <= LOG_COMPILED_LEVEL) && ((type) <= (g)->gLogLevel)) logMessageAt((g), (type), (source), (line), __VA_ARGS__); } while(0)
+#define LogMessage(g, ...) LOG_EXPAND(LOG_AT(g, __VA_ARGS__))
+
 
 #ifdef HAVE_FLAC
 #include <FLAC/stream_encoder.h>
@@ -106,6 +122,109 @@ extern "C" {
 #define FRONT_END_MCASTER1_PLUGIN 1
 #define FRONT_END_TRANSCODER 2
 
+#define GOVERNOR_EFFORT_LEVELS 4
+#define GOVERNOR_MAX_SLOTS 64
+#define GOVERNOR_DEFAULT_HIGH_LOAD 850
+#define GOVERNOR_DEFAULT_LOW_LOAD 500
+#define GOVERNOR_DEFAULT_HOLD_MS 5000
+
+/* Adaptive bitrate, backlog is the audio written but not yet out on the link */
+#define ABR_CHECK_MS			500
+#define ABR_HIGH_BACKLOG_MS		1500	// step down above
+#define ABR_LOW_BACKLOG_MS		250		// step up after ABR_RECOVER_MS below
+#define ABR_DOWN_HOLD_MS		2000	// between two steps down, the backlog needs time to drain
+#define ABR_RECOVER_MS			10000
+#define ABR_DEFAULT_MIN_KBPS	32
+#define PACE_DEFAULT_HEADROOM	50		// percent over the nominal bitrate
+#define PACE_DEFAULT_BURST_KB	32
+
+/* Reconnect replay */
+#define REPLAY_IDLE				0
+#define REPLAY_HELD				1		// disconnected, the ring keeps what the server missed
+#define REPLAY_RUNNING			2		// connected again, encoding from the ring
+#define REPLAY_DEFAULT_SPEED	150		// percent of real time while catching up
+#define REPLAY_DEFAULT_BURST	2		// seconds let out ahead of real time on reconnect
+#define REPLAY_BURST_BLOCKS		4		// most burst per host block, in host blocks
+#define REPLAY_CHUNK_FRAMES		4096
+
+/* Low latency profile */
+#define LOWLAT_CAPTURE_FRAMES	240		// 5 ms at 48 kHz
+#define LOWLAT_QUEUE_MS			250		// send queue bound, audio at the bitrate
+#define LOWLAT_DEFAULT_FRAME_MS	20		// Opus, 10 or 20
+#define LATENCY_REPORT_MS		30000
+
+/* Capture to wire, the stages a block's latency is split into */
+#define LATENCY_STAGE_QUEUE_WAIT	0	// capture to the codec: host, metering, resampling
+#define LATENCY_STAGE_ENCODE		1
+#define LATENCY_STAGE_SEND			2	// netSend, queue waits included
+#define LATENCY_STAGE_WIRE			3	// capture to send() of the block's last byte
+#define LATENCY_STAGES				4
+#define LATENCY_DEFAULT_REPORT_SECS	60
+
+/*
+ * Sample layouts a codec can ask do_encoding for.  Float is -1.0..1.0,
+ * the integer layouts carry 16 bit values.
+ */
+#define PCM_FLOAT_INTERLEAVED	0
+#define PCM_FLOAT_PLANAR		1
+#define PCM_INT16_INTERLEAVED	2
+#define PCM_INT16_PLANAR		3
+#define PCM_INT32_INTERLEAVED	4
+
+/*
+ * Compressed frames an input hands over for passthrough.  samplerate and
+ * channels are what the frame header says, for HE-AAC in ADTS that is the
+ * core (half) rate.
+ */
+#define FRAME_CODEC_MP3		1
+#define FRAME_CODEC_ADTS	2
+
+#define PASSTHROUGH_CONFIRM_FRAMES	8	// matching frames in a row before a live input is forwarded
+
+typedef struct tagCompressedFrame {
+	int		codec;				// FRAME_CODEC_xxx
+	const unsigned char	*data;	// whole frame, header included
+	int		length;
+	int		samplerate;
+	int		channels;
+	int		bitrate;			// kbps, 0 = unknown or varies frame to frame
+	int		samples;			// per channel
+	int		selfContained;		// decodes without earlier frames (MP3 main_data_begin == 0)
+} CompressedFrame;
+
+/* Per slot background archive writer, see archive_writer.h */
+typedef struct tagArchiveWriter ArchiveWriter;
+
+/* Source connection run by the network reactor, see net_reactor.h */
+typedef struct tagNetConnection NetConnection;
+
+/* Per slot counters of the metrics endpoint, see metrics_server.h */
+typedef struct tagSlotMetrics SlotMetrics;
+
+/* A slot as the quality governor sees it */
+typedef struct tagGovernedSlot GovernedSlot;
+
+typedef struct tagPCMBlock {
+	int		frames;				// samples per channel in this block
+	int		channels;			// channels the codec was opened with
+	int		built;				// (1 << PCM_xxx) for layouts already built
+	float	*floatSource;		// host block, stereo interleaved (not owned)
+	short	*int16Source;		// host block, stereo interleaved (not owned)
+	int		capacity;			// frames the buffers below can hold
+	float	*floatInterleaved;
+	float	*floatPlanar[2];
+	short	*int16Interleaved;
+	short	*int16Planar[2];
+	int		*int32Interleaved;
+	short	*int16Stereo;		// rechannel scratch for handle_output_int16
+	float	*floatStereo;		// rechannel scratch for handle_output
+	int		floatStereoCapacity;
+	float	*resampled;			// handle_output's resampler output
+	int		resampledCapacity;
+} PCMBlock;
+
+struct tagEncoderCodec;
+
 typedef struct tagLAMEOptions {
 	int		cbrflag;
 	int		out_samplerate;
@@ -158,26 +277,6 @@ typedef struct {
 	short *	waveformData;
 } DataChunk;
 
-struct wavhead
-{
-	unsigned int  main_chunk;
-	unsigned int  length;
-	unsigned int  chunk_type;
-	unsigned int  sub_chunk;
-	unsigned int  sc_len;
-	unsigned short  format;
-	unsigned short  modus;
-	unsigned int  sample_fq;
-	unsigned int  byte_p_sec;
-	unsigned short  byte_p_spl;
-	unsigned short  bit_p_spl;
-	unsigned int  data_chunk;
-	unsigned int  data_length;
-};
-
-
-static struct wavhead   wav_header;
-
 // Global variables....gotta love em...
 typedef struct {
 	long		currentSamplerate;
@@ -186,6 +285,7 @@ typedef struct {
 	int		currentBitrateMax;
 	int		currentChannels;
 	int		gSCSocket;
+	NetConnection	*connection;	// owns gSCSocket while connected
 	int		gSCSocket2;
 	int		gSCSocketControl;
 	CMySocket	dataChannel;
@@ -242,6 +342,11 @@ typedef struct {
 	OggOpusEnc *opusEncoder;
 	OggOpusComments *opusComments;
 	int opusComplexity;    // 0-10, default 10
+	std::atomic<int> opusChainPending; // title changed, chain at next write (set after opusChainRequested)
+	long long opusChainRequested; // getMonotonicMicros() of the title change
+	long opusChainCount;         // logical streams chained since init
+	long opusChainLastMs;        // title change -> chain latency, last chain
+	int opusAwaitBOS;            // drop pages until the next stream starts
 
 	// New format flags
 	int gOpusFlag;
@@ -273,7 +378,7 @@ typedef struct {
 	FILE		*logFilep;
 	int		gSaveDirectoryFlag;
 	int		gSaveAsWAV;
-	FILE		*gSaveFile;
+	ArchiveWriter	*archive;		// running while the slot is connected with SaveDirectoryFlag
 	LAMEOptions	gLAMEOptions;
 	int		gLAMEHighpassFlag;
 	int		gLAMELowpassFlag;
@@ -393,19 +498,165 @@ typedef struct {
 
 		int		LAMEJointStereoFlag;
 		CBUFFER	circularBuffer;
+
+		const struct tagEncoderCodec	*codec;	// active entry of the codec table
+		PCMBlock	pcm;					// per-block layout scratch
+		int		connectionLost;				// disconnect caused by a send error
+
+		// Warm reconnect - codec instances survive a dropped connection
+		char_t	warmEncoderKey[512];	// settings the live codecs were built with
+		int		warmEncoderReuse;		// last initializeencoder reset instead of rebuilt
+		long long	connectStarted;		// getMonotonicMicros() at connectToServer
+		long long	connectReady;		// handshake done, before codec init
+		long long	codecReady;			// codec init done
+		int		awaitingFirstByte;
+		long	lastTimeToFirstByteMs;
+
+		// Quality governor - codec effort follows the CPU cost of encoding
+		int		governorEnabled;
+		long	governorHighLoad;		// permille of real time, step effort down above (main config)
+		long	governorLowLoad;		// step back up (or readmit) below (main config)
+		long	governorHoldMs;			// minimum time between two decisions (main config)
+		int		governorPriority;		// 0 = never shed, lowest is shed first
+		GovernedSlot	*governorEntry;	// NULL = left out, the table was full
+		int		governorRegistered;
+		int		encoderEffort;			// 0 = configured quality .. GOVERNOR_EFFORT_LEVELS-1
+		int		encoderEffortTarget;	// set by the governor, applied by the encoder thread
+		long	encodeLoad;				// smoothed encode cost, permille of real time
+		long long	blockSendMicros;	// time spent in send() during the current block
+		long	deadlineMisses;			// blocks that took longer to encode than to play
+		long	effortChanges;
+		int		governorShed;			// disconnected to free CPU for other slots
+		int		governorShedRequest;
+
+		// Adaptive bitrate - the codec bitrate follows the send backlog
+		int		abrEnabled;
+		int		abrMinBitrate;			// kbps floor, the configured bitrate is the ceiling
+		int		abrBitrate;				// kbps the codec runs at now
+		long	abrBacklogMs;			// last sample
+		long long	abrLastCheck;
+		long long	abrLastChange;
+		long long	abrCalmSince;		// backlog low since, 0 = not low
+		long	abrChanges;
+
+		// Send pacing - a token bucket smooths the codec's bursts on the way out
+		int		pacingEnabled;
+		int		pacingHeadroom;
+		int		pacingBurstKB;
+
+		// Reconnect replay - recent PCM, encoded again after a reconnect
+		int		replaySecs;				// ring length, 0 = no replay
+		int		replaySpeed;
+		int		replayBurstSecs;
+		float	*replayRing;			// stereo interleaved at the encoder rate
+		long	replayCapacity;			// frames
+		long long	replayWritten;		// frames ever captured
+		long long	replayRead;			// next frame to encode while replaying
+		int		replayState;
+		long	replayBurstFrames;		// still to let out ahead of real time
+		long long	replayFrames;		// this replay, frames encoded
+		long long	replayBytes;		// this replay, bytes sent
+		long long	replayLostFrames;	// fell out of the ring before they could be replayed
+		long long	replayedMsTotal;
+		long long	replayedBytesTotal;
+
+		// Low latency profile - small frames, a page per packet, no Nagle, short queues
+		int		lowLatency;
+		int		lowLatencyFrameMs;
+		long	captureLatencyMs;		// from the host, what the sound card path adds
+		long long	latencyEncodeMicros;	// smoothed wall time of a block, send included
+		long long	latencyLastReport;
+		long	latencyTheoreticalMs;
+		long	latencyMeasuredMs;
+
+		// Capture to wire - each block carries its capture time through the stages
+		long long	pendingCaptureMicros;	// stamped by the host for the next block
+		long long	blockCaptureMicros;		// the block being encoded
+		LatencyHistogram	stageLatency[LATENCY_STAGES];
+		int		stageReportSecs;
+		long long	stageLastReport;
+
+		FILE	*outputFile;			// transcoder front end writes here instead of a socket
+		int		resampleInRate;			// input rate the resampler was set up for
+
+		// Relay input (main slot) - upstream mount pulled in place of the sound card
+		char_t	relayURL[1024];			// empty = sound card
+		int		relayBufferMs;			// jitter buffer in front of the encoders
+
+		// Passthrough - compressed input frames that already match the slot are sent as they are
+		int		passthroughEnabled;
+		int		passthroughConfirmFrames;	// matching frames before switching
+		int		passthroughMatched;			// matching frames in a row
+		int		passthroughActive;			// frames go out untouched, PCM is ignored
+		long	passthroughFrames;			// frames forwarded since connect
+
+		// Archive writer settings, read by startArchiveWriter
+		int		archiveRotateMinutes;		// 0 = one file per connection
+		int		archiveRotateMB;			// 0 = no size limit
+		int		archivePreallocMB;			// disk reserved ahead of the data, 0 = none
+		int		archiveQueueKB;				// ring between the encoder and the writer thread
+		int		archiveCheckpointSeconds;	// WAV header rewritten this often, 0 = at close only
+		int		archiveIndexEnabled;		// <archive>.idx next to MP3, AAC and Ogg archives
+
+		int		metadataCoalesceMs;			// title updates wait this long, the last one in the window is sent
+
+		// Reconnect scheduler, see reconnect_scheduler.h
+		int		reconnectMaxSecs;			// backoff cap, gReconnectSec is the first delay
+		int		reconnectAttempts;			// failed in a row
+		long long	reconnectDue;			// monotonic micros, 0 = not scheduled
+		int		reconnectToBackup;			// the next connectToServer goes to the backup server
+		int		reconnectRunning;			// a pool thread has the slot
+		char_t	backupServer[256];			// empty = no failover
+		char_t	backupPort[10];				// empty = Port
+		int		standbyEnabled;				// keep a logged in connection to the other server
+		NetConnection	*standby;			// fed the same bytes, swapped in when connection fails
+		int		onBackup;					// connection goes to backupServer
+		int		standbyAttempts;
+		long long	standbyDue;
+		long	failovers;
+		int		parallelConnects;			// slots connecting at once at startup
+
+		// Metrics endpoint, see metrics_server.h
+		int		metricsPort;				// 0 = no endpoint
+		char_t	metricsAddress[64];
+		SlotMetrics	*metrics;				// this slot's counters, NULL until the first count
+		int		metricsRegistered;
+		int		traceEnable;				// record the pipeline trace from startup, see pipeline_trace.h
 } mcaster1Globals;
 
+/*
+ * One output format.  inputLayout is the PCM_xxx layout encode wants,
+ * flush/reset/close/setEffort/finish may be NULL.  encode returns < 0 on a socket error.
+ */
+typedef struct tagEncoderCodec {
+	const char_t	*name;
+	const char_t	*extension;			// file extension for transcoder output
+	int		inputLayout;
+	int		(*active)(mcaster1Globals *g);		// selected by the current config?
+	int		(*init)(mcaster1Globals *g);
+	int		(*encode)(mcaster1Globals *g, PCMBlock *block);
+	int		(*flush)(mcaster1Globals *g);		// send buffered tail on a clean stop
+	int		(*reset)(mcaster1Globals *g);		// reuse across reconnect, 0 = rebuild
+	void	(*close)(mcaster1Globals *g);
+	int		(*setEffort)(mcaster1Globals *g);	// apply g->encoderEffort to the live instance
+	int		(*finish)(mcaster1Globals *g);		// end the stream for good, output is a file
+	int		(*setBitrate)(mcaster1Globals *g);	// apply g->abrBitrate to the live instance
+} EncoderCodec;
+
 
 void addConfigVariable(mcaster1Globals *g, char_t *variable);
 int initializeencoder(mcaster1Globals *g);
 void getCurrentSongTitle(mcaster1Globals *g, char_t *song, char_t *artist, char_t *full);
 void initializeGlobals(mcaster1Globals *g);
+void freeupGlobals(mcaster1Globals *g);
 void ReplaceString(char_t *source, char_t *dest, char_t *from, char_t *to);
 void config_read(mcaster1Globals *g);
 void config_write(mcaster1Globals *g);
 int connectToServer(mcaster1Globals *g);
+int openSourceConnection(mcaster1Globals *g, NetConnection *conn, const char_t *server, const char_t *port);
 int disconnectFromServer(mcaster1Globals *g);
-int do_encoding(mcaster1Globals *g, short int *samples, int numsamples, int nch);
+int do_encoding(mcaster1Globals *g, float *samples, int numsamples, int nch);
+int do_encoding_int16(mcaster1Globals *g, short *samples, int numsamples, int nch);
 void URLize(char_t *input, char_t *output, int inputlen, int outputlen);
 int updateSongTitle(mcaster1Globals *g, int forceURL);
 int setCurrentSongTitleURL(mcaster1Globals *g, char_t *song);
@@ -428,6 +679,7 @@ int     getCurrentChannels(mcaster1Globals *g);
 int  ocConvertAudio(mcaster1Globals *g,float *in_samples, float *out_samples, int num_in_samples, int num_out_samples);
 int initializeResampler(mcaster1Globals *g,long inSampleRate, long inNCH);
 int handle_output(mcaster1Globals *g, float *samples, int nsamples, int nchannels, int in_samplerate);
+int handle_output_int16(mcaster1Globals *g, short *samples, int nsamples, int nchannels, int in_samplerate);
 void setServerStatusCallback(mcaster1Globals *g,void (*pCallback)(void *,void *));
 void setGeneralStatusCallback(mcaster1Globals *g, void (*pCallback)(void *,void *));
 void setWriteBytesCallback(mcaster1Globals *g, void (*pCallback)(void *,void *));
@@ -481,7 +733,6 @@ char_t *getgLogFile(mcaster1Globals *g);
 void	setgLogFile(mcaster1Globals *g,char_t *logFile);
 int getSaveAsWAV(mcaster1Globals *g);
 void setSaveAsWAV(mcaster1Globals *g, int flag);
-FILE *getSaveFileP(mcaster1Globals *g);
 long getWritten(mcaster1Globals *g);
 void setWritten(mcaster1Globals *g, long writ);
 int deleteConfigFile(mcaster1Globals *g);
@@ -491,10 +742,48 @@ void freeVorbisComments(mcaster1Globals *g);
 void addBasicEncoderSettings(mcaster1Globals *g);
 void addUISettings(mcaster1Globals *g);
 void setDefaultLogFileName(char_t *filename);
-void LogMessage(mcaster1Globals *g, int type, char_t *source, int line, char_t *fmt, ...);
+void logMessageAt(mcaster1Globals *g, int type, const char_t *source, int line, const char_t *fmt, ...);
 char_t *getWindowsRecordingDevice(mcaster1Globals *g);
 void	setWindowsRecordingDevice(mcaster1Globals *g, char_t *device);
 int getLAMEJointStereoFlag(mcaster1Globals *g);
 void	setLAMEJointStereoFlag(mcaster1Globals *g, int flag);
 int triggerDisconnect(mcaster1Globals *g);
+long long getMonotonicMicros(void);
+long	getOpusChainCount(mcaster1Globals *g);
+long	getOpusChainLastMs(mcaster1Globals *g);
+long	getLastTimeToFirstByteMs(mcaster1Globals *g);
+void	releaseEncoders(mcaster1Globals *g);
+const EncoderCodec *findEncoderCodec(mcaster1Globals *g);
+void	*getPCMLayout(PCMBlock *block, int layout);
+void	freePCMBlock(PCMBlock *block);
+void	meterPCMBlock(const PCMBlock *block, int numsamples, long *left, long *right);
+void	FloatScale(float *destination, float *source, int numsamples, int destchannels);
+long	getEncodeLoad(mcaster1Globals *g);
+int		getEncoderEffort(mcaster1Globals *g);
+long	getDeadlineMisses(mcaster1Globals *g);
+long	getEffortChanges(mcaster1Globals *g);
+int		getGovernorShed(mcaster1Globals *g);
+long	getGovernorTotalLoad(void);
+long	getGovernorDecisions(void);
+void	setGovernorThresholds(long highLoad, long lowLoad, long holdMs);
+int		getAdaptiveBitrate(mcaster1Globals *g);
+long	getSendBacklogMs(mcaster1Globals *g);
+long	getBitrateChanges(mcaster1Globals *g);
+long	getPacingDelayMs(mcaster1Globals *g);
+long	getSendQueueBytes(mcaster1Globals *g);
+long long	getReplayedMs(mcaster1Globals *g);
+long long	getReplayedBytes(mcaster1Globals *g);
+void	setCaptureLatency(mcaster1Globals *g, long ms);
+long	getTheoreticalLatencyMs(mcaster1Globals *g);
+long	getMeasuredLatencyMs(mcaster1Globals *g);
+void	stampCapture(mcaster1Globals *g, long long captureMicros);
+const LatencyHistogram *getStageLatency(mcaster1Globals *g, int stage);
+const char	*getStageName(int stage);
+const char_t *getEncoderExtension(mcaster1Globals *g);
+int		openOutputFile(mcaster1Globals *g, char_t *filename);
+int		closeOutputFile(mcaster1Globals *g);
+int		getArchiveStats(mcaster1Globals *g, struct tagArchiveStats *stats);
+int		passthroughMatches(mcaster1Globals *g, const CompressedFrame *frame);
+int		passthroughFrame(mcaster1Globals *g, const CompressedFrame *frame);
+void	passthroughGap(mcaster1Globals *g);
 #endif
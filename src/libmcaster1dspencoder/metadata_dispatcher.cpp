@@ -0,0 +1,503 @@
+/*
+ * metadata_dispatcher.cpp - keep-alive title updates, one worker per server
+ *
+ * dispatcherMutex guards the server list, every pending list and the
+ * stats.  A worker drops it for the network: it takes the update that is
+ * due, sends it on the kept connection and reads the whole reply, so the
+ * connection is clean for the next request.  A kept connection the server
+ * has since closed fails before any reply arrives; that update is retried
+ * once on a new connection.  dispatcherSent is signalled after every
+ * update a worker sent, for dropMetadataUpdates to wait on.
+ */
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metadata_dispatcher.h"
+#include "pipeline_trace.h"
+
+#ifndef WIN32
+#include <strings.h>
+#define INVALID_SOCKET	-1
+#define _stricmp		strcasecmp
+#endif
+
+typedef struct tagMetadataUpdate {
+	mcaster1Globals				*g;				// the slot, also the coalescing key
+	char						path[2048];
+	char						authorization[512];
+	long long					due;			// monotonic micros
+	struct tagMetadataUpdate	*next;
+} MetadataUpdate;
+
+typedef struct tagMetadataServer {
+	char						host[256];
+	int							port;
+	pthread_cond_t				wake;
+	MetadataUpdate				*pending;
+	MetadataUpdate				*sending;		// taken off pending, on the wire
+	MetadataStats				stats;
+	long long					latencyTotalMs;
+	struct tagMetadataServer	*next;
+} MetadataServer;
+
+/* The worker's connection, only its thread touches it */
+typedef struct tagMetadataConnection {
+	CMySocket	connector;
+	SOCKET		s;
+	long long	lastUsed;
+	char		buffer[4096];
+	int			have;
+	int			at;
+} MetadataConnection;
+
+typedef struct tagMetadataReply {
+	int		status;
+	int		keepAlive;
+	char	body[METADATA_REPLY_BYTES];
+	int		bodyLength;
+} MetadataReply;
+
+static pthread_mutex_t	dispatcherMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	dispatcherSent = PTHREAD_COND_INITIALIZER;
+static MetadataServer	*servers = NULL;
+
+static void closeConnection(MetadataConnection *conn) {
+	if(conn->s != INVALID_SOCKET) {
+		closesocket(conn->s);
+		conn->s = INVALID_SOCKET;
+	}
+
+	conn->have = conn->at = 0;
+}
+
+/* Next byte of the reply, -1 = closed or timed out (SO_RCVTIMEO from DoSocketConnect) */
+static int readByte(MetadataConnection *conn) {
+	if(conn->at == conn->have) {
+		int got = recv(conn->s, conn->buffer, sizeof(conn->buffer), 0);
+
+		if(got <= 0) {
+			return -1;
+		}
+
+		conn->have = got;
+		conn->at = 0;
+	}
+
+	return (unsigned char) conn->buffer[conn->at++];
+}
+
+/* A line without its CRLF.  0 = the connection ended first */
+static int readLine(MetadataConnection *conn, char *line, int size) {
+	int length = 0;
+
+	for(;;) {
+		int c = readByte(conn);
+
+		if(c < 0) {
+			return 0;
+		}
+
+		if(c == '\n') {
+			break;
+		}
+
+		if((c != '\r') && (length < size - 1)) {
+			line[length++] = (char) c;
+		}
+	}
+
+	line[length] = '\000';
+	return 1;
+}
+
+static void keepBody(MetadataReply *reply, int c) {
+	if(reply->bodyLength < METADATA_REPLY_BYTES - 1) {
+		reply->body[reply->bodyLength++] = (char) c;
+		reply->body[reply->bodyLength] = '\000';
+	}
+}
+
+/* Status line, headers and the body however it is delimited.  0 = incomplete */
+static int readReply(MetadataConnection *conn, MetadataReply *reply) {
+	char	line[1024];
+	long	contentLength = -1;
+	int		chunked = 0;
+	int		minor = 0;
+
+	memset(reply, '\000', sizeof(*reply));
+	if(!readLine(conn, line, sizeof(line)) || (sscanf(line, "HTTP/1.%d %d", &minor, &reply->status) != 2)) {
+		return 0;
+	}
+
+	reply->keepAlive = (minor >= 1);
+	for(;;) {
+		if(!readLine(conn, line, sizeof(line))) {
+			return 0;
+		}
+
+		if(!line[0]) {
+			break;
+		}
+
+		char	*value = strchr(line, ':');
+
+		if(!value) {
+			continue;
+		}
+
+		*value++ = '\000';
+		while(*value == ' ') {
+			value++;
+		}
+
+		if(!_stricmp(line, "Content-Length")) {
+			contentLength = atol(value);
+		}
+		else if(!_stricmp(line, "Transfer-Encoding") && !_stricmp(value, "chunked")) {
+			chunked = 1;
+		}
+		else if(!_stricmp(line, "Connection") && !_stricmp(value, "close")) {
+			reply->keepAlive = 0;
+		}
+		else if(!_stricmp(line, "Connection") && !_stricmp(value, "keep-alive")) {
+			reply->keepAlive = 1;
+		}
+	}
+
+	if(chunked) {
+		for(;;) {
+			long	size;
+
+			if(!readLine(conn, line, sizeof(line))) {
+				return 0;
+			}
+
+			size = strtol(line, NULL, 16);
+			if(size == 0) {
+				/* trailers up to the empty line */
+				while(readLine(conn, line, sizeof(line)) && line[0]) {
+				}
+
+				return 1;
+			}
+
+			while(size-- > 0) {
+				int c = readByte(conn);
+
+				if(c < 0) {
+					return 0;
+				}
+
+				keepBody(reply, c);
+			}
+
+			readLine(conn, line, sizeof(line));
+		}
+	}
+
+	if(contentLength >= 0) {
+		while(contentLength-- > 0) {
+			int c = readByte(conn);
+
+			if(c < 0) {
+				return 0;
+			}
+
+			keepBody(reply, c);
+		}
+
+		return 1;
+	}
+
+	/* no length (Shoutcast 1.x), the body ends with the connection */
+	for(int c = readByte(conn); c >= 0; c = readByte(conn)) {
+		keepBody(reply, c);
+	}
+
+	reply->keepAlive = 0;
+	return 1;
+}
+
+/* 1 = a complete reply was read.  *fresh = the connection was opened for this request */
+static int sendUpdate(MetadataServer *server, MetadataConnection *conn, MetadataUpdate *update, MetadataReply *reply, int *fresh) {
+	char	request[4096];
+
+	*fresh = 0;
+	if(conn->s == INVALID_SOCKET) {
+		*fresh = 1;
+		conn->s = conn->connector.DoSocketConnect(server->host, (unsigned short) server->port);
+		if(conn->s == INVALID_SOCKET) {
+			return 0;
+		}
+
+		pthread_mutex_lock(&dispatcherMutex);
+		server->stats.connects++;
+		pthread_mutex_unlock(&dispatcherMutex);
+	}
+
+	snprintf(request, sizeof(request),
+			 "GET %s HTTP/1.1\r\nHost: %s:%d\r\n%s%s%sUser-Agent: (Mozilla Compatible)\r\nConnection: keep-alive\r\n\r\n",
+			 update->path,
+			 server->host,
+			 server->port,
+			 update->authorization[0] ? "Authorization: Basic " : "",
+			 update->authorization,
+			 update->authorization[0] ? "\r\n" : "");
+
+	int length = (int) strlen(request);
+
+	if((send(conn->s, request, length, 0) != length) || !readReply(conn, reply)) {
+		closeConnection(conn);
+		return 0;
+	}
+
+	conn->lastUsed = getMonotonicMicros();
+	if(!reply->keepAlive) {
+		closeConnection(conn);
+	}
+
+	return 1;
+}
+
+static void dispatch(MetadataServer *server, MetadataConnection *conn, MetadataUpdate *update) {
+	MetadataReply	*reply = (MetadataReply *) malloc(sizeof(MetadataReply));
+	long long		started = getMonotonicMicros();
+	int				answered = 0;
+	int				fresh = 0;
+
+	TRACE_BEGIN("metadata", update->g->encoderNumber);
+	if(reply) {
+		answered = sendUpdate(server, conn, update, reply, &fresh);
+
+		/* the kept connection had gone stale */
+		if(!answered && !fresh) {
+			answered = sendUpdate(server, conn, update, reply, &fresh);
+		}
+	}
+
+	TRACE_END("metadata", update->g->encoderNumber);
+
+	long	latencyMs = (long) ((getMonotonicMicros() - started) / 1000);
+	int		accepted = answered && (reply->status >= 200) && (reply->status < 300) && !strstr(reply->body, "<return>0</return>");
+
+	pthread_mutex_lock(&dispatcherMutex);
+	if(answered) {
+		server->stats.lastStatus = reply->status;
+	}
+
+	if(accepted) {
+		server->stats.updates++;
+		server->stats.latencyMsLast = latencyMs;
+		server->latencyTotalMs += latencyMs;
+		server->stats.latencyMsAvg = (long) (server->latencyTotalMs / server->stats.updates);
+		if(latencyMs > server->stats.latencyMsMax) {
+			server->stats.latencyMsMax = latencyMs;
+		}
+	}
+	else {
+		server->stats.failures++;
+	}
+
+	pthread_mutex_unlock(&dispatcherMutex);
+
+	if(accepted) {
+		LogMessage(update->g, LOG_DEBUG, "Metadata update to %s:%d took %ld ms", server->host, server->port, latencyMs);
+	}
+	else if(answered) {
+		LogMessage(update->g, LOG_ERROR, "Metadata update refused by %s:%d (HTTP %d)", server->host, server->port, reply->status);
+	}
+	else {
+		LogMessage(update->g, LOG_ERROR, "Metadata update to %s:%d failed, no connection or no reply", server->host, server->port);
+	}
+
+	free(reply);
+}
+
+static void *metadataThread(void *arg) {
+	MetadataServer		*server = (MetadataServer *) arg;
+	MetadataConnection	*conn = new MetadataConnection;
+
+	conn->s = INVALID_SOCKET;
+	conn->have = conn->at = 0;
+	conn->lastUsed = 0;
+
+	pthread_mutex_lock(&dispatcherMutex);
+	for(;;) {
+		long long		now = getMonotonicMicros();
+		MetadataUpdate	**due = NULL;
+
+		for(MetadataUpdate **link = &server->pending; *link; link = &(*link)->next) {
+			if(!due || ((*link)->due < (*due)->due)) {
+				due = link;
+			}
+		}
+
+		if(due && ((*due)->due <= now)) {
+			MetadataUpdate	*update = *due;
+
+			*due = update->next;
+			server->stats.pending--;
+			server->sending = update;
+			pthread_mutex_unlock(&dispatcherMutex);
+			dispatch(server, conn, update);
+			pthread_mutex_lock(&dispatcherMutex);
+			server->sending = NULL;
+			free(update);
+			pthread_cond_broadcast(&dispatcherSent);
+			continue;
+		}
+
+		if((conn->s != INVALID_SOCKET) && (now - conn->lastUsed > (long long) METADATA_IDLE_CLOSE_MS * 1000)) {
+			closeConnection(conn);
+		}
+
+		/* short waits, the next update may be due before anyone signals */
+		struct timespec until;
+
+		timespec_get(&until, TIME_UTC);
+		until.tv_nsec += METADATA_POLL_MS * 1000000L;
+		if(until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&server->wake, &dispatcherMutex, &until);
+	}
+
+	return NULL;
+}
+
+/* With dispatcherMutex held */
+static MetadataServer *findServer(const char *host, int port, int create) {
+	MetadataServer	*server;
+
+	for(server = servers; server; server = server->next) {
+		if((server->port == port) && !_stricmp(server->host, host)) {
+			return server;
+		}
+	}
+
+	if(!create) {
+		return NULL;
+	}
+
+	server = (MetadataServer *) calloc(1, sizeof(MetadataServer));
+	if(!server) {
+		return NULL;
+	}
+
+	pthread_t	thread;
+
+	snprintf(server->host, sizeof(server->host), "%s", host);
+	server->port = port;
+	pthread_cond_init(&server->wake, NULL);
+	if(pthread_create(&thread, NULL, metadataThread, server) != 0) {
+		pthread_cond_destroy(&server->wake);
+		free(server);
+		return NULL;
+	}
+
+	pthread_detach(thread);
+	server->next = servers;
+	servers = server;
+	return server;
+}
+
+/*
+ =======================================================================================================================
+    API
+ =======================================================================================================================
+ */
+int queueMetadataUpdate(mcaster1Globals *g, const char *host, int port, const char *path, const char *authorization, int coalesceMs) {
+	pthread_mutex_lock(&dispatcherMutex);
+
+	MetadataServer	*server = findServer(host, port, 1);
+
+	if(!server) {
+		pthread_mutex_unlock(&dispatcherMutex);
+		LogMessage(g, LOG_ERROR, "Metadata update: out of memory");
+		return 0;
+	}
+
+	MetadataUpdate	*update;
+
+	for(update = server->pending; update && (update->g != g); update = update->next) {
+	}
+
+	if(update) {
+		/* keeps its place and due time, only the title is newer */
+		server->stats.coalesced++;
+	}
+	else {
+		update = (MetadataUpdate *) calloc(1, sizeof(MetadataUpdate));
+		if(!update) {
+			pthread_mutex_unlock(&dispatcherMutex);
+			LogMessage(g, LOG_ERROR, "Metadata update: out of memory");
+			return 0;
+		}
+
+		update->g = g;
+		update->due = getMonotonicMicros() + (long long) ((coalesceMs > 0) ? coalesceMs : 0) * 1000;
+		update->next = server->pending;
+		server->pending = update;
+		server->stats.pending++;
+	}
+
+	snprintf(update->path, sizeof(update->path), "%s", path);
+	snprintf(update->authorization, sizeof(update->authorization), "%s", authorization ? authorization : "");
+	pthread_cond_signal(&server->wake);
+	pthread_mutex_unlock(&dispatcherMutex);
+	return 1;
+}
+
+void dropMetadataUpdates(mcaster1Globals *g) {
+	pthread_mutex_lock(&dispatcherMutex);
+	for(MetadataServer *server = servers; server; server = server->next) {
+		for(MetadataUpdate **link = &server->pending; *link;) {
+			MetadataUpdate	*update = *link;
+
+			if(update->g == g) {
+				*link = update->next;
+				server->stats.pending--;
+				free(update);
+			}
+			else {
+				link = &update->next;
+			}
+		}
+	}
+
+	/* one may be on the wire, it logs against g when the reply is in */
+	for(;;) {
+		MetadataServer	*server;
+
+		for(server = servers; server && !(server->sending && (server->sending->g == g)); server = server->next) {
+		}
+
+		if(!server) {
+			break;
+		}
+
+		pthread_cond_wait(&dispatcherSent, &dispatcherMutex);
+	}
+
+	pthread_mutex_unlock(&dispatcherMutex);
+}
+
+int getMetadataStats(const char *host, int port, MetadataStats *stats) {
+	pthread_mutex_lock(&dispatcherMutex);
+
+	MetadataServer	*server = findServer(host, port, 0);
+
+	if(server) {
+		*stats = server->stats;
+	}
+
+	pthread_mutex_unlock(&dispatcherMutex);
+	return server != NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef __METADATA_DISPATCHER_H__
+#define __METADATA_DISPATCHER_H__
+
+#include "libmcaster1dspencoder.h"
+
+/*
+ * Out of band title updates (Shoutcast admin.cgi, Icecast /admin/metadata).
+ * Every server gets one worker thread and one HTTP/1.1 keep-alive
+ * connection that all slots streaming to it share.  An update waits
+ * MetadataCoalesceMs before it goes out and a newer title for the same slot
+ * replaces it in the meantime, so a burst of title changes costs one
+ * request.  Replies are read and checked; servers that answer HTTP/1.0 or
+ * Connection: close get a new connection for the next update.
+ */
+#define METADATA_DEFAULT_COALESCE_MS	500
+#define METADATA_IDLE_CLOSE_MS			60000	// an unused keep-alive connection is closed after this
+#define METADATA_REPLY_BYTES			8192	// kept of a reply body, the rest is read and dropped
+#define METADATA_POLL_MS				100
+
+typedef struct tagMetadataStats {
+	long	updates;				// accepted by the server
+	long	failures;				// no connection, no reply or not 2xx
+	long	coalesced;				// replaced by a newer title before they were sent
+	long	connects;				// updates / connects is the keep-alive reuse
+	long	latencyMsLast;			// request sent to reply read, connect included
+	long	latencyMsAvg;
+	long	latencyMsMax;
+	int		lastStatus;				// HTTP status of the last reply, 0 = none
+	int		pending;				// waiting to be sent
+} MetadataStats;
+
+/*
+ * Queues GET path for the slot's server, authorization is the Basic
+ * credentials or NULL.  Returns at once; the result is logged against g.
+ */
+int		queueMetadataUpdate(mcaster1Globals *g, const char *host, int port, const char *path, const char *authorization, int coalesceMs);
+/* Forgets the slot's queued updates and waits out one being sent, before g is freed */
+void	dropMetadataUpdates(mcaster1Globals *g);
+/* 0 = nothing was ever sent to that server */
+int		getMetadataStats(const char *host, int port, MetadataStats *stats);
+
+#endif //__METADATA_DISPATCHER_H__
@@ -0,0 +1,562 @@
+/*
+ * metrics_server.cpp - Prometheus text endpoint for the slots
+ *
+ * metricsMutex guards the slot table and the listener.  The encode path
+ * never takes it after a slot's first count: metricsCount goes straight to
+ * the slot's entry through g->metrics.  The server thread serves one
+ * request at a time, builds the whole reply under metricsMutex and closes
+ * the connection; a scrape every few seconds is all it is meant for.
+ *
+ * The same port serves the pipeline trace: /trace/start and /trace/stop
+ * switch it, /trace returns what the rings hold as Chrome trace JSON.
+ */
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <atomic>
+#include "metrics_server.h"
+#include "archive_writer.h"
+#include "metadata_dispatcher.h"
+#include "reconnect_scheduler.h"
+#include "pipeline_trace.h"
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <sys/time.h>
+#define INVALID_SOCKET	-1
+#endif
+
+/* One thread group's share of a slot's counters, a cache line of its own */
+typedef struct alignas(64) tagMetricsShard {
+	std::atomic<long long>	value[METRIC_COUNTERS];
+} MetricsShard;
+
+struct tagSlotMetrics {
+	mcaster1Globals	*g;					// NULL = free
+	MetricsShard	shard[METRICS_SHARDS];
+	long long		scrapeBytes;		// bytes sent at the previous scrape
+	long long		scrapeMicros;
+	long			sendKbps;			// between the last two scrapes
+};
+
+typedef struct tagMetricsText {
+	char	*data;
+	int		length;
+	int		size;
+} MetricsText;
+
+static pthread_mutex_t			metricsMutex = PTHREAD_MUTEX_INITIALIZER;
+static SlotMetrics				slotMetrics[METRICS_MAX_SLOTS];
+static std::atomic<int>			nextShard(0);
+static std::atomic<long long>	captureXruns(0);
+static std::atomic<int>			serverRunning(0);
+static SOCKET					listener = INVALID_SOCKET;
+static pthread_t				serverThread;
+static mcaster1Globals			*serverLog = NULL;
+
+static const double	summaryQuantiles[] = { 0.5, 0.99, 0.999 };
+
+/* Threads are dealt shards round robin the first time they count */
+static int threadShard(void) {
+	static thread_local int	shard = -1;
+
+	if(shard < 0) {
+		shard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+	}
+
+	return shard;
+}
+
+static void metricsRegister(mcaster1Globals *g) {
+	SlotMetrics *slot = NULL;
+
+	pthread_mutex_lock(&metricsMutex);
+
+	/* initializeGlobals again on a registered slot keeps its entry */
+	for(int i = 0; (i < METRICS_MAX_SLOTS) && !slot; i++) {
+		if(slotMetrics[i].g == g) {
+			slot = &slotMetrics[i];
+		}
+	}
+
+	for(int i = 0; (i < METRICS_MAX_SLOTS) && !slot; i++) {
+		if(!slotMetrics[i].g) {
+			slot = &slotMetrics[i];
+			for(int s = 0; s < METRICS_SHARDS; s++) {
+				for(int c = 0; c < METRIC_COUNTERS; c++) {
+					slot->shard[s].value[c].store(0, std::memory_order_relaxed);
+				}
+			}
+
+			slot->scrapeBytes = 0;
+			slot->scrapeMicros = 0;
+			slot->sendKbps = 0;
+			slot->g = g;
+		}
+	}
+
+	/* a full table leaves the slot out rather than trying again every block */
+	g->metrics = slot;
+	g->metricsRegistered = 1;
+	pthread_mutex_unlock(&metricsMutex);
+}
+
+void metricsCount(mcaster1Globals *g, int counter, long long n) {
+	if(!g->metricsRegistered) {
+		metricsRegister(g);
+	}
+
+	if(g->metrics) {
+		g->metrics->shard[threadShard()].value[counter].fetch_add(n, std::memory_order_relaxed);
+	}
+}
+
+void metricsCaptureXrun(void) {
+	captureXruns.fetch_add(1, std::memory_order_relaxed);
+}
+
+void metricsUnregister(mcaster1Globals *g) {
+	pthread_mutex_lock(&metricsMutex);
+	for(int i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g == g) {
+			slotMetrics[i].g = NULL;
+		}
+	}
+
+	g->metrics = NULL;
+	g->metricsRegistered = 0;
+	pthread_mutex_unlock(&metricsMutex);
+}
+
+static long long counterValue(SlotMetrics *slot, int counter) {
+	long long	total = 0;
+
+	for(int s = 0; s < METRICS_SHARDS; s++) {
+		total += slot->shard[s].value[counter].load(std::memory_order_relaxed);
+	}
+
+	return total;
+}
+
+/*
+ =======================================================================================================================
+    Exposition
+ =======================================================================================================================
+ */
+static void appendText(MetricsText *t, const char *fmt, ...) {
+	for(;;) {
+		int		room = t->size - t->length;
+		int		n = -1;
+		va_list	parms;
+
+		if(room > 0) {
+			va_start(parms, fmt);
+			n = vsnprintf(t->data + t->length, room, fmt, parms);
+			va_end(parms);
+		}
+
+		if((n >= 0) && (n < room)) {
+			t->length += n;
+			return;
+		}
+
+		int		size = (t->size ? t->size * 2 : 16384);
+		char	*data = (char *) realloc(t->data, size);
+
+		if(!data) {
+			return;
+		}
+
+		t->data = data;
+		t->size = size;
+	}
+}
+
+/* A label value, with \ " and newlines escaped */
+static void appendLabel(MetricsText *t, const char *name, const char *value) {
+	appendText(t, ",%s=\"", name);
+	for(const char *p = value; *p; p++) {
+		if((*p == '\\') || (*p == '"')) {
+			appendText(t, "\\%c", *p);
+		}
+		else if(*p == '\n') {
+			appendText(t, "\\n");
+		}
+		else {
+			appendText(t, "%c", *p);
+		}
+	}
+
+	appendText(t, "\"");
+}
+
+static void family(MetricsText *t, const char *name, const char *type, const char *help) {
+	appendText(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void counterFamily(MetricsText *t, int counter, const char *name, const char *help) {
+	family(t, name, "counter", help);
+	for(int i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g) {
+			appendText(t, "%s{slot=\"%d\"} %lld\n", name, slotMetrics[i].g->encoderNumber, counterValue(&slotMetrics[i], counter));
+		}
+	}
+}
+
+/* Called with metricsMutex held */
+static void buildMetrics(MetricsText *t) {
+	long long	now = getMonotonicMicros();
+	int			i;
+
+	family(t, "mcaster1_slot_info", "gauge", "Where each slot streams to, always 1");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		mcaster1Globals *g = slotMetrics[i].g;
+
+		if(g) {
+			appendText(t, "mcaster1_slot_info{slot=\"%d\"", g->encoderNumber);
+			appendLabel(t, "server", getTargetServer(g, g->onBackup));
+			appendLabel(t, "port", getTargetPort(g, g->onBackup));
+			appendLabel(t, "mount", g->gMountpoint);
+			appendLabel(t, "encoder", g->gEncodeType);
+			appendText(t, "} 1\n");
+		}
+	}
+
+	counterFamily(t, METRIC_BYTES_SENT, "mcaster1_bytes_sent_total", "Stream bytes handed to the connection");
+	counterFamily(t, METRIC_BLOCKS, "mcaster1_blocks_encoded_total", "Blocks through the codec");
+	counterFamily(t, METRIC_CONNECTION_LOSSES, "mcaster1_connection_losses_total", "Connections dropped by a send error");
+	counterFamily(t, METRIC_RECONNECTS, "mcaster1_reconnects_total", "Connections made again after a loss");
+	counterFamily(t, METRIC_REPLAY_LOST_FRAMES, "mcaster1_replay_lost_frames_total", "Frames the replay buffer overwrote before they were sent");
+
+	family(t, "mcaster1_encode_seconds_total", "counter", "Wall time in the codec, sends included");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g) {
+			appendText(t, "mcaster1_encode_seconds_total{slot=\"%d\"} %.6f\n", slotMetrics[i].g->encoderNumber,
+						counterValue(&slotMetrics[i], METRIC_ENCODE_MICROS) / 1000000.0);
+		}
+	}
+
+	family(t, "mcaster1_input_blocks_total", "counter", "Input blocks by path: float at the encoder rate, resampled, or 16 bit straight to the codec");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g) {
+			int	slot = slotMetrics[i].g->encoderNumber;
+
+			appendText(t, "mcaster1_input_blocks_total{slot=\"%d\",path=\"float\"} %lld\n", slot, counterValue(&slotMetrics[i], METRIC_INPUT_FLOAT));
+			appendText(t, "mcaster1_input_blocks_total{slot=\"%d\",path=\"resampled\"} %lld\n", slot, counterValue(&slotMetrics[i], METRIC_INPUT_RESAMPLED));
+			appendText(t, "mcaster1_input_blocks_total{slot=\"%d\",path=\"int16\"} %lld\n", slot, counterValue(&slotMetrics[i], METRIC_INPUT_INT16));
+		}
+	}
+
+	family(t, "mcaster1_archive_dropped_bytes_total", "counter", "Archive bytes dropped because the writer fell behind, for the current archive");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		ArchiveStats	archive;
+
+		if(slotMetrics[i].g && getArchiveStats(slotMetrics[i].g, &archive)) {
+			appendText(t, "mcaster1_archive_dropped_bytes_total{slot=\"%d\"} %lld\n", slotMetrics[i].g->encoderNumber, archive.droppedBytes);
+		}
+	}
+
+	family(t, "mcaster1_connected", "gauge", "1 while the slot is streaming");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g) {
+			appendText(t, "mcaster1_connected{slot=\"%d\"} %d\n", slotMetrics[i].g->encoderNumber, slotMetrics[i].g->weareconnected ? 1 : 0);
+		}
+	}
+
+	family(t, "mcaster1_bitrate_kbps", "gauge", "Codec bitrate, the adaptive one when it is on");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g) {
+			appendText(t, "mcaster1_bitrate_kbps{slot=\"%d\"} %d\n", slotMetrics[i].g->encoderNumber, getAdaptiveBitrate(slotMetrics[i].g));
+		}
+	}
+
+	family(t, "mcaster1_send_kbps", "gauge", "Bytes sent since the previous scrape, in kbit/s");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		SlotMetrics *slot = &slotMetrics[i];
+
+		if(slot->g) {
+			long long	bytes = counterValue(slot, METRIC_BYTES_SENT);
+
+			if(slot->scrapeMicros && (now > slot->scrapeMicros)) {
+				slot->sendKbps = (long) ((bytes - slot->scrapeBytes) * 8000 / (now - slot->scrapeMicros));
+			}
+
+			slot->scrapeBytes = bytes;
+			slot->scrapeMicros = now;
+			appendText(t, "mcaster1_send_kbps{slot=\"%d\"} %ld\n", slot->g->encoderNumber, slot->sendKbps);
+		}
+	}
+
+	family(t, "mcaster1_send_queue_bytes", "gauge", "Bytes queued in the network reactor for the server");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g) {
+			appendText(t, "mcaster1_send_queue_bytes{slot=\"%d\"} %ld\n", slotMetrics[i].g->encoderNumber, getSendQueueBytes(slotMetrics[i].g));
+		}
+	}
+
+	family(t, "mcaster1_encode_load_ratio", "gauge", "Smoothed encode cost as a fraction of real time");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		if(slotMetrics[i].g) {
+			appendText(t, "mcaster1_encode_load_ratio{slot=\"%d\"} %.3f\n", slotMetrics[i].g->encoderNumber, getEncodeLoad(slotMetrics[i].g) / 1000.0);
+		}
+	}
+
+	/* per server, under every slot that streams to it */
+	family(t, "mcaster1_metadata_latency_seconds", "gauge", "Title update request to reply, the last one and the average");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		mcaster1Globals *g = slotMetrics[i].g;
+		MetadataStats	stats;
+
+		if(g && getMetadataStats(getTargetServer(g, g->onBackup), atoi(getTargetPort(g, g->onBackup)), &stats)) {
+			appendText(t, "mcaster1_metadata_latency_seconds{slot=\"%d\",stat=\"last\"} %.3f\n", g->encoderNumber, stats.latencyMsLast / 1000.0);
+			appendText(t, "mcaster1_metadata_latency_seconds{slot=\"%d\",stat=\"avg\"} %.3f\n", g->encoderNumber, stats.latencyMsAvg / 1000.0);
+			appendText(t, "mcaster1_metadata_latency_seconds{slot=\"%d\",stat=\"max\"} %.3f\n", g->encoderNumber, stats.latencyMsMax / 1000.0);
+		}
+	}
+
+	family(t, "mcaster1_metadata_updates_total", "counter", "Title updates sent to the slot's server, by result");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		mcaster1Globals *g = slotMetrics[i].g;
+		MetadataStats	stats;
+
+		if(g && getMetadataStats(getTargetServer(g, g->onBackup), atoi(getTargetPort(g, g->onBackup)), &stats)) {
+			appendText(t, "mcaster1_metadata_updates_total{slot=\"%d\",result=\"ok\"} %ld\n", g->encoderNumber, stats.updates);
+			appendText(t, "mcaster1_metadata_updates_total{slot=\"%d\",result=\"failed\"} %ld\n", g->encoderNumber, stats.failures);
+			appendText(t, "mcaster1_metadata_updates_total{slot=\"%d\",result=\"coalesced\"} %ld\n", g->encoderNumber, stats.coalesced);
+		}
+	}
+
+	family(t, "mcaster1_stage_latency_seconds", "summary", "Time a block spends in each pipeline stage since the slot connected");
+	for(i = 0; i < METRICS_MAX_SLOTS; i++) {
+		mcaster1Globals *g = slotMetrics[i].g;
+
+		if(!g) {
+			continue;
+		}
+
+		for(int stage = 0; stage < LATENCY_STAGES; stage++) {
+			const LatencyHistogram	*h = getStageLatency(g, stage);
+			const char				*name = getStageName(stage);
+
+			for(int q = 0; q < (int) (sizeof(summaryQuantiles) / sizeof(summaryQuantiles[0])); q++) {
+				appendText(t, "mcaster1_stage_latency_seconds{slot=\"%d\",stage=\"%s\",quantile=\"%g\"} %.6f\n", g->encoderNumber, name,
+							summaryQuantiles[q], latencyPercentile(h, summaryQuantiles[q] * 100.0) / 1000000.0);
+			}
+
+			appendText(t, "mcaster1_stage_latency_seconds_sum{slot=\"%d\",stage=\"%s\"} %.6f\n", g->encoderNumber, name, h->sumMicros / 1000000.0);
+			appendText(t, "mcaster1_stage_latency_seconds_count{slot=\"%d\",stage=\"%s\"} %lld\n", g->encoderNumber, name, h->count);
+		}
+	}
+
+	family(t, "mcaster1_capture_xruns_total", "counter", "Sound card input overflows and underflows");
+	appendText(t, "mcaster1_capture_xruns_total %lld\n", captureXruns.load(std::memory_order_relaxed));
+}
+
+/*
+ =======================================================================================================================
+    HTTP
+ =======================================================================================================================
+ */
+static void sendAll(SOCKET s, const char *data, int length) {
+	int sendflags = 0;
+
+#if !defined(WIN32) && !defined(__FreeBSD__)
+	sendflags = MSG_NOSIGNAL;
+#endif
+	while(length > 0) {
+		int n = send(s, data, length, sendflags);
+
+		if(n <= 0) {
+			return;
+		}
+
+		data += n;
+		length -= n;
+	}
+}
+
+static void sendReply(SOCKET s, const char *status, const char *contentType, const char *body, int length) {
+	char	header[256];
+
+	int n = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+					 status, contentType, length);
+
+	sendAll(s, header, n);
+	sendAll(s, body, length);
+}
+
+static int isPath(const char *path, size_t length, const char *want) {
+	return (length == strlen(want)) && !strncmp(path, want, length);
+}
+
+static void serveRequest(SOCKET s) {
+	char	request[METRICS_REQUEST_BYTES];
+	int		have = 0;
+
+	/* a client that never finishes its request does not hold up the next scrape */
+#ifdef WIN32
+	DWORD			timeout = 2000;
+#else
+	struct timeval	timeout = { 2, 0 };
+#endif
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout, sizeof(timeout));
+
+	while(have < (int) sizeof(request) - 1) {
+		int n = recv(s, request + have, sizeof(request) - 1 - have, 0);
+
+		if(n <= 0) {
+			break;
+		}
+
+		have += n;
+		request[have] = '\000';
+		if(strstr(request, "\r\n\r\n")) {
+			break;
+		}
+	}
+
+	request[have] = '\000';
+	if(strncmp(request, "GET ", 4)) {
+		sendReply(s, "405 Method Not Allowed", "text/plain", "GET only\n", 9);
+		return;
+	}
+
+	const char	*path = request + 4;
+	size_t		pathLength = strcspn(path, " ?\r\n");
+
+	/* the pipeline timeline, see pipeline_trace.h */
+	if(isPath(path, pathLength, "/trace/start") || isPath(path, pathLength, "/trace/stop")) {
+		setTraceEnabled(isPath(path, pathLength, "/trace/start"));
+		sendReply(s, "200 OK", "text/plain", traceEnabled ? "tracing\n" : "stopped\n", 8);
+		return;
+	}
+
+	if(isPath(path, pathLength, "/trace")) {
+		int		length = 0;
+		char	*json = traceDumpJSON(&length);
+
+		if(!json) {
+			sendReply(s, "500 Internal Server Error", "text/plain", "Out of memory\n", 14);
+			return;
+		}
+
+		sendReply(s, "200 OK", "application/json", json, length);
+		free(json);
+		return;
+	}
+
+	if(!isPath(path, pathLength, "/metrics")) {
+		sendReply(s, "404 Not Found", "text/plain", "Try /metrics\n", 13);
+		return;
+	}
+
+	MetricsText text = { NULL, 0, 0 };
+
+	pthread_mutex_lock(&metricsMutex);
+	buildMetrics(&text);
+	pthread_mutex_unlock(&metricsMutex);
+
+	sendReply(s, "200 OK", "text/plain; version=0.0.4; charset=utf-8", text.data ? text.data : "", text.length);
+	free(text.data);
+}
+
+static void *metricsThread(void *arg) {
+	(void) arg;
+
+	while(serverRunning) {
+		fd_set			readable;
+		struct timeval	tv = { 0, METRICS_POLL_MS * 1000 };
+
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+		if(select((int) listener + 1, &readable, NULL, NULL, &tv) <= 0) {
+			continue;
+		}
+
+		SOCKET	s = accept(listener, NULL, NULL);
+
+		if(s == INVALID_SOCKET) {
+			continue;
+		}
+
+		serveRequest(s);
+		closesocket(s);
+	}
+
+	return NULL;
+}
+
+int startMetricsServer(mcaster1Globals *g) {
+	struct sockaddr_in	sa;
+	int					on = 1;
+
+	if(g->metricsPort <= 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&metricsMutex);
+	if(serverRunning) {
+		pthread_mutex_unlock(&metricsMutex);
+		return 1;
+	}
+
+	memset(&sa, '\000', sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons((unsigned short) g->metricsPort);
+	if(inet_pton(AF_INET, g->metricsAddress[0] ? g->metricsAddress : METRICS_DEFAULT_ADDRESS, &sa.sin_addr) != 1) {
+		pthread_mutex_unlock(&metricsMutex);
+		LogMessage(g, LOG_ERROR, "MetricsAddress %s is not an IPv4 address, no metrics endpoint", g->metricsAddress);
+		return 0;
+	}
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(listener == INVALID_SOCKET) {
+		pthread_mutex_unlock(&metricsMutex);
+		LogMessage(g, LOG_ERROR, "Cannot create the metrics socket");
+		return 0;
+	}
+
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
+	if((bind(listener, (struct sockaddr *) &sa, sizeof(sa)) != 0) || (listen(listener, SOMAXCONN) != 0)) {
+		closesocket(listener);
+		listener = INVALID_SOCKET;
+		pthread_mutex_unlock(&metricsMutex);
+		LogMessage(g, LOG_ERROR, "Cannot listen on %s:%d for metrics, the port may be in use", g->metricsAddress, g->metricsPort);
+		return 0;
+	}
+
+	serverRunning = 1;
+	serverLog = g;
+	if(pthread_create(&serverThread, NULL, metricsThread, NULL) != 0) {
+		serverRunning = 0;
+		closesocket(listener);
+		listener = INVALID_SOCKET;
+		pthread_mutex_unlock(&metricsMutex);
+		LogMessage(g, LOG_ERROR, "Cannot start the metrics thread");
+		return 0;
+	}
+
+	pthread_mutex_unlock(&metricsMutex);
+	LogMessage(g, LOG_INFO, "Metrics at http://%s:%d/metrics", g->metricsAddress, g->metricsPort);
+	return 1;
+}
+
+void stopMetricsServer(void) {
+	if(!serverRunning) {
+		return;
+	}
+
+	/* the thread sees the flag within METRICS_POLL_MS */
+	serverRunning = 0;
+	pthread_join(serverThread, NULL);
+	closesocket(listener);
+	listener = INVALID_SOCKET;
+	if(serverLog) {
+		LogMessage(serverLog, LOG_INFO, "Metrics endpoint closed");
+	}
+}
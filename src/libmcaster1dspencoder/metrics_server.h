@@ -0,0 +1,44 @@
+#ifndef __METRICS_SERVER_H__
+#define __METRICS_SERVER_H__
+
+#include "libmcaster1dspencoder.h"
+
+/*
+ * Local metrics endpoint.  GET /metrics on MetricsAddress:MetricsPort is
+ * answered in the Prometheus text format: counters the encode path adds
+ * to, and gauges read from the slots when the endpoint is scraped.
+ * /trace, /trace/start and /trace/stop control the pipeline trace.
+ *
+ * A counter is sharded by thread.  Each thread adds to its own cache line
+ * of the slot with a relaxed atomic add, no lock and no line shared with
+ * another writer; a scrape sums the shards.  A slot registers on its first
+ * count and unregisters in freeupGlobals.
+ */
+#define METRICS_DEFAULT_ADDRESS		"127.0.0.1"	// loopback only unless configured otherwise
+#define METRICS_SHARDS				8
+#define METRICS_MAX_SLOTS			64
+#define METRICS_REQUEST_BYTES		4096
+#define METRICS_POLL_MS				250			// how soon stopMetricsServer is noticed
+
+/* Per slot counters */
+#define METRIC_BYTES_SENT			0
+#define METRIC_BLOCKS				1
+#define METRIC_ENCODE_MICROS		2
+#define METRIC_CONNECTION_LOSSES	3
+#define METRIC_RECONNECTS			4
+#define METRIC_INPUT_FLOAT			5			// float blocks already at the encoder rate
+#define METRIC_INPUT_RESAMPLED		6
+#define METRIC_INPUT_INT16			7			// 16 bit blocks straight to the codec
+#define METRIC_REPLAY_LOST_FRAMES	8			// overwritten before they could be replayed
+#define METRIC_COUNTERS				9
+
+void	metricsCount(mcaster1Globals *g, int counter, long long n);
+/* PortAudio input overflow or underflow, not tied to a slot */
+void	metricsCaptureXrun(void);
+void	metricsUnregister(mcaster1Globals *g);
+
+/* On g's metricsAddress and metricsPort, logged against g.  0 = port 0 or it failed */
+int		startMetricsServer(mcaster1Globals *g);
+void	stopMetricsServer(void);
+
+#endif //__METRICS_SERVER_H__
@@ -0,0 +1,1399 @@
+/*
+ * net_reactor.cpp - non-blocking source connections
+ *
+ * Each connection has its own mutex, taken by the reactor thread for the
+ * events of that connection and by netSend on the encoder thread.  Where a
+ * reactor thread also needs its connection list the list mutex comes first.
+ *
+ * A NetConnection belongs to its encoder slot and outlives every socket it
+ * opens, so an event or timeout scan that races netClose finds the
+ * connection unregistered and leaves it alone.  Before freeing it,
+ * freeNetConnection waits for every reactor thread to finish the pass it is
+ * in, so an event read ahead of the close is never serviced after the free.
+ *
+ * The outbound queue is a byte ring; positions only grow.  A drain writes
+ * everything queued in one gathered write (two pieces when the ring wraps).
+ * With pacing a drain writes no more than the token bucket holds.  A queue
+ * the bucket holds back drops its write interest, and the reactor thread,
+ * ticking every NET_PACE_TICK_MS while it has paced connections, drains it
+ * again as the bucket refills.
+ *
+ * Connecting starts with an asynchronous lookup (net_resolver.h).  The
+ * addresses are then raced happy eyeballs style: a new attempt starts every
+ * NET_ATTEMPT_DELAY_MS while none has connected, and the first to connect
+ * wins.  A lookup answer or attempt event meant for an earlier open of the
+ * connection is recognised by the generation it carries.
+ */
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#define NET_USE_EPOLL
+#define NET_HAVE_SIOCOUTQ
+#endif
+#endif
+#include "libmcaster1dspencoder.h"
+#include "net_reactor.h"
+#include "net_resolver.h"
+
+#ifdef WIN32
+#define netLastError()			WSAGetLastError()
+#define NET_WOULD_BLOCK(e)		((e) == WSAEWOULDBLOCK)
+#define NET_IN_PROGRESS(e)		(((e) == WSAEWOULDBLOCK) || ((e) == WSAEINPROGRESS))
+#define NET_REFUSED				WSAECONNREFUSED
+#define netPoll(fds, n, ms)		WSAPoll(fds, n, ms)
+typedef WSAPOLLFD				NetPollFd;
+#else
+#define INVALID_SOCKET			-1
+#define netLastError()			errno
+#define NET_WOULD_BLOCK(e)		(((e) == EAGAIN) || ((e) == EWOULDBLOCK) || ((e) == EINTR))
+#define NET_IN_PROGRESS(e)		((e) == EINPROGRESS)
+#define NET_REFUSED				ECONNREFUSED
+#define netPoll(fds, n, ms)		poll(fds, n, ms)
+typedef struct pollfd			NetPollFd;
+#endif
+
+#if !defined(WIN32) && !defined(__FreeBSD__)
+#define NET_SEND_FLAGS	MSG_NOSIGNAL
+#else
+#define NET_SEND_FLAGS	0
+#endif
+
+#define NET_EVENTS_MAX	64
+
+typedef struct tagNetReactorThread	NetReactorThread;
+
+typedef struct tagNetTimeMark {
+	long long	position;				// bytesSent once the block is out
+	long long	stamp;
+} NetTimeMark;
+
+typedef struct tagNetStep {
+	char	*text;
+	int		length;
+	char	expect[16];
+	int		awaitReply;
+} NetStep;
+
+struct tagNetConnection {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		changed;		// state changes and queue space
+	NetReactorThread	*owner;			// NULL = not registered with a reactor thread
+	SOCKET				s;
+	int					state;
+	int					failedState;
+	char				error[256];
+	long long			deadline;		// connect or reply wait, monotonic micros, 0 = none
+	long				generation;		// counts netOpen calls
+	long long			phaseStarted;	// for the phase times in stats
+
+	char				host[256];
+	int					resolving;
+	ResolvedAddresses	addresses;
+	int					nextAddress;
+	SOCKET				attempts[RESOLVE_MAX_ADDRESSES];	// connects in flight
+	int					attemptCount;
+	long long			nextAttemptAt;
+	char				attemptError[128];
+	long long			lastProgress;
+	int					events;			// registered with epoll
+
+	long				paceRate;		// bytes per second, 0 = no pacing
+	long				paceBurst;
+	double				paceTokens;
+	long long			paceRefilled;
+	long long			paceHeldSince;	// queued data waiting on the bucket, 0 = none
+	long long			paceHeldMicros;
+
+	int					lowLatency;
+	long				queueLimit;		// netSend fills the queue up to here
+
+	LatencyHistogram	*wireLatency;	// the owner's, capture to send()
+	NetTimeMark			marks[NET_TIME_MARKS];
+	int					markTail;
+	int					markCount;
+
+	NetStep				steps[NET_HANDSHAKE_STEPS];
+	int					stepCount;
+	int					step;
+	int					stepQueued;		// the text of step is in the queue
+	char				replies[NET_HANDSHAKE_STEPS][NET_REPLY_BYTES];
+	int					replyLength;
+
+	char				*queue;
+	long long			queueHead;		// bytes ever queued
+	long long			queueTail;		// bytes ever written
+	NetStats			stats;
+};
+
+struct tagNetReactorThread {
+	pthread_t		thread;
+	pthread_mutex_t	mutex;				// connections
+	NetConnection	**connections;
+	int				count;
+	int				allocated;
+	int				paced;				// streaming connections with pacing, picks the tick
+	long			passes;				// loop passes done, under mutex
+	pthread_cond_t	passed;
+#ifdef NET_USE_EPOLL
+	int				epoll;
+#endif
+};
+
+static NetReactorThread	reactors[NET_REACTOR_THREADS];
+static int				reactorsStarted = 0;
+static int				nextReactor = 0;
+static pthread_mutex_t	reactorMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void closeSocket(SOCKET s) {
+	if(s != INVALID_SOCKET) {
+		closesocket(s);
+	}
+}
+
+static int setNonBlocking(SOCKET s) {
+#ifdef WIN32
+	u_long	on = 1;
+
+	return ioctlsocket(s, FIONBIO, &on) == 0;
+#else
+	int		flags = fcntl(s, F_GETFL, 0);
+
+	return (flags != -1) && (fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1);
+#endif
+}
+
+static const char *netErrorText(int error) {
+#ifdef WIN32
+	static char text[32];
+
+	snprintf(text, sizeof(text), "winsock error %d", error);
+	return text;
+#else
+	return strerror(error);
+#endif
+}
+
+/* One gathered write of up to two pieces */
+static long writeBuffers(SOCKET s, char *first, int firstLength, char *second, int secondLength) {
+#ifdef WIN32
+	WSABUF	buffers[2];
+	DWORD	sent = 0;
+
+	buffers[0].buf = first;
+	buffers[0].len = firstLength;
+	buffers[1].buf = second;
+	buffers[1].len = secondLength;
+	if(WSASend(s, buffers, secondLength ? 2 : 1, &sent, 0, NULL, NULL) != 0) {
+		return -1;
+	}
+
+	return (long) sent;
+#else
+	struct iovec	buffers[2];
+	struct msghdr	message;
+
+	buffers[0].iov_base = first;
+	buffers[0].iov_len = firstLength;
+	buffers[1].iov_base = second;
+	buffers[1].iov_len = secondLength;
+	memset(&message, '\000', sizeof(message));
+	message.msg_iov = buffers;
+	message.msg_iovlen = secondLength ? 2 : 1;
+	return (long) sendmsg(s, &message, NET_SEND_FLAGS);
+#endif
+}
+
+/*
+ =======================================================================================================================
+    Connection state, called with the connection mutex held
+ =======================================================================================================================
+ */
+static void updateInterest(NetConnection *conn) {
+#ifdef NET_USE_EPOLL
+	if(!conn->owner || (conn->s == INVALID_SOCKET)) {
+		return;
+	}
+
+	int queued = (conn->queueHead > conn->queueTail);
+	int events = 0;
+
+	switch(conn->state) {
+		case NET_CONNECTING:
+			events = EPOLLOUT;
+			break;
+
+		case NET_HANDSHAKE:
+			events = queued ? EPOLLOUT : EPOLLIN;
+			break;
+
+		case NET_STREAMING:
+			events = EPOLLIN | ((queued && !conn->paceHeldSince) ? (int) EPOLLOUT : 0);
+			break;
+	}
+
+	if(events != conn->events) {
+		struct epoll_event	event;
+
+		memset(&event, '\000', sizeof(event));
+		event.events = events;
+		event.data.ptr = conn;
+		epoll_ctl(conn->owner->epoll, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->s, &event);
+		conn->events = events;
+	}
+#endif
+}
+
+static void closeAttempt(NetConnection *conn, int i) {
+#ifdef NET_USE_EPOLL
+	if(conn->owner) {
+		epoll_ctl(conn->owner->epoll, EPOLL_CTL_DEL, conn->attempts[i], NULL);
+	}
+#endif
+	closeSocket(conn->attempts[i]);
+	conn->attempts[i] = conn->attempts[--conn->attemptCount];
+}
+
+static void closeAttempts(NetConnection *conn) {
+	while(conn->attemptCount) {
+		closeAttempt(conn, conn->attemptCount - 1);
+	}
+}
+
+static void failConnection(NetConnection *conn, const char *fmt, ...) {
+	va_list parms;
+
+	va_start(parms, fmt);
+	vsnprintf(conn->error, sizeof(conn->error), fmt, parms);
+	va_end(parms);
+
+	conn->failedState = conn->state;
+	conn->state = NET_FAILED;
+#ifdef NET_USE_EPOLL
+	if(conn->owner && conn->events) {
+		epoll_ctl(conn->owner->epoll, EPOLL_CTL_DEL, conn->s, NULL);
+	}
+#endif
+	conn->events = 0;
+	closeSocket(conn->s);
+	conn->s = INVALID_SOCKET;
+	closeAttempts(conn);
+	pthread_cond_broadcast(&conn->changed);
+}
+
+static long long queuedBytes(NetConnection *conn) {
+	return conn->queueHead - conn->queueTail;
+}
+
+static void queueBytes(NetConnection *conn, const char *data, int length) {
+	long	at = (long) (conn->queueHead % NET_QUEUE_BYTES);
+	long	first = NET_QUEUE_BYTES - at;
+
+	if(first > length) {
+		first = length;
+	}
+
+	memcpy(conn->queue + at, data, first);
+	memcpy(conn->queue, data + first, length - first);
+	conn->queueHead += length;
+
+	if(queuedBytes(conn) > conn->stats.queuePeakBytes) {
+		conn->stats.queuePeakBytes = (long) queuedBytes(conn);
+	}
+}
+
+/* Blocks whose last byte has now gone to the socket */
+static void passTimeMarks(NetConnection *conn, long long now) {
+	while(conn->markCount && (conn->marks[conn->markTail].position <= conn->stats.bytesSent)) {
+		if(conn->wireLatency) {
+			latencyRecord(conn->wireLatency, now - conn->marks[conn->markTail].stamp);
+		}
+
+		conn->markTail = (conn->markTail + 1) % NET_TIME_MARKS;
+		conn->markCount--;
+	}
+}
+
+/* Bytes the token bucket lets through now, LONG_MAX without pacing */
+static long paceAllowance(NetConnection *conn, long long now) {
+	if(!conn->paceRate || (conn->state != NET_STREAMING)) {
+		return LONG_MAX;
+	}
+
+	conn->paceTokens += (double) (now - conn->paceRefilled) * conn->paceRate / 1000000.0;
+	if(conn->paceTokens > conn->paceBurst) {
+		conn->paceTokens = conn->paceBurst;
+	}
+
+	conn->paceRefilled = now;
+	return (long) conn->paceTokens;
+}
+
+static void paceHold(NetConnection *conn, long long now) {
+	if(!conn->paceHeldSince) {
+		conn->paceHeldSince = now;
+		conn->stats.pacingHolds++;
+	}
+}
+
+static void paceSpend(NetConnection *conn, long sent, long long now) {
+	if(!conn->paceRate) {
+		return;
+	}
+
+	conn->paceTokens -= sent;
+	if(conn->paceHeldSince) {
+		conn->paceHeldMicros += now - conn->paceHeldSince;
+		conn->paceHeldSince = 0;
+	}
+}
+
+/* Write what is queued until the socket is full or the bucket empty.  0 = the connection failed */
+static int drainQueue(NetConnection *conn) {
+	while(queuedBytes(conn) > 0) {
+		long long	now = getMonotonicMicros();
+		long		allowed = paceAllowance(conn, now);
+
+		if(allowed <= 0) {
+			paceHold(conn, now);
+			return 1;
+		}
+
+		long	at = (long) (conn->queueTail % NET_QUEUE_BYTES);
+		long	queued = ((long) queuedBytes(conn) < allowed) ? (long) queuedBytes(conn) : allowed;
+		long	first = (queued < NET_QUEUE_BYTES - at) ? queued : NET_QUEUE_BYTES - at;
+		long	sent = writeBuffers(conn->s, conn->queue + at, first, conn->queue, queued - first);
+
+		if(sent < 0) {
+			int error = netLastError();
+
+			if(NET_WOULD_BLOCK(error)) {
+				return 1;
+			}
+
+			failConnection(conn, "Send failed: %s", netErrorText(error));
+			return 0;
+		}
+
+		conn->queueTail += sent;
+		conn->stats.bytesSent += sent;
+		conn->stats.writes++;
+		conn->lastProgress = now;
+		paceSpend(conn, sent, now);
+		passTimeMarks(conn, now);
+		pthread_cond_broadcast(&conn->changed);
+
+		if(sent < queued) {
+			return 1;
+		}
+	}
+
+	return 1;
+}
+
+static void startStreaming(NetConnection *conn) {
+	conn->state = NET_STREAMING;
+	conn->deadline = 0;
+	conn->lastProgress = getMonotonicMicros();
+	conn->stats.loginMs = (long) ((conn->lastProgress - conn->phaseStarted) / 1000);
+	conn->paceTokens = conn->paceBurst;
+	conn->paceRefilled = conn->lastProgress;
+	conn->paceHeldSince = 0;
+	conn->paceHeldMicros = 0;
+	pthread_cond_broadcast(&conn->changed);
+}
+
+/* Collects the reply to the current step.  1 = complete (a line, or the server closed after it) */
+static int readReply(NetConnection *conn) {
+	char	*reply = conn->replies[conn->step];
+
+	for(;;) {
+		int room = NET_REPLY_BYTES - 1 - conn->replyLength;
+
+		if(room <= 0) {
+			return 1;
+		}
+
+		int got = recv(conn->s, reply + conn->replyLength, room, 0);
+
+		if(got > 0) {
+			conn->replyLength += got;
+			reply[conn->replyLength] = '\000';
+			if(strchr(reply, '\n')) {
+				return 1;
+			}
+
+			continue;
+		}
+
+		if(got == 0) {
+			if(!conn->replyLength) {
+				failConnection(conn, "Connection closed by the server during login");
+			}
+
+			return conn->replyLength > 0;
+		}
+
+		int error = netLastError();
+
+		if(!NET_WOULD_BLOCK(error)) {
+			failConnection(conn, "Login failed: %s", netErrorText(error));
+		}
+
+		return 0;
+	}
+}
+
+/* Sends each step and checks its reply, as far as the socket allows right now */
+static void advanceHandshake(NetConnection *conn) {
+	while(conn->state == NET_HANDSHAKE) {
+		if(!conn->stepQueued) {
+			if(conn->step >= conn->stepCount) {
+				startStreaming(conn);
+				break;
+			}
+
+			queueBytes(conn, conn->steps[conn->step].text, conn->steps[conn->step].length);
+			conn->stepQueued = 1;
+			conn->replyLength = 0;
+			conn->deadline = getMonotonicMicros() + (long long) NET_REPLY_TIMEOUT_MS * 1000;
+		}
+
+		if(!drainQueue(conn) || (queuedBytes(conn) > 0)) {
+			break;
+		}
+
+		NetStep *step = &conn->steps[conn->step];
+
+		if(step->awaitReply) {
+			if(!readReply(conn)) {
+				break;
+			}
+
+			if(strncmp(conn->replies[conn->step], step->expect, strlen(step->expect))) {
+				char	*end = strpbrk(conn->replies[conn->step], "\r\n");
+
+				if(end) {
+					*end = '\000';
+				}
+
+				failConnection(conn, "Login refused: %s", conn->replies[conn->step]);
+				break;
+			}
+		}
+
+		conn->step++;
+		conn->stepQueued = 0;
+	}
+
+	updateInterest(conn);
+}
+
+/* No Nagle delay, and the kernel takes on little unsent data: what is late waits in the queue, where it is counted */
+static void setLowLatency(SOCKET s) {
+	int on = 1;
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *) &on, sizeof(on));
+#ifdef TCP_NOTSENT_LOWAT
+	int lowat = NET_NOTSENT_LOWAT;
+
+	setsockopt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char *) &lowat, sizeof(lowat));
+#endif
+}
+
+/* The attempt that connected becomes the connection, the others are dropped */
+static void connected(NetConnection *conn, int winner) {
+	SOCKET	s = conn->attempts[winner];
+
+	conn->attempts[winner] = conn->attempts[--conn->attemptCount];
+	closeAttempts(conn);
+	conn->s = s;
+	if(conn->lowLatency) {
+		setLowLatency(s);
+	}
+
+#ifdef NET_USE_EPOLL
+	conn->events = EPOLLOUT;		// as the attempt was registered
+#endif
+
+	long long	now = getMonotonicMicros();
+
+	conn->stats.connectMs = (long) ((now - conn->phaseStarted) / 1000);
+	conn->phaseStarted = now;
+	conn->state = NET_HANDSHAKE;
+	advanceHandshake(conn);
+}
+
+/* Starts connecting to the next address.  Moves on at once past addresses that fail straight away */
+static void startAttempt(NetConnection *conn) {
+	while(conn->nextAddress < conn->addresses.count) {
+		ResolvedAddress *address = &conn->addresses.address[conn->nextAddress++];
+		SOCKET			s = socket(address->family, SOCK_STREAM, 0);
+
+		if(s == INVALID_SOCKET) {
+			snprintf(conn->attemptError, sizeof(conn->attemptError), "%s", netErrorText(netLastError()));
+			continue;
+		}
+
+		if(!setNonBlocking(s)) {
+			snprintf(conn->attemptError, sizeof(conn->attemptError), "%s", netErrorText(netLastError()));
+			closeSocket(s);
+			continue;
+		}
+
+		int done = connect(s, (struct sockaddr *) address->storage, address->length) == 0;
+
+		if(!done && !NET_IN_PROGRESS(netLastError())) {
+			snprintf(conn->attemptError, sizeof(conn->attemptError), "%s", netErrorText(netLastError()));
+			closeSocket(s);
+			continue;
+		}
+
+		conn->attempts[conn->attemptCount++] = s;
+		conn->nextAttemptAt = getMonotonicMicros() + (long long) NET_ATTEMPT_DELAY_MS * 1000;
+#ifdef NET_USE_EPOLL
+		struct epoll_event	event;
+
+		memset(&event, '\000', sizeof(event));
+		event.events = EPOLLOUT;
+		event.data.ptr = conn;
+		epoll_ctl(conn->owner->epoll, EPOLL_CTL_ADD, s, &event);
+#endif
+		if(done) {
+			connected(conn, conn->attemptCount - 1);
+		}
+
+		return;
+	}
+
+	if(!conn->attemptCount) {
+		failConnection(conn, "Connect to %s failed: %s", conn->host, conn->attemptError);
+	}
+}
+
+/* Finds the attempts that finished: the first one connected wins, failed ones are closed */
+static void checkAttempts(NetConnection *conn) {
+	NetPollFd	fds[RESOLVE_MAX_ADDRESSES];
+	int			n = conn->attemptCount;
+
+	for(int i = 0; i < n; i++) {
+		fds[i].fd = conn->attempts[i];
+		fds[i].events = POLLOUT;
+		fds[i].revents = 0;
+	}
+
+	if(netPoll(fds, n, 0) <= 0) {
+		return;
+	}
+
+	for(int i = n - 1; i >= 0; i--) {
+		if(!fds[i].revents) {
+			continue;
+		}
+
+		int			error = 0;
+		socklen_t	length = sizeof(error);
+
+		if(getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, (char *) &error, &length) != 0) {
+			error = netLastError();
+		}
+
+		if(!error && (fds[i].revents & POLLOUT)) {
+			connected(conn, i);
+			return;
+		}
+
+		snprintf(conn->attemptError, sizeof(conn->attemptError), "%s", netErrorText(error ? error : NET_REFUSED));
+		closeAttempt(conn, i);
+	}
+
+	/* the next address without waiting out the delay */
+	if(!conn->attemptCount) {
+		startAttempt(conn);
+	}
+}
+
+/* Lookup answer for netOpen, on a resolver thread or the caller's */
+static void resolved(NetConnection *conn, long generation, const ResolvedAddresses *result) {
+	if((conn->state != NET_CONNECTING) || (conn->generation != generation) || !conn->resolving) {
+		return;
+	}
+
+	conn->resolving = 0;
+	if(!result->count) {
+		failConnection(conn, "Cannot find host %s: %s", conn->host, result->error);
+		return;
+	}
+
+	long long	now = getMonotonicMicros();
+
+	conn->stats.resolveMs = (long) ((now - conn->phaseStarted) / 1000);
+	conn->phaseStarted = now;
+	conn->addresses = *result;
+	conn->nextAddress = 0;
+	snprintf(conn->attemptError, sizeof(conn->attemptError), "no address");
+	startAttempt(conn);
+}
+
+static void resolvedCallback(void *context, long tag, const ResolvedAddresses *result) {
+	NetConnection	*conn = (NetConnection *) context;
+
+	pthread_mutex_lock(&conn->mutex);
+	resolved(conn, tag, result);
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Whatever the server says while we stream is read and dropped, only its close matters */
+static void discardInput(NetConnection *conn) {
+	char	buffer[1024];
+
+	for(;;) {
+		int got = recv(conn->s, buffer, sizeof(buffer), 0);
+
+		if(got > 0) {
+			continue;
+		}
+
+		if(got == 0) {
+			failConnection(conn, "Connection closed by the server");
+		}
+		else if(!NET_WOULD_BLOCK(netLastError())) {
+			failConnection(conn, "Connection lost: %s", netErrorText(netLastError()));
+		}
+
+		return;
+	}
+}
+
+static void serviceConnection(NetConnection *conn, int readable, int writable) {
+	switch(conn->state) {
+		case NET_CONNECTING:
+			checkAttempts(conn);
+			break;
+
+		case NET_HANDSHAKE:
+			advanceHandshake(conn);
+			break;
+
+		case NET_STREAMING:
+			if(readable) {
+				discardInput(conn);
+			}
+
+			if(writable && (conn->state == NET_STREAMING)) {
+				drainQueue(conn);
+			}
+
+			updateInterest(conn);
+			break;
+	}
+}
+
+static void checkTimeout(NetConnection *conn, long long now) {
+	if(conn->deadline && (now > conn->deadline)) {
+		if(conn->state == NET_CONNECTING) {
+			failConnection(conn, conn->resolving ? "Lookup of %s timed out" : "Connect to %s timed out", conn->host);
+		}
+		else if(conn->state == NET_HANDSHAKE) {
+			failConnection(conn, "No reply from the server during login");
+		}
+	}
+
+	if((conn->state == NET_STREAMING) && (queuedBytes(conn) > 0) &&
+	   (now - conn->lastProgress > (long long) NET_STALL_TIMEOUT_MS * 1000)) {
+		failConnection(conn, "Send stalled for %d seconds", NET_STALL_TIMEOUT_MS / 1000);
+	}
+
+	/* the bucket has refilled since it held the queue back */
+	if((conn->state == NET_STREAMING) && conn->paceHeldSince) {
+		drainQueue(conn);
+		updateInterest(conn);
+	}
+
+	/* no answer from the attempts so far, race the next address */
+	if((conn->state == NET_CONNECTING) && !conn->resolving && (now >= conn->nextAttemptAt)) {
+		startAttempt(conn);
+	}
+}
+
+/*
+ =======================================================================================================================
+    Reactor threads
+ =======================================================================================================================
+ */
+static void checkTimeouts(NetReactorThread *t) {
+	long long	now = getMonotonicMicros();
+	int			paced = 0;
+
+	pthread_mutex_lock(&t->mutex);
+	for(int i = 0; i < t->count; i++) {
+		NetConnection	*conn = t->connections[i];
+
+		pthread_mutex_lock(&conn->mutex);
+		checkTimeout(conn, now);
+		if(conn->paceRate && (conn->state == NET_STREAMING)) {
+			paced++;
+		}
+
+		pthread_mutex_unlock(&conn->mutex);
+	}
+
+	t->paced = paced;
+	pthread_mutex_unlock(&t->mutex);
+}
+
+/* Nothing read in this pass is touched after it */
+static void endPass(NetReactorThread *t) {
+	pthread_mutex_lock(&t->mutex);
+	t->passes++;
+	pthread_cond_broadcast(&t->passed);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+#ifdef NET_USE_EPOLL
+static void *reactorThread(void *arg) {
+	NetReactorThread	*t = (NetReactorThread *) arg;
+	struct epoll_event	events[NET_EVENTS_MAX];
+	long long			lastCheck = getMonotonicMicros();
+
+	for(;;) {
+		int tick = t->paced ? NET_PACE_TICK_MS : NET_TICK_MS;
+		int n = epoll_wait(t->epoll, events, NET_EVENTS_MAX, tick);
+
+		for(int i = 0; i < n; i++) {
+			NetConnection	*conn = (NetConnection *) events[i].data.ptr;
+			int				flags = events[i].events;
+
+			pthread_mutex_lock(&conn->mutex);
+			if(conn->owner == t) {
+				serviceConnection(conn, flags & (EPOLLIN | EPOLLERR | EPOLLHUP), flags & (EPOLLOUT | EPOLLERR | EPOLLHUP));
+			}
+
+			pthread_mutex_unlock(&conn->mutex);
+		}
+
+		if(getMonotonicMicros() - lastCheck >= tick * 1000) {
+			checkTimeouts(t);
+			lastCheck = getMonotonicMicros();
+		}
+
+		endPass(t);
+	}
+
+	return NULL;
+}
+#else
+
+/* Portable fallback: the poll set is rebuilt from the connection states every pass */
+static void *reactorThread(void *arg) {
+	NetReactorThread	*t = (NetReactorThread *) arg;
+	NetPollFd			*fds = NULL;
+	NetConnection		**polled = NULL;
+	int					allocated = 0;
+	long long			lastCheck = getMonotonicMicros();
+
+	for(;;) {
+		int n = 0;
+		int tick = t->paced ? NET_PACE_TICK_MS : NET_TICK_MS;
+
+		pthread_mutex_lock(&t->mutex);
+		if(t->count * RESOLVE_MAX_ADDRESSES > allocated) {
+			allocated = t->allocated * RESOLVE_MAX_ADDRESSES;
+			fds = (NetPollFd *) realloc(fds, allocated * sizeof(NetPollFd));
+			polled = (NetConnection **) realloc(polled, allocated * sizeof(NetConnection *));
+		}
+
+		for(int i = 0; i < t->count; i++) {
+			NetConnection	*conn = t->connections[i];
+			short			events = 0;
+
+			pthread_mutex_lock(&conn->mutex);
+			if(conn->state == NET_CONNECTING) {
+				for(int a = 0; a < conn->attemptCount; a++) {
+					fds[n].fd = conn->attempts[a];
+					fds[n].events = POLLOUT;
+					fds[n].revents = 0;
+					polled[n++] = conn;
+				}
+			}
+			else if(conn->state == NET_HANDSHAKE) {
+				events = (queuedBytes(conn) > 0) ? POLLOUT : POLLIN;
+			}
+			else if(conn->state == NET_STREAMING) {
+				events = POLLIN | (((queuedBytes(conn) > 0) && !conn->paceHeldSince) ? POLLOUT : 0);
+			}
+
+			if(events) {
+				fds[n].fd = conn->s;
+				fds[n].events = events;
+				fds[n].revents = 0;
+				polled[n++] = conn;
+			}
+
+			pthread_mutex_unlock(&conn->mutex);
+		}
+
+		pthread_mutex_unlock(&t->mutex);
+
+		if(!n) {
+#ifdef WIN32
+			Sleep(tick);
+#else
+			poll(NULL, 0, tick);
+#endif
+		}
+		else if(netPoll(fds, n, tick) > 0) {
+			for(int i = 0; i < n; i++) {
+				NetConnection	*conn = polled[i];
+				int				flags = fds[i].revents;
+
+				if(!flags) {
+					continue;
+				}
+
+				/* a socket since closed only costs a wasted read or drain */
+				pthread_mutex_lock(&conn->mutex);
+				if(conn->owner == t) {
+					serviceConnection(conn, flags & (POLLIN | POLLERR | POLLHUP), flags & (POLLOUT | POLLERR | POLLHUP));
+				}
+
+				pthread_mutex_unlock(&conn->mutex);
+			}
+		}
+
+		if(getMonotonicMicros() - lastCheck >= tick * 1000) {
+			checkTimeouts(t);
+			lastCheck = getMonotonicMicros();
+		}
+
+		endPass(t);
+	}
+
+	return NULL;
+}
+#endif
+
+/* The threads start with the first connection and run for the life of the process */
+static NetReactorThread *pickReactor(void) {
+	NetReactorThread	*t = NULL;
+
+	pthread_mutex_lock(&reactorMutex);
+	if(!reactorsStarted) {
+		for(int i = 0; i < NET_REACTOR_THREADS; i++) {
+			pthread_mutex_init(&reactors[i].mutex, NULL);
+			pthread_cond_init(&reactors[i].passed, NULL);
+#ifdef NET_USE_EPOLL
+			reactors[i].epoll = epoll_create1(EPOLL_CLOEXEC);
+#endif
+			pthread_create(&reactors[i].thread, NULL, reactorThread, &reactors[i]);
+		}
+
+		reactorsStarted = 1;
+	}
+
+	/* the thread with the fewest connections */
+	for(int i = 0; i < NET_REACTOR_THREADS; i++) {
+		NetReactorThread	*candidate = &reactors[(nextReactor + i) % NET_REACTOR_THREADS];
+
+		if(!t || (candidate->count < t->count)) {
+			t = candidate;
+		}
+	}
+
+	nextReactor = (nextReactor + 1) % NET_REACTOR_THREADS;
+	pthread_mutex_unlock(&reactorMutex);
+	return t;
+}
+
+static int addToReactor(NetReactorThread *t, NetConnection *conn) {
+	pthread_mutex_lock(&t->mutex);
+	if(t->count == t->allocated) {
+		int				grow = t->allocated ? t->allocated * 2 : 16;
+		NetConnection	**connections = (NetConnection **) realloc(t->connections, grow * sizeof(NetConnection *));
+
+		if(!connections) {
+			pthread_mutex_unlock(&t->mutex);
+			return 0;
+		}
+
+		t->connections = connections;
+		t->allocated = grow;
+	}
+
+	t->connections[t->count++] = conn;
+	pthread_mutex_unlock(&t->mutex);
+	return 1;
+}
+
+static void removeFromReactor(NetReactorThread *t, NetConnection *conn) {
+	pthread_mutex_lock(&t->mutex);
+	for(int i = 0; i < t->count; i++) {
+		if(t->connections[i] == conn) {
+			t->connections[i] = t->connections[--t->count];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&t->mutex);
+}
+
+/* A pass that started before the connection was closed may still hold it in its events */
+static void waitReactorPasses(void) {
+	pthread_mutex_lock(&reactorMutex);
+
+	int started = reactorsStarted;
+
+	pthread_mutex_unlock(&reactorMutex);
+	if(!started) {
+		return;
+	}
+
+	for(int i = 0; i < NET_REACTOR_THREADS; i++) {
+		NetReactorThread	*t = &reactors[i];
+
+		pthread_mutex_lock(&t->mutex);
+
+		long	until = t->passes + 1;
+
+		while(t->passes < until) {
+			pthread_cond_wait(&t->passed, &t->mutex);
+		}
+
+		pthread_mutex_unlock(&t->mutex);
+	}
+}
+
+/*
+ =======================================================================================================================
+    API
+ =======================================================================================================================
+ */
+NetConnection *createNetConnection(void) {
+	NetConnection	*conn = (NetConnection *) calloc(1, sizeof(NetConnection));
+
+	if(!conn) {
+		return NULL;
+	}
+
+	conn->queue = (char *) malloc(NET_QUEUE_BYTES);
+	if(!conn->queue) {
+		free(conn);
+		return NULL;
+	}
+
+	pthread_mutex_init(&conn->mutex, NULL);
+	pthread_cond_init(&conn->changed, NULL);
+	conn->s = INVALID_SOCKET;
+	conn->state = NET_IDLE;
+	conn->queueLimit = NET_QUEUE_BYTES;
+	conn->stats.queueSize = NET_QUEUE_BYTES;
+	return conn;
+}
+
+void freeNetConnection(NetConnection *conn) {
+	if(!conn) {
+		return;
+	}
+
+	resolveCancel(conn);
+	netClose(conn);
+	waitReactorPasses();
+	pthread_cond_destroy(&conn->changed);
+	pthread_mutex_destroy(&conn->mutex);
+	free(conn->queue);
+	free(conn);
+}
+
+int netAddHandshake(NetConnection *conn, const char *text, int length, const char *expect) {
+	int ok = 0;
+
+	pthread_mutex_lock(&conn->mutex);
+	if((conn->state == NET_IDLE) && (conn->stepCount < NET_HANDSHAKE_STEPS) && (length <= NET_QUEUE_BYTES)) {
+		NetStep *step = &conn->steps[conn->stepCount];
+
+		step->text = (char *) malloc(length);
+		if(step->text) {
+			memcpy(step->text, text, length);
+			step->length = length;
+			step->awaitReply = (expect != NULL);
+			snprintf(step->expect, sizeof(step->expect), "%s", expect ? expect : "");
+			conn->stepCount++;
+			ok = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+	return ok;
+}
+
+int netOpen(NetConnection *conn, const char *host, int port) {
+	NetReactorThread	*t = pickReactor();
+	ResolvedAddresses	addresses;
+	long				generation;
+
+	pthread_mutex_lock(&conn->mutex);
+	if(conn->state != NET_IDLE) {
+		pthread_mutex_unlock(&conn->mutex);
+		return 0;
+	}
+
+	conn->state = NET_CONNECTING;
+	conn->generation++;
+	conn->error[0] = '\000';
+	conn->step = 0;
+	conn->stepQueued = 0;
+	conn->queueHead = conn->queueTail = 0;
+	conn->markCount = 0;
+	memset(conn->replies, '\000', sizeof(conn->replies));
+	memset(&conn->stats, '\000', sizeof(conn->stats));
+	conn->stats.queueSize = conn->queueLimit;
+	snprintf(conn->host, sizeof(conn->host), "%s", host);
+	conn->resolving = 1;
+	conn->attemptCount = 0;
+	conn->phaseStarted = getMonotonicMicros();
+	conn->deadline = conn->phaseStarted + (long long) NET_CONNECT_TIMEOUT_MS * 1000;
+	conn->owner = t;
+	generation = conn->generation;
+	pthread_mutex_unlock(&conn->mutex);
+
+	if(!addToReactor(t, conn)) {
+		pthread_mutex_lock(&conn->mutex);
+		conn->owner = NULL;
+		failConnection(conn, "Out of memory");
+		pthread_mutex_unlock(&conn->mutex);
+		return 0;
+	}
+
+	/* no lock held here, the resolver calls back with its own */
+	if(resolveHostAsync(host, port, resolvedCallback, conn, generation, &addresses)) {
+		pthread_mutex_lock(&conn->mutex);
+		resolved(conn, generation, &addresses);
+		pthread_mutex_unlock(&conn->mutex);
+	}
+
+	return 1;
+}
+
+int netWaitOpen(NetConnection *conn) {
+	pthread_mutex_lock(&conn->mutex);
+	while((conn->state == NET_CONNECTING) || (conn->state == NET_HANDSHAKE)) {
+		pthread_cond_wait(&conn->changed, &conn->mutex);
+	}
+
+	int state = conn->state;
+
+	pthread_mutex_unlock(&conn->mutex);
+	return state;
+}
+
+int netSend(NetConnection *conn, const char *data, int length) {
+	int			total = length;
+	int			waited = 0;
+	long long	giveUp = 0;
+
+	pthread_mutex_lock(&conn->mutex);
+	while(length > 0) {
+		if(conn->state != NET_STREAMING) {
+			pthread_mutex_unlock(&conn->mutex);
+			return -1;
+		}
+
+		long long	now = getMonotonicMicros();
+		long		allowed = paceAllowance(conn, now);
+
+		/* nothing waiting ahead of it, try the socket on this thread */
+		if((queuedBytes(conn) == 0) && (allowed > 0)) {
+			int sent = send(conn->s, data, (length < allowed) ? length : (int) allowed, NET_SEND_FLAGS);
+
+			if(sent > 0) {
+				data += sent;
+				length -= sent;
+				conn->stats.bytesSent += sent;
+				conn->stats.writes++;
+				conn->stats.directWrites++;
+				conn->lastProgress = now;
+				paceSpend(conn, sent, now);
+				continue;
+			}
+
+			if((sent < 0) && !NET_WOULD_BLOCK(netLastError())) {
+				failConnection(conn, "Send failed: %s", netErrorText(netLastError()));
+				pthread_mutex_unlock(&conn->mutex);
+				return -1;
+			}
+		}
+
+		long	space = conn->queueLimit - (long) queuedBytes(conn);
+
+		if(space <= 0) {
+			struct timespec until;
+
+			if(!waited) {
+				waited = 1;
+				conn->stats.queueWaits++;
+				giveUp = getMonotonicMicros() + (long long) NET_SEND_TIMEOUT_MS * 1000;
+			}
+			else if(getMonotonicMicros() > giveUp) {
+				failConnection(conn, "Send queue full for %d seconds", NET_SEND_TIMEOUT_MS / 1000);
+				pthread_mutex_unlock(&conn->mutex);
+				return -1;
+			}
+
+			/* the queue filled on this call, the reactor thread has to be told before it can drain it */
+			updateInterest(conn);
+			timespec_get(&until, TIME_UTC);
+			until.tv_nsec += NET_TICK_MS * 1000000L;
+			if(until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+
+			pthread_cond_timedwait(&conn->changed, &conn->mutex, &until);
+			continue;
+		}
+
+		int take = (space < length) ? (int) space : length;
+
+		queueBytes(conn, data, take);
+		data += take;
+		length -= take;
+		if(allowed <= 0) {
+			paceHold(conn, now);
+		}
+	}
+
+	updateInterest(conn);
+	pthread_mutex_unlock(&conn->mutex);
+	return total;
+}
+
+int netSendNoWait(NetConnection *conn, const char *data, int length) {
+	int total = length;
+
+	pthread_mutex_lock(&conn->mutex);
+	if(conn->state != NET_STREAMING) {
+		pthread_mutex_unlock(&conn->mutex);
+		return -1;
+	}
+
+	long long	now = getMonotonicMicros();
+	long		allowed = paceAllowance(conn, now);
+
+	if((queuedBytes(conn) == 0) && (allowed > 0)) {
+		int sent = send(conn->s, data, (length < allowed) ? length : (int) allowed, NET_SEND_FLAGS);
+
+		if(sent > 0) {
+			data += sent;
+			length -= sent;
+			conn->stats.bytesSent += sent;
+			conn->stats.writes++;
+			conn->stats.directWrites++;
+			conn->lastProgress = now;
+			paceSpend(conn, sent, now);
+		}
+		else if((sent < 0) && !NET_WOULD_BLOCK(netLastError())) {
+			failConnection(conn, "Send failed: %s", netErrorText(netLastError()));
+			pthread_mutex_unlock(&conn->mutex);
+			return -1;
+		}
+	}
+
+	if(length > conn->queueLimit - queuedBytes(conn)) {
+		failConnection(conn, "Send queue full, the connection fell behind");
+		pthread_mutex_unlock(&conn->mutex);
+		return -1;
+	}
+
+	if(length > 0) {
+		queueBytes(conn, data, length);
+		if(paceAllowance(conn, now) <= 0) {
+			paceHold(conn, now);
+		}
+
+		updateInterest(conn);
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+	return total;
+}
+
+void netClose(NetConnection *conn) {
+	NetReactorThread	*t;
+
+	pthread_mutex_lock(&conn->mutex);
+	t = conn->owner;
+	pthread_mutex_unlock(&conn->mutex);
+
+	/* list first, connection second, as everywhere */
+	if(t) {
+		removeFromReactor(t, conn);
+	}
+
+	pthread_mutex_lock(&conn->mutex);
+#ifdef NET_USE_EPOLL
+	if(t && conn->events) {
+		epoll_ctl(t->epoll, EPOLL_CTL_DEL, conn->s, NULL);
+	}
+#endif
+	conn->events = 0;
+	closeSocket(conn->s);
+	conn->s = INVALID_SOCKET;
+	closeAttempts(conn);
+	conn->owner = NULL;
+	conn->state = NET_IDLE;
+	for(int i = 0; i < conn->stepCount; i++) {
+		free(conn->steps[i].text);
+	}
+
+	memset(conn->steps, '\000', sizeof(conn->steps));
+	conn->stepCount = 0;
+	pthread_cond_broadcast(&conn->changed);
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+int netGetState(NetConnection *conn) {
+	pthread_mutex_lock(&conn->mutex);
+
+	int state = conn->state;
+
+	pthread_mutex_unlock(&conn->mutex);
+	return state;
+}
+
+int netGetFailedState(NetConnection *conn) {
+	return conn->failedState;
+}
+
+const char *netGetError(NetConnection *conn) {
+	return conn->error;
+}
+
+const char *netGetReply(NetConnection *conn, int step) {
+	return ((step >= 0) && (step < NET_HANDSHAKE_STEPS)) ? conn->replies[step] : "";
+}
+
+SOCKET netGetSocket(NetConnection *conn) {
+	return conn->s;
+}
+
+void netSetPacing(NetConnection *conn, long bytesPerSecond, long burstBytes) {
+	/* a bucket smaller than two refill ticks would cap the rate below bytesPerSecond */
+	long	tickBytes = (long) (((long long) bytesPerSecond * NET_PACE_TICK_MS * 2) / 1000);
+
+	pthread_mutex_lock(&conn->mutex);
+	conn->paceRate = (bytesPerSecond > 0) ? bytesPerSecond : 0;
+	conn->paceBurst = (burstBytes > tickBytes) ? burstBytes : tickBytes;
+	if(conn->paceTokens > conn->paceBurst) {
+		conn->paceTokens = conn->paceBurst;
+	}
+
+	conn->paceRefilled = getMonotonicMicros();
+	if(!conn->paceRate && conn->paceHeldSince) {
+		conn->paceHeldMicros += conn->paceRefilled - conn->paceHeldSince;
+		conn->paceHeldSince = 0;
+		updateInterest(conn);
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+void netSetLowLatency(NetConnection *conn, long queueBytes) {
+	pthread_mutex_lock(&conn->mutex);
+	conn->lowLatency = (queueBytes > 0);
+	conn->queueLimit = (conn->lowLatency && (queueBytes < NET_QUEUE_BYTES)) ? queueBytes : NET_QUEUE_BYTES;
+	conn->stats.queueSize = conn->queueLimit;
+	if(conn->lowLatency && (conn->s != INVALID_SOCKET)) {
+		setLowLatency(conn->s);
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+void netSetLatencyHistogram(NetConnection *conn, LatencyHistogram *wire) {
+	pthread_mutex_lock(&conn->mutex);
+	conn->wireLatency = wire;
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+void netResetLatencyHistogram(NetConnection *conn) {
+	pthread_mutex_lock(&conn->mutex);
+	if(conn->wireLatency) {
+		latencyReset(conn->wireLatency);
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+void netMarkTime(NetConnection *conn, long long captureMicros) {
+	pthread_mutex_lock(&conn->mutex);
+	if(conn->state == NET_STREAMING) {
+		long long	position = conn->stats.bytesSent + queuedBytes(conn);
+
+		/* all of it went out directly */
+		if(!queuedBytes(conn)) {
+			if(conn->wireLatency) {
+				latencyRecord(conn->wireLatency, getMonotonicMicros() - captureMicros);
+			}
+		}
+		else if(conn->markCount == NET_TIME_MARKS) {
+			conn->marks[(conn->markTail + conn->markCount - 1) % NET_TIME_MARKS].position = position;
+		}
+		else {
+			NetTimeMark *mark = &conn->marks[(conn->markTail + conn->markCount) % NET_TIME_MARKS];
+
+			mark->position = position;
+			mark->stamp = captureMicros;
+			conn->markCount++;
+		}
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+void netGetStats(NetConnection *conn, NetStats *stats) {
+	long long	held;
+
+	pthread_mutex_lock(&conn->mutex);
+	*stats = conn->stats;
+	stats->queuedBytes = (long) queuedBytes(conn);
+	held = conn->paceHeldMicros + (conn->paceHeldSince ? getMonotonicMicros() - conn->paceHeldSince : 0);
+	stats->pacingDelayMs = (long) (held / 1000);
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+long netGetBacklog(NetConnection *conn) {
+	long	backlog = 0;
+
+	pthread_mutex_lock(&conn->mutex);
+	if(conn->state == NET_STREAMING) {
+		backlog = (long) queuedBytes(conn);
+#ifdef NET_HAVE_SIOCOUTQ
+		int unsent = 0;
+
+		/* sent but not yet acknowledged counts too, it is what a slow link holds back */
+		if(ioctl(conn->s, SIOCOUTQ, &unsent) == 0) {
+			backlog += unsent;
+		}
+#endif
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+	return backlog;
+}
@@ -0,0 +1,108 @@
+#ifndef __NET_REACTOR_H__
+#define __NET_REACTOR_H__
+
+#include "libmcaster1dspencoder_socket.h"
+#include "latency_histogram.h"
+
+/*
+ * Non-blocking source connections.  A small pool of reactor threads (epoll
+ * on Linux, poll/WSAPoll elsewhere) owns every socket: it runs connect and
+ * the login handshake as a state machine, drains the outbound queue with
+ * one gathered write per wakeup and enforces the timeouts.  Host names go
+ * through the lookup cache in net_resolver.h and the IPv4 and IPv6
+ * addresses are raced.  The encoder thread only copies into the queue;
+ * when the queue is empty it tries the socket directly first, so an idle
+ * connection costs no thread handoff.
+ */
+#define NET_REACTOR_THREADS		2
+#define NET_QUEUE_BYTES			(512 * 1024)
+#define NET_CONNECT_TIMEOUT_MS	10000	// lookup and connect
+#define NET_ATTEMPT_DELAY_MS	250		// before racing the next address
+#define NET_REPLY_TIMEOUT_MS	10000	// for each handshake reply
+#define NET_STALL_TIMEOUT_MS	10000	// queued data and no byte written
+#define NET_SEND_TIMEOUT_MS		10000	// netSend waiting for queue space
+#define NET_TICK_MS				100		// timeout checks
+#define NET_PACE_TICK_MS		10		// timeout checks and bucket refills while a connection is paced
+#define NET_NOTSENT_LOWAT		16384	// low latency: unsent bytes the kernel takes on
+#define NET_HANDSHAKE_STEPS		4
+#define NET_TIME_MARKS			256		// blocks in flight with a capture time
+#define NET_REPLY_BYTES			1024
+
+#define NET_IDLE		0
+#define NET_CONNECTING	1
+#define NET_HANDSHAKE	2
+#define NET_STREAMING	3
+#define NET_FAILED		4
+
+typedef struct tagNetStats {
+	long		queueSize;
+	long		queuedBytes;
+	long		queuePeakBytes;
+	long long	bytesSent;
+	long		writes;				// socket writes, gathered or direct
+	long		directWrites;		// done on the caller's thread, the queue was empty
+	long		queueWaits;			// netSend found the queue full
+	long		resolveMs;			// phases of the last netOpen, 0 until reached
+	long		connectMs;			// the winning attempt, the address race included
+	long		loginMs;			// all handshake steps
+	long		pacingHolds;		// times the token bucket ran dry with data queued
+	long		pacingDelayMs;		// total time it held it back
+} NetStats;
+
+typedef struct tagNetConnection NetConnection;
+
+NetConnection	*createNetConnection(void);
+void			freeNetConnection(NetConnection *conn);
+
+/*
+ * Login steps, sent in order once the socket is connected.  With expect
+ * the reply must start with it before the next step (Shoutcast "OK"), NULL
+ * goes straight on.  Cleared by netClose.
+ */
+int				netAddHandshake(NetConnection *conn, const char *text, int length, const char *expect);
+/* Starts connect and handshake on a reactor thread.  1 = started */
+int				netOpen(NetConnection *conn, const char *host, int port);
+/* Blocks the caller until streaming or failed, returns the state */
+int				netWaitOpen(NetConnection *conn);
+/* Queue for sending.  Bytes taken, -1 = the connection failed or is closed */
+int				netSend(NetConnection *conn, const char *data, int length);
+/* Never waits: what does not fit in the queue now fails the connection.  For mirrors that must not hold up the caller */
+int				netSendNoWait(NetConnection *conn, const char *data, int length);
+void			netClose(NetConnection *conn);
+/*
+ * Token bucket between the queue and the socket: once streaming, at most
+ * burstBytes go out at once and bytesPerSecond on average.  0 = no pacing.
+ * Data held back waits in the queue and counts as backlog.
+ */
+void			netSetPacing(NetConnection *conn, long bytesPerSecond, long burstBytes);
+/*
+ * queueBytes > 0: no Nagle delay, little unsent data in the kernel
+ * (TCP_NOTSENT_LOWAT where there is one) and a queue bounded to queueBytes,
+ * so late data waits where netSend sees it.  0 = the defaults.
+ */
+void			netSetLowLatency(NetConnection *conn, long queueBytes);
+/*
+ * Capture to wire: netMarkTime after a netSend stamps the end of what was
+ * sent with the capture time of its audio.  When send() has taken the
+ * last of those bytes the time since the stamp goes into the histogram set
+ * here, which the caller owns.  Past NET_TIME_MARKS blocks in flight the
+ * newest mark takes in the next block, keeping the older stamp.  The reactor
+ * thread records under the connection's lock, so the caller empties the
+ * histogram with netResetLatencyHistogram.
+ */
+void			netSetLatencyHistogram(NetConnection *conn, LatencyHistogram *wire);
+void			netResetLatencyHistogram(NetConnection *conn);
+void			netMarkTime(NetConnection *conn, long long captureMicros);
+
+int				netGetState(NetConnection *conn);
+/* State the connection was in when it failed, and why */
+int				netGetFailedState(NetConnection *conn);
+const char		*netGetError(NetConnection *conn);
+/* Reply to handshake step n, "" if none */
+const char		*netGetReply(NetConnection *conn, int step);
+SOCKET			netGetSocket(NetConnection *conn);
+void			netGetStats(NetConnection *conn, NetStats *stats);
+/* Bytes written but not yet out: the queue, plus the kernel send queue on Linux (SIOCOUTQ) */
+long			netGetBacklog(NetConnection *conn);
+
+#endif //__NET_REACTOR_H__
@@ -0,0 +1,367 @@
+/*
+ * net_resolver.cpp - cached host name lookups on resolver threads
+ *
+ * One cache entry per host name.  A lookup that is already running collects
+ * further callers as waiters instead of starting a second one, and every
+ * waiter is answered with its own port filled in.  Callbacks run with the
+ * resolver mutex held, which is what makes resolveCancel final.
+ */
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+#include "libmcaster1dspencoder.h"
+#include "net_resolver.h"
+
+typedef struct tagResolveWaiter {
+	ResolveCallback			callback;
+	void					*context;
+	long					tag;
+	int						port;
+	struct tagResolveWaiter	*next;
+} ResolveWaiter;
+
+typedef struct tagResolveEntry {
+	char					host[256];
+	ResolvedAddresses		addresses;		// port 0
+	long long				expires;		// monotonic micros, 0 = never looked up
+	long long				staleUntil;
+	int						queued;			// for a resolver thread
+	int						running;
+	ResolveWaiter			*waiters;
+	struct tagResolveEntry	*next;
+} ResolveEntry;
+
+typedef struct tagBlockingLookup {
+	ResolvedAddresses	*result;
+	int					done;
+} BlockingLookup;
+
+static pthread_mutex_t	resolverMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	resolverWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	resolverDone = PTHREAD_COND_INITIALIZER;	// for resolveHost
+static ResolveEntry		*cache = NULL;
+static int				resolverStarted = 0;
+
+static void setPort(ResolvedAddress *address, int port) {
+	if(address->family == AF_INET6) {
+		((struct sockaddr_in6 *) address->storage)->sin6_port = htons((unsigned short) port);
+	}
+	else {
+		((struct sockaddr_in *) address->storage)->sin_port = htons((unsigned short) port);
+	}
+}
+
+static void copyWithPort(const ResolvedAddresses *in, int port, ResolvedAddresses *out) {
+	*out = *in;
+	for(int i = 0; i < out->count; i++) {
+		setPort(&out->address[i], port);
+	}
+}
+
+/* getaddrinfo, then the families interleaved starting with the first one returned */
+static void lookupHost(const char *host, ResolvedAddresses *out) {
+	struct addrinfo		hints;
+	struct addrinfo		*list = NULL;
+	ResolvedAddress		found[RESOLVE_MAX_ADDRESSES];
+	int					foundCount = 0;
+
+	memset(out, '\000', sizeof(*out));
+	memset(&hints, '\000', sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	int error = getaddrinfo(host, NULL, &hints, &list);
+
+	if(error != 0) {
+		snprintf(out->error, sizeof(out->error), "%s", gai_strerror(error));
+		return;
+	}
+
+	for(struct addrinfo *ai = list; ai && (foundCount < RESOLVE_MAX_ADDRESSES); ai = ai->ai_next) {
+		if(((ai->ai_family != AF_INET) && (ai->ai_family != AF_INET6)) || (ai->ai_addrlen > sizeof(found[0].storage))) {
+			continue;
+		}
+
+		int duplicate = 0;
+
+		for(int i = 0; i < foundCount; i++) {
+			if((found[i].length == (int) ai->ai_addrlen) && !memcmp(found[i].storage, ai->ai_addr, ai->ai_addrlen)) {
+				duplicate = 1;
+			}
+		}
+
+		if(!duplicate) {
+			memset(&found[foundCount], '\000', sizeof(found[0]));
+			found[foundCount].family = ai->ai_family;
+			found[foundCount].length = (int) ai->ai_addrlen;
+			memcpy(found[foundCount].storage, ai->ai_addr, ai->ai_addrlen);
+			foundCount++;
+		}
+	}
+
+	freeaddrinfo(list);
+
+	if(!foundCount) {
+		snprintf(out->error, sizeof(out->error), "no IPv4 or IPv6 address");
+		return;
+	}
+
+	int taken[RESOLVE_MAX_ADDRESSES] = { 0 };
+	int family = found[0].family;
+
+	while(out->count < foundCount) {
+		int next = -1;
+
+		for(int i = 0; i < foundCount; i++) {
+			if(!taken[i] && (found[i].family == family)) {
+				next = i;
+				break;
+			}
+		}
+
+		/* one family ran out, the rest are the other one */
+		for(int i = 0; (next < 0) && (i < foundCount); i++) {
+			if(!taken[i]) {
+				next = i;
+			}
+		}
+
+		taken[next] = 1;
+		out->address[out->count++] = found[next];
+		family = (family == AF_INET) ? AF_INET6 : AF_INET;
+	}
+}
+
+static ResolveEntry *findEntry(const char *host) {
+	ResolveEntry	*entry;
+
+	for(entry = cache; entry; entry = entry->next) {
+		if(!strcmp(entry->host, host)) {
+			return entry;
+		}
+	}
+
+	entry = (ResolveEntry *) calloc(1, sizeof(ResolveEntry));
+	if(entry) {
+		snprintf(entry->host, sizeof(entry->host), "%s", host);
+		entry->next = cache;
+		cache = entry;
+	}
+
+	return entry;
+}
+
+static void queueLookup(ResolveEntry *entry) {
+	if(!entry->queued && !entry->running) {
+		entry->queued = 1;
+		pthread_cond_signal(&resolverWork);
+	}
+}
+
+static void *resolverThread(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&resolverMutex);
+	for(;;) {
+		ResolveEntry	*entry;
+
+		for(entry = cache; entry && !entry->queued; entry = entry->next) {
+		}
+
+		if(!entry) {
+			pthread_cond_wait(&resolverWork, &resolverMutex);
+			continue;
+		}
+
+		char				host[256];
+		ResolvedAddresses	fresh;
+
+		entry->queued = 0;
+		entry->running = 1;
+		strcpy(host, entry->host);
+		pthread_mutex_unlock(&resolverMutex);
+
+		lookupHost(host, &fresh);
+
+		pthread_mutex_lock(&resolverMutex);
+
+		long long	now = getMonotonicMicros();
+
+		entry->running = 0;
+		if(fresh.count) {
+			entry->addresses = fresh;
+			entry->expires = now + (long long) RESOLVE_TTL_SECONDS * 1000000;
+			entry->staleUntil = now + (long long) RESOLVE_STALE_SECONDS * 1000000;
+		}
+		else if(entry->addresses.count && (now < entry->staleUntil)) {
+			/* the old answer stays, the next caller after this tries again */
+			entry->expires = now + (long long) RESOLVE_NEGATIVE_SECONDS * 1000000;
+		}
+		else {
+			entry->addresses = fresh;
+			entry->expires = now + (long long) RESOLVE_NEGATIVE_SECONDS * 1000000;
+			entry->staleUntil = 0;
+		}
+
+		while(entry->waiters) {
+			ResolveWaiter		*waiter = entry->waiters;
+			ResolvedAddresses	result;
+
+			entry->waiters = waiter->next;
+			copyWithPort(&entry->addresses, waiter->port, &result);
+			waiter->callback(waiter->context, waiter->tag, &result);
+			free(waiter);
+		}
+	}
+
+	return NULL;
+}
+
+/* With resolverMutex held.  1 = answered into result */
+static int lookupLocked(const char *host, int port, ResolveCallback callback, void *context, long tag, ResolvedAddresses *result) {
+	if(!resolverStarted) {
+		for(int i = 0; i < RESOLVE_THREADS; i++) {
+			pthread_t	thread;
+
+			pthread_create(&thread, NULL, resolverThread, NULL);
+			pthread_detach(thread);
+		}
+
+		resolverStarted = 1;
+	}
+
+	ResolveEntry	*entry = findEntry(host);
+	long long		now = getMonotonicMicros();
+
+	if(!entry) {
+		memset(result, '\000', sizeof(*result));
+		snprintf(result->error, sizeof(result->error), "out of memory");
+		return 1;
+	}
+
+	if(entry->expires) {
+		if(entry->addresses.count && (now < entry->staleUntil)) {
+			if(now >= entry->expires) {
+				queueLookup(entry);
+			}
+
+			copyWithPort(&entry->addresses, port, result);
+			return 1;
+		}
+
+		if(!entry->addresses.count && (now < entry->expires)) {
+			*result = entry->addresses;
+			return 1;
+		}
+	}
+
+	ResolveWaiter	*waiter = (ResolveWaiter *) calloc(1, sizeof(ResolveWaiter));
+
+	if(!waiter) {
+		memset(result, '\000', sizeof(*result));
+		snprintf(result->error, sizeof(result->error), "out of memory");
+		return 1;
+	}
+
+	waiter->callback = callback;
+	waiter->context = context;
+	waiter->tag = tag;
+	waiter->port = port;
+	waiter->next = entry->waiters;
+	entry->waiters = waiter;
+	queueLookup(entry);
+	return 0;
+}
+
+static void cancelLocked(void *context) {
+	for(ResolveEntry *entry = cache; entry; entry = entry->next) {
+		ResolveWaiter	**link = &entry->waiters;
+
+		while(*link) {
+			ResolveWaiter	*waiter = *link;
+
+			if(waiter->context == context) {
+				*link = waiter->next;
+				free(waiter);
+			}
+			else {
+				link = &waiter->next;
+			}
+		}
+	}
+}
+
+static void blockingDone(void *context, long tag, const ResolvedAddresses *result) {
+	BlockingLookup	*lookup = (BlockingLookup *) context;
+
+	(void) tag;
+
+	*lookup->result = *result;
+	lookup->done = 1;
+	pthread_cond_broadcast(&resolverDone);
+}
+
+/*
+ =======================================================================================================================
+    API
+ =======================================================================================================================
+ */
+int resolveHostAsync(const char *host, int port, ResolveCallback callback, void *context, long tag, ResolvedAddresses *result) {
+	pthread_mutex_lock(&resolverMutex);
+
+	int answered = lookupLocked(host, port, callback, context, tag, result);
+
+	pthread_mutex_unlock(&resolverMutex);
+	return answered;
+}
+
+int resolveHost(const char *host, int port, ResolvedAddresses *result, int timeoutMs) {
+	BlockingLookup	lookup;
+	long long		giveUp = getMonotonicMicros() + (long long) timeoutMs * 1000;
+
+	lookup.result = result;
+	lookup.done = 0;
+
+	pthread_mutex_lock(&resolverMutex);
+	lookup.done = lookupLocked(host, port, blockingDone, &lookup, 0, result);
+	while(!lookup.done) {
+		struct timespec until;
+
+		if(getMonotonicMicros() > giveUp) {
+			cancelLocked(&lookup);
+			memset(result, '\000', sizeof(*result));
+			snprintf(result->error, sizeof(result->error), "lookup timed out");
+			break;
+		}
+
+		timespec_get(&until, TIME_UTC);
+		until.tv_nsec += 100 * 1000000L;
+		if(until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&resolverDone, &resolverMutex, &until);
+	}
+
+	pthread_mutex_unlock(&resolverMutex);
+	return result->count > 0;
+}
+
+void resolveCancel(void *context) {
+	pthread_mutex_lock(&resolverMutex);
+	cancelLocked(context);
+	pthread_mutex_unlock(&resolverMutex);
+}
@@ -0,0 +1,49 @@
+#ifndef __NET_RESOLVER_H__
+#define __NET_RESOLVER_H__
+
+/*
+ * Host name lookups off the calling thread.  getaddrinfo runs on a couple of
+ * resolver threads and the answers, IPv4 and IPv6, are cached per host.
+ * getaddrinfo does not hand out the record TTL, so an answer is trusted for
+ * RESOLVE_TTL_SECONDS; after that it is still returned at once while a
+ * refresh runs behind it, and kept if the refresh fails.  Failed lookups are
+ * remembered for RESOLVE_NEGATIVE_SECONDS so a reconnect loop does not
+ * hammer the resolver.
+ *
+ * Addresses come back in connect order (RFC 8305): the families alternate,
+ * starting with the one the system prefers.
+ */
+#define RESOLVE_THREADS				2
+#define RESOLVE_TTL_SECONDS			300
+#define RESOLVE_STALE_SECONDS		86400	// an expired answer is used this long if refreshes fail
+#define RESOLVE_NEGATIVE_SECONDS	10
+#define RESOLVE_MAX_ADDRESSES		8
+#define RESOLVE_TIMEOUT_MS			10000	// resolveHost
+
+typedef struct tagResolvedAddress {
+	int			family;				// AF_INET or AF_INET6
+	int			length;				// of the sockaddr in storage
+	long long	storage[4];			// struct sockaddr_in or sockaddr_in6, port filled in
+} ResolvedAddress;
+
+typedef struct tagResolvedAddresses {
+	int				count;
+	ResolvedAddress	address[RESOLVE_MAX_ADDRESSES];
+	char			error[128];		// count == 0
+} ResolvedAddresses;
+
+/* Runs on a resolver thread; must not call back into the resolver */
+typedef void (*ResolveCallback) (void *context, long tag, const ResolvedAddresses *result);
+
+/*
+ * 1 = answered from the cache into result, the callback is not called.  0 =
+ * the callback gets the answer later, unless resolveCancel(context) runs
+ * first.
+ */
+int		resolveHostAsync(const char *host, int port, ResolveCallback callback, void *context, long tag, ResolvedAddresses *result);
+/* Blocks for at most timeoutMs.  1 = at least one address */
+int		resolveHost(const char *host, int port, ResolvedAddresses *result, int timeoutMs);
+/* No callback for context runs after this returns */
+void	resolveCancel(void *context);
+
+#endif //__NET_RESOLVER_H__
@@ -0,0 +1,220 @@
+/*
+ * pipeline_trace.cpp - per thread span rings, dumped as Chrome trace JSON
+ *
+ * A ring has one writer, its thread, which fills the slot and then
+ * publishes the new count with a release store.  The dump copies a ring
+ * and reads the count again afterwards: whatever the writer may have
+ * overwritten during the copy is thrown away.  traceMutex only guards the
+ * ring table, a thread takes it once to get its ring.
+ *
+ * A ring goes back to the table when its thread ends, so the archive
+ * writer threads that come and go with connections do not use them up.
+ * The dump names a thread after the oldest span left in its ring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "libmcaster1dspencoder.h"
+#include "pipeline_trace.h"
+
+typedef struct tagTraceEvent {
+	long long	micros;
+	const char	*name;
+	int			slot;
+	char		phase;
+} TraceEvent;
+
+typedef struct tagTraceRing {
+	TraceEvent				events[TRACE_RING_EVENTS];
+	std::atomic<long long>	written;
+	std::atomic<int>		live;			// its thread is still running
+	int						tid;
+} TraceRing;
+
+/* Hands the ring back when the thread ends */
+struct TraceThread {
+	TraceRing	*ring;
+	int			full;						// no ring was free, do not ask again
+	~TraceThread() {
+		if(ring) {
+			ring->live.store(0, std::memory_order_release);
+		}
+	}
+};
+
+std::atomic<int>				traceEnabled(0);
+
+static pthread_mutex_t			traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing				*traceRings[TRACE_MAX_THREADS];
+static int						traceNextTid = 1;
+static thread_local TraceThread	traceThread;
+
+static TraceRing *traceAttach(void) {
+	TraceRing	*ring = NULL;
+
+	pthread_mutex_lock(&traceMutex);
+	for(int i = 0; (i < TRACE_MAX_THREADS) && !ring; i++) {
+		if(!traceRings[i]) {
+			traceRings[i] = (TraceRing *) calloc(1, sizeof(TraceRing));
+			ring = traceRings[i];
+		}
+		else if(!traceRings[i]->live.load(std::memory_order_acquire)) {
+			/* left by a thread that ended, its spans go with it */
+			ring = traceRings[i];
+		}
+	}
+
+	if(ring) {
+		ring->written.store(0, std::memory_order_relaxed);
+		ring->live.store(1, std::memory_order_relaxed);
+		ring->tid = traceNextTid++;
+	}
+
+	pthread_mutex_unlock(&traceMutex);
+
+	traceThread.ring = ring;
+	traceThread.full = !ring;
+	return ring;
+}
+
+void traceEvent(const char *name, char phase, int slot) {
+	TraceRing	*ring = traceThread.ring;
+
+	if(!ring) {
+		if(traceThread.full || !(ring = traceAttach())) {
+			return;
+		}
+	}
+
+	long long	n = ring->written.load(std::memory_order_relaxed);
+	TraceEvent	*e = &ring->events[n & (TRACE_RING_EVENTS - 1)];
+
+	e->micros = getMonotonicMicros();
+	e->name = name;
+	e->slot = slot;
+	e->phase = phase;
+	ring->written.store(n + 1, std::memory_order_release);
+}
+
+void setTraceEnabled(int on) {
+	traceEnabled.store(on ? 1 : 0, std::memory_order_relaxed);
+}
+
+/*
+ =======================================================================================================================
+    Dump
+ =======================================================================================================================
+ */
+typedef struct tagTraceText {
+	char	*data;
+	int		length;
+	int		size;
+} TraceText;
+
+/* names are literals from this tree, nothing in them needs escaping */
+static int appendJSON(TraceText *t, const char *fmt, ...) {
+	for(;;) {
+		int		room = t->size - t->length;
+		int		n = -1;
+		va_list	parms;
+
+		if(room > 0) {
+			va_start(parms, fmt);
+			n = vsnprintf(t->data + t->length, room, fmt, parms);
+			va_end(parms);
+		}
+
+		if((n >= 0) && (n < room)) {
+			t->length += n;
+			return 1;
+		}
+
+		int		size = (t->size ? t->size * 2 : 1024 * 1024);
+		char	*data = (char *) realloc(t->data, size);
+
+		if(!data) {
+			return 0;
+		}
+
+		t->data = data;
+		t->size = size;
+	}
+}
+
+static void dumpRing(TraceText *t, TraceRing *ring, TraceEvent *copy, int *first) {
+	long long	written = ring->written.load(std::memory_order_acquire);
+	long long	from = (written > TRACE_RING_EVENTS) ? written - TRACE_RING_EVENTS : 0;
+
+	for(long long n = from; n < written; n++) {
+		copy[n - from] = ring->events[n & (TRACE_RING_EVENTS - 1)];
+	}
+
+	/* the writer kept going during the copy, what it got round to again is torn */
+	long long	valid = ring->written.load(std::memory_order_acquire) - TRACE_RING_EVENTS + 1;
+
+	if(valid < from) {
+		valid = from;
+	}
+
+	int			depth = 0;
+	const char	*threadName = NULL;
+
+	for(long long n = valid; n < written; n++) {
+		TraceEvent	*e = &copy[n - from];
+
+		/* the begin of this one was overwritten, or tracing was switched on inside it */
+		if(e->phase == 'E') {
+			if(!depth) {
+				continue;
+			}
+
+			depth--;
+		}
+		else {
+			depth++;
+		}
+
+		if(!threadName) {
+			threadName = e->name;
+		}
+
+		appendJSON(t, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%d,\"args\":{\"slot\":%d}}",
+				   *first ? "" : ",\n", e->name, e->phase, e->micros, ring->tid, e->slot);
+		*first = 0;
+	}
+
+	if(threadName) {
+		appendJSON(t, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", ring->tid, threadName);
+	}
+}
+
+char *traceDumpJSON(int *length) {
+	TraceText	t = { NULL, 0, 0 };
+	TraceEvent	*copy = (TraceEvent *) malloc(sizeof(TraceEvent) * TRACE_RING_EVENTS);
+	int			first = 1;
+
+	if(!copy) {
+		return NULL;
+	}
+
+	appendJSON(&t, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	pthread_mutex_lock(&traceMutex);
+	for(int i = 0; i < TRACE_MAX_THREADS; i++) {
+		if(traceRings[i]) {
+			dumpRing(&t, traceRings[i], copy, &first);
+		}
+	}
+
+	pthread_mutex_unlock(&traceMutex);
+	free(copy);
+
+	if(!appendJSON(&t, "\n]}\n")) {
+		free(t.data);
+		return NULL;
+	}
+
+	*length = t.length;
+	return t.data;
+}
@@ -0,0 +1,31 @@
+#ifndef __PIPELINE_TRACE_H__
+#define __PIPELINE_TRACE_H__
+
+#include <atomic>
+
+/*
+ * Timeline of the audio pipeline, for finding the stage that blew a
+ * deadline.  TRACE_BEGIN and TRACE_END record a span into a ring owned by
+ * the calling thread: no lock, the oldest events are overwritten.  The
+ * rings are dumped on demand as Chrome trace event JSON, which
+ * chrome://tracing and ui.perfetto.dev open as they are.
+ *
+ * Switched off, a trace point is one load and one untaken branch.  Names
+ * must be string literals or otherwise outlive the dump, only the pointer
+ * is kept.
+ */
+#define TRACE_RING_EVENTS	32768		// per thread, a power of two
+#define TRACE_MAX_THREADS	64
+
+extern std::atomic<int>	traceEnabled;
+
+#define TRACE_BEGIN(name, slot)	do { if(traceEnabled.load(std::memory_order_relaxed)) traceEvent((name), 'B', (slot)); } while(0)
+#define TRACE_END(name, slot)	do { if(traceEnabled.load(std::memory_order_relaxed)) traceEvent((name), 'E', (slot)); } while(0)
+
+/* slot is the encoder number, 0 = not tied to a slot */
+void	traceEvent(const char *name, char phase, int slot);
+void	setTraceEnabled(int on);
+/* The rings as one JSON document, malloc'd for the caller to free.  NULL = out of memory */
+char	*traceDumpJSON(int *length);
+
+#endif //__PIPELINE_TRACE_H__
@@ -0,0 +1,454 @@
+/*
+ * reconnect_scheduler.cpp - backoff reconnects and standby connections
+ *
+ * schedulerMutex guards the slot list and every reconnect and standby field
+ * of a slot.  A pool thread claims a slot with reconnectRunning before it
+ * drops the mutex for connectToServer or a standby login, so a slot never has
+ * two jobs at once.  g->standby only changes under the mutex; the encoder
+ * thread reads it without, it is the only thread that swaps it.  A job
+ * does not touch the slot once it has cleared reconnectRunning, and
+ * schedulerIdle is signalled then, so reconnectUnregister can wait for it
+ * before the slot is freed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libmcaster1dspencoder.h"
+#include "net_reactor.h"
+#include "reconnect_scheduler.h"
+#include "metrics_server.h"
+
+#define RECONNECT_MAX_SLOTS	64
+
+static pthread_mutex_t	schedulerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	schedulerWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	schedulerIdle = PTHREAD_COND_INITIALIZER;
+static mcaster1Globals	*scheduledSlots[RECONNECT_MAX_SLOTS];
+static int				schedulerStarted = 0;
+static unsigned long long	jitterState = 0;
+
+typedef struct tagStartupRun {
+	mcaster1Globals	**slots;
+	int				count;
+	int				next;				// the next slot to take
+	int				connected;
+	pthread_mutex_t	mutex;
+} StartupRun;
+
+static void *schedulerThread(void *arg);
+static void scheduleLocked(mcaster1Globals *g);
+
+/* With schedulerMutex held */
+static void registerSlot(mcaster1Globals *g) {
+	int empty = -1;
+
+	for(int i = 0; i < RECONNECT_MAX_SLOTS; i++) {
+		if(scheduledSlots[i] == g) {
+			return;
+		}
+
+		if(!scheduledSlots[i] && (empty < 0)) {
+			empty = i;
+		}
+	}
+
+	if(empty >= 0) {
+		scheduledSlots[empty] = g;
+	}
+
+	if(!schedulerStarted) {
+		jitterState = (unsigned long long) getMonotonicMicros() | 1;
+		for(int i = 0; i < RECONNECT_THREADS; i++) {
+			pthread_t	thread;
+
+			pthread_create(&thread, NULL, schedulerThread, NULL);
+			pthread_detach(thread);
+		}
+
+		schedulerStarted = 1;
+	}
+}
+
+/* xorshift, with schedulerMutex held */
+static unsigned long jitter(unsigned long range) {
+	jitterState ^= jitterState << 13;
+	jitterState ^= jitterState >> 7;
+	jitterState ^= jitterState << 17;
+	return range ? (unsigned long) (jitterState % (range + 1)) : 0;
+}
+
+/* AutomaticReconnectSecs doubled per failure up to ReconnectMaxSecs, then between half and all of it */
+static long long backoffMicros(mcaster1Globals *g, int attempts) {
+	long long	capMs = (long long) ((g->reconnectMaxSecs > 0) ? g->reconnectMaxSecs : RECONNECT_DEFAULT_MAX_SECS) * 1000;
+	long long	delayMs = (long long) ((g->gReconnectSec > 0) ? g->gReconnectSec : 1) * 1000;
+
+	for(int i = 0; (i < attempts) && (delayMs < capMs); i++) {
+		delayMs *= 2;
+	}
+
+	if(delayMs > capMs) {
+		delayMs = capMs;
+	}
+
+	return (delayMs / 2 + jitter((unsigned long) (delayMs / 2))) * 1000;
+}
+
+/* A mid-stream join needs a format without stream headers */
+static int standbyPossible(mcaster1Globals *g) {
+#ifdef WIN32
+	if(g->gOpusFlag) {
+		return 0;
+	}
+#endif
+	return g->standbyEnabled && g->backupServer[0] && !g->gOggFlag && !g->gFLACFlag;
+}
+
+static void runReconnect(mcaster1Globals *g) {
+	if(g->backupServer[0]) {
+		/* the first retry goes back to the same server, then they alternate */
+		g->reconnectToBackup = (g->reconnectAttempts & 1) ? g->onBackup : !g->onBackup;
+	}
+
+	LogMessage(g, LOG_INFO, "Encoder %d: reconnect attempt %d", g->encoderNumber, g->reconnectAttempts);
+
+	int connected = connectToServer(g);
+
+	if(connected) {
+		metricsCount(g, METRIC_RECONNECTS, 1);
+	}
+
+	pthread_mutex_lock(&schedulerMutex);
+
+	/* Stop AutoConnect clears forcedDisconnect while the attempt runs */
+	if(!connected && g->forcedDisconnect) {
+		scheduleLocked(g);
+	}
+
+	g->reconnectRunning = 0;
+	pthread_cond_broadcast(&schedulerIdle);
+	pthread_mutex_unlock(&schedulerMutex);
+}
+
+/* Called with schedulerMutex held, returns with it held */
+static void runStandby(mcaster1Globals *g) {
+	int			backup = !g->onBackup;
+	NetConnection	*standby = g->standby;
+
+	if(!openSourceConnection(g, standby, getTargetServer(g, backup), getTargetPort(g, backup))) {
+		g->standbyAttempts++;
+		g->standbyDue = getMonotonicMicros() + backoffMicros(g, g->standbyAttempts);
+		g->reconnectRunning = 0;
+		pthread_cond_broadcast(&schedulerIdle);
+		return;
+	}
+
+	pthread_mutex_unlock(&schedulerMutex);
+
+	int streaming = (netWaitOpen(standby) == NET_STREAMING);
+
+	if(streaming) {
+		LogMessage(g, LOG_INFO, "Encoder %d: standby logged in to %s:%s", g->encoderNumber, getTargetServer(g, backup), getTargetPort(g, backup));
+	}
+	else {
+		LogMessage(g, LOG_ERROR, "Encoder %d: standby to %s:%s: %s", g->encoderNumber, getTargetServer(g, backup), getTargetPort(g, backup),
+					netGetError(standby));
+	}
+
+	pthread_mutex_lock(&schedulerMutex);
+	g->reconnectRunning = 0;
+	pthread_cond_broadcast(&schedulerIdle);
+	if(streaming) {
+		/* a standby the server drops again is not reopened in a tight loop */
+		g->standbyAttempts = 0;
+		g->standbyDue = getMonotonicMicros() + backoffMicros(g, 0);
+	}
+	else {
+		if(g->standby == standby) {
+			netClose(standby);
+		}
+
+		g->standbyAttempts++;
+		g->standbyDue = getMonotonicMicros() + backoffMicros(g, g->standbyAttempts);
+	}
+}
+
+static void *schedulerThread(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&schedulerMutex);
+	for(;;) {
+		long long	now = getMonotonicMicros();
+		int			ran = 0;
+
+		for(int i = 0; (i < RECONNECT_MAX_SLOTS) && !ran; i++) {
+			mcaster1Globals *g = scheduledSlots[i];
+
+			if(!g || g->reconnectRunning) {
+				continue;
+			}
+
+			if(g->forcedDisconnect && !g->weareconnected && g->reconnectDue && (now >= g->reconnectDue)) {
+				g->reconnectDue = 0;
+				g->reconnectRunning = 1;
+				pthread_mutex_unlock(&schedulerMutex);
+				runReconnect(g);
+				pthread_mutex_lock(&schedulerMutex);
+				ran = 1;
+			}
+			else if(g->weareconnected && standbyPossible(g) && (now >= g->standbyDue)) {
+				if(!g->standby) {
+					g->standby = createNetConnection();
+				}
+
+				if(g->standby) {
+					int state = netGetState(g->standby);
+
+					if((state == NET_IDLE) || (state == NET_FAILED)) {
+						g->reconnectRunning = 1;
+						runStandby(g);
+						ran = 1;
+					}
+				}
+			}
+		}
+
+		if(ran) {
+			continue;
+		}
+
+		struct timespec until;
+
+		timespec_get(&until, TIME_UTC);
+		until.tv_nsec += RECONNECT_POLL_MS * 1000000L;
+		if(until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&schedulerWork, &schedulerMutex, &until);
+	}
+
+	return NULL;
+}
+
+static void *startupThread(void *arg) {
+	StartupRun	*run = (StartupRun *) arg;
+
+	for(;;) {
+		pthread_mutex_lock(&run->mutex);
+
+		int next = run->next++;
+
+		pthread_mutex_unlock(&run->mutex);
+		if(next >= run->count) {
+			break;
+		}
+
+		mcaster1Globals *g = run->slots[next];
+
+		if(g->weareconnected) {
+			continue;
+		}
+
+		if(connectToServer(g)) {
+			pthread_mutex_lock(&run->mutex);
+			run->connected++;
+			pthread_mutex_unlock(&run->mutex);
+		}
+		else {
+			scheduleReconnect(g);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ =======================================================================================================================
+    API
+ =======================================================================================================================
+ */
+/* With schedulerMutex held */
+static void scheduleLocked(mcaster1Globals *g) {
+	registerSlot(g);
+
+	/* a slot that was streaming or stopped starts the backoff over */
+	if(!g->forcedDisconnect) {
+		g->reconnectAttempts = 0;
+	}
+
+	g->reconnectDue = getMonotonicMicros() + backoffMicros(g, g->reconnectAttempts);
+	if(g->reconnectAttempts < 30) {
+		g->reconnectAttempts++;
+	}
+
+	g->forcedDisconnect = true;
+	g->forcedDisconnectSecs = time(NULL);
+	pthread_cond_signal(&schedulerWork);
+}
+
+void scheduleReconnect(mcaster1Globals *g) {
+	pthread_mutex_lock(&schedulerMutex);
+	scheduleLocked(g);
+	pthread_mutex_unlock(&schedulerMutex);
+}
+
+void reconnectSucceeded(mcaster1Globals *g) {
+	pthread_mutex_lock(&schedulerMutex);
+	registerSlot(g);
+	g->reconnectAttempts = 0;
+	g->reconnectDue = 0;
+	g->standbyAttempts = 0;
+	g->standbyDue = 0;
+	pthread_cond_signal(&schedulerWork);
+	pthread_mutex_unlock(&schedulerMutex);
+}
+
+int getReconnectWait(mcaster1Globals *g) {
+	int wait = -1;
+
+	pthread_mutex_lock(&schedulerMutex);
+	if(g->forcedDisconnect && g->reconnectDue && !g->reconnectRunning) {
+		long long	left = g->reconnectDue - getMonotonicMicros();
+
+		wait = (left > 0) ? (int) ((left + 999999) / 1000000) : 0;
+	}
+
+	pthread_mutex_unlock(&schedulerMutex);
+	return wait;
+}
+
+int failoverToStandby(mcaster1Globals *g) {
+	pthread_mutex_lock(&schedulerMutex);
+
+	NetConnection	*failed = g->connection;
+
+	if(!g->standby || !failed || (netGetState(g->standby) != NET_STREAMING)) {
+		pthread_mutex_unlock(&schedulerMutex);
+		return 0;
+	}
+
+	g->connection = g->standby;
+	g->standby = failed;
+	netClose(failed);
+	g->onBackup = !g->onBackup;
+	g->gSCSocket = (int) netGetSocket(g->connection);
+	if(!g->gIcecast2Flag && !g->gIcecastFlag) {
+		g->gSCFlag = !strncmp(netGetReply(g->connection, 0), "OK2", strlen("OK2"));
+	}
+
+	g->failovers++;
+	g->standbyAttempts = 0;
+	g->standbyDue = getMonotonicMicros() + backoffMicros(g, 0);
+	pthread_mutex_unlock(&schedulerMutex);
+
+	LogMessage(g, LOG_INFO, "Encoder %d: connection to %s:%s lost, streaming to the standby on %s:%s (failover %ld)",
+				g->encoderNumber,
+				getTargetServer(g, !g->onBackup),
+				getTargetPort(g, !g->onBackup),
+				getTargetServer(g, g->onBackup),
+				getTargetPort(g, g->onBackup),
+				g->failovers);
+	if(g->serverStatusCallback) {
+		g->serverStatusCallback(g, (void *) (g->onBackup ? "Switched to backup server" : "Switched to primary server"));
+	}
+
+	return 1;
+}
+
+const char_t *getTargetServer(mcaster1Globals *g, int backup) {
+	return backup ? g->backupServer : g->gServer;
+}
+
+const char_t *getTargetPort(mcaster1Globals *g, int backup) {
+	return (backup && g->backupPort[0]) ? g->backupPort : g->gPort;
+}
+
+void mirrorToStandby(mcaster1Globals *g, const char *data, int length) {
+	NetConnection	*standby = g->standby;
+
+	/* a standby still logging in or behind is left to the pool */
+	if(standby) {
+		netSendNoWait(standby, data, length);
+	}
+}
+
+void closeStandby(mcaster1Globals *g) {
+	pthread_mutex_lock(&schedulerMutex);
+	if(g->standby) {
+		netClose(g->standby);
+	}
+
+	g->standbyAttempts = 0;
+	g->standbyDue = 0;
+	pthread_mutex_unlock(&schedulerMutex);
+}
+
+void reconnectUnregister(mcaster1Globals *g) {
+	pthread_mutex_lock(&schedulerMutex);
+
+	/* a pool thread still connecting or logging in a standby for it, a failed attempt registers it again */
+	while(g->reconnectRunning) {
+		pthread_cond_wait(&schedulerIdle, &schedulerMutex);
+	}
+
+	for(int i = 0; i < RECONNECT_MAX_SLOTS; i++) {
+		if(scheduledSlots[i] == g) {
+			scheduledSlots[i] = NULL;
+		}
+	}
+
+	g->reconnectDue = 0;
+	if(g->standby) {
+		freeNetConnection(g->standby);
+		g->standby = NULL;
+	}
+
+	pthread_mutex_unlock(&schedulerMutex);
+}
+
+int connectAllServers(mcaster1Globals **slots, int count, int parallel) {
+	pthread_t	threads[RECONNECT_MAX_SLOTS];
+	int			started = 0;
+	StartupRun	run;
+	long long	began = getMonotonicMicros();
+
+	if(count <= 0) {
+		return 0;
+	}
+
+	run.slots = slots;
+	run.count = count;
+	run.next = 0;
+	run.connected = 0;
+	pthread_mutex_init(&run.mutex, NULL);
+
+	if(parallel > count) {
+		parallel = count;
+	}
+
+	if(parallel > RECONNECT_MAX_SLOTS) {
+		parallel = RECONNECT_MAX_SLOTS;
+	}
+
+	for(int i = 0; i < parallel; i++) {
+		if(pthread_create(&threads[started], NULL, startupThread, &run) == 0) {
+			started++;
+		}
+	}
+
+	/* no thread to be had, the slots come up one by one on this one */
+	if(!started) {
+		startupThread(&run);
+	}
+
+	for(int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&run.mutex);
+	LogMessage(slots[0], LOG_INFO, "Startup: %d of %d encoders connected in %ld ms, %d at a time",
+				run.connected, count, (long) ((getMonotonicMicros() - began) / 1000), started ? started : 1);
+	return run.connected;
+}
@@ -0,0 +1,47 @@
+#ifndef __RECONNECT_SCHEDULER_H__
+#define __RECONNECT_SCHEDULER_H__
+
+#include "libmcaster1dspencoder.h"
+
+/*
+ * Reconnects run on a small fixed pool of threads instead of one new thread
+ * per attempt.  The wait before an attempt doubles with every failure, from
+ * AutomaticReconnectSecs up to ReconnectMaxSecs, and is jittered (half fixed,
+ * half random) so slots that lost the same server do not come back to it in
+ * lockstep.  With a BackupServer the attempts alternate between the two.
+ *
+ * StandbyEnable keeps a second source connection, logged in to the server
+ * the slot is not streaming to, and mirrors the stream into it.  Servers drop
+ * an idle source, so the mirror is what keeps it alive; when the live
+ * connection fails sendToServer swaps the two and carries on.  Ogg formats
+ * cannot join a server mid-stream without their headers and get no standby.
+ *
+ * At startup connectAllServers brings the slots up side by side, at most
+ * ParallelConnects at a time, instead of one lookup, connect, login and
+ * codec init after the other.
+ */
+#define RECONNECT_THREADS			2
+#define RECONNECT_DEFAULT_MAX_SECS	300
+#define RECONNECT_POLL_MS			100
+#define STARTUP_DEFAULT_PARALLEL	4
+
+/* After a failed connect or a lost connection; sets forcedDisconnect */
+void	scheduleReconnect(mcaster1Globals *g);
+/* From connectToServer once the slot is streaming */
+void	reconnectSucceeded(mcaster1Globals *g);
+/* Seconds until the next attempt, -1 = none scheduled */
+int		getReconnectWait(mcaster1Globals *g);
+/* 1 = the standby is now the connection */
+int		failoverToStandby(mcaster1Globals *g);
+/* Copies the bytes to a logged in standby, never waits */
+void	mirrorToStandby(mcaster1Globals *g, const char *data, int length);
+void	closeStandby(mcaster1Globals *g);
+/* Server and port of the primary (0) or the backup (1), BackupPort defaults to Port */
+const char_t	*getTargetServer(mcaster1Globals *g, int backup);
+const char_t	*getTargetPort(mcaster1Globals *g, int backup);
+/* Waits out a job running for the slot and forgets it, before g is freed */
+void	reconnectUnregister(mcaster1Globals *g);
+/* Connects every slot that is not connected, failures go to scheduleReconnect.  Returns how many came up */
+int		connectAllServers(mcaster1Globals **slots, int count, int parallel);
+
+#endif //__RECONNECT_SCHEDULER_H__
@@ -0,0 +1,863 @@
+/*
+ * relay_input.cpp - upstream Icecast/Shoutcast mount as an input source
+ *
+ * Two threads per relay.  The network thread connects, strips the ICY
+ * metadata blocks out of the body and splits the audio into frames for the
+ * jitter buffer; when the upstream drops it reconnects with a growing pause.
+ * The clock thread plays the frames on an absolute RELAY_BLOCK_MS schedule,
+ * taking silence whenever the buffer is refilling.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include "libmcaster1dspencoder.h"
+#include "relay_input.h"
+
+static void relaySleep(int ms) {
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static void relayStatus(RelayInput *relay, const char *fmt, ...) {
+	char	message[1024];
+	va_list parms;
+
+	va_start(parms, fmt);
+	vsnprintf(message, sizeof(message), fmt, parms);
+	va_end(parms);
+
+	if(relay->status) {
+		relay->status(message);
+	}
+}
+
+static int startsWithText(const char *text, const char *prefix) {
+	for(; *prefix; text++, prefix++) {
+		if(tolower((unsigned char) *text) != tolower((unsigned char) *prefix)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* http://host[:port][/path] */
+static int parseRelayURL(const char *url, char *host, int hostSize, int *port, char *path, int pathSize) {
+	const char	*p = url;
+
+	if(startsWithText(p, "http://")) {
+		p += 7;
+	}
+	else if(strstr(p, "://")) {
+		return 0;
+	}
+
+	const char	*hostEnd = p + strcspn(p, ":/");
+	int			hostLength = (int) (hostEnd - p);
+
+	if((hostLength <= 0) || (hostLength >= hostSize)) {
+		return 0;
+	}
+
+	memcpy(host, p, hostLength);
+	host[hostLength] = '\000';
+
+	*port = 80;
+	p = hostEnd;
+	if(*p == ':') {
+		*port = atoi(p + 1);
+		p += strcspn(p, "/");
+	}
+
+	snprintf(path, pathSize, "%s", *p ? p : "/");
+	return (*port > 0) && (*port < 65536);
+}
+
+/*
+ =======================================================================================================================
+    Jitter buffer of compressed frames
+ =======================================================================================================================
+ */
+static long long relayFrameMicros(const CompressedFrame *frame) {
+	return (long long) frame->samples * 1000000 / frame->samplerate;
+}
+
+static void freeRelayFrame(RelayFrame *node) {
+	free(node->title);
+	free(node);
+}
+
+/*
+ * Parser callback on the network thread.  The queue holds twice the target
+ * delay; when the upstream runs faster than our clock, or bursts on connect,
+ * the oldest frames are dropped so the delay never grows past that.
+ */
+static void queueRelayFrame(const CompressedFrame *frame, void *user) {
+	RelayInput	*relay = (RelayInput *) user;
+	RelayFrame	*node = (RelayFrame *) malloc(sizeof(RelayFrame) + frame->length);
+
+	if(!node) {
+		return;
+	}
+
+	node->next = NULL;
+	node->frame = *frame;
+	node->frame.data = (const unsigned char *) (node + 1);
+	memcpy(node + 1, frame->data, frame->length);
+	if(frame->codec == FRAME_CODEC_ADTS) {
+		node->frame.bitrate = relay->icyBitrate;
+	}
+
+	node->title = NULL;
+	if(relay->pendingTitle[0]) {
+		node->title = strdup(relay->pendingTitle);
+		relay->pendingTitle[0] = '\000';
+	}
+
+	pthread_mutex_lock(&relay->mutex);
+
+	if(relay->tail) {
+		relay->tail->next = node;
+	}
+	else {
+		relay->head = node;
+	}
+
+	relay->tail = node;
+	relay->queuedMicros += relayFrameMicros(&node->frame);
+
+	while((relay->queuedMicros > (long long) relay->bufferMs * 2000) && (relay->head != node)) {
+		RelayFrame	*old = relay->head;
+
+		relay->head = old->next;
+		relay->queuedMicros -= relayFrameMicros(&old->frame);
+		relay->droppedFrames++;
+
+		/* a title still applies to what follows it */
+		if(old->title && !relay->head->title) {
+			relay->head->title = old->title;
+			old->title = NULL;
+		}
+
+		freeRelayFrame(old);
+	}
+
+	if(relay->buffering && (relay->queuedMicros >= (long long) relay->bufferMs * 1000)) {
+		relay->buffering = 0;
+	}
+
+	pthread_mutex_unlock(&relay->mutex);
+}
+
+/*
+ * Next frame that is due, NULL when the clock is not owed a whole frame or
+ * the queue is buffering.  The first bytes of the frame after it are copied
+ * to next: the MP3 decoder reads them to keep its bit reservoir.
+ */
+static RelayFrame *popRelayFrame(RelayInput *relay, long long *owed, unsigned char *next, int *nextLength, int *underrun) {
+	RelayFrame	*node = NULL;
+
+	*nextLength = 0;
+	pthread_mutex_lock(&relay->mutex);
+
+	if(!relay->buffering) {
+		if(!relay->head) {
+			if(*owed >= RELAY_BLOCK_MS * 1000) {
+				relay->buffering = 1;
+				relay->underruns++;
+				*underrun = 1;
+			}
+		}
+		else if(*owed >= relayFrameMicros(&relay->head->frame)) {
+			node = relay->head;
+			relay->head = node->next;
+			if(!relay->head) {
+				relay->tail = NULL;
+			}
+
+			relay->queuedMicros -= relayFrameMicros(&node->frame);
+			*owed -= relayFrameMicros(&node->frame);
+
+			if(relay->head) {
+				*nextLength = (relay->head->frame.length < RELAY_NEXT_HEADER) ? relay->head->frame.length : RELAY_NEXT_HEADER;
+				memcpy(next, relay->head->frame.data, *nextLength);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&relay->mutex);
+	return node;
+}
+
+/*
+ =======================================================================================================================
+    Decoders, run on the clock thread for frames some encoder needs as PCM.  Both hand stereo float to the
+    audio callback and return the frames produced.
+ =======================================================================================================================
+ */
+#ifdef HAVE_MAD
+static float madSample(mad_fixed_t sample) {
+	if(sample >= MAD_F_ONE) {
+		return 1.f;
+	}
+
+	if(sample <= -MAD_F_ONE) {
+		return -1.f;
+	}
+
+	return (float) sample / (float) MAD_F_ONE;
+}
+
+static int decodeRelayMP3(RelayInput *relay, const CompressedFrame *frame, const unsigned char *next, int nextLength) {
+	if(frame->length + MAD_BUFFER_GUARD > RELAY_MP3_BUFFER) {
+		return 0;
+	}
+
+	/* libmad keeps the bit reservoir across buffers, it only needs the next header to size it */
+	memcpy(relay->madBuffer, frame->data, frame->length);
+	memset(relay->madBuffer + frame->length, 0, MAD_BUFFER_GUARD);
+	memcpy(relay->madBuffer + frame->length, next, nextLength);
+	mad_stream_buffer(&relay->madStream, relay->madBuffer, frame->length + MAD_BUFFER_GUARD);
+
+	if(mad_frame_decode(&relay->madFrame, &relay->madStream)) {
+		/* MAD_ERROR_BADDATAPTR after a passthrough stretch, the reservoir refills by itself */
+		return 0;
+	}
+
+	mad_synth_frame(&relay->madSynth, &relay->madFrame);
+
+	struct mad_pcm	*pcm = &relay->madSynth.pcm;
+	int				right = (pcm->channels >= 2) ? 1 : 0;
+
+	for(unsigned i = 0; i < pcm->length; i++) {
+		relay->decoded[i * 2] = madSample(pcm->samples[0][i]);
+		relay->decoded[i * 2 + 1] = madSample(pcm->samples[right][i]);
+	}
+
+	relay->samplerate = (int) pcm->samplerate;
+	relay->audio(relay->decoded, pcm->length, 2, relay->samplerate);
+	return pcm->length;
+}
+#endif
+
+#ifdef HAVE_FDKAAC
+static int decodeRelayAAC(RelayInput *relay, const CompressedFrame *frame) {
+	UCHAR	*buffer = (UCHAR *) frame->data;
+	UINT	size = (UINT) frame->length;
+	UINT	valid = size;
+	int		produced = 0;
+
+	if(aacDecoder_Fill(relay->aacDecoder, &buffer, &size, &valid) != AAC_DEC_OK) {
+		return 0;
+	}
+
+	/* one call per raw data block, usually one per ADTS frame */
+	while(aacDecoder_DecodeFrame(relay->aacDecoder, relay->aacPCM, sizeof(relay->aacPCM) / sizeof(INT_PCM), 0) == AAC_DEC_OK) {
+		CStreamInfo *info = aacDecoder_GetStreamInfo(relay->aacDecoder);
+
+		if(!info || (info->numChannels <= 0) || (info->frameSize > RELAY_DECODE_FRAMES)) {
+			continue;
+		}
+
+		int right = (info->numChannels >= 2) ? 1 : 0;
+
+		for(int i = 0; i < info->frameSize; i++) {
+			relay->decoded[i * 2] = relay->aacPCM[i * info->numChannels] / 32768.f;
+			relay->decoded[i * 2 + 1] = relay->aacPCM[i * info->numChannels + right] / 32768.f;
+		}
+
+		relay->samplerate = info->sampleRate;
+		relay->audio(relay->decoded, info->frameSize, 2, relay->samplerate);
+		produced += info->frameSize;
+	}
+
+	return produced;
+}
+#endif
+
+static int relayDecoderAvailable(int codec) {
+	switch(codec) {
+#ifdef HAVE_MAD
+		case FRAME_CODEC_MP3:
+			return 1;
+#endif
+
+#ifdef HAVE_FDKAAC
+		case FRAME_CODEC_ADTS:
+			return 1;
+#endif
+	}
+
+	return 0;
+}
+
+static void closeRelayDecoder(RelayInput *relay) {
+	switch(relay->decoderCodec) {
+#ifdef HAVE_MAD
+		case FRAME_CODEC_MP3:
+			mad_synth_finish(&relay->madSynth);
+			mad_frame_finish(&relay->madFrame);
+			mad_stream_finish(&relay->madStream);
+			break;
+#endif
+
+#ifdef HAVE_FDKAAC
+		case FRAME_CODEC_ADTS:
+			if(relay->aacDecoder) {
+				aacDecoder_Close(relay->aacDecoder);
+				relay->aacDecoder = NULL;
+			}
+			break;
+#endif
+	}
+
+	relay->decoderCodec = 0;
+}
+
+static int openRelayDecoder(RelayInput *relay, int codec) {
+	if(relay->decoderCodec == codec) {
+		return 1;
+	}
+
+	closeRelayDecoder(relay);
+
+	switch(codec) {
+#ifdef HAVE_MAD
+		case FRAME_CODEC_MP3:
+			mad_stream_init(&relay->madStream);
+			mad_frame_init(&relay->madFrame);
+			mad_synth_init(&relay->madSynth);
+			relay->decoderCodec = codec;
+			return 1;
+#endif
+
+#ifdef HAVE_FDKAAC
+		case FRAME_CODEC_ADTS:
+			relay->aacDecoder = aacDecoder_Open(TT_MP4_ADTS, 1);
+			if(!relay->aacDecoder) {
+				return 0;
+			}
+
+			relay->decoderCodec = codec;
+			return 1;
+#endif
+	}
+
+	return 0;
+}
+
+static void decodeRelayFrame(RelayInput *relay, const CompressedFrame *frame, const unsigned char *next, int nextLength) {
+	int produced = 0;
+
+	if(!relayDecoderAvailable(frame->codec)) {
+		if(relay->undecodableCodec != frame->codec) {
+			relay->undecodableCodec = frame->codec;
+			relayStatus(relay, "Relay: this build cannot decode %s, encoders that do not pass it through get silence",
+						(frame->codec == FRAME_CODEC_ADTS) ? "AAC" : "MP3");
+		}
+	}
+	else if(openRelayDecoder(relay, frame->codec)) {
+		switch(frame->codec) {
+#ifdef HAVE_MAD
+			case FRAME_CODEC_MP3:
+				produced = decodeRelayMP3(relay, frame, next, nextLength);
+				break;
+#endif
+
+#ifdef HAVE_FDKAAC
+			case FRAME_CODEC_ADTS:
+				produced = decodeRelayAAC(relay, frame);
+				break;
+#endif
+		}
+	}
+
+	/* a frame that did not decode still takes its time */
+	if(!produced) {
+		int frames = (frame->samples < RELAY_DECODE_FRAMES) ? frame->samples : RELAY_DECODE_FRAMES;
+
+		memset(relay->decoded, 0, sizeof(float) * 2 * frames);
+		relay->audio(relay->decoded, frames, 2, frame->samplerate);
+	}
+}
+
+/*
+ =======================================================================================================================
+    Clock thread: every RELAY_BLOCK_MS it plays the frames that became due, or a block of silence while
+    buffering.  A frame goes to the frame callback first and is decoded only if that asks for the PCM.
+ =======================================================================================================================
+ */
+static void playRelayFrame(RelayInput *relay, RelayFrame *node, const unsigned char *next, int nextLength) {
+	if(node->title && relay->metadata) {
+		relay->metadata(node->title);
+	}
+
+	int needPCM = relay->frame ? relay->frame(&node->frame) : 1;
+
+	relay->live = 1;
+	if(needPCM && relay->audio) {
+		decodeRelayFrame(relay, &node->frame, next, nextLength);
+	}
+}
+
+static void relayGap(RelayInput *relay) {
+	if(relay->live) {
+		relay->live = 0;
+		if(relay->gap) {
+			relay->gap();
+		}
+	}
+}
+
+static void *relayClockThread(void *arg) {
+	RelayInput		*relay = (RelayInput *) arg;
+	float			*block = (float *) malloc(sizeof(float) * 2 * (192000 * RELAY_BLOCK_MS / 1000));
+	long long		next = getMonotonicMicros();
+	long long		owed = 0;
+	unsigned char	nextHeader[RELAY_NEXT_HEADER];
+
+	if(!block) {
+		return NULL;
+	}
+
+	while(relay->running) {
+		RelayFrame	*node;
+		int			nextLength;
+		int			underrun = 0;
+
+		owed += RELAY_BLOCK_MS * 1000;
+		while((node = popRelayFrame(relay, &owed, nextHeader, &nextLength, &underrun)) != NULL) {
+			playRelayFrame(relay, node, nextHeader, nextLength);
+			freeRelayFrame(node);
+		}
+
+		if(underrun) {
+			relayStatus(relay, "Relay: buffer ran dry, rebuffering (%ld underruns)", relay->underruns);
+		}
+
+		pthread_mutex_lock(&relay->mutex);
+
+		int buffering = relay->buffering;
+
+		pthread_mutex_unlock(&relay->mutex);
+
+		if(buffering) {
+			int frames = relay->samplerate * RELAY_BLOCK_MS / 1000;
+
+			relayGap(relay);
+			owed = 0;
+			memset(block, 0, sizeof(float) * 2 * frames);
+			if(relay->audio) {
+				relay->audio(block, frames, 2, relay->samplerate);
+			}
+		}
+
+		next += RELAY_BLOCK_MS * 1000;
+
+		long long	wait = next - getMonotonicMicros();
+
+		if(wait > 0) {
+			relaySleep((int) (wait / 1000));
+		}
+		else if(wait < -1000000) {
+			/* the encoders stalled for a second, do not try to catch up */
+			next = getMonotonicMicros();
+			owed = 0;
+		}
+	}
+
+	relayGap(relay);
+	closeRelayDecoder(relay);
+	free(block);
+	return NULL;
+}
+
+/*
+ =======================================================================================================================
+    ICY metadata: every icy-metaint audio bytes there is a length byte (in 16 byte units) and that much of
+    "StreamTitle='...';StreamUrl='...';" padded with zeros.
+ =======================================================================================================================
+ */
+static void handleRelayMetadata(RelayInput *relay) {
+	relay->metaBuffer[relay->metaRead] = '\000';
+
+	char	*title = strstr(relay->metaBuffer, "StreamTitle='");
+
+	if(!title) {
+		return;
+	}
+
+	title += strlen("StreamTitle='");
+
+	char	*end = strstr(title, "';");
+
+	if(end) {
+		*end = '\000';
+	}
+
+	/* handed on with the frame it arrived in front of, not when it arrives */
+	if(*title && strcmp(title, relay->lastTitle)) {
+		snprintf(relay->lastTitle, sizeof(relay->lastTitle), "%s", title);
+		snprintf(relay->pendingTitle, sizeof(relay->pendingTitle), "%s", title);
+	}
+}
+
+static void feedRelayAudio(RelayInput *relay, const unsigned char *data, int length) {
+	feedFrameParser(&relay->parser, data, length, queueRelayFrame, relay);
+}
+
+static void demuxRelayBody(RelayInput *relay, const unsigned char *data, int length) {
+	if(!relay->metaInterval) {
+		feedRelayAudio(relay, data, length);
+		return;
+	}
+
+	while(length > 0) {
+		if(relay->metaCountdown > 0) {
+			int audio = (length < relay->metaCountdown) ? length : relay->metaCountdown;
+
+			feedRelayAudio(relay, data, audio);
+			relay->metaCountdown -= audio;
+			data += audio;
+			length -= audio;
+		}
+		else if(relay->metaLength < 0) {
+			relay->metaLength = *data * 16;
+			relay->metaRead = 0;
+			data++;
+			length--;
+
+			/* most blocks are empty, the title only comes when it changes */
+			if(!relay->metaLength) {
+				relay->metaLength = -1;
+				relay->metaCountdown = relay->metaInterval;
+			}
+		}
+		else {
+			int take = relay->metaLength - relay->metaRead;
+
+			if(take > length) {
+				take = length;
+			}
+
+			memcpy(relay->metaBuffer + relay->metaRead, data, take);
+			relay->metaRead += take;
+			data += take;
+			length -= take;
+
+			if(relay->metaRead == relay->metaLength) {
+				handleRelayMetadata(relay);
+				relay->metaLength = -1;
+				relay->metaCountdown = relay->metaInterval;
+			}
+		}
+	}
+}
+
+/*
+ =======================================================================================================================
+    HTTP
+ =======================================================================================================================
+ */
+static const char *headerValue(const char *headers, const char *name) {
+	const char	*line = headers;
+
+	while(line && *line) {
+		if(startsWithText(line, name) && (line[strlen(name)] == ':')) {
+			const char	*value = line + strlen(name) + 1;
+
+			while(*value == ' ') {
+				value++;
+			}
+
+			return value;
+		}
+
+		line = strstr(line, "\r\n");
+		if(line) {
+			line += 2;
+		}
+	}
+
+	return NULL;
+}
+
+static void copyHeaderValue(char *dest, int destSize, const char *value) {
+	int length = value ? (int) strcspn(value, "\r\n") : 0;
+
+	if(length >= destSize) {
+		length = destSize - 1;
+	}
+
+	memcpy(dest, value ? value : "", length);
+	dest[length] = '\000';
+}
+
+static void closeRelaySocket(RelayInput *relay) {
+	pthread_mutex_lock(&relay->mutex);
+	if(relay->sock != (SOCKET) -1) {
+		closesocket(relay->sock);
+		relay->sock = (SOCKET) -1;
+	}
+
+	pthread_mutex_unlock(&relay->mutex);
+}
+
+/*
+ * Connect and read the response headers, following redirects.  Body bytes
+ * that arrived with the headers are left in body/bodyLength.  1 = streaming.
+ */
+static int connectRelay(RelayInput *relay, unsigned char *body, int *bodyLength) {
+	char		url[1024];
+	char		host[256];
+	char		path[1024];
+	int			port;
+	char		headers[RELAY_HEADER_BUFFER];
+	CMySocket	connector;
+
+	snprintf(url, sizeof(url), "%s", relay->url);
+
+	for(int redirects = 0; redirects <= RELAY_MAX_REDIRECTS; redirects++) {
+		if(!parseRelayURL(url, host, sizeof(host), &port, path, sizeof(path))) {
+			relayStatus(relay, "Relay: cannot use URL %s", url);
+			return 0;
+		}
+
+		relayStatus(relay, "Relay: connecting to %s:%d", host, port);
+
+		SOCKET	s = connector.DoSocketConnect(host, (unsigned short) port);
+
+		if(s == (SOCKET) -1) {
+			relayStatus(relay, "Relay: cannot connect to %s:%d", host, port);
+			return 0;
+		}
+
+		pthread_mutex_lock(&relay->mutex);
+		relay->sock = s;
+		pthread_mutex_unlock(&relay->mutex);
+
+		/* HTTP/1.0 keeps the body unchunked */
+		snprintf(headers, sizeof(headers),
+				 "GET %s HTTP/1.0\r\nHost: %s:%d\r\nUser-Agent: Mcaster1DSPEncoder relay\r\nIcy-MetaData: 1\r\nAccept: */*\r\n\r\n",
+				 path, host, port);
+		if(send(s, headers, (int) strlen(headers), 0) <= 0) {
+			closeRelaySocket(relay);
+			return 0;
+		}
+
+		int		got = 0;
+		char	*end = NULL;
+
+		while(!end) {
+			if(got >= (int) sizeof(headers) - 1) {
+				break;
+			}
+
+			int n = recv(s, headers + got, sizeof(headers) - 1 - got, 0);
+
+			if(n <= 0) {
+				break;
+			}
+
+			got += n;
+			headers[got] = '\000';
+			end = strstr(headers, "\r\n\r\n");
+		}
+
+		if(!end) {
+			relayStatus(relay, "Relay: no response from %s:%d", host, port);
+			closeRelaySocket(relay);
+			return 0;
+		}
+
+		int headerLength = (int) (end + 4 - headers);
+
+		*bodyLength = got - headerLength;
+		memcpy(body, headers + headerLength, *bodyLength);
+		*end = '\000';
+
+		/* "ICY 200 OK" from Shoutcast 1, "HTTP/1.x 200 OK" otherwise */
+		const char	*code = strchr(headers, ' ');
+		int			status = code ? atoi(code + 1) : 0;
+
+		if((status == 301) || (status == 302) || (status == 303) || (status == 307)) {
+			copyHeaderValue(url, sizeof(url), headerValue(headers, "Location"));
+			closeRelaySocket(relay);
+			continue;
+		}
+
+		if(status != 200) {
+			char	line[256];
+
+			copyHeaderValue(line, sizeof(line), headers);
+			relayStatus(relay, "Relay: %s:%d answered %s", host, port, line);
+			closeRelaySocket(relay);
+			return 0;
+		}
+
+		char	contentType[128];
+		char	metaint[32];
+		char	bitrate[32];
+
+		copyHeaderValue(contentType, sizeof(contentType), headerValue(headers, "Content-Type"));
+		copyHeaderValue(metaint, sizeof(metaint), headerValue(headers, "icy-metaint"));
+		copyHeaderValue(bitrate, sizeof(bitrate), headerValue(headers, "icy-br"));
+
+		/* audio/aac, audio/aacp, audio/x-aac are ADTS, anything else is taken as MP3 */
+		relay->codec = strstr(contentType, "aac") ? FRAME_CODEC_ADTS : FRAME_CODEC_MP3;
+		initFrameParser(&relay->parser, relay->codec);
+		relay->icyBitrate = atoi(bitrate);
+		relay->metaInterval = atoi(metaint);
+		relay->metaCountdown = relay->metaInterval;
+		relay->metaLength = -1;
+		relay->metaRead = 0;
+
+		relay->connects++;
+		relayStatus(relay, "Relay: streaming %s from %s:%d%s", (relay->codec == FRAME_CODEC_ADTS) ? "AAC" : "MP3",
+					host, port, path);
+		return 1;
+	}
+
+	relayStatus(relay, "Relay: too many redirects for %s", relay->url);
+	return 0;
+}
+
+static void *relayNetworkThread(void *arg) {
+	RelayInput		*relay = (RelayInput *) arg;
+	unsigned char	*buffer = (unsigned char *) malloc(RELAY_HEADER_BUFFER);
+	int				backoff = 1;
+
+	if(!buffer) {
+		return NULL;
+	}
+
+	while(relay->running) {
+		int length = 0;
+
+		if(!connectRelay(relay, buffer, &length)) {
+			/* the clock thread keeps the encoders on silence meanwhile */
+			for(int waited = 0; relay->running && (waited < backoff * 1000); waited += 100) {
+				relaySleep(100);
+			}
+
+			backoff = (backoff * 2 > RELAY_MAX_BACKOFF) ? RELAY_MAX_BACKOFF : backoff * 2;
+			continue;
+		}
+
+		backoff = 1;
+		while(relay->running) {
+			if(length > 0) {
+				demuxRelayBody(relay, buffer, length);
+			}
+
+			/* SO_RCVTIMEO from DoSocketConnect ends a stalled upstream */
+			length = recv(relay->sock, (char *) buffer, RELAY_RECV_BUFFER, 0);
+			if(length <= 0) {
+				break;
+			}
+		}
+
+		closeRelaySocket(relay);
+
+		if(relay->running) {
+			relayStatus(relay, "Relay: upstream lost, reconnecting");
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/*
+ =======================================================================================================================
+    Start/stop
+ =======================================================================================================================
+ */
+int startRelayInput(RelayInput *relay, const char *url, int bufferMs, relayFrameCallback frame,
+					relayAudioCallback audio, relayTextCallback metadata, relayGapCallback gap,
+					relayTextCallback status) {
+	char	host[256];
+	char	path[1024];
+	int		port;
+
+	memset(relay, '\000', sizeof(*relay));
+	if(!parseRelayURL(url, host, sizeof(host), &port, path, sizeof(path))) {
+		return 0;
+	}
+
+	snprintf(relay->url, sizeof(relay->url), "%s", url);
+	relay->bufferMs = (bufferMs <= 0) ? RELAY_DEFAULT_BUFFER_MS : bufferMs;
+	if(relay->bufferMs > RELAY_MAX_BUFFER_MS) {
+		relay->bufferMs = RELAY_MAX_BUFFER_MS;
+	}
+
+	relay->frame = frame;
+	relay->audio = audio;
+	relay->metadata = metadata;
+	relay->gap = gap;
+	relay->status = status;
+	relay->sock = (SOCKET) -1;
+	relay->samplerate = RELAY_DEFAULT_SAMPLERATE;
+	relay->buffering = 1;
+
+	pthread_mutex_init(&relay->mutex, NULL);
+
+	relay->running = 1;
+	if(pthread_create(&relay->clockThread, NULL, relayClockThread, relay) != 0) {
+		relay->running = 0;
+	}
+	else if(pthread_create(&relay->networkThread, NULL, relayNetworkThread, relay) != 0) {
+		relay->running = 0;
+		pthread_join(relay->clockThread, NULL);
+	}
+
+	if(!relay->running) {
+		pthread_mutex_destroy(&relay->mutex);
+		return 0;
+	}
+
+	relay->threadsStarted = 1;
+	return 1;
+}
+
+void stopRelayInput(RelayInput *relay) {
+	if(!relay->threadsStarted) {
+		return;
+	}
+
+	relay->running = 0;
+
+	/* wake a blocked recv() */
+	pthread_mutex_lock(&relay->mutex);
+	if(relay->sock != (SOCKET) -1) {
+		shutdown(relay->sock, 2);
+	}
+
+	pthread_mutex_unlock(&relay->mutex);
+
+	pthread_join(relay->networkThread, NULL);
+	pthread_join(relay->clockThread, NULL);
+	relay->threadsStarted = 0;
+
+	while(relay->head) {
+		RelayFrame	*node = relay->head;
+
+		relay->head = node->next;
+		freeRelayFrame(node);
+	}
+
+	relay->tail = NULL;
+	pthread_mutex_destroy(&relay->mutex);
+}
+
+int relayInputRunning(RelayInput *relay) {
+	return relay->threadsStarted;
+}
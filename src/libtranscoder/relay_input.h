@@ -0,0 +1,126 @@
+#ifndef __RELAY_INPUT_H
+#define __RELAY_INPUT_H
+
+/*
+ * Relay input: pulls an upstream Icecast/Shoutcast mount (MP3 or ADTS AAC)
+ * and plays it into the encoders like a sound card.  ICY metadata is split
+ * out of the stream and handed on as song titles.  A jitter buffer of
+ * compressed frames sits between the network and the encoders; while it
+ * refills (at start and while the upstream is reconnecting) the encoders are
+ * fed silence, so the downstream connections stay up.
+ *
+ * Each frame is offered to the frame callback first (passthrough); it is
+ * only decoded when some encoder still wants the PCM.  A build without the
+ * decoder still relays the stream to encoders that pass it through, the
+ * others get silence.
+ *
+ * mcaster1_relaytest runs it against a mock upstream: metadata, redirects,
+ * reconnects and stalls.
+ */
+#include <pthread.h>
+#include "libmcaster1dspencoder_socket.h"
+#include "frame_parser.h"
+
+#ifdef HAVE_MAD
+#include <mad.h>
+#endif
+#ifdef HAVE_FDKAAC
+#include <fdk-aac/aacdecoder_lib.h>
+#endif
+
+#define RELAY_BLOCK_MS				20		// audio handed to the encoders per clock tick
+#define RELAY_DEFAULT_BUFFER_MS		3000
+#define RELAY_MAX_BUFFER_MS			30000
+#define RELAY_DEFAULT_SAMPLERATE	44100	// silence rate before the first decoded frame
+#define RELAY_RECV_BUFFER			8192
+#define RELAY_HEADER_BUFFER			8192
+#define RELAY_MP3_BUFFER			2048	// one frame (1441 bytes at most) and the start of the next
+#define RELAY_NEXT_HEADER			8		// bytes of the next frame the MP3 decoder peeks at (MAD_BUFFER_GUARD)
+#define RELAY_DECODE_FRAMES			4096	// largest decoded frame (HE-AAC is 2048)
+#define RELAY_MAX_REDIRECTS			3
+#define RELAY_MAX_BACKOFF			30		// seconds between reconnect attempts
+
+/* samples are interleaved stereo float */
+typedef void (*relayAudioCallback) (float *samples, int frames, int channels, int samplerate);
+typedef void (*relayTextCallback) (const char *text);
+/* 1 = decode this frame, some encoder needs the PCM */
+typedef int (*relayFrameCallback) (const CompressedFrame *frame);
+/* the frames stopped (buffering), silence follows */
+typedef void (*relayGapCallback) (void);
+
+/* a queued frame, its bytes follow the struct */
+typedef struct tagRelayFrame {
+	struct tagRelayFrame	*next;
+	CompressedFrame			frame;
+	char					*title;		// ICY title that starts with this frame, NULL = none
+} RelayFrame;
+
+typedef struct tagRelayInput {
+	char	url[1024];
+	int		bufferMs;
+
+	relayFrameCallback	frame;
+	relayAudioCallback	audio;
+	relayTextCallback	metadata;
+	relayGapCallback	gap;
+	relayTextCallback	status;
+
+	int			running;
+	int			threadsStarted;
+	pthread_t	networkThread;
+	pthread_t	clockThread;
+	SOCKET		sock;
+
+	// Jitter buffer, written by the network thread and drained by the clock thread
+	pthread_mutex_t	mutex;
+	RelayFrame	*head;
+	RelayFrame	*tail;
+	long long	queuedMicros;	// play time of the queued frames
+	int			buffering;		// silence until bufferMs is queued
+	int			live;			// frames went out since the last gap
+	int			samplerate;		// of the last decoded audio, used for the silence
+
+	// Network thread side
+	int			codec;			// FRAME_CODEC_xxx of the upstream
+	int			icyBitrate;		// icy-br, ADTS headers carry no bitrate
+	FrameParser	parser;
+	char		pendingTitle[1024];	// goes with the next queued frame
+
+	// ICY metadata demux
+	int		metaInterval;		// icy-metaint, 0 = none
+	int		metaCountdown;		// audio bytes before the next metadata block
+	int		metaLength;			// bytes in the current metadata block, -1 = length byte next
+	int		metaRead;
+	char	metaBuffer[255 * 16 + 1];
+	char	lastTitle[1024];
+
+	// Decoder, clock thread only
+	int		decoderCodec;
+	int		undecodableCodec;	// reported once: wanted as PCM, no decoder in this build
+	float	decoded[RELAY_DECODE_FRAMES * 2];
+#ifdef HAVE_MAD
+	struct mad_stream	madStream;
+	struct mad_frame	madFrame;
+	struct mad_synth	madSynth;
+	unsigned char		madBuffer[RELAY_MP3_BUFFER];
+#endif
+#ifdef HAVE_FDKAAC
+	HANDLE_AACDECODER	aacDecoder;
+	INT_PCM				aacPCM[RELAY_DECODE_FRAMES * 8];
+#endif
+
+	// Counters for the status line
+	long	connects;
+	long	underruns;
+	long	droppedFrames;
+} RelayInput;
+
+/* 1 = threads started (the upstream is connected in the background), 0 = bad URL */
+/* frame and gap may be NULL, every frame is then decoded */
+int		startRelayInput(RelayInput *relay, const char *url, int bufferMs, relayFrameCallback frame,
+						relayAudioCallback audio, relayTextCallback metadata, relayGapCallback gap,
+						relayTextCallback status);
+void	stopRelayInput(RelayInput *relay);
+int		relayInputRunning(RelayInput *relay);
+
+#endif
@@ -0,0 +1,537 @@
+/*
+ * transcode_input.cpp - WAV, FLAC and MP3 readers for the transcoder front end.
+ *
+ * WAV is parsed here, FLAC goes through the libFLAC stream decoder and MP3
+ * through libmad.  FLAC and MP3 decode a frame at a time into a pending
+ * buffer that readTranscodeInput drains.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "transcode_input.h"
+
+#define WAV_READ_FRAMES 1024
+
+static const char *fileExtension(const char *filename) {
+	const char	*dot = strrchr(filename, '.');
+
+	return dot ? dot + 1 : "";
+}
+
+static int sameText(const char *a, const char *b) {
+	while(*a && *b) {
+		if(tolower((unsigned char) *a) != tolower((unsigned char) *b)) {
+			return 0;
+		}
+
+		a++;
+		b++;
+	}
+
+	return (*a == *b);
+}
+
+static int reservePending(TranscodeInput *in, int frames) {
+	if(frames <= in->pendingCapacity) {
+		return 1;
+	}
+
+	float	*grown = (float *) realloc(in->pending, sizeof(float) * frames * 2);
+
+	if(!grown) {
+		return 0;
+	}
+
+	in->pending = grown;
+	in->pendingCapacity = frames;
+	return 1;
+}
+
+/* Hand out what the FLAC or MP3 decoder left in the pending buffer */
+static int drainPending(TranscodeInput *in, float *dest, int maxFrames) {
+	int frames = in->pendingFrames - in->pendingPos;
+
+	if(frames > maxFrames) {
+		frames = maxFrames;
+	}
+
+	if(frames > 0) {
+		memcpy(dest, in->pending + in->pendingPos * in->channels, sizeof(float) * frames * in->channels);
+		in->pendingPos += frames;
+	}
+
+	return frames;
+}
+
+/*
+ =======================================================================================================================
+    WAV
+ =======================================================================================================================
+ */
+static unsigned long readLE(const unsigned char *p, int bytes) {
+	unsigned long	value = 0;
+
+	for(int i = bytes - 1; i >= 0; i--) {
+		value = (value << 8) | p[i];
+	}
+
+	return value;
+}
+
+static int openWAV(TranscodeInput *in, char *message, int messageSize) {
+	unsigned char	header[12];
+	unsigned char	chunk[8];
+	unsigned char	fmt[40];
+	int				haveFormat = 0;
+
+	if((fread(header, 1, sizeof(header), in->fp) != sizeof(header)) || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+		snprintf(message, messageSize, "not a RIFF/WAVE file");
+		return 0;
+	}
+
+	while(fread(chunk, 1, sizeof(chunk), in->fp) == sizeof(chunk)) {
+		unsigned long	size = readLE(chunk + 4, 4);
+
+		if(!memcmp(chunk, "fmt ", 4)) {
+			int want = (size < sizeof(fmt)) ? (int) size : (int) sizeof(fmt);
+
+			if((size < 16) || (fread(fmt, 1, want, in->fp) != (size_t) want)) {
+				break;
+			}
+
+			in->wavFormat = (int) readLE(fmt, 2);
+			in->sourceChannels = (int) readLE(fmt + 2, 2);
+			in->samplerate = (int) readLE(fmt + 4, 4);
+			in->wavBits = (int) readLE(fmt + 14, 2);
+			if((in->wavFormat == 0xFFFE) && (want >= 26)) {
+				in->wavFormat = (int) readLE(fmt + 24, 2);	/* WAVE_FORMAT_EXTENSIBLE sub format */
+			}
+
+			haveFormat = 1;
+			size -= want;
+		}
+		else if(!memcmp(chunk, "data", 4)) {
+			if(!haveFormat) {
+				break;
+			}
+
+			in->wavDataLeft = size;
+			break;
+		}
+
+		/* chunks are word aligned */
+		if(fseek(in->fp, (long) (size + (size & 1)), SEEK_CUR) != 0) {
+			break;
+		}
+	}
+
+	if(!haveFormat || (in->wavDataLeft <= 0)) {
+		snprintf(message, messageSize, "no fmt or data chunk");
+		return 0;
+	}
+
+	if(!(((in->wavFormat == 1) && ((in->wavBits == 8) || (in->wavBits == 16) || (in->wavBits == 24) || (in->wavBits == 32)))
+	   || ((in->wavFormat == 3) && (in->wavBits == 32)))) {
+		snprintf(message, messageSize, "unsupported WAV format %d/%d bit", in->wavFormat, in->wavBits);
+		return 0;
+	}
+
+	if((in->sourceChannels < 1) || (in->samplerate <= 0)) {
+		snprintf(message, messageSize, "bad channel count or sample rate");
+		return 0;
+	}
+
+	return 1;
+}
+
+static float wavSample(TranscodeInput *in, const unsigned char *p) {
+	switch(in->wavBits) {
+		case 8:
+			return ((int) p[0] - 128) / 128.f;
+
+		case 16:
+			return (short) readLE(p, 2) / 32768.f;
+
+		case 24:
+			return ((int) (readLE(p, 3) << 8) >> 8) / 8388608.f;
+
+		default:
+			if(in->wavFormat == 3) {
+				float	value;
+
+				memcpy(&value, p, sizeof(value));
+				return value;
+			}
+
+			return (int) readLE(p, 4) / 2147483648.f;
+	}
+}
+
+static int readWAV(TranscodeInput *in, float *dest, int maxFrames) {
+	unsigned char	raw[WAV_READ_FRAMES * 8 * 4];
+	int				bytesPerSample = in->wavBits / 8;
+	int				frameBytes = bytesPerSample * in->sourceChannels;
+	int				maxRawFrames = (int) sizeof(raw) / frameBytes;
+	int				done = 0;
+
+	while((done < maxFrames) && (in->wavDataLeft >= frameBytes)) {
+		int frames = maxFrames - done;
+
+		if(frames > maxRawFrames) {
+			frames = maxRawFrames;
+		}
+
+		if((long long) frames * frameBytes > in->wavDataLeft) {
+			frames = (int) (in->wavDataLeft / frameBytes);
+		}
+
+		int got = (int) (fread(raw, frameBytes, frames, in->fp));
+
+		if(got <= 0) {
+			in->wavDataLeft = 0;
+			break;
+		}
+
+		in->wavDataLeft -= (long long) got * frameBytes;
+		for(int i = 0; i < got; i++) {
+			const unsigned char *frame = raw + i * frameBytes;
+
+			for(int c = 0; c < in->channels; c++) {
+				*dest++ = wavSample(in, frame + c * bytesPerSample);
+			}
+		}
+
+		done += got;
+	}
+
+	return done;
+}
+
+/*
+ =======================================================================================================================
+    FLAC
+ =======================================================================================================================
+ */
+#ifdef HAVE_FLAC
+static FLAC__StreamDecoderWriteStatus flacDecodeWrite(const FLAC__StreamDecoder *decoder,
+													 const FLAC__Frame *frame,
+													 const FLAC__int32 *const buffer[],
+													 void *client_data) {
+	TranscodeInput	*in = (TranscodeInput *) client_data;
+	unsigned		blocksize = frame->header.blocksize;
+	float			scale = 1.f / (float) (1u << (frame->header.bits_per_sample - 1));
+
+	if(!reservePending(in, (int) blocksize)) {
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	}
+
+	for(unsigned i = 0; i < blocksize; i++) {
+		for(int c = 0; c < in->channels; c++) {
+			in->pending[i * in->channels + c] = buffer[c][i] * scale;
+		}
+	}
+
+	in->pendingFrames = (int) blocksize;
+	in->pendingPos = 0;
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void flacDecodeMetadata(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data) {
+	TranscodeInput	*in = (TranscodeInput *) client_data;
+
+	if(metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+		in->samplerate = (int) metadata->data.stream_info.sample_rate;
+		in->sourceChannels = (int) metadata->data.stream_info.channels;
+		in->channels = (in->sourceChannels >= 2) ? 2 : 1;
+	}
+}
+
+static void flacDecodeError(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
+	/* lost sync and bad CRCs are skipped by the decoder, nothing to do */
+}
+
+static int openFLAC(TranscodeInput *in, const char *filename, char *message, int messageSize) {
+	in->flacDecoder = FLAC__stream_decoder_new();
+	if(!in->flacDecoder) {
+		snprintf(message, messageSize, "cannot create FLAC decoder");
+		return 0;
+	}
+
+	if(FLAC__stream_decoder_init_file(in->flacDecoder, filename, flacDecodeWrite, flacDecodeMetadata, flacDecodeError, in)
+	   != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+		snprintf(message, messageSize, "cannot open FLAC stream");
+		return 0;
+	}
+
+	if(!FLAC__stream_decoder_process_until_end_of_metadata(in->flacDecoder) || (in->samplerate <= 0)) {
+		snprintf(message, messageSize, "no FLAC STREAMINFO");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int readFLAC(TranscodeInput *in, float *dest, int maxFrames) {
+	int done = 0;
+
+	while(done < maxFrames) {
+		if(in->pendingPos >= in->pendingFrames) {
+			if(in->eof) {
+				break;
+			}
+
+			in->pendingFrames = in->pendingPos = 0;
+			if(!FLAC__stream_decoder_process_single(in->flacDecoder)) {
+				in->failed = 1;
+				break;
+			}
+
+			if(FLAC__stream_decoder_get_state(in->flacDecoder) == FLAC__STREAM_DECODER_END_OF_STREAM) {
+				in->eof = 1;
+			}
+
+			continue;
+		}
+
+		done += drainPending(in, dest + done * in->channels, maxFrames - done);
+	}
+
+	return (in->failed && !done) ? -1 : done;
+}
+#endif
+
+/*
+ =======================================================================================================================
+    MP3
+ =======================================================================================================================
+ */
+#ifdef HAVE_MAD
+static float madSample(mad_fixed_t sample) {
+	if(sample >= MAD_F_ONE) {
+		return 1.f;
+	}
+
+	if(sample <= -MAD_F_ONE) {
+		return -1.f;
+	}
+
+	return (float) sample / (float) MAD_F_ONE;
+}
+
+/* Decode the next audio frame into the pending buffer, 0 at the end of the file */
+static int decodeMP3Frame(TranscodeInput *in) {
+	for(;;) {
+		if(!in->madStarted || (in->madStream.error == MAD_ERROR_BUFLEN)) {
+			size_t	keep = 0;
+
+			if(in->eof) {
+				return 0;
+			}
+
+			if(in->madStream.next_frame) {
+				keep = in->madStream.bufend - in->madStream.next_frame;
+				memmove(in->madBuffer, in->madStream.next_frame, keep);
+			}
+
+			size_t	got = fread(in->madBuffer + keep, 1, TRANSCODE_MP3_BUFFER - keep, in->fp);
+
+			if(got < TRANSCODE_MP3_BUFFER - keep) {
+				/* the last frame needs MAD_BUFFER_GUARD zero bytes after it */
+				in->eof = 1;
+				memset(in->madBuffer + keep + got, 0, MAD_BUFFER_GUARD);
+				got += MAD_BUFFER_GUARD;
+			}
+
+			mad_stream_buffer(&in->madStream, in->madBuffer, keep + got);
+			in->madStream.error = MAD_ERROR_NONE;
+			in->madStarted = 1;
+		}
+
+		if(mad_frame_decode(&in->madFrame, &in->madStream)) {
+			if(MAD_RECOVERABLE(in->madStream.error) || (in->madStream.error == MAD_ERROR_BUFLEN)) {
+				continue;
+			}
+
+			in->failed = 1;
+			return 0;
+		}
+
+		mad_synth_frame(&in->madSynth, &in->madFrame);
+
+		struct mad_pcm	*pcm = &in->madSynth.pcm;
+
+		if(!in->samplerate) {
+			in->samplerate = (int) pcm->samplerate;
+			in->sourceChannels = pcm->channels;
+			in->channels = (pcm->channels >= 2) ? 2 : 1;
+		}
+
+		if(!reservePending(in, pcm->length)) {
+			in->failed = 1;
+			return 0;
+		}
+
+		for(unsigned i = 0; i < pcm->length; i++) {
+			for(int c = 0; c < in->channels; c++) {
+				in->pending[i * in->channels + c] = madSample(pcm->samples[(c < pcm->channels) ? c : 0][i]);
+			}
+		}
+
+		in->pendingFrames = pcm->length;
+		in->pendingPos = 0;
+		return 1;
+	}
+}
+
+static int openMP3(TranscodeInput *in, char *message, int messageSize) {
+	mad_stream_init(&in->madStream);
+	mad_frame_init(&in->madFrame);
+	mad_synth_init(&in->madSynth);
+	in->madStarted = 0;
+
+	/* the format is only known once the first frame is decoded */
+	if(!decodeMP3Frame(in) || (in->samplerate <= 0)) {
+		snprintf(message, messageSize, "no MPEG audio frames");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int readMP3(TranscodeInput *in, float *dest, int maxFrames) {
+	int done = 0;
+
+	while(done < maxFrames) {
+		if(in->pendingPos >= in->pendingFrames) {
+			if(!decodeMP3Frame(in)) {
+				break;
+			}
+
+			continue;
+		}
+
+		done += drainPending(in, dest + done * in->channels, maxFrames - done);
+	}
+
+	return (in->failed && !done) ? -1 : done;
+}
+#endif
+
+/*
+ =======================================================================================================================
+    The type is picked from the file extension.
+ =======================================================================================================================
+ */
+int openTranscodeInput(TranscodeInput *in, const char *filename, char *message, int messageSize) {
+	const char	*ext = fileExtension(filename);
+	int			ok = 0;
+
+	memset(in, '\000', sizeof(*in));
+	message[0] = '\000';
+
+	if(sameText(ext, "wav")) {
+		in->type = TRANSCODE_INPUT_WAV;
+	}
+	else if(sameText(ext, "flac")) {
+		in->type = TRANSCODE_INPUT_FLAC;
+	}
+	else if(sameText(ext, "mp3")) {
+		in->type = TRANSCODE_INPUT_MP3;
+	}
+	else {
+		snprintf(message, messageSize, "unknown input type .%s", ext);
+		return 0;
+	}
+
+	switch(in->type) {
+		case TRANSCODE_INPUT_WAV:
+			in->fp = fopen(filename, "rb");
+			ok = in->fp && openWAV(in, message, messageSize);
+			in->channels = (in->sourceChannels >= 2) ? 2 : 1;
+			break;
+
+		case TRANSCODE_INPUT_FLAC:
+#ifdef HAVE_FLAC
+			ok = openFLAC(in, filename, message, messageSize);
+#else
+			snprintf(message, messageSize, "not compiled with FLAC support");
+#endif
+			break;
+
+		case TRANSCODE_INPUT_MP3:
+#ifdef HAVE_MAD
+			in->fp = fopen(filename, "rb");
+			ok = in->fp && openMP3(in, message, messageSize);
+#else
+			snprintf(message, messageSize, "not compiled with MP3 (libmad) support");
+#endif
+			break;
+	}
+
+	if(!ok) {
+		if(!message[0]) {
+			snprintf(message, messageSize, "cannot open");
+		}
+
+		closeTranscodeInput(in);
+		return 0;
+	}
+
+	return 1;
+}
+
+int readTranscodeInput(TranscodeInput *in, float *dest, int maxFrames) {
+	int frames = 0;
+
+	switch(in->type) {
+		case TRANSCODE_INPUT_WAV:
+			frames = readWAV(in, dest, maxFrames);
+			break;
+
+#ifdef HAVE_FLAC
+		case TRANSCODE_INPUT_FLAC:
+			frames = readFLAC(in, dest, maxFrames);
+			break;
+#endif
+
+#ifdef HAVE_MAD
+		case TRANSCODE_INPUT_MP3:
+			frames = readMP3(in, dest, maxFrames);
+			break;
+#endif
+	}
+
+	if(frames > 0) {
+		in->framesRead += frames;
+	}
+
+	return frames;
+}
+
+void closeTranscodeInput(TranscodeInput *in) {
+#ifdef HAVE_FLAC
+	if(in->flacDecoder) {
+		FLAC__stream_decoder_finish(in->flacDecoder);
+		FLAC__stream_decoder_delete(in->flacDecoder);
+		in->flacDecoder = NULL;
+	}
+#endif
+#ifdef HAVE_MAD
+	if(in->type == TRANSCODE_INPUT_MP3) {
+		mad_synth_finish(&in->madSynth);
+		mad_frame_finish(&in->madFrame);
+		mad_stream_finish(&in->madStream);
+	}
+#endif
+	if(in->fp) {
+		fclose(in->fp);
+		in->fp = NULL;
+	}
+
+	if(in->pending) {
+		free(in->pending);
+		in->pending = NULL;
+	}
+
+	in->pendingCapacity = in->pendingFrames = in->pendingPos = 0;
+}
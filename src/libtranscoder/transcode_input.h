@@ -0,0 +1,64 @@
+#ifndef __TRANSCODE_INPUT_H
+#define __TRANSCODE_INPUT_H
+
+/*
+ * Decoders for the transcoder front end.  Every input type is read back as
+ * interleaved float (-1.0..1.0) in one or two channels, the shape
+ * handle_output takes.  Inputs with more channels keep the first two.
+ */
+#include <stdio.h>
+
+#ifdef HAVE_FLAC
+#include <FLAC/stream_decoder.h>
+#endif
+#ifdef HAVE_MAD
+#include <mad.h>
+#endif
+
+#define TRANSCODE_INPUT_WAV		1
+#define TRANSCODE_INPUT_FLAC	2
+#define TRANSCODE_INPUT_MP3		3
+
+#define TRANSCODE_MP3_BUFFER	16384
+
+typedef struct tagTranscodeInput {
+	int		type;
+	int		samplerate;
+	int		channels;			// channels delivered, 1 or 2
+	int		sourceChannels;		// channels in the file
+	long long	framesRead;
+
+	FILE	*fp;
+
+	// WAV
+	int		wavFormat;			// 1 = PCM, 3 = IEEE float
+	int		wavBits;
+	long long	wavDataLeft;	// bytes of the data chunk not read yet
+
+	// Decoded frames not handed out yet (FLAC, MP3)
+	float	*pending;
+	int		pendingFrames;
+	int		pendingPos;
+	int		pendingCapacity;
+	int		eof;
+	int		failed;
+
+#ifdef HAVE_FLAC
+	FLAC__StreamDecoder	*flacDecoder;
+#endif
+#ifdef HAVE_MAD
+	struct mad_stream	madStream;
+	struct mad_frame	madFrame;
+	struct mad_synth	madSynth;
+	unsigned char		madBuffer[TRANSCODE_MP3_BUFFER + MAD_BUFFER_GUARD];
+	int					madStarted;
+#endif
+} TranscodeInput;
+
+/* 1 = ok, 0 = unsupported or unreadable, the reason is in message */
+int		openTranscodeInput(TranscodeInput *in, const char *filename, char *message, int messageSize);
+/* frames written to dest (maxFrames * in->channels floats), 0 at the end, -1 on a decode error */
+int		readTranscodeInput(TranscodeInput *in, float *dest, int maxFrames);
+void	closeTranscodeInput(TranscodeInput *in);
+
+#endif
@@ -0,0 +1,1139 @@
+/*
+ * mcaster1_bench.cpp - how many slots a box can carry
+ *
+ * Loads encoder slots from the YAML configs the encoder uses and pushes
+ * the same audio through handle_output on every one of them, one thread
+ * per slot, as fast as the codecs go.  The input is a file (decoded to
+ * memory first, decoding is not measured) or a generated signal, looped.
+ * The encoded stream goes to the null device or to a mock Icecast on the
+ * loopback, which takes the login and throws the stream away, so the
+ * socket path is measured as well.
+ *
+ * Each block size given is a run of its own.  The results go to stdout as
+ * one JSON document, to be kept and compared between builds; a summary
+ * goes to stderr.
+ *
+ * usage: mcaster1_bench [-c config] [-e 1,2,...] [-n slots] [-b 256,1024,...] [-s seconds]
+ *                       [-g tone|noise] [-r rate] [-k null|mock] [-l label] [-o results.json] [input]
+ */
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#ifdef _DEBUG
+#include <crtdbg.h>
+#endif
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/select.h>
+#include <arpa/inet.h>
+#define INVALID_SOCKET	-1
+#endif
+#include "libmcaster1dspencoder.h"
+#include "async_log.h"
+#include "config_yaml.h"
+#include "latency_histogram.h"
+#include "transcode_input.h"
+
+#define BENCH_MAX_SLOTS			64
+#define BENCH_MAX_RUNS			16
+#define BENCH_CHANNELS			2
+#define BENCH_SIGNAL_SECONDS	10			// generated input, looped
+#define BENCH_DRAIN_MS			10000		// mock sink, wait for the send queues to empty
+#define BENCH_MOCK_BUFFER		(64 * 1024)
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+#define SINK_NULL	0
+#define SINK_MOCK	1
+
+#ifdef WIN32
+#define NULL_DEVICE	"NUL"
+#else
+#define NULL_DEVICE	"/dev/null"
+#endif
+
+typedef struct tagBenchSlot {
+	int					configSlot;		// <config>_<n>.yaml
+	mcaster1Globals		*g;
+	float				*block;
+	int					blockFrames;
+	int					offset;			// where in the input this slot starts
+	pthread_t			thread;
+	int					started;
+	int					failed;
+	long long			blocks;
+	long long			frames;
+	long long			wallMicros;
+	long long			cpuMicros;
+	LatencyHistogram	blockLatency;	// handle_output, a block in to its bytes out
+} BenchSlot;
+
+static char				configBase[1024] = "MCASTER1DSPENCODER";
+static int				configSlots[BENCH_MAX_SLOTS];
+static int				numConfigSlots = 0;
+static int				numBenchSlots = 0;			// 0 = one per config slot
+static int				blockSizes[BENCH_MAX_RUNS] = { 1024 };
+static int				numBlockSizes = 1;
+static double			streamSeconds = 60.0;		// of audio per slot and run
+static char				signalName[16] = "noise";
+static int				sinkType = SINK_NULL;
+static char				label[256] = "";
+static const char		*inputName = NULL;
+
+static float			*input = NULL;				// interleaved, BENCH_CHANNELS
+static long				inputFrames = 0;
+static int				inputRate = 44100;
+
+static BenchSlot		benchSlots[BENCH_MAX_SLOTS];
+static pthread_mutex_t	startMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	startGate = PTHREAD_COND_INITIALIZER;
+static int				startGo = 0;
+
+static void usage(void) {
+	fprintf(stderr, "usage: mcaster1_bench [-c config] [-e 1,2,...] [-n slots] [-b 256,1024,...] [-s seconds]\n");
+	fprintf(stderr, "                      [-g tone|noise] [-r rate] [-k null|mock] [-l label] [-o results.json] [input]\n");
+	fprintf(stderr, "  -c config  encoder config base name, slot n is read from <config>_<n>.yaml (default %s)\n", configBase);
+	fprintf(stderr, "  -e list    encoder slots to run (default all NumEncoders in <config>_0.yaml)\n");
+	fprintf(stderr, "  -n slots   slots to run at once, the -e list is repeated to fill them (default its length)\n");
+	fprintf(stderr, "  -b sizes   frames per handle_output call, one run per size (default 1024)\n");
+	fprintf(stderr, "  -s seconds audio pushed through each slot per run (default 60)\n");
+	fprintf(stderr, "  -g signal  generated input when no file is given, tone or noise (default noise)\n");
+	fprintf(stderr, "  -r rate    sample rate of the generated input (default 44100)\n");
+	fprintf(stderr, "  -k sink    null: encoded streams go to %s, mock: to an Icecast stand-in on 127.0.0.1\n", NULL_DEVICE);
+	fprintf(stderr, "  -l label   stored with the results, e.g. the commit measured\n");
+	fprintf(stderr, "  -o file    JSON results (default stdout)\n");
+	fprintf(stderr, "input: .wav .flac .mp3, decoded to memory before the runs\n");
+}
+
+/*
+ =======================================================================================================================
+    Allocation count.  Only where the runtime lets every malloc be seen: the
+    debug CRT, and glibc, whose malloc this executable replaces.  Elsewhere
+    the count is reported as null.
+ =======================================================================================================================
+ */
+static std::atomic<int>			allocCounting(0);
+static std::atomic<long long>	allocations(0);
+
+static inline void countAllocation(void) {
+	if(allocCounting.load(std::memory_order_relaxed)) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+#if defined(WIN32) && defined(_DEBUG)
+#define ALLOC_COUNTED	1
+
+static int allocHook(int type, void *, size_t, int, long, const unsigned char *, int) {
+	if((type == _HOOK_ALLOC) || (type == _HOOK_REALLOC)) {
+		countAllocation();
+	}
+
+	return TRUE;
+}
+
+static void startAllocCount(void) {
+	_CrtSetAllocHook(allocHook);
+}
+
+#elif defined(__GLIBC__)
+#define ALLOC_COUNTED	1
+
+extern "C" {
+void	*__libc_malloc(size_t size);
+void	*__libc_calloc(size_t count, size_t size);
+void	*__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+	countAllocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	countAllocation();
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) {
+	countAllocation();
+	return __libc_realloc(p, size);
+}
+}
+
+static void startAllocCount(void) {
+}
+
+#else
+#define ALLOC_COUNTED	0
+
+static void startAllocCount(void) {
+}
+#endif
+
+/*
+ =======================================================================================================================
+    CPU time
+ =======================================================================================================================
+ */
+#ifdef WIN32
+static long long fileTimeMicros(const FILETIME *t) {
+	return (((long long) t->dwHighDateTime << 32) | t->dwLowDateTime) / 10;
+}
+
+static long long threadCPUMicros(void) {
+	FILETIME	created, exited, kernel, user;
+
+	if(!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) {
+		return 0;
+	}
+
+	return fileTimeMicros(&kernel) + fileTimeMicros(&user);
+}
+
+static long long processCPUMicros(void) {
+	FILETIME	created, exited, kernel, user;
+
+	if(!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+		return 0;
+	}
+
+	return fileTimeMicros(&kernel) + fileTimeMicros(&user);
+}
+
+static void sleepMs(int ms) {
+	Sleep(ms);
+}
+
+#else
+static long long clockMicros(clockid_t clock) {
+	struct timespec ts;
+
+	if(clock_gettime(clock, &ts) != 0) {
+		return 0;
+	}
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long threadCPUMicros(void) {
+	return clockMicros(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static long long processCPUMicros(void) {
+	return clockMicros(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void sleepMs(int ms) {
+	usleep(ms * 1000);
+}
+#endif
+
+/*
+ =======================================================================================================================
+    Input
+ =======================================================================================================================
+ */
+static int loadInput(const char *filename) {
+	TranscodeInput	in;
+	char			message[1024] = "";
+	long			capacity;
+	int				frames;
+
+	if(!openTranscodeInput(&in, filename, message, sizeof(message))) {
+		fprintf(stderr, "%s: %s\n", filename, message);
+		return 0;
+	}
+
+	/* no more than a run pushes through a slot */
+	capacity = (long) (streamSeconds * in.samplerate) + 1;
+	input = (float *) malloc(sizeof(float) * BENCH_CHANNELS * capacity);
+	float	*block = (float *) malloc(sizeof(float) * in.channels * 4096);
+
+	if(!input || !block) {
+		fprintf(stderr, "%s: out of memory\n", filename);
+		free(block);
+		closeTranscodeInput(&in);
+		return 0;
+	}
+
+	while((inputFrames < capacity) && ((frames = readTranscodeInput(&in, block, 4096)) > 0)) {
+		for(int i = 0; (i < frames) && (inputFrames < capacity); i++, inputFrames++) {
+			/* mono is doubled, the slots see the same stereo input either way */
+			input[inputFrames * 2] = block[i * in.channels];
+			input[inputFrames * 2 + 1] = block[i * in.channels + in.channels - 1];
+		}
+	}
+
+	inputRate = in.samplerate;
+	free(block);
+	closeTranscodeInput(&in);
+
+	if(inputFrames <= 0) {
+		fprintf(stderr, "%s: no audio\n", filename);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* A chord with a slow fade, or white noise (the expensive case for most codecs), both at -6 dBFS */
+static int generateInput(void) {
+	unsigned int	seed = 0x2545f491;
+
+	inputFrames = (long) BENCH_SIGNAL_SECONDS * inputRate;
+	input = (float *) malloc(sizeof(float) * BENCH_CHANNELS * inputFrames);
+	if(!input) {
+		fprintf(stderr, "out of memory\n");
+		return 0;
+	}
+
+	for(long i = 0; i < inputFrames; i++) {
+		double	t = (double) i / inputRate;
+
+		if(!strcmp(signalName, "tone")) {
+			double	fade = 0.75 + 0.25 * sin(2 * M_PI * 0.5 * t);
+
+			input[i * 2] = (float) (0.25 * fade * (sin(2 * M_PI * 220.0 * t) + sin(2 * M_PI * 277.18 * t)));
+			input[i * 2 + 1] = (float) (0.25 * fade * (sin(2 * M_PI * 329.63 * t) + sin(2 * M_PI * 440.0 * t)));
+		}
+		else {
+			for(int c = 0; c < BENCH_CHANNELS; c++) {
+				seed = seed * 1664525 + 1013904223;
+				input[i * 2 + c] = (float) ((int) (seed >> 8) - (1 << 23)) / (float) (1 << 24);
+			}
+		}
+	}
+
+	return 1;
+}
+
+/*
+ =======================================================================================================================
+    Mock Icecast.  Takes any number of source logins and title updates on
+    one thread: a SOURCE/PUT gets its 200 and the stream after it is
+    counted and dropped, a GET (the metadata dispatcher) gets an empty
+    keep-alive 200.
+ =======================================================================================================================
+ */
+typedef struct tagMockClient {
+	SOCKET	s;
+	int		streaming;			// past the source request headers
+	int		source;				// request is SOURCE or PUT
+	int		lineLength;			// characters on the current header line
+	int		firstLength;
+	char	first[8];			// start of the request line
+} MockClient;
+
+static SOCKET					mockListener = INVALID_SOCKET;
+static int						mockPort = 0;
+static pthread_t				mockThread;
+static std::atomic<int>			mockRunning(0);
+static std::atomic<long long>	mockBytes(0);
+static std::atomic<int>			mockSources(0);		// streams not closed yet
+
+static void mockReply(SOCKET s, const char *reply) {
+	send(s, reply, (int) strlen(reply), 0);
+}
+
+/* Walks the request headers, 1 = they are done */
+static int mockHeaders(MockClient *c, const char *data, int length, int *used) {
+	for(*used = 0; *used < length; (*used)++) {
+		char	ch = data[*used];
+
+		if(ch == '\r') {
+			continue;
+		}
+
+		if(c->firstLength < (int) sizeof(c->first) - 1) {
+			c->first[c->firstLength++] = ch;
+		}
+
+		if(ch != '\n') {
+			c->lineLength++;
+			continue;
+		}
+
+		if(c->lineLength) {
+			c->lineLength = 0;
+			continue;
+		}
+
+		(*used)++;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void mockData(MockClient *c, const char *data, int length) {
+	while(length > 0) {
+		if(c->streaming) {
+			mockBytes.fetch_add(length, std::memory_order_relaxed);
+			return;
+		}
+
+		int used;
+
+		if(!mockHeaders(c, data, length, &used)) {
+			return;
+		}
+
+		if(!strncmp(c->first, "SOURCE", 6) || !strncmp(c->first, "PUT", 3)) {
+			mockReply(c->s, "HTTP/1.0 200 OK\r\n\r\n");
+			c->streaming = 1;
+			mockSources++;
+		}
+		else {
+			mockReply(c->s, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n");
+			c->firstLength = 0;
+			memset(c->first, '\000', sizeof(c->first));
+		}
+
+		data += used;
+		length -= used;
+	}
+}
+
+static void *mockServer(void *) {
+	MockClient	clients[BENCH_MAX_SLOTS * 2];
+	int			numClients = 0;
+	char		*buffer = (char *) malloc(BENCH_MOCK_BUFFER);
+
+	while(buffer && mockRunning) {
+		fd_set			readable;
+		struct timeval	tv;
+		SOCKET			top = mockListener;
+
+		FD_ZERO(&readable);
+		FD_SET(mockListener, &readable);
+		for(int i = 0; i < numClients; i++) {
+			FD_SET(clients[i].s, &readable);
+			if(clients[i].s > top) {
+				top = clients[i].s;
+			}
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 100 * 1000;
+		if(select((int) top + 1, &readable, NULL, NULL, &tv) <= 0) {
+			continue;
+		}
+
+		if(FD_ISSET(mockListener, &readable)) {
+			SOCKET	s = accept(mockListener, NULL, NULL);
+
+			if(s != INVALID_SOCKET) {
+				if(numClients < BENCH_MAX_SLOTS * 2) {
+					memset(&clients[numClients], '\000', sizeof(MockClient));
+					clients[numClients++].s = s;
+				}
+				else {
+					closesocket(s);
+				}
+			}
+		}
+
+		for(int i = 0; i < numClients; i++) {
+			if(!FD_ISSET(clients[i].s, &readable)) {
+				continue;
+			}
+
+			int n = recv(clients[i].s, buffer, BENCH_MOCK_BUFFER, 0);
+
+			if(n > 0) {
+				mockData(&clients[i], buffer, n);
+				continue;
+			}
+
+			if(clients[i].streaming) {
+				mockSources--;
+			}
+
+			closesocket(clients[i].s);
+			clients[i--] = clients[--numClients];
+		}
+	}
+
+	for(int i = 0; i < numClients; i++) {
+		closesocket(clients[i].s);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static int startMockServer(void) {
+	struct sockaddr_in	sa;
+	socklen_t			length = sizeof(sa);
+
+	memset(&sa, '\000', sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = 0;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	mockListener = socket(AF_INET, SOCK_STREAM, 0);
+	if(mockListener == INVALID_SOCKET) {
+		return 0;
+	}
+
+	if((bind(mockListener, (struct sockaddr *) &sa, sizeof(sa)) != 0)
+	   || (listen(mockListener, SOMAXCONN) != 0)
+	   || (getsockname(mockListener, (struct sockaddr *) &sa, &length) != 0)) {
+		closesocket(mockListener);
+		mockListener = INVALID_SOCKET;
+		return 0;
+	}
+
+	mockPort = ntohs(sa.sin_port);
+	mockRunning = 1;
+	if(pthread_create(&mockThread, NULL, mockServer, NULL) != 0) {
+		mockRunning = 0;
+		closesocket(mockListener);
+		mockListener = INVALID_SOCKET;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void stopMockServer(void) {
+	if(!mockRunning) {
+		return;
+	}
+
+	mockRunning = 0;
+	pthread_join(mockThread, NULL);
+	closesocket(mockListener);
+	mockListener = INVALID_SOCKET;
+}
+
+/*
+ =======================================================================================================================
+    Slots
+ =======================================================================================================================
+ */
+static int loadSlotConfig(mcaster1Globals *g, int slot) {
+	memset(g, '\000', sizeof(*g));
+	g->encoderNumber = slot;
+	setConfigFileName(g, configBase);
+	initializeGlobals(g);
+
+	/* config_read only takes the keys registered here, as in the encoder */
+	if(slot == 0) {
+		addUISettings(g);
+	}
+	else {
+		addBasicEncoderSettings(g);
+	}
+
+	return readConfigYAML(g);
+}
+
+static void freeSlotConfig(mcaster1Globals *g) {
+	for(int i = 0; i < g->numConfigVariables; i++) {
+		free(g->configVariables[i]);
+	}
+
+	/* the log thread may still have lines for this slot */
+	logFlush();
+	if(g->logFilep) {
+		fclose(g->logFilep);
+	}
+
+	pthread_mutex_destroy(&(g->mutex));
+	free(g);
+}
+
+/* Connected to the sink, codec up, nothing that reacts to load left on */
+static int openSlot(BenchSlot *s, int blockFrames) {
+	mcaster1Globals *g = (mcaster1Globals *) malloc(sizeof(mcaster1Globals));
+
+	s->g = g;
+	s->blockFrames = blockFrames;
+	s->block = (float *) malloc(sizeof(float) * BENCH_CHANNELS * blockFrames);
+	if(!g || !s->block) {
+		fprintf(stderr, "[%d]: out of memory\n", s->configSlot);
+		return 0;
+	}
+
+	if(!loadSlotConfig(g, s->configSlot)) {
+		fprintf(stderr, "[%d]: cannot read %s_%d.yaml\n", s->configSlot, configBase, s->configSlot);
+		return 0;
+	}
+
+	if(!getEncoderExtension(g)) {
+		fprintf(stderr, "[%d]: encoder %s is not available in this build\n", s->configSlot, g->gEncodeType);
+		return 0;
+	}
+
+	setFrontEndType(g, FRONT_END_TRANSCODER);
+	snprintf(g->gSongTitle, sizeof(g->gSongTitle), "mcaster1_bench");
+	g->governorEnabled = 0;
+	g->abrEnabled = 0;
+	g->pacingEnabled = 0;
+	g->gSaveDirectoryFlag = 0;
+	g->gAutoReconnect = 0;
+
+	if(sinkType == SINK_NULL) {
+		char	device[] = NULL_DEVICE;
+
+		if(!openOutputFile(g, device)) {
+			fprintf(stderr, "[%d]: cannot start the %s encoder\n", s->configSlot, g->gEncodeType);
+			return 0;
+		}
+
+		return 1;
+	}
+
+	snprintf(g->gServer, sizeof(g->gServer), "127.0.0.1");
+	snprintf(g->gPort, sizeof(g->gPort), "%d", mockPort);
+	snprintf(g->gServerType, sizeof(g->gServerType), "Icecast2");
+	g->gShoutcastFlag = 0;
+	g->gIcecastFlag = 0;
+	g->gIcecast2Flag = 1;
+	g->backupServer[0] = '\000';
+
+	if(!connectToServer(g)) {
+		fprintf(stderr, "[%d]: cannot connect the %s encoder to the mock server\n", s->configSlot, g->gEncodeType);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void closeSink(BenchSlot *s) {
+	mcaster1Globals *g = s->g;
+
+	if(!g) {
+		return;
+	}
+
+	if(g->outputFile) {
+		closeOutputFile(g);
+	}
+	else if(g->weareconnected) {
+		disconnectFromServer(g);
+	}
+}
+
+static void closeSlot(BenchSlot *s) {
+	mcaster1Globals *g = s->g;
+
+	closeSink(s);
+	if(g) {
+		freeupGlobals(g);
+		freeSlotConfig(g);
+	}
+
+	free(s->block);
+	s->g = NULL;
+	s->block = NULL;
+}
+
+static void *slotWorker(void *arg) {
+	BenchSlot		*s = (BenchSlot *) arg;
+	mcaster1Globals *g = s->g;
+	long long		target = (long long) (streamSeconds * inputRate);
+	long			position = s->offset;
+
+	pthread_mutex_lock(&startMutex);
+	while(!startGo) {
+		pthread_cond_wait(&startGate, &startMutex);
+	}
+
+	pthread_mutex_unlock(&startMutex);
+
+	long long	wallStarted = getMonotonicMicros();
+	long long	cpuStarted = threadCPUMicros();
+
+	while(s->frames < target) {
+		int frames = s->blockFrames;
+
+		if(frames > target - s->frames) {
+			frames = (int) (target - s->frames);
+		}
+
+		/* the input is looped, a block is copied out so the codec never sees the loop point or shared memory */
+		for(int i = 0; i < frames; i++) {
+			s->block[i * 2] = input[position * 2];
+			s->block[i * 2 + 1] = input[position * 2 + 1];
+			if(++position >= inputFrames) {
+				position = 0;
+			}
+		}
+
+		long long	before = getMonotonicMicros();
+
+		handle_output(g, s->block, frames, BENCH_CHANNELS, inputRate);
+		latencyRecord(&s->blockLatency, getMonotonicMicros() - before);
+
+		if(!g->weareconnected) {
+			s->failed = 1;
+			break;
+		}
+
+		s->blocks++;
+		s->frames += frames;
+	}
+
+	s->cpuMicros = threadCPUMicros() - cpuStarted;
+	s->wallMicros = getMonotonicMicros() - wallStarted;
+	return NULL;
+}
+
+/*
+ =======================================================================================================================
+    Results
+ =======================================================================================================================
+ */
+static void writeJSONString(FILE *out, const char *text) {
+	fputc('"', out);
+	for(const unsigned char *p = (const unsigned char *) text; *p; p++) {
+		if((*p == '"') || (*p == '\\')) {
+			fprintf(out, "\\%c", *p);
+		}
+		else if(*p < 0x20) {
+			fprintf(out, "\\u%04x", *p);
+		}
+		else {
+			fputc(*p, out);
+		}
+	}
+
+	fputc('"', out);
+}
+
+static void mergeHistogram(LatencyHistogram *into, const LatencyHistogram *h) {
+	for(int i = 0; i < LATENCY_BUCKETS; i++) {
+		into->buckets[i] += h->buckets[i];
+	}
+
+	into->count += h->count;
+	into->sumMicros += h->sumMicros;
+	if(h->maxMicros > into->maxMicros) {
+		into->maxMicros = h->maxMicros;
+	}
+}
+
+static void writePercentiles(FILE *out, const LatencyHistogram *h) {
+	fprintf(out, "{\"p50\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%lld,\"mean\":%.1f}",
+			latencyPercentile(h, 50),
+			latencyPercentile(h, 99),
+			latencyPercentile(h, 99.9),
+			h->maxMicros,
+			h->count ? (double) h->sumMicros / h->count : 0.0);
+}
+
+static const char *slotCodec(BenchSlot *s) {
+	return (s->g->codec && s->g->codec->name) ? s->g->codec->name : s->g->gEncodeType;
+}
+
+/* One codec's slots together: CPU per second of stream, block latency */
+static void writeCodec(FILE *out, const char *codec, int slotCount, double frameSeconds) {
+	LatencyHistogram	block;
+	LatencyHistogram	encode;
+	long long			cpuMicros = 0;
+	long long			frames = 0;
+	int					slots = 0;
+
+	latencyReset(&block);
+	latencyReset(&encode);
+	for(int i = 0; i < slotCount; i++) {
+		if(strcmp(slotCodec(&benchSlots[i]), codec)) {
+			continue;
+		}
+
+		slots++;
+		cpuMicros += benchSlots[i].cpuMicros;
+		frames += benchSlots[i].frames;
+		mergeHistogram(&block, &benchSlots[i].blockLatency);
+		mergeHistogram(&encode, getStageLatency(benchSlots[i].g, LATENCY_STAGE_ENCODE));
+	}
+
+	double	seconds = frames * frameSeconds;
+
+	fprintf(out, "\t\t\t\t{\"codec\":");
+	writeJSONString(out, codec);
+	fprintf(out, ",\"slots\":%d,\"stream_seconds\":%.3f,\"cpu_seconds\":%.3f,\"cpu_ms_per_stream_second\":%.3f,\n\t\t\t\t \"block_latency_us\":",
+			slots, seconds, cpuMicros / 1000000.0, seconds > 0 ? cpuMicros / 1000.0 / seconds : 0.0);
+	writePercentiles(out, &block);
+	fprintf(out, ",\"encode_latency_us\":");
+	writePercentiles(out, &encode);
+	fprintf(out, "}");
+}
+
+static void writeRun(FILE *out, int blockFrames, int slotCount, long long wallMicros, long long processMicros, long long allocs, long long mockReceived) {
+	LatencyHistogram	block;
+	LatencyHistogram	wire;
+	double				frameSeconds = 1.0 / inputRate;
+	double				stream = 0;
+	double				slowest = 0;
+	long long			blocks = 0;
+	const char			*codecs[BENCH_MAX_SLOTS];
+	int					numCodecs = 0;
+
+	latencyReset(&block);
+	latencyReset(&wire);
+	for(int i = 0; i < slotCount; i++) {
+		BenchSlot	*s = &benchSlots[i];
+		double		seconds = s->frames * frameSeconds;
+		double		rtf = s->wallMicros ? seconds / (s->wallMicros / 1000000.0) : 0.0;
+
+		stream += seconds;
+		blocks += s->blocks;
+		if(!i || (rtf < slowest)) {
+			slowest = rtf;
+		}
+
+		mergeHistogram(&block, &s->blockLatency);
+		mergeHistogram(&wire, getStageLatency(s->g, LATENCY_STAGE_WIRE));
+
+		int known = 0;
+
+		for(int c = 0; c < numCodecs; c++) {
+			known |= !strcmp(codecs[c], slotCodec(s));
+		}
+
+		if(!known) {
+			codecs[numCodecs++] = slotCodec(s);
+		}
+	}
+
+	double	wall = wallMicros / 1000000.0;
+
+	fprintf(out, "\t\t{\n\t\t\t\"block_frames\":%d,\"slots\":%d,\"wall_seconds\":%.3f,\"stream_seconds\":%.3f,\n", blockFrames, slotCount, wall, stream);
+	fprintf(out, "\t\t\t\"realtime_factor\":%.3f,\"slowest_slot_realtime_factor\":%.3f,\"process_cpu_seconds\":%.3f,\n",
+			wall > 0 ? stream / wall : 0.0, slowest, processMicros / 1000000.0);
+	fprintf(out, "\t\t\t\"blocks\":%lld,", blocks);
+	if(ALLOC_COUNTED) {
+		fprintf(out, "\"allocations\":%lld,\"allocations_per_block\":%.3f,\n", allocs, blocks ? (double) allocs / blocks : 0.0);
+	}
+	else {
+		fprintf(out, "\"allocations\":null,\"allocations_per_block\":null,\n");
+	}
+
+	fprintf(out, "\t\t\t\"block_latency_us\":");
+	writePercentiles(out, &block);
+	if(sinkType == SINK_MOCK) {
+		fprintf(out, ",\n\t\t\t\"capture_to_wire_us\":");
+		writePercentiles(out, &wire);
+		fprintf(out, ",\"bytes_received\":%lld", mockReceived);
+	}
+
+	fprintf(out, ",\n\t\t\t\"codecs\":[\n");
+	for(int c = 0; c < numCodecs; c++) {
+		writeCodec(out, codecs[c], slotCount, frameSeconds);
+		fprintf(out, "%s\n", (c + 1 < numCodecs) ? "," : "");
+	}
+
+	fprintf(out, "\t\t\t]\n\t\t}");
+
+	char	perBlock[32] = "not counted";
+
+	if(ALLOC_COUNTED) {
+		snprintf(perBlock, sizeof(perBlock), "%.2f", blocks ? (double) allocs / blocks : 0.0);
+	}
+
+	fprintf(stderr, "%5d frames x %d slots: %.1fx real time (slowest slot %.1fx), block p50/p99/p99.9 %lld/%lld/%lld us, allocations/block %s\n",
+			blockFrames, slotCount, wall > 0 ? stream / wall : 0.0, slowest,
+			latencyPercentile(&block, 50), latencyPercentile(&block, 99), latencyPercentile(&block, 99.9),
+			perBlock);
+}
+
+/* 1 = every slot ran its audio through */
+static int runBlockSize(FILE *out, int blockFrames, int first) {
+	int slotCount = numBenchSlots ? numBenchSlots : numConfigSlots;
+	int ok = 1;
+
+	memset(benchSlots, '\000', sizeof(benchSlots));
+	for(int i = 0; (i < slotCount) && ok; i++) {
+		benchSlots[i].configSlot = configSlots[i % numConfigSlots];
+		benchSlots[i].offset = (int) ((long long) inputFrames * i / slotCount);
+		ok = openSlot(&benchSlots[i], blockFrames);
+	}
+
+	startGo = 0;
+	for(int i = 0; (i < slotCount) && ok; i++) {
+		benchSlots[i].started = (pthread_create(&benchSlots[i].thread, NULL, slotWorker, &benchSlots[i]) == 0);
+		ok = benchSlots[i].started;
+	}
+
+	long long	mockBefore = mockBytes.load();
+	long long	processStarted = processCPUMicros();
+	long long	wallStarted = getMonotonicMicros();
+
+	allocations = 0;
+	allocCounting = ok;
+
+	pthread_mutex_lock(&startMutex);
+	startGo = 1;
+	pthread_cond_broadcast(&startGate);
+	pthread_mutex_unlock(&startMutex);
+
+	for(int i = 0; i < slotCount; i++) {
+		if(benchSlots[i].started) {
+			pthread_join(benchSlots[i].thread, NULL);
+		}
+
+		ok = ok && !benchSlots[i].failed;
+	}
+
+	/* the mock sink has to have the bytes before the run is over */
+	for(int waited = 0; ok && (sinkType == SINK_MOCK) && (waited < BENCH_DRAIN_MS); waited += 10) {
+		long	queued = 0;
+
+		for(int i = 0; i < slotCount; i++) {
+			queued += getSendQueueBytes(benchSlots[i].g);
+		}
+
+		if(!queued) {
+			break;
+		}
+
+		sleepMs(10);
+	}
+
+	long long	wallMicros = getMonotonicMicros() - wallStarted;
+	long long	processMicros = processCPUMicros() - processStarted;
+
+	allocCounting = 0;
+
+	/* what is still in the socket buffers arrives once the streams are closed */
+	for(int i = 0; i < slotCount; i++) {
+		closeSink(&benchSlots[i]);
+	}
+
+	for(int waited = 0; (sinkType == SINK_MOCK) && mockSources && (waited < BENCH_DRAIN_MS); waited += 10) {
+		sleepMs(10);
+	}
+
+	if(ok) {
+		fprintf(out, "%s", first ? "" : ",\n");
+		writeRun(out, blockFrames, slotCount, wallMicros, processMicros, allocations.load(), mockBytes.load() - mockBefore);
+	}
+	else {
+		fprintf(stderr, "%d frames: the run did not finish, a slot failed to start or lost its sink\n", blockFrames);
+	}
+
+	for(int i = 0; i < slotCount; i++) {
+		closeSlot(&benchSlots[i]);
+	}
+
+	return ok;
+}
+
+/*
+ =======================================================================================================================
+    Command line
+ =======================================================================================================================
+ */
+static int parseList(const char *list, int *values, int max, int minimum) {
+	const char	*p = list;
+	int			count = 0;
+
+	while(*p && (count < max)) {
+		int value = atoi(p);
+
+		if(value < minimum) {
+			return 0;
+		}
+
+		values[count++] = value;
+		p = strchr(p, ',');
+		if(!p) {
+			break;
+		}
+
+		p++;
+	}
+
+	return count;
+}
+
+/* All slots the encoder itself would run, from NumEncoders in <config>_0.yaml */
+static int defaultSlots(void) {
+	mcaster1Globals	*g = (mcaster1Globals *) malloc(sizeof(mcaster1Globals));
+	int				count = 0;
+
+	if(g && loadSlotConfig(g, 0)) {
+		count = g->gNumEncoders;
+	}
+
+	if(g) {
+		freeSlotConfig(g);
+	}
+
+	for(numConfigSlots = 0; (numConfigSlots < count) && (numConfigSlots < BENCH_MAX_SLOTS); numConfigSlots++) {
+		configSlots[numConfigSlots] = numConfigSlots + 1;
+	}
+
+	return numConfigSlots > 0;
+}
+
+int main(int argc, char **argv) {
+	const char	*outputName = NULL;
+	int			i;
+
+	for(i = 1; i < argc; i++) {
+		if((argv[i][0] != '-') || !argv[i][1]) {
+			break;
+		}
+
+		if(i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+
+		switch(argv[i][1]) {
+			case 'c':
+				strncpy(configBase, argv[++i], sizeof(configBase) - 1);
+				break;
+
+			case 'e':
+				if(!(numConfigSlots = parseList(argv[++i], configSlots, BENCH_MAX_SLOTS, 1))) {
+					fprintf(stderr, "bad encoder list %s\n", argv[i]);
+					return 2;
+				}
+				break;
+
+			case 'n':
+				numBenchSlots = atoi(argv[++i]);
+				if((numBenchSlots < 1) || (numBenchSlots > BENCH_MAX_SLOTS)) {
+					fprintf(stderr, "-n takes 1 to %d slots\n", BENCH_MAX_SLOTS);
+					return 2;
+				}
+				break;
+
+			case 'b':
+				if(!(numBlockSizes = parseList(argv[++i], blockSizes, BENCH_MAX_RUNS, 16))) {
+					fprintf(stderr, "bad block sizes %s, at least 16 frames\n", argv[i]);
+					return 2;
+				}
+				break;
+
+			case 's':
+				streamSeconds = atof(argv[++i]);
+				break;
+
+			case 'g':
+				strncpy(signalName, argv[++i], sizeof(signalName) - 1);
+				if(strcmp(signalName, "tone") && strcmp(signalName, "noise")) {
+					fprintf(stderr, "signal is tone or noise\n");
+					return 2;
+				}
+				break;
+
+			case 'r':
+				inputRate = atoi(argv[++i]);
+				break;
+
+			case 'k':
+				if(!strcmp(argv[++i], "mock")) {
+					sinkType = SINK_MOCK;
+				}
+				else if(strcmp(argv[i], "null")) {
+					fprintf(stderr, "sink is null or mock\n");
+					return 2;
+				}
+				break;
+
+			case 'l':
+				strncpy(label, argv[++i], sizeof(label) - 1);
+				break;
+
+			case 'o':
+				outputName = argv[++i];
+				break;
+
+			default:
+				usage();
+				return 2;
+		}
+	}
+
+	if(i + 1 < argc) {
+		usage();
+		return 2;
+	}
+
+	inputName = (i < argc) ? argv[i] : NULL;
+	if((streamSeconds <= 0) || (inputRate < 8000)) {
+		usage();
+		return 2;
+	}
+
+	if(!numConfigSlots && !defaultSlots()) {
+		fprintf(stderr, "no encoders configured in %s_0.yaml, use -e\n", configBase);
+		return 2;
+	}
+
+	if(!(inputName ? loadInput(inputName) : generateInput())) {
+		return 1;
+	}
+
+#ifdef WIN32
+	WSADATA wsaData;
+
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+	if((sinkType == SINK_MOCK) && !startMockServer()) {
+		fprintf(stderr, "cannot listen on 127.0.0.1 for the mock server\n");
+		return 1;
+	}
+
+	FILE	*out = outputName ? fopen(outputName, "w") : stdout;
+
+	if(!out) {
+		fprintf(stderr, "cannot write %s\n", outputName);
+		stopMockServer();
+		return 1;
+	}
+
+	startAllocCount();
+
+	time_t	now = time(NULL);
+	char	when[64] = "";
+
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+	fprintf(out, "{\n\t\"benchmark\":\"mcaster1_bench\",\"label\":");
+	writeJSONString(out, label);
+	fprintf(out, ",\"started\":\"%s\",\n\t\"config\":", when);
+	writeJSONString(out, configBase);
+	fprintf(out, ",\"input\":");
+	writeJSONString(out, inputName ? inputName : signalName);
+	fprintf(out, ",\"samplerate\":%d,\"channels\":%d,\"sink\":\"%s\",\"seconds_per_slot\":%.3f,\n\t\"runs\":[\n",
+			inputRate, BENCH_CHANNELS, (sinkType == SINK_MOCK) ? "mock" : "null", streamSeconds);
+
+	int written = 0;
+	int failed = 0;
+
+	for(i = 0; i < numBlockSizes; i++) {
+		if(runBlockSize(out, blockSizes[i], !written)) {
+			written++;
+		}
+		else {
+			failed++;
+		}
+	}
+
+	fprintf(out, "\n\t]\n}\n");
+	if(outputName) {
+		fclose(out);
+	}
+
+	stopMockServer();
+	free(input);
+	return failed ? 1 : 0;
+}
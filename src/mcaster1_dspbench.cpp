@@ -0,0 +1,1099 @@
+/*
+ * mcaster1_dspbench.cpp - micro benchmarks for the DSP building blocks
+ *
+ * Times the resampler, CBUFFER, the Ooura FFTs (Fftsg_fl.cpp), SuperEQ,
+ * FloatScale and the VU metering over block sizes, channel counts and
+ * sample rate ratios.  Each kernel runs next to a plain scalar reference
+ * kept in this file, the baseline a SIMD version has to beat and agree
+ * with: every case compares its output with the reference's and reports
+ * the largest difference.  SuperEQ keeps its filter inside Equ.cpp, it is
+ * timed without a reference; the host's peak/RMS meter lives in the MFC
+ * front end, only its reference copy is timed.
+ *
+ * A case is timed as the best of BENCH_ROUNDS rounds, each long enough
+ * (-t) for the clock not to matter.  ns/sample is per sample going in,
+ * all channels counted; GB/s counts the bytes read and written.
+ *
+ * usage: mcaster1_dspbench [-k kernel,...] [-t ms] [-l label] [-o results.json]
+ */
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "libmcaster1dspencoder.h"
+#include "libmcaster1dspencoder_resample.h"
+#include "cbuffer.h"
+#include "paramlist.hpp"
+
+#define BENCH_ROUNDS		5
+#define BENCH_MAX_BLOCK		16384		// frames
+#define BENCH_CBUFFER_SIZE	(256 * 1024)
+#define BENCH_EQ_BITS		14			// SuperEQ window, as the encoder sets it up
+#define BENCH_EQ_BANDS		18
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* Fftsg_fl.cpp and Equ.cpp come without headers */
+void	cdft(int n, int isgn, float *a, int *ip, float *w);
+void	rdft(int n, int isgn, float *a, int *ip, float *w);
+void	equ_init(int wb);
+void	equ_makeTable(float *lbc, float *rbc, paramlist *param, float fs);
+void	equ_clearbuf(int bps, int srate);
+int		equ_modifySamples(char *buf, int nsamples, int nch, int bps);
+void	equ_quit(void);
+
+typedef void (*benchFunction)(void *context);
+
+typedef struct tagBenchCase {
+	const char	*kernel;
+	const char	*variant;			// tree = the code the encoder runs, scalar = reference here
+	int			frames;				// per call, per channel (points for the FFTs)
+	int			channels;
+	int			inRate;				// 0 = no rate involved
+	int			outRate;
+	double		samples;			// going in per call
+	double		bytes;				// read and written per call
+	double		maxError;			// against the scalar reference, < 0 = none
+} BenchCase;
+
+static int				roundMs = 20;
+static char				kernels[256] = "";			// empty = all
+static char				label[256] = "";
+static FILE				*out = NULL;
+static int				results = 0;
+static volatile float	sink = 0;
+
+static const int	blockSizes[] = { 64, 256, 1024, 4096 };
+static const int	fftSizes[] = { 256, 1024, 4096, 16384 };
+static const int	eqBlockSizes[] = { 576, 1152, 4096 };
+static const int	rateRatios[][2] = { { 44100, 48000 }, { 48000, 44100 }, { 22050, 44100 }, { 44100, 22050 }, { 32000, 48000 } };
+
+#define COUNT(a)	((int) (sizeof(a) / sizeof((a)[0])))
+
+static void usage(void) {
+	fprintf(stderr, "usage: mcaster1_dspbench [-k kernel,...] [-t ms] [-l label] [-o results.json]\n");
+	fprintf(stderr, "  -k list   resample, cbuffer, rdft, cdft, superequ, floatscale, meter (default all)\n");
+	fprintf(stderr, "  -t ms     length of one timing round (default %d), a case is the best of %d\n", roundMs, BENCH_ROUNDS);
+	fprintf(stderr, "  -l label  stored with the results, e.g. the commit measured\n");
+	fprintf(stderr, "  -o file   JSON results (default stdout)\n");
+}
+
+/*
+ =======================================================================================================================
+    Timing
+ =======================================================================================================================
+ */
+static double nowNanos(void) {
+#ifdef WIN32
+	static LARGE_INTEGER	frequency;
+	LARGE_INTEGER			counter;
+
+	if(!frequency.QuadPart) {
+		QueryPerformanceFrequency(&frequency);
+	}
+
+	QueryPerformanceCounter(&counter);
+	return (double) counter.QuadPart * 1e9 / (double) frequency.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static double timeRound(benchFunction f, void *context, long calls) {
+	double	started = nowNanos();
+
+	for(long i = 0; i < calls; i++) {
+		f(context);
+	}
+
+	return nowNanos() - started;
+}
+
+/* Nanoseconds per call, the best round */
+static double timeCalls(benchFunction f, void *context) {
+	long	calls = 1;
+	double	best = 0;
+
+	/* warm the caches and find how many calls fill a round */
+	while((timeRound(f, context, calls) < roundMs * 1e6) && (calls < (1L << 30))) {
+		calls *= 2;
+	}
+
+	for(int round = 0; round < BENCH_ROUNDS; round++) {
+		double	perCall = timeRound(f, context, calls) / calls;
+
+		if(!round || (perCall < best)) {
+			best = perCall;
+		}
+	}
+
+	return best;
+}
+
+static int wanted(const char *kernel) {
+	const char	*p = kernels;
+	size_t		length = strlen(kernel);
+
+	if(!kernels[0]) {
+		return 1;
+	}
+
+	while(p && *p) {
+		if(!strncmp(p, kernel, length) && ((p[length] == ',') || !p[length])) {
+			return 1;
+		}
+
+		p = strchr(p, ',');
+		if(p) {
+			p++;
+		}
+	}
+
+	return 0;
+}
+
+static void report(const BenchCase *c, double nanos) {
+	double	nsPerSample = nanos / c->samples;
+	double	gbPerSecond = c->bytes / nanos;
+
+	fprintf(out, "%s\t\t{\"kernel\":\"%s\",\"variant\":\"%s\",\"frames\":%d,\"channels\":%d,", results ? ",\n" : "", c->kernel, c->variant, c->frames, c->channels);
+	if(c->inRate) {
+		fprintf(out, "\"in_rate\":%d,\"out_rate\":%d,", c->inRate, c->outRate);
+	}
+	else {
+		fprintf(out, "\"in_rate\":null,\"out_rate\":null,");
+	}
+
+	fprintf(out, "\"ns_per_call\":%.1f,\"ns_per_sample\":%.3f,\"gb_per_s\":%.3f,", nanos, nsPerSample, gbPerSecond);
+	if(c->maxError >= 0) {
+		fprintf(out, "\"max_error\":%g}", c->maxError);
+	}
+	else {
+		fprintf(out, "\"max_error\":null}");
+	}
+
+	results++;
+
+	char	rates[32] = "";
+
+	if(c->inRate) {
+		snprintf(rates, sizeof(rates), "%d->%d", c->inRate, c->outRate);
+	}
+
+	fprintf(stderr, "%-14s %-7s %6d x %d %-12s %10.1f ns %8.3f ns/sample %7.2f GB/s",
+			c->kernel, c->variant, c->frames, c->channels, rates, nanos, nsPerSample, gbPerSecond);
+	if(c->maxError >= 0) {
+		fprintf(stderr, "  err %g", c->maxError);
+	}
+
+	fprintf(stderr, "\n");
+}
+
+static void fillNoise(float *samples, long count) {
+	static unsigned int seed = 0x2545f491;
+
+	for(long i = 0; i < count; i++) {
+		seed = seed * 1664525 + 1013904223;
+		samples[i] = (float) ((int) (seed >> 8) - (1 << 23)) / (float) (1 << 24);
+	}
+}
+
+static double maxDifference(const float *a, const float *b, long count) {
+	double	worst = 0;
+
+	for(long i = 0; i < count; i++) {
+		double	d = fabs((double) a[i] - (double) b[i]);
+
+		if(d > worst) {
+			worst = d;
+		}
+	}
+
+	return worst;
+}
+
+/*
+ =======================================================================================================================
+    Resampler.  The reference is a direct polyphase FIR over a linear
+    history with the same coefficient table; it adds in the same order as
+    res_push_interleaved, so the two agree to the bit.
+ =======================================================================================================================
+ */
+typedef struct tagRefResampler {
+	const float	*table;
+	int			taps;
+	int			inRate;
+	int			outRate;
+	int			channels;
+	float		*line;				// interleaved history and the new block
+	long		lineFrames;
+	long		position;			// frame the next output is centred on
+	int			offset;				// phase, in output steps
+} RefResampler;
+
+static int refResampleInit(RefResampler *r, const res_state *state) {
+	r->table = state->table;
+	r->taps = (int) state->taps;
+	r->inRate = (int) state->infreq;
+	r->outRate = (int) state->outfreq;
+	r->channels = (int) state->channels;
+	r->line = (float *) calloc((size_t) (r->taps + BENCH_MAX_BLOCK + 1) * r->channels, sizeof(float));
+
+	/* res_init starts with half a filter of silence */
+	r->lineFrames = r->taps / 2 + 1;
+	r->position = r->taps;
+	r->offset = 0;
+	return r->line != NULL;
+}
+
+static int refResample(RefResampler *r, float *dest, const float *source, long frames) {
+	int	produced = 0;
+
+	memcpy(r->line + r->lineFrames * r->channels, source, sizeof(float) * frames * r->channels);
+	r->lineFrames += frames;
+
+	while(r->position < r->lineFrames) {
+		const float *scale = r->table + r->offset * r->taps;
+
+		for(int c = 0; c < r->channels; c++) {
+			float	total = 0.0f;
+
+			for(int k = 0; k < r->taps; k++) {
+				total += r->line[(r->position - k) * r->channels + c] * scale[k];
+			}
+
+			dest[produced * r->channels + c] = total;
+		}
+
+		produced++;
+		r->offset += r->inRate;
+		while(r->offset >= r->outRate) {
+			r->offset -= r->outRate;
+			r->position++;
+		}
+	}
+
+	/* keep what the next outputs reach back to */
+	long	keep = ((r->position < r->lineFrames) ? r->position : r->lineFrames) - (r->taps - 1);
+
+	if(keep > 0) {
+		memmove(r->line, r->line + keep * r->channels, sizeof(float) * (r->lineFrames - keep) * r->channels);
+		r->lineFrames -= keep;
+		r->position -= keep;
+	}
+
+	return produced;
+}
+
+typedef struct tagResampleContext {
+	res_state		state;
+	RefResampler	ref;
+	float			*input;
+	float			*output;
+	int				frames;
+} ResampleContext;
+
+static void runResample(void *context) {
+	ResampleContext *c = (ResampleContext *) context;
+
+	res_push_interleaved(&c->state, c->output, c->input, c->frames);
+}
+
+static void runRefResample(void *context) {
+	ResampleContext *c = (ResampleContext *) context;
+
+	refResample(&c->ref, c->output, c->input, c->frames);
+}
+
+/* Eight blocks through both from the start, outputs side by side */
+static double checkResample(int channels, int inRate, int outRate, int frames) {
+	res_state		state;
+	RefResampler	ref;
+	float			*input = (float *) malloc(sizeof(float) * frames * channels);
+	float			*a = (float *) malloc(sizeof(float) * (frames * 4 + 16) * channels);
+	float			*b = (float *) malloc(sizeof(float) * (frames * 4 + 16) * channels);
+	double			worst = 0;
+
+	if(!input || !a || !b || res_init(&state, channels, outRate, inRate, RES_END) || !refResampleInit(&ref, &state)) {
+		free(input);
+		free(a);
+		free(b);
+		return -1;
+	}
+
+	for(int block = 0; block < 8; block++) {
+		fillNoise(input, (long) frames * channels);
+
+		int n = res_push_interleaved(&state, a, input, frames);
+		int m = refResample(&ref, b, input, frames);
+
+		if(n != m) {
+			worst = 1e9;
+			break;
+		}
+
+		double	d = maxDifference(a, b, (long) n * channels);
+
+		if(d > worst) {
+			worst = d;
+		}
+	}
+
+	free(ref.line);
+	res_clear(&state);
+	free(input);
+	free(a);
+	free(b);
+	return worst;
+}
+
+static void benchResample(void) {
+	for(int r = 0; r < COUNT(rateRatios); r++) {
+		for(int channels = 1; channels <= 2; channels++) {
+			for(int s = 0; s < COUNT(blockSizes); s++) {
+				ResampleContext c;
+				BenchCase		bc;
+				int				inRate = rateRatios[r][0];
+				int				outRate = rateRatios[r][1];
+				int				frames = blockSizes[s];
+
+				memset(&c, '\000', sizeof(c));
+				c.frames = frames;
+				c.input = (float *) malloc(sizeof(float) * frames * channels);
+				c.output = (float *) malloc(sizeof(float) * (frames * 4 + 16) * channels);
+				if(!c.input || !c.output || res_init(&c.state, channels, outRate, inRate, RES_END) || !refResampleInit(&c.ref, &c.state)) {
+					fprintf(stderr, "resample: out of memory\n");
+					return;
+				}
+
+				fillNoise(c.input, (long) frames * channels);
+
+				memset(&bc, '\000', sizeof(bc));
+				bc.kernel = "resample";
+				bc.frames = frames;
+				bc.channels = channels;
+				bc.inRate = inRate;
+				bc.outRate = outRate;
+				bc.samples = (double) frames * channels;
+				bc.bytes = ((double) frames + (double) frames * outRate / inRate) * channels * sizeof(float);
+				bc.maxError = checkResample(channels, inRate, outRate, frames);
+
+				bc.variant = "tree";
+				report(&bc, timeCalls(runResample, &c));
+				bc.variant = "scalar";
+				report(&bc, timeCalls(runRefResample, &c));
+
+				sink += c.output[0];
+				free(c.ref.line);
+				res_clear(&c.state);
+				free(c.input);
+				free(c.output);
+			}
+		}
+	}
+}
+
+/*
+ =======================================================================================================================
+    CBUFFER.  A block of 16 bit samples in and out again; the reference is
+    the same ring, a byte at a time, without the lock.
+ =======================================================================================================================
+ */
+typedef struct tagRefRing {
+	char			*buf;
+	unsigned long	size;
+	unsigned long	readIndex;
+	unsigned long	writeIndex;
+	unsigned long	used;
+} RefRing;
+
+static int refRingInsert(RefRing *r, const char *items, unsigned long count) {
+	for(unsigned long i = 0; i < count; i++) {
+		if(r->used >= r->size) {
+			return BUFFER_FULL;
+		}
+
+		r->used++;
+		if(++r->writeIndex >= r->size) {
+			r->writeIndex = 0;
+		}
+
+		r->buf[r->writeIndex] = items[i];
+	}
+
+	return 1;
+}
+
+static int refRingExtract(RefRing *r, char *items, unsigned long count) {
+	for(unsigned long i = 0; i < count; i++) {
+		if(!r->used) {
+			return BUFFER_EMPTY;
+		}
+
+		r->used--;
+		if(++r->readIndex >= r->size) {
+			r->readIndex = 0;
+		}
+
+		items[i] = r->buf[r->readIndex];
+	}
+
+	return 1;
+}
+
+typedef struct tagRingContext {
+	CBUFFER			buffer;
+	RefRing			ref;
+	char			*input;
+	char			*output;
+	unsigned long	bytes;
+} RingContext;
+
+static void runCbuffer(void *context) {
+	RingContext *c = (RingContext *) context;
+
+	cbuffer_insert(&c->buffer, c->input, c->bytes);
+	cbuffer_extract(&c->buffer, c->output, c->bytes);
+}
+
+static void runRefRing(void *context) {
+	RingContext *c = (RingContext *) context;
+
+	refRingInsert(&c->ref, c->input, c->bytes);
+	refRingExtract(&c->ref, c->output, c->bytes);
+}
+
+static void benchCbuffer(void) {
+	for(int channels = 1; channels <= 2; channels++) {
+		for(int s = 0; s < COUNT(blockSizes); s++) {
+			RingContext c;
+			BenchCase	bc;
+			int			frames = blockSizes[s];
+
+			memset(&c, '\000', sizeof(c));
+			c.bytes = (unsigned long) frames * channels * sizeof(short);
+			c.input = (char *) malloc(c.bytes);
+			c.output = (char *) malloc(c.bytes);
+			c.ref.buf = (char *) malloc(BENCH_CBUFFER_SIZE);
+			c.ref.size = BENCH_CBUFFER_SIZE;
+			c.ref.readIndex = c.ref.writeIndex = BENCH_CBUFFER_SIZE - 1;
+			if(!c.input || !c.output || !c.ref.buf || !cbuffer_init(&c.buffer, BENCH_CBUFFER_SIZE)) {
+				fprintf(stderr, "cbuffer: out of memory\n");
+				return;
+			}
+
+			for(unsigned long i = 0; i < c.bytes; i++) {
+				c.input[i] = (char) (i * 7 + 3);
+			}
+
+			memset(&bc, '\000', sizeof(bc));
+			bc.kernel = "cbuffer";
+			bc.frames = frames;
+			bc.channels = channels;
+			bc.samples = (double) frames * channels;
+			bc.bytes = 4.0 * c.bytes;
+
+			/* both must hand back what went in */
+			runCbuffer(&c);
+			bc.maxError = memcmp(c.input, c.output, c.bytes) ? 1 : 0;
+			runRefRing(&c);
+			if(memcmp(c.input, c.output, c.bytes)) {
+				bc.maxError = 1;
+			}
+
+			bc.variant = "tree";
+			report(&bc, timeCalls(runCbuffer, &c));
+			bc.variant = "scalar";
+			report(&bc, timeCalls(runRefRing, &c));
+
+			sink += c.output[0];
+			cbuffer_destroy(&c.buffer);
+			pthread_mutex_destroy(&c.buffer.cbuffer_mutex);
+			free(c.ref.buf);
+			free(c.input);
+			free(c.output);
+		}
+	}
+}
+
+/*
+ =======================================================================================================================
+    FFTs.  The reference is a textbook iterative radix-2 complex FFT with
+    Ooura's sign, exp(2 pi i j k / n); the real transform runs it on the
+    full length with zero imaginary parts and packs the result as rdft
+    does.  A call copies the input in and transforms each channel.
+ =======================================================================================================================
+ */
+typedef struct tagFFTContext {
+	int		points;				// real points (rdft), complex points (cdft)
+	int		channels;
+	int		complexInput;
+	float	*input;				// per channel: points floats, or 2 * points for cdft
+	float	*work;
+	int		*ip;
+	float	*w;
+	float	*twiddle;			// reference: cos, sin of 2 pi k / n, interleaved
+	float	*scratch;			// reference: complex working copy for rdft
+} FFTContext;
+
+static void refFFT(float *a, int n, const float *twiddle) {
+	for(int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+
+		for(; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+
+		j |= bit;
+		if(i < j) {
+			float	re = a[i * 2];
+			float	im = a[i * 2 + 1];
+
+			a[i * 2] = a[j * 2];
+			a[i * 2 + 1] = a[j * 2 + 1];
+			a[j * 2] = re;
+			a[j * 2 + 1] = im;
+		}
+	}
+
+	for(int length = 2; length <= n; length <<= 1) {
+		int step = n / length;
+
+		for(int i = 0; i < n; i += length) {
+			for(int k = 0; k < length / 2; k++) {
+				float	wr = twiddle[k * step * 2];
+				float	wi = twiddle[k * step * 2 + 1];
+				float	*u = a + (i + k) * 2;
+				float	*v = a + (i + k + length / 2) * 2;
+				float	tr = v[0] * wr - v[1] * wi;
+				float	ti = v[0] * wi + v[1] * wr;
+
+				v[0] = u[0] - tr;
+				v[1] = u[1] - ti;
+				u[0] += tr;
+				u[1] += ti;
+			}
+		}
+	}
+}
+
+static void refRealFFT(float *a, int n, const float *twiddle, float *scratch) {
+	for(int i = 0; i < n; i++) {
+		scratch[i * 2] = a[i];
+		scratch[i * 2 + 1] = 0.0f;
+	}
+
+	refFFT(scratch, n, twiddle);
+
+	/* rdft: a[0] = R[0], a[1] = R[n/2], then R[k], I[k] */
+	a[0] = scratch[0];
+	a[1] = scratch[n];
+	for(int k = 1; k < n / 2; k++) {
+		a[k * 2] = scratch[k * 2];
+		a[k * 2 + 1] = scratch[k * 2 + 1];
+	}
+}
+
+static void runFFT(void *context) {
+	FFTContext	*c = (FFTContext *) context;
+	int			floats = c->complexInput ? c->points * 2 : c->points;
+
+	memcpy(c->work, c->input, sizeof(float) * floats * c->channels);
+	for(int ch = 0; ch < c->channels; ch++) {
+		if(c->complexInput) {
+			cdft(floats, 1, c->work + ch * floats, c->ip, c->w);
+		}
+		else {
+			rdft(floats, 1, c->work + ch * floats, c->ip, c->w);
+		}
+	}
+}
+
+static void runRefFFT(void *context) {
+	FFTContext	*c = (FFTContext *) context;
+	int			floats = c->complexInput ? c->points * 2 : c->points;
+
+	memcpy(c->work, c->input, sizeof(float) * floats * c->channels);
+	for(int ch = 0; ch < c->channels; ch++) {
+		if(c->complexInput) {
+			refFFT(c->work + ch * floats, c->points, c->twiddle);
+		}
+		else {
+			refRealFFT(c->work + ch * floats, c->points, c->twiddle, c->scratch);
+		}
+	}
+}
+
+static void benchFFT(int complexInput) {
+	for(int channels = 1; channels <= 2; channels++) {
+		for(int s = 0; s < COUNT(fftSizes); s++) {
+			FFTContext	c;
+			BenchCase	bc;
+			int			points = fftSizes[s];
+			int			floats = complexInput ? points * 2 : points;
+
+			memset(&c, '\000', sizeof(c));
+			c.points = points;
+			c.channels = channels;
+			c.complexInput = complexInput;
+			c.input = (float *) malloc(sizeof(float) * floats * channels);
+			c.work = (float *) malloc(sizeof(float) * floats * channels);
+			c.ip = (int *) calloc(2 + (int) sqrt((double) floats) + 1, sizeof(int));
+			c.w = (float *) malloc(sizeof(float) * floats);
+			c.twiddle = (float *) malloc(sizeof(float) * points);
+			c.scratch = (float *) malloc(sizeof(float) * points * 2);
+			if(!c.input || !c.work || !c.ip || !c.w || !c.twiddle || !c.scratch) {
+				fprintf(stderr, "fft: out of memory\n");
+				return;
+			}
+
+			for(int k = 0; k < points / 2; k++) {
+				c.twiddle[k * 2] = (float) cos(2 * M_PI * k / points);
+				c.twiddle[k * 2 + 1] = (float) sin(2 * M_PI * k / points);
+			}
+
+			fillNoise(c.input, (long) floats * channels);
+
+			memset(&bc, '\000', sizeof(bc));
+			bc.kernel = complexInput ? "cdft" : "rdft";
+			bc.frames = points;
+			bc.channels = channels;
+			bc.samples = (double) points * channels;
+			bc.bytes = 3.0 * floats * channels * sizeof(float);
+
+			/* the error is relative to the largest bin */
+			float	*a = (float *) malloc(sizeof(float) * floats * channels);
+
+			runFFT(&c);
+			if(a) {
+				memcpy(a, c.work, sizeof(float) * floats * channels);
+				runRefFFT(&c);
+
+				double	peak = 0;
+
+				for(long i = 0; i < (long) floats * channels; i++) {
+					peak = (fabs(c.work[i]) > peak) ? fabs(c.work[i]) : peak;
+				}
+
+				bc.maxError = peak ? maxDifference(a, c.work, (long) floats * channels) / peak : 0;
+				free(a);
+			}
+			else {
+				bc.maxError = -1;
+			}
+
+			bc.variant = "tree";
+			report(&bc, timeCalls(runFFT, &c));
+			bc.variant = "scalar";
+			report(&bc, timeCalls(runRefFFT, &c));
+
+			sink += c.work[0];
+			free(c.input);
+			free(c.work);
+			free(c.ip);
+			free(c.w);
+			free(c.twiddle);
+			free(c.scratch);
+		}
+	}
+}
+
+/*
+ =======================================================================================================================
+    SuperEQ, flat, on 16 bit samples in place
+ =======================================================================================================================
+ */
+typedef struct tagEqContext {
+	short	*input;
+	short	*work;
+	int		frames;
+	int		channels;
+} EqContext;
+
+static void runEqualizer(void *context) {
+	EqContext	*c = (EqContext *) context;
+
+	memcpy(c->work, c->input, sizeof(short) * c->frames * c->channels);
+	equ_modifySamples((char *) c->work, c->frames, c->channels, 16);
+}
+
+static void benchEqualizer(void) {
+	float		bands[BENCH_EQ_BANDS];
+	paramlist	param;
+	static const int	rates[] = { 44100, 48000 };
+
+	for(int i = 0; i < BENCH_EQ_BANDS; i++) {
+		bands[i] = 1.0f;
+	}
+
+	equ_init(BENCH_EQ_BITS);
+	for(int r = 0; r < COUNT(rates); r++) {
+		equ_makeTable(bands, bands, &param, (float) rates[r]);
+		for(int channels = 1; channels <= 2; channels++) {
+			for(int s = 0; s < COUNT(eqBlockSizes); s++) {
+				EqContext	c;
+				BenchCase	bc;
+				int			frames = eqBlockSizes[s];
+				float		*noise = (float *) malloc(sizeof(float) * frames * channels);
+
+				c.frames = frames;
+				c.channels = channels;
+				c.input = (short *) malloc(sizeof(short) * frames * channels);
+				c.work = (short *) malloc(sizeof(short) * frames * channels);
+				if(!noise || !c.input || !c.work) {
+					fprintf(stderr, "superequ: out of memory\n");
+					return;
+				}
+
+				fillNoise(noise, (long) frames * channels);
+				for(int i = 0; i < frames * channels; i++) {
+					c.input[i] = (short) (noise[i] * 32767.f);
+				}
+
+				free(noise);
+				equ_clearbuf(16, rates[r]);
+
+				memset(&bc, '\000', sizeof(bc));
+				bc.kernel = "superequ";
+				bc.variant = "tree";
+				bc.frames = frames;
+				bc.channels = channels;
+				bc.inRate = rates[r];
+				bc.outRate = rates[r];
+				bc.samples = (double) frames * channels;
+				bc.bytes = 3.0 * frames * channels * sizeof(short);
+				bc.maxError = -1;
+				report(&bc, timeCalls(runEqualizer, &c));
+
+				sink += c.work[0];
+				free(c.input);
+				free(c.work);
+			}
+		}
+	}
+
+	equ_quit();
+}
+
+/*
+ =======================================================================================================================
+    FloatScale, stereo float to the 16 bit range, or folded to mono
+ =======================================================================================================================
+ */
+typedef struct tagScaleContext {
+	float	*input;				// stereo interleaved
+	float	*output;
+	int		frames;
+	int		destChannels;
+} ScaleContext;
+
+static void refFloatScale(float *destination, const float *source, int numsamples, int destchannels) {
+	if(destchannels == 2) {
+		for(int i = 0; i < numsamples; i++) {
+			destination[i] = source[i] * 32767.f;
+		}
+	}
+	else {
+		for(int i = 0; i < numsamples / 2; i++) {
+			destination[i] = (source[i * 2] + source[i * 2 + 1]) * 16383.f;
+		}
+	}
+}
+
+static void runFloatScale(void *context) {
+	ScaleContext	*c = (ScaleContext *) context;
+
+	FloatScale(c->output, c->input, c->frames * 2, c->destChannels);
+}
+
+static void runRefFloatScale(void *context) {
+	ScaleContext	*c = (ScaleContext *) context;
+
+	refFloatScale(c->output, c->input, c->frames * 2, c->destChannels);
+}
+
+static void benchFloatScale(void) {
+	for(int channels = 1; channels <= 2; channels++) {
+		for(int s = 0; s < COUNT(blockSizes); s++) {
+			ScaleContext	c;
+			BenchCase		bc;
+			int				frames = blockSizes[s];
+
+			c.frames = frames;
+			c.destChannels = channels;
+			c.input = (float *) malloc(sizeof(float) * frames * 2);
+			c.output = (float *) malloc(sizeof(float) * frames * 2);
+
+			float	*a = (float *) malloc(sizeof(float) * frames * 2);
+
+			if(!c.input || !c.output || !a) {
+				fprintf(stderr, "floatscale: out of memory\n");
+				return;
+			}
+
+			fillNoise(c.input, (long) frames * 2);
+
+			memset(&bc, '\000', sizeof(bc));
+			bc.kernel = "floatscale";
+			bc.frames = frames;
+			bc.channels = channels;
+			bc.samples = (double) frames * 2;
+			bc.bytes = ((double) frames * 2 + (double) frames * channels) * sizeof(float);
+
+			runFloatScale(&c);
+			memcpy(a, c.output, sizeof(float) * frames * channels);
+			runRefFloatScale(&c);
+			bc.maxError = maxDifference(a, c.output, (long) frames * channels);
+			free(a);
+
+			bc.variant = "tree";
+			report(&bc, timeCalls(runFloatScale, &c));
+			bc.variant = "scalar";
+			report(&bc, timeCalls(runRefFloatScale, &c));
+
+			sink += c.output[0];
+			free(c.input);
+			free(c.output);
+		}
+	}
+}
+
+/*
+ =======================================================================================================================
+    Metering.  meter: the encoder's mean level of a stereo host block
+    (meterPCMBlock), float and 16 bit.  meter_peak_rms: the front end's
+    peak and RMS over the capture block (handleAllOutput), reference only.
+ =======================================================================================================================
+ */
+typedef struct tagMeterContext {
+	PCMBlock	block;
+	float		*floats;
+	short		*shorts;
+	int			frames;
+	int			channels;
+	long		left;
+	long		right;
+	double		rmsLeft;
+	double		rmsRight;
+} MeterContext;
+
+static void refMeterBlock(MeterContext *c) {
+	long	left = 0;
+	long	right = 0;
+
+	for(int i = 0; i < c->frames; i++) {
+		if(c->block.floatSource) {
+			left += abs((int) (c->block.floatSource[i * 2] * 32767.f));
+			right += abs((int) (c->block.floatSource[i * 2 + 1] * 32767.f));
+		}
+		else {
+			left += abs((int) c->block.int16Source[i * 2]);
+			right += abs((int) c->block.int16Source[i * 2 + 1]);
+		}
+	}
+
+	c->left = c->frames ? left / (c->frames * 2) : 0;
+	c->right = c->frames ? right / (c->frames * 2) : 0;
+}
+
+static void runMeter(void *context) {
+	MeterContext	*c = (MeterContext *) context;
+
+	meterPCMBlock(&c->block, c->frames, &c->left, &c->right);
+}
+
+static void runRefMeter(void *context) {
+	refMeterBlock((MeterContext *) context);
+}
+
+static void runRefPeakRMS(void *context) {
+	MeterContext	*c = (MeterContext *) context;
+	long			leftMax = 0;
+	long			rightMax = 0;
+	double			sumLeft = 0.0;
+	double			sumRight = 0.0;
+
+	for(int i = 0; i < c->frames; i++) {
+		long	left = abs((int) (c->floats[i * c->channels] * 32767.f));
+		long	right = (c->channels == 2) ? abs((int) (c->floats[i * 2 + 1] * 32767.f)) : left;
+
+		sumLeft += left * left;
+		sumRight += right * right;
+		if(left > leftMax) {
+			leftMax = left;
+		}
+
+		if(right > rightMax) {
+			rightMax = right;
+		}
+	}
+
+	c->left = leftMax;
+	c->right = rightMax;
+	c->rmsLeft = sqrt(sumLeft);
+	c->rmsRight = sqrt(sumRight);
+}
+
+static void benchMeter(void) {
+	for(int s = 0; s < COUNT(blockSizes); s++) {
+		for(int source = 0; source < 3; source++) {
+			MeterContext	c;
+			BenchCase		bc;
+			int				frames = blockSizes[s];
+
+			memset(&c, '\000', sizeof(c));
+			c.frames = frames;
+			c.channels = 2;
+			c.floats = (float *) malloc(sizeof(float) * frames * 2);
+			c.shorts = (short *) malloc(sizeof(short) * frames * 2);
+			if(!c.floats || !c.shorts) {
+				fprintf(stderr, "meter: out of memory\n");
+				return;
+			}
+
+			fillNoise(c.floats, (long) frames * 2);
+			for(int i = 0; i < frames * 2; i++) {
+				c.shorts[i] = (short) (c.floats[i] * 32767.f);
+			}
+
+			memset(&bc, '\000', sizeof(bc));
+			bc.frames = frames;
+			bc.channels = 2;
+			bc.samples = (double) frames * 2;
+
+			if(source < 2) {
+				/* 0 = float host block, 1 = 16 bit */
+				c.block.floatSource = source ? NULL : c.floats;
+				c.block.int16Source = source ? c.shorts : NULL;
+				bc.kernel = source ? "meter_int16" : "meter_float";
+				bc.bytes = (double) frames * 2 * (source ? sizeof(short) : sizeof(float));
+
+				long	left, right;
+
+				runMeter(&c);
+				left = c.left;
+				right = c.right;
+				runRefMeter(&c);
+				bc.maxError = (double) (labs(left - c.left) + labs(right - c.right));
+
+				bc.variant = "tree";
+				report(&bc, timeCalls(runMeter, &c));
+				bc.variant = "scalar";
+				report(&bc, timeCalls(runRefMeter, &c));
+			}
+			else {
+				bc.kernel = "meter_peak_rms";
+				bc.variant = "scalar";
+				bc.bytes = (double) frames * 2 * sizeof(float);
+				bc.maxError = -1;
+				report(&bc, timeCalls(runRefPeakRMS, &c));
+			}
+
+			sink += (float) c.left;
+			free(c.floats);
+			free(c.shorts);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	const char	*outputName = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if((argv[i][0] != '-') || !argv[i][1] || (i + 1 >= argc)) {
+			usage();
+			return 2;
+		}
+
+		switch(argv[i][1]) {
+			case 'k':
+				strncpy(kernels, argv[++i], sizeof(kernels) - 1);
+				break;
+
+			case 't':
+				roundMs = atoi(argv[++i]);
+				if(roundMs < 1) {
+					usage();
+					return 2;
+				}
+				break;
+
+			case 'l':
+				strncpy(label, argv[++i], sizeof(label) - 1);
+				break;
+
+			case 'o':
+				outputName = argv[++i];
+				break;
+
+			default:
+				usage();
+				return 2;
+		}
+	}
+
+	out = outputName ? fopen(outputName, "w") : stdout;
+	if(!out) {
+		fprintf(stderr, "cannot write %s\n", outputName);
+		return 1;
+	}
+
+	time_t	now = time(NULL);
+	char	when[64] = "";
+
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+	/* the label goes in as given, quotes and backslashes left out */
+	fprintf(out, "{\n\t\"benchmark\":\"mcaster1_dspbench\",\"label\":\"");
+	for(const char *p = label; *p; p++) {
+		if((*p != '"') && (*p != '\\') && ((unsigned char) *p >= 0x20)) {
+			fputc(*p, out);
+		}
+	}
+
+	fprintf(out, "\",\"started\":\"%s\",\"round_ms\":%d,\"rounds\":%d,\n\t\"results\":[\n", when, roundMs, BENCH_ROUNDS);
+
+	if(wanted("resample")) {
+		benchResample();
+	}
+
+	if(wanted("cbuffer")) {
+		benchCbuffer();
+	}
+
+	if(wanted("rdft")) {
+		benchFFT(0);
+	}
+
+	if(wanted("cdft")) {
+		benchFFT(1);
+	}
+
+	if(wanted("superequ")) {
+		benchEqualizer();
+	}
+
+	if(wanted("floatscale")) {
+		benchFloatScale();
+	}
+
+	if(wanted("meter")) {
+		benchMeter();
+	}
+
+	fprintf(out, "\n\t]\n}\n");
+	if(outputName) {
+		fclose(out);
+	}
+
+	return results ? 0 : 1;
+}
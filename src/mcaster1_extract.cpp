@@ -0,0 +1,266 @@
+/*
+ * mcaster1_extract.cpp - cut a time range out of an archive
+ *
+ * Reads the <archive>.idx index the archive writer leaves next to MP3, AAC
+ * and Ogg archives and copies the bytes from the frame or page at the start
+ * time to the one at the end time.  Nothing is decoded or re-encoded.  For
+ * Ogg the header pages of the logical stream are copied in front so the
+ * result plays on its own.
+ *
+ * usage: mcaster1_extract [-l] archive [from to output]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "archive_format.h"
+
+#define EXTRACT_COPY_BLOCK	(64 * 1024)
+
+#ifdef WIN32
+#define extractSeek(fp, offset)	_fseeki64(fp, offset, SEEK_SET)
+#define extractSeekEnd(fp)		_fseeki64(fp, 0, SEEK_END)
+#define extractTell(fp)			_ftelli64(fp)
+#else
+#define extractSeek(fp, offset)	fseeko(fp, (off_t) (offset), SEEK_SET)
+#define extractSeekEnd(fp)		fseeko(fp, 0, SEEK_END)
+#define extractTell(fp)			(long long) ftello(fp)
+#endif
+
+static void usage(void) {
+	fprintf(stderr, "usage: mcaster1_extract [-l] archive [from to output]\n");
+	fprintf(stderr, "  -l      list the titles in the archive with their times\n");
+	fprintf(stderr, "  from/to YYYY-MM-DD HH:MM[:SS], HH:MM[:SS] on the day the archive starts, or +seconds into it\n");
+	fprintf(stderr, "the archive needs its .idx index (ArchiveIndexEnable), WAV archives have none\n");
+}
+
+static void formatTime(char *out, int outSize, long long wallMillis) {
+	time_t		seconds = (time_t) (wallMillis / 1000);
+	struct tm	*tp = localtime(&seconds);
+
+	if(!tp || !strftime(out, outSize, "%Y-%m-%d %H:%M:%S", tp)) {
+		snprintf(out, outSize, "%lld", wallMillis);
+	}
+}
+
+/* A time of day without a date is taken on the day the archive starts, or the next one if that is earlier */
+static int parseTime(const char *text, const ArchiveIndex *index, long long *wallMillis) {
+	long long	first = index->entries[0].wallMillis;
+	time_t		firstSeconds = (time_t) (first / 1000);
+	struct tm	when;
+	int			year, month, day, hour, minute, second = 0;
+	int			fields;
+
+	if(text[0] == '+') {
+		*wallMillis = first + (long long) (atof(text + 1) * 1000);
+		return 1;
+	}
+
+	memcpy(&when, localtime(&firstSeconds), sizeof(when));
+	fields = sscanf(text, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second);
+	if(fields >= 5) {
+		when.tm_year = year - 1900;
+		when.tm_mon = month - 1;
+		when.tm_mday = day;
+	}
+	else {
+		second = 0;
+		if(sscanf(text, "%d:%d:%d", &hour, &minute, &second) < 2) {
+			return 0;
+		}
+	}
+
+	when.tm_hour = hour;
+	when.tm_min = minute;
+	when.tm_sec = second;
+	when.tm_isdst = -1;
+
+	time_t	seconds = mktime(&when);
+
+	if(seconds == (time_t) -1) {
+		return 0;
+	}
+
+	if((fields < 5) && ((long long) seconds * 1000 < first - 1000)) {
+		seconds += 24 * 60 * 60;
+	}
+
+	*wallMillis = (long long) seconds * 1000;
+	return 1;
+}
+
+static void listTitles(const ArchiveIndex *index) {
+	int lastTitle = -2;
+
+	for(int i = 0; i < index->count; i++) {
+		const ArchiveIndexEntry *entry = &index->entries[i];
+
+		if(entry->header || (entry->title == lastTitle)) {
+			continue;
+		}
+
+		char		when[64];
+		long long	offset = (entry->wallMillis - index->entries[0].wallMillis) / 1000;
+
+		formatTime(when, sizeof(when), entry->wallMillis);
+		printf("%s  +%02lld:%02lld:%02lld  %s\n", when, offset / 3600, (offset / 60) % 60, offset % 60,
+			   (entry->title >= 0) ? index->titles[entry->title] : "");
+		lastTitle = entry->title;
+	}
+}
+
+static int copyRange(FILE *in, FILE *out, long long from, long long to) {
+	static char buffer[EXTRACT_COPY_BLOCK];
+
+	if(extractSeek(in, from) != 0) {
+		return 0;
+	}
+
+	while(from < to) {
+		size_t	want = (to - from > EXTRACT_COPY_BLOCK) ? EXTRACT_COPY_BLOCK : (size_t) (to - from);
+		size_t	got = fread(buffer, 1, want, in);
+
+		if(!got || (fwrite(buffer, 1, got, out) != got)) {
+			return got ? 0 : 1;		// a short archive (cut off) ends the copy
+		}
+
+		from += (long long) got;
+	}
+
+	return 1;
+}
+
+static int extract(const char *archive, const ArchiveIndex *index, long long from, long long to, const char *output) {
+	int start = findIndexEntry(index, from);
+
+	if(start < 0) {
+		fprintf(stderr, "%s: no audio in the index\n", archive);
+		return 0;
+	}
+
+	FILE	*in = fopen(archive, "rb");
+
+	if(!in) {
+		fprintf(stderr, "Cannot open %s\n", archive);
+		return 0;
+	}
+
+	extractSeekEnd(in);
+
+	long long	size = extractTell(in);
+	long long	endOffset = size;
+	int			end = -1;
+
+	for(int i = start + 1; i < index->count; i++) {
+		if(!index->entries[i].header && (index->entries[i].wallMillis >= to)) {
+			end = i;
+			endOffset = index->entries[i].offset;
+			break;
+		}
+	}
+
+	FILE	*out = fopen(output, "wb");
+
+	if(!out) {
+		fprintf(stderr, "Cannot create %s\n", output);
+		fclose(in);
+		return 0;
+	}
+
+	int ok = 1;
+
+	/* Ogg: the header pages of the logical stream the range starts in */
+	int headerLast = start - 1;
+
+	while((headerLast >= 0) && !index->entries[headerLast].header) {
+		headerLast--;
+	}
+
+	if(headerLast >= 0) {
+		int headerFirst = headerLast;
+
+		while((headerFirst > 0) && index->entries[headerFirst - 1].header) {
+			headerFirst--;
+		}
+
+		for(int i = headerFirst; ok && (i <= headerLast); i++) {
+			ok = copyRange(in, out, index->entries[i].offset, index->entries[i + 1].offset);
+		}
+	}
+
+	ok = ok && copyRange(in, out, index->entries[start].offset, (endOffset < size) ? endOffset : size);
+	ok = (fclose(out) == 0) && ok;
+	fclose(in);
+
+	if(!ok) {
+		fprintf(stderr, "Cannot write %s\n", output);
+		return 0;
+	}
+
+	const ArchiveIndexEntry *first = &index->entries[start];
+	const ArchiveIndexEntry *last = (end >= 0) ? &index->entries[end] : &index->entries[index->count - 1];
+	char					fromText[64];
+	char					toText[64];
+	double					seconds = first->samplerate ? (double) (last->sample - first->sample) / first->samplerate :
+		(double) (last->wallMillis - first->wallMillis) / 1000;
+
+	formatTime(fromText, sizeof(fromText), first->wallMillis);
+	formatTime(toText, sizeof(toText), last->wallMillis);
+	printf("%s: %s to %s, %.1f seconds of audio, %lld bytes from offset %lld\n", output, fromText, toText, seconds,
+		   endOffset - first->offset, first->offset);
+	if(first->title >= 0) {
+		printf("starts in: %s\n", index->titles[first->title]);
+	}
+
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	int				list = 0;
+	int				arg = 1;
+	ArchiveIndex	index;
+
+	if((arg < argc) && !strcmp(argv[arg], "-l")) {
+		list = 1;
+		arg++;
+	}
+
+	if(!((list && (argc - arg == 1)) || (!list && (argc - arg == 4)))) {
+		usage();
+		return 1;
+	}
+
+	const char	*archive = argv[arg];
+
+	if(!loadArchiveIndex(archive, &index)) {
+		fprintf(stderr, "Cannot read the index %s%s\n", archive, ARCHIVE_INDEX_SUFFIX);
+		return 1;
+	}
+
+	if(!index.count) {
+		fprintf(stderr, "%s%s has no entries\n", archive, ARCHIVE_INDEX_SUFFIX);
+		freeArchiveIndex(&index);
+		return 1;
+	}
+
+	int ok = 1;
+
+	if(list) {
+		listTitles(&index);
+	}
+	else {
+		long long	from;
+		long long	to;
+
+		if(!parseTime(argv[arg + 1], &index, &from) || !parseTime(argv[arg + 2], &index, &to) || (to <= from)) {
+			fprintf(stderr, "Bad time range %s - %s\n", argv[arg + 1], argv[arg + 2]);
+			ok = 0;
+		}
+		else {
+			ok = extract(archive, &index, from, to, argv[arg + 3]);
+		}
+	}
+
+	freeArchiveIndex(&index);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,632 @@
+/*
+ * mcaster1_relaytest.cpp - the relay input against a mock upstream
+ *
+ * Runs relay_input.cpp against an Icecast/Shoutcast stand-in on the
+ * loopback and checks what comes out of its callbacks.  The mock streams
+ * synthetic MP3 frames in real time, each numbered in its main data, with
+ * ICY metadata every few hundred bytes, and sends the body in odd sized
+ * pieces so frame headers and metadata blocks straddle recv() calls.
+ *
+ * Scenarios:
+ *   metadata   one connection; every frame and every title arrives, in
+ *              order, the titles with the frame they were sent in front of
+ *   redirect   the first request is answered 302, the relay follows it
+ *   reconnect  the upstream closes mid-stream; the relay reconnects and
+ *              the numbering carries on
+ *   stall      the upstream goes quiet with the socket open; the relay
+ *              rebuffers on silence and picks up again when data returns
+ *
+ * In every scenario the encoders must be fed without a break: no gap
+ * between two clock thread callbacks may be longer than RELAY_TEST_MAX_GAP_MS.
+ * Frames go to the frame callback only (passthrough), so no decoder runs.
+ *
+ * usage: mcaster1_relaytest [-t scenario,...] [-s stall ms] [-v]
+ */
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/select.h>
+#include <arpa/inet.h>
+#define INVALID_SOCKET	-1
+#endif
+#include "libmcaster1dspencoder.h"
+#include "relay_input.h"
+
+#define RELAY_TEST_BUFFER_MS		500
+#define RELAY_TEST_MAX_GAP_MS		150		// between two callbacks of the clock thread
+#define RELAY_TEST_METAINT			1000
+#define RELAY_TEST_TITLE_EVERY		25		// frames
+#define RELAY_TEST_MAX_FRAMES		4096
+#define RELAY_TEST_MAX_TITLES		256
+#define RELAY_TEST_TITLE_SLACK		2		// frames a title may land away from where it was sent
+
+/* MPEG 1 Layer III, 128 kbps, 44100 Hz, stereo, no padding: 144 * 128000 / 44100 */
+#define MOCK_FRAME_BYTES		417
+#define MOCK_FRAME_SAMPLES		1152
+#define MOCK_FRAME_MICROS		(1000000LL * MOCK_FRAME_SAMPLES / 44100)
+#define MOCK_SEQUENCE_OFFSET	36		// past the header and the stereo side info
+
+static const unsigned char	mockHeader[4] = { 0xFF, 0xFB, 0x90, 0x00 };
+static const int			chunkSizes[] = { 1, 700, 13, 389, 2, 1024, 97, 5, 512, 251 };
+
+static int	stallMs = 3000;
+static int	verbose = 0;
+
+static void usage(void) {
+	fprintf(stderr, "usage: mcaster1_relaytest [-t scenario,...] [-s stall ms] [-v]\n");
+	fprintf(stderr, "  -t list  metadata, redirect, reconnect, stall (default all)\n");
+	fprintf(stderr, "  -s ms    how long the upstream goes quiet in the stall scenario (default %d)\n", stallMs);
+	fprintf(stderr, "  -v       print the relay's status lines\n");
+}
+
+static void sleepMs(int ms) {
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/*
+ =======================================================================================================================
+    Mock upstream.  One connection at a time, as the relay makes them.  The
+    frame numbering and the title schedule run on across connections, the
+    way a server's mount does.
+ =======================================================================================================================
+ */
+typedef struct tagMockPlan {
+	const char	*name;
+	int			redirectFirst;		// answer the first request with a 302 to /live
+	int			icyStatus;			// "ICY 200 OK" instead of "HTTP/1.0 200 OK"
+	int			seconds;			// streamed in all
+	int			dropAfterFrames;	// close the first connection after this many frames, 0 = never
+	int			stallAfterFrames;	// go quiet for stallMs after this many frames, 0 = never
+} MockPlan;
+
+typedef struct tagMockUpstream {
+	const MockPlan		*plan;
+	SOCKET				listener;
+	int					port;
+	pthread_t			thread;
+	std::atomic<int>	running;
+	std::atomic<int>	finished;			// every frame of the plan was sent
+	int					requests;
+	char				lastPath[256];
+	long				framesSent;
+	int					titlesSent;
+	long				titleFrame[RELAY_TEST_MAX_TITLES];	// the frame each title was sent in front of
+	long long			stallStarted;
+	long long			stallEnded;
+} MockUpstream;
+
+static void mockTitle(char *title, int size, int n) {
+	snprintf(title, size, "Mock Artist %d - Song '%d'", n, n);
+}
+
+/* Sends in the odd sized pieces, 0 = the relay has gone */
+static int mockSend(SOCKET s, const unsigned char *data, int length, int *piece) {
+	while(length > 0) {
+		int size = chunkSizes[(*piece)++ % (sizeof(chunkSizes) / sizeof(chunkSizes[0]))];
+
+		if(size > length) {
+			size = length;
+		}
+
+		if(send(s, (const char *) data, size, 0) != size) {
+			return 0;
+		}
+
+		data += size;
+		length -= size;
+	}
+
+	return 1;
+}
+
+/* Request headers up to the blank line, 0 = closed first */
+static int mockRequest(SOCKET s, char *path, int pathSize) {
+	char	request[4096];
+	int		got = 0;
+
+	request[0] = '\000';
+
+	while(!strstr(request, "\r\n\r\n")) {
+		if(got >= (int) sizeof(request) - 1) {
+			return 0;
+		}
+
+		int n = recv(s, request + got, sizeof(request) - 1 - got, 0);
+
+		if(n <= 0) {
+			return 0;
+		}
+
+		got += n;
+		request[got] = '\000';
+	}
+
+	const char	*start = strchr(request, ' ');
+	int			length = start ? (int) strcspn(start + 1, " \r\n") : 0;
+
+	if(length >= pathSize) {
+		length = pathSize - 1;
+	}
+
+	memcpy(path, start ? start + 1 : "", length);
+	path[length] = '\000';
+	return 1;
+}
+
+/* Streams until the plan says to stop or the relay goes, 1 = the plan is done */
+static int mockStream(MockUpstream *m, SOCKET s, int first) {
+	const MockPlan	*plan = m->plan;
+	long			totalFrames = (long) ((long long) plan->seconds * 1000000 / MOCK_FRAME_MICROS);
+	long			burst = (long) ((long long) RELAY_TEST_BUFFER_MS * 1000 / MOCK_FRAME_MICROS);
+	long			framesHere = 0;
+	long long		started = getMonotonicMicros();
+	int				countdown = RELAY_TEST_METAINT;
+	int				titleDirty = 1;			// a new listener gets the current title
+	int				piece = 0;
+	unsigned char	frame[MOCK_FRAME_BYTES];
+	unsigned char	out[MOCK_FRAME_BYTES * 2 + 256 * 16];
+
+	while(m->running && (m->framesSent < totalFrames)) {
+		if(first && plan->dropAfterFrames && (framesHere == plan->dropAfterFrames)) {
+			return 0;
+		}
+
+		if(first && plan->stallAfterFrames && (framesHere == plan->stallAfterFrames) && !m->stallStarted) {
+			m->stallStarted = getMonotonicMicros();
+			for(int waited = 0; m->running && (waited < stallMs); waited += 10) {
+				sleepMs(10);
+			}
+
+			m->stallEnded = getMonotonicMicros();
+			started += m->stallEnded - m->stallStarted;
+		}
+
+		/* a burst of the relay's buffer, then real time */
+		long long	due = started + (framesHere - burst) * MOCK_FRAME_MICROS;
+		long long	wait = due - getMonotonicMicros();
+
+		if(wait > 1000) {
+			sleepMs((int) (wait / 1000));
+		}
+
+		if((m->framesSent % RELAY_TEST_TITLE_EVERY == 0) && (m->titlesSent < RELAY_TEST_MAX_TITLES)) {
+			m->titleFrame[m->titlesSent++] = m->framesSent;
+			titleDirty = 1;
+		}
+
+		memset(frame, 0, sizeof(frame));
+		memcpy(frame, mockHeader, sizeof(mockHeader));
+		frame[MOCK_SEQUENCE_OFFSET] = (unsigned char) (m->framesSent >> 24);
+		frame[MOCK_SEQUENCE_OFFSET + 1] = (unsigned char) (m->framesSent >> 16);
+		frame[MOCK_SEQUENCE_OFFSET + 2] = (unsigned char) (m->framesSent >> 8);
+		frame[MOCK_SEQUENCE_OFFSET + 3] = (unsigned char) m->framesSent;
+
+		/* the frame with a metadata block wherever RELAY_TEST_METAINT comes round */
+		int length = 0;
+
+		for(int at = 0; at < MOCK_FRAME_BYTES;) {
+			int take = (MOCK_FRAME_BYTES - at < countdown) ? MOCK_FRAME_BYTES - at : countdown;
+
+			memcpy(out + length, frame + at, take);
+			length += take;
+			at += take;
+			countdown -= take;
+			if(countdown) {
+				continue;
+			}
+
+			countdown = RELAY_TEST_METAINT;
+			if(!titleDirty) {
+				out[length++] = 0;
+				continue;
+			}
+
+			char	title[128];
+			char	meta[256];
+
+			mockTitle(title, sizeof(title), m->titlesSent - 1);
+
+			int metaLength = snprintf(meta, sizeof(meta), "StreamTitle='%s';StreamUrl='';", title);
+			int blocks = (metaLength + 15) / 16;
+
+			out[length++] = (unsigned char) blocks;
+			memset(out + length, 0, blocks * 16);
+			memcpy(out + length, meta, metaLength);
+			length += blocks * 16;
+			titleDirty = 0;
+		}
+
+		if(!mockSend(s, out, length, &piece)) {
+			return 0;
+		}
+
+		m->framesSent++;
+		framesHere++;
+	}
+
+	return m->framesSent >= totalFrames;
+}
+
+static void *mockUpstreamThread(void *arg) {
+	MockUpstream	*m = (MockUpstream *) arg;
+	int				connections = 0;
+
+	while(m->running) {
+		fd_set			readable;
+		struct timeval	tv;
+
+		FD_ZERO(&readable);
+		FD_SET(m->listener, &readable);
+		tv.tv_sec = 0;
+		tv.tv_usec = 100 * 1000;
+		if(select((int) m->listener + 1, &readable, NULL, NULL, &tv) <= 0) {
+			continue;
+		}
+
+		SOCKET	s = accept(m->listener, NULL, NULL);
+
+		if(s == INVALID_SOCKET) {
+			continue;
+		}
+
+		if(mockRequest(s, m->lastPath, sizeof(m->lastPath))) {
+			char	reply[512];
+
+			m->requests++;
+			if(m->plan->redirectFirst && (m->requests == 1)) {
+				snprintf(reply, sizeof(reply), "HTTP/1.0 302 Found\r\nLocation: http://127.0.0.1:%d/live\r\n\r\n", m->port);
+				send(s, reply, (int) strlen(reply), 0);
+			}
+			else {
+				snprintf(reply, sizeof(reply), "%s\r\nContent-Type: audio/mpeg\r\nicy-br: 128\r\nicy-metaint: %d\r\n\r\n",
+						 m->plan->icyStatus ? "ICY 200 OK" : "HTTP/1.0 200 OK", RELAY_TEST_METAINT);
+				send(s, reply, (int) strlen(reply), 0);
+				if(mockStream(m, s, !connections++)) {
+					m->finished = 1;
+
+					/* the relay keeps the connection, the test stops it */
+					while(m->running) {
+						sleepMs(10);
+					}
+				}
+			}
+		}
+
+		closesocket(s);
+	}
+
+	return NULL;
+}
+
+static int startMockUpstream(MockUpstream *m, const MockPlan *plan) {
+	struct sockaddr_in	sa;
+	socklen_t			length = sizeof(sa);
+
+	memset(&sa, '\000', sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = 0;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	m->plan = plan;
+	m->listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(m->listener == INVALID_SOCKET) {
+		return 0;
+	}
+
+	if((bind(m->listener, (struct sockaddr *) &sa, sizeof(sa)) != 0)
+	   || (listen(m->listener, SOMAXCONN) != 0)
+	   || (getsockname(m->listener, (struct sockaddr *) &sa, &length) != 0)) {
+		closesocket(m->listener);
+		return 0;
+	}
+
+	m->port = ntohs(sa.sin_port);
+	m->running = 1;
+	if(pthread_create(&m->thread, NULL, mockUpstreamThread, m) != 0) {
+		m->running = 0;
+		closesocket(m->listener);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void stopMockUpstream(MockUpstream *m) {
+	m->running = 0;
+	pthread_join(m->thread, NULL);
+	closesocket(m->listener);
+}
+
+/*
+ =======================================================================================================================
+    What the relay hands the encoders, all from its clock thread
+ =======================================================================================================================
+ */
+typedef struct tagRelayRecord {
+	pthread_mutex_t	mutex;
+	long			frames;
+	long			lastSequence;
+	long			outOfOrder;
+	long			missing;
+	long			silenceFrames;
+	long			gaps;
+	long long		lastCallback;
+	long long		longestGap;			// micros between two callbacks
+	int				titles;
+	char			title[RELAY_TEST_MAX_TITLES][128];
+	long			titleFrame[RELAY_TEST_MAX_TITLES];	// the frame played right after it
+	int				titlePending;
+	long			framesAfterStall;
+	long long		stallEnded;			// set by the test once the mock resumes
+} RelayRecord;
+
+static RelayRecord	record;
+
+/* With record.mutex held */
+static void recordCallback(void) {
+	long long	now = getMonotonicMicros();
+
+	if(record.lastCallback && (now - record.lastCallback > record.longestGap)) {
+		record.longestGap = now - record.lastCallback;
+	}
+
+	record.lastCallback = now;
+}
+
+static int onFrame(const CompressedFrame *frame) {
+	const unsigned char *p = frame->data + MOCK_SEQUENCE_OFFSET;
+	long				sequence = ((long) p[0] << 24) | ((long) p[1] << 16) | ((long) p[2] << 8) | (long) p[3];
+
+	pthread_mutex_lock(&record.mutex);
+	recordCallback();
+	if(record.frames && (sequence <= record.lastSequence)) {
+		record.outOfOrder++;
+	}
+	else if(record.frames) {
+		record.missing += sequence - record.lastSequence - 1;
+	}
+
+	if(record.titlePending) {
+		record.titleFrame[record.titles - 1] = sequence;
+		record.titlePending = 0;
+	}
+
+	if(record.stallEnded && (record.lastCallback > record.stallEnded)) {
+		record.framesAfterStall++;
+	}
+
+	record.lastSequence = sequence;
+	record.frames++;
+	pthread_mutex_unlock(&record.mutex);
+
+	/* passthrough, nothing to decode */
+	return 0;
+}
+
+static void onAudio(float *samples, int frames, int channels, int samplerate) {
+	(void) samples;
+	(void) channels;
+	(void) samplerate;
+	pthread_mutex_lock(&record.mutex);
+	recordCallback();
+	record.silenceFrames += frames;
+	pthread_mutex_unlock(&record.mutex);
+}
+
+static void onMetadata(const char *text) {
+	pthread_mutex_lock(&record.mutex);
+	if(record.titles < RELAY_TEST_MAX_TITLES) {
+		snprintf(record.title[record.titles], sizeof(record.title[0]), "%s", text);
+		record.titleFrame[record.titles++] = -1;
+		record.titlePending = 1;
+	}
+
+	pthread_mutex_unlock(&record.mutex);
+}
+
+static void onGap(void) {
+	pthread_mutex_lock(&record.mutex);
+	record.gaps++;
+	pthread_mutex_unlock(&record.mutex);
+}
+
+static void onStatus(const char *text) {
+	if(verbose) {
+		fprintf(stderr, "    %s\n", text);
+	}
+}
+
+/*
+ =======================================================================================================================
+    Scenarios
+ =======================================================================================================================
+ */
+static const MockPlan	plans[] = {
+	{ "metadata", 0, 1, 6, 0, 0 },
+	{ "redirect", 1, 0, 3, 0, 0 },
+	{ "reconnect", 0, 0, 6, 100, 0 },
+	{ "stall", 0, 1, 6, 0, 100 },
+};
+
+static int	failures = 0;
+
+static void check(const char *scenario, int ok, const char *fmt, ...) {
+	char	message[512];
+	va_list parms;
+
+	va_start(parms, fmt);
+	vsnprintf(message, sizeof(message), fmt, parms);
+	va_end(parms);
+
+	printf("%s %-10s %s\n", ok ? "PASS" : "FAIL", scenario, message);
+	if(!ok) {
+		failures++;
+	}
+}
+
+static void runScenario(const MockPlan *plan) {
+	MockUpstream	*m = new MockUpstream();
+	RelayInput		*relay = (RelayInput *) calloc(1, sizeof(RelayInput));
+	char			url[256];
+
+	memset(&record.frames, '\000', sizeof(record) - offsetof(RelayRecord, frames));
+	if(!relay || !startMockUpstream(m, plan)) {
+		check(plan->name, 0, "cannot listen on 127.0.0.1");
+		delete m;
+		free(relay);
+		return;
+	}
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/stream", m->port);
+	if(!startRelayInput(relay, url, RELAY_TEST_BUFFER_MS, onFrame, onAudio, onMetadata, onGap, onStatus)) {
+		check(plan->name, 0, "startRelayInput refused %s", url);
+		stopMockUpstream(m);
+		delete m;
+		free(relay);
+		return;
+	}
+
+	/* the plan, the stall, a reconnect and the buffer to drain, with room to spare */
+	long long	deadline = getMonotonicMicros() + ((long long) plan->seconds * 1000 + stallMs + 5000) * 1000;
+
+	while(!m->finished && (getMonotonicMicros() < deadline)) {
+		pthread_mutex_lock(&record.mutex);
+		record.stallEnded = m->stallEnded;
+		pthread_mutex_unlock(&record.mutex);
+		sleepMs(20);
+	}
+
+	/* the buffer runs dry once the upstream is done, that one is not counted */
+	long	underruns = relay->underruns;
+
+	/* what is still in the jitter buffer plays out */
+	sleepMs(RELAY_TEST_BUFFER_MS * 2);
+	stopRelayInput(relay);
+	stopMockUpstream(m);
+
+	RelayRecord *r = &record;
+	long		sent = m->framesSent;
+
+	check(plan->name, m->finished, "mock streamed %ld frames over %d connection(s)", sent, m->requests - plan->redirectFirst);
+	check(plan->name, r->outOfOrder == 0, "%ld frames played, %ld out of order", r->frames, r->outOfOrder);
+	check(plan->name, r->longestGap <= RELAY_TEST_MAX_GAP_MS * 1000, "longest wait between two blocks %lld ms (at most %d)",
+		  r->longestGap / 1000, RELAY_TEST_MAX_GAP_MS);
+
+	/* a frame is only let out once the header after it is in */
+	long	unplayed = sent - r->frames - r->missing;
+
+	check(plan->name, (unplayed >= 0) && (unplayed <= 2), "%ld frames not played at the end", unplayed);
+
+	if(!strcmp(plan->name, "metadata")) {
+		check(plan->name, (r->missing == 0) && (relay->droppedFrames == 0), "%ld frames missing, %ld dropped by the jitter buffer",
+			  r->missing, relay->droppedFrames);
+		check(plan->name, underruns == 0, "%ld underruns", underruns);
+
+		int inOrder = 1;
+		int aligned = 1;
+
+		for(int i = 0; i < r->titles; i++) {
+			char	expected[128];
+
+			mockTitle(expected, sizeof(expected), i);
+			if(strcmp(r->title[i], expected)) {
+				inOrder = 0;
+			}
+
+			if((r->titleFrame[i] >= 0) && (labs(r->titleFrame[i] - m->titleFrame[i]) > RELAY_TEST_TITLE_SLACK)) {
+				aligned = 0;
+			}
+		}
+
+		/* the last title may still be waiting for its frame */
+		check(plan->name, inOrder && (r->titles >= m->titlesSent - 1), "%d of %d titles in order, quotes inside kept", r->titles, m->titlesSent);
+		check(plan->name, aligned, "titles within %d frames of where they were sent", RELAY_TEST_TITLE_SLACK);
+	}
+	else if(!strcmp(plan->name, "redirect")) {
+		check(plan->name, (m->requests == 2) && !strcmp(m->lastPath, "/live"), "%d requests, the last for %s", m->requests, m->lastPath);
+		check(plan->name, relay->connects == 1, "%ld streaming connections", relay->connects);
+	}
+	else if(!strcmp(plan->name, "reconnect")) {
+		check(plan->name, relay->connects == 2, "%ld streaming connections", relay->connects);
+
+		/*
+		 * the dropped connection's last frame never sees the header after it,
+		 * and the new connection's burst lands on a full jitter buffer
+		 */
+		check(plan->name, r->missing <= relay->droppedFrames + 1, "%ld frames lost across the reconnect, %ld dropped by the jitter buffer",
+			  r->missing, relay->droppedFrames);
+		check(plan->name, r->titles >= m->titlesSent - 1, "%d of %d titles after the reconnect", r->titles, m->titlesSent);
+	}
+	else if(!strcmp(plan->name, "stall")) {
+		check(plan->name, (underruns >= 1) && (r->gaps >= 1) && (r->silenceFrames > 0), "%ld underruns, %ld gaps, %ld frames of silence",
+			  underruns, r->gaps, r->silenceFrames);
+		check(plan->name, r->framesAfterStall > 0, "%ld frames played after the upstream came back", r->framesAfterStall);
+	}
+
+	free(relay);
+	delete m;
+}
+
+int main(int argc, char **argv) {
+	const char	*scenarios = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-v")) {
+			verbose = 1;
+		}
+		else if(!strcmp(argv[i], "-t") && (i + 1 < argc)) {
+			scenarios = argv[++i];
+		}
+		else if(!strcmp(argv[i], "-s") && (i + 1 < argc)) {
+			stallMs = atoi(argv[++i]);
+		}
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+#ifdef WIN32
+	WSADATA wsaData;
+
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+	pthread_mutex_init(&record.mutex, NULL);
+
+	int ran = 0;
+
+	for(int i = 0; i < (int) (sizeof(plans) / sizeof(plans[0])); i++) {
+		const char	*name = plans[i].name;
+		const char	*at = scenarios ? strstr(scenarios, name) : NULL;
+
+		if(scenarios && !(at && ((at == scenarios) || (at[-1] == ',')) && ((at[strlen(name)] == ',') || !at[strlen(name)]))) {
+			continue;
+		}
+
+		runScenario(&plans[i]);
+		ran++;
+	}
+
+	if(!ran) {
+		usage();
+		return 2;
+	}
+
+	printf("%s, %d check(s) failed\n", failures ? "FAILED" : "passed", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * mcaster1_transcoder.cpp - FRONT_END_TRANSCODER
+ *
+ * Pre-encodes jingles and show libraries with exactly the codec settings of
+ * the live encoder slots.  Every (input file, encoder slot) pair is a job;
+ * a job decodes the file and pushes it through handle_output as fast as the
+ * CPU allows, the slot's codec writes to a file instead of a server.  Jobs
+ * run on a pool of worker threads.  An MP3 that already is what the slot
+ * encodes is copied frame by frame instead (passthrough).
+ *
+ * usage: mcaster1_transcoder [-c config] [-e 1,2,...] [-j jobs] [-o outdir] file...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "libmcaster1dspencoder.h"
+#include "async_log.h"
+#include "config_yaml.h"
+#include "transcode_input.h"
+#include "frame_parser.h"
+
+#define TRANSCODE_BLOCK_FRAMES	4096
+#define TRANSCODE_MAX_SLOTS		64
+
+#ifdef WIN32
+#define PATH_SEPARATOR '\\'
+#else
+#define PATH_SEPARATOR '/'
+#endif
+
+static char				configBase[1024] = "MCASTER1DSPENCODER";
+static char				outputDir[1024] = "";
+static int				slots[TRANSCODE_MAX_SLOTS];
+static int				numSlots = 0;
+static char				**inputFiles = NULL;
+static int				numInputFiles = 0;
+
+static pthread_mutex_t	jobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t	configMutex = PTHREAD_MUTEX_INITIALIZER;	/* the config store in the lib is shared */
+static int				nextJob = 0;
+static int				failedJobs = 0;
+
+static void usage(void) {
+	fprintf(stderr, "usage: mcaster1_transcoder [-c config] [-e 1,2,...] [-j jobs] [-o outdir] file...\n");
+	fprintf(stderr, "  -c config  encoder config base name, slot n is read from <config>_<n>.yaml (default %s)\n", configBase);
+	fprintf(stderr, "  -e list    encoder slots to transcode with (default all NumEncoders in <config>_0.yaml)\n");
+	fprintf(stderr, "  -j jobs    files/slots encoded in parallel (default one per CPU)\n");
+	fprintf(stderr, "  -o outdir  output directory (default next to each input)\n");
+	fprintf(stderr, "input: .wav .flac .mp3, output: <outdir>/<name>_<slot>.<codec extension>\n");
+}
+
+static int cpuCount(void) {
+#ifdef WIN32
+	SYSTEM_INFO	info;
+
+	GetSystemInfo(&info);
+	return (int) info.dwNumberOfProcessors;
+#else
+	long		n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0) ? (int) n : 1;
+#endif
+}
+
+/* Slot settings come from the same YAML files the encoder uses */
+static int loadSlotConfig(mcaster1Globals *g, int slot) {
+	int ok;
+
+	memset(g, '\000', sizeof(*g));
+	g->encoderNumber = slot;
+	setConfigFileName(g, configBase);
+	initializeGlobals(g);
+
+	/* config_read only takes the keys registered here, as in the encoder */
+	if(slot == 0) {
+		addUISettings(g);
+	}
+	else {
+		addBasicEncoderSettings(g);
+	}
+
+	pthread_mutex_lock(&configMutex);
+	ok = readConfigYAML(g);
+	pthread_mutex_unlock(&configMutex);
+
+	setFrontEndType(g, FRONT_END_TRANSCODER);
+	return ok;
+}
+
+static void freeSlotConfig(mcaster1Globals *g) {
+	for(int i = 0; i < g->numConfigVariables; i++) {
+		free(g->configVariables[i]);
+	}
+
+	/* the log thread may still have lines for this slot */
+	logFlush();
+	if(g->logFilep) {
+		fclose(g->logFilep);
+	}
+
+	pthread_mutex_destroy(&(g->mutex));
+	free(g);
+}
+
+/* Start of the file name in a path */
+static const char *pathTail(const char *path) {
+	const char	*tail = strrchr(path, PATH_SEPARATOR);
+
+#ifdef WIN32
+	if(!tail) {
+		tail = strrchr(path, '/');
+	}
+#endif
+	return tail ? tail + 1 : path;
+}
+
+/* File name without directory and extension */
+static void baseName(char *out, int outSize, const char *input) {
+	snprintf(out, outSize, "%s", pathTail(input));
+
+	char	*dot = strrchr(out, '.');
+
+	if(dot) {
+		*dot = '\000';
+	}
+}
+
+static void buildOutputName(char *out, int outSize, const char *input, int slot, const char *extension) {
+	char	name[1024] = "";
+
+	baseName(name, sizeof(name), input);
+	if(outputDir[0]) {
+		snprintf(out, outSize, "%s%c%s_%d.%s", outputDir, PATH_SEPARATOR, name, slot, extension);
+	}
+	else {
+		/* next to the input */
+		snprintf(out, outSize, "%.*s%s_%d.%s", (int) (pathTail(input) - input), input, name, slot, extension);
+	}
+}
+
+/*
+ =======================================================================================================================
+    Stream copy.  A first pass checks that every frame of the file matches the slot, a second one sends them.
+ =======================================================================================================================
+ */
+typedef struct tagStreamCopy {
+	mcaster1Globals	*g;
+	int				matches;		// every frame so far matched the slot
+	long long		samples;		// per channel, copied
+	int				samplerate;
+} StreamCopy;
+
+static void checkCopyFrame(const CompressedFrame *frame, void *user) {
+	StreamCopy	*copy = (StreamCopy *) user;
+
+	if(!passthroughMatches(copy->g, frame)) {
+		copy->matches = 0;
+	}
+}
+
+static void sendCopyFrame(const CompressedFrame *frame, void *user) {
+	StreamCopy	*copy = (StreamCopy *) user;
+
+	if(copy->g->weareconnected && passthroughFrame(copy->g, frame)) {
+		copy->samples += frame->samples;
+		copy->samplerate = frame->samplerate;
+	}
+}
+
+/* 1 = the whole file was read */
+static int parseMP3File(const char *input, FrameParser *parser, frameParserCallback callback, StreamCopy *copy) {
+	FILE			*fp = fopen(input, "rb");
+	unsigned char	buffer[8192];
+	size_t			n;
+
+	if(!fp) {
+		return 0;
+	}
+
+	initFrameParser(parser, FRAME_CODEC_MP3);
+	while((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		feedFrameParser(parser, buffer, (int) n, callback, copy);
+		if(!copy->matches) {
+			break;
+		}
+	}
+
+	int ok = !ferror(fp);
+
+	fclose(fp);
+	if(ok && copy->matches) {
+		flushFrameParser(parser, callback, copy);
+	}
+
+	return ok;
+}
+
+static int canCopyMP3(mcaster1Globals *g, const char *input, FrameParser *parser) {
+	StreamCopy	copy;
+
+	memset(&copy, '\000', sizeof(copy));
+	copy.g = g;
+	copy.matches = 1;
+	return parseMP3File(input, parser, checkCopyFrame, &copy) && copy.matches && parser->frames;
+}
+
+static int transcodeJob(const char *input, int slot) {
+	mcaster1Globals	*g = (mcaster1Globals *) malloc(sizeof(mcaster1Globals));
+	TranscodeInput	in;
+	char			message[1024] = "";
+	char			output[1024] = "";
+	float			*block = (float *) malloc(sizeof(float) * TRANSCODE_BLOCK_FRAMES * 2);
+	FrameParser		*parser = (FrameParser *) malloc(sizeof(FrameParser));
+	int				ok = 0;
+
+	if(!g || !block || !parser) {
+		fprintf(stderr, "%s [%d]: out of memory\n", input, slot);
+		free(g);
+		free(block);
+		free(parser);
+		return 0;
+	}
+
+	if(!loadSlotConfig(g, slot)) {
+		fprintf(stderr, "%s [%d]: cannot read %s_%d.yaml\n", input, slot, configBase, slot);
+	}
+	else if(!getEncoderExtension(g)) {
+		fprintf(stderr, "%s [%d]: encoder %s is not available in this build\n", input, slot, g->gEncodeType);
+	}
+	else if(!openTranscodeInput(&in, input, message, sizeof(message))) {
+		fprintf(stderr, "%s: %s\n", input, message);
+	}
+	else {
+		buildOutputName(output, sizeof(output), input, slot, getEncoderExtension(g));
+		/* title for the stream headers (Vorbis/Opus/FLAC comments) */
+		baseName(g->gSongTitle, sizeof(g->gSongTitle), input);
+
+		long long	started = getMonotonicMicros();
+
+		if(!openOutputFile(g, output)) {
+			fprintf(stderr, "%s [%d]: cannot start %s encoder for %s\n", input, slot, g->gEncodeType, output);
+		}
+		else {
+			int			frames = 0;
+			double		seconds;
+			StreamCopy	copy;
+
+			memset(&copy, '\000', sizeof(copy));
+			copy.g = g;
+			copy.matches = 1;
+
+			if((in.type == TRANSCODE_INPUT_MP3) && canCopyMP3(g, input, parser)) {
+				/* nothing has been encoded yet, so there is nothing to flush in front of the frames */
+				g->passthroughActive = 1;
+				if(!parseMP3File(input, parser, sendCopyFrame, &copy)) {
+					frames = -1;
+				}
+
+				seconds = copy.samplerate ? (double) copy.samples / copy.samplerate : 0.0;
+			}
+			else {
+				while((frames = readTranscodeInput(&in, block, TRANSCODE_BLOCK_FRAMES)) > 0) {
+					handle_output(g, block, frames, in.channels, in.samplerate);
+
+					/* a write error disconnects the slot */
+					if(!g->weareconnected) {
+						break;
+					}
+				}
+
+				seconds = (double) in.framesRead / in.samplerate;
+			}
+
+			ok = (frames == 0) && g->weareconnected;
+			if(!closeOutputFile(g)) {
+				ok = 0;
+			}
+
+			double	elapsed = (getMonotonicMicros() - started) / 1000000.0;
+
+			if(ok) {
+				printf("%s -> %s (%s%s, %.1f s in %.1f s, %.0fx real time)\n",
+					   input, output, g->codec ? g->codec->name : g->gEncodeType, g->passthroughActive ? " copy" : "", seconds, elapsed,
+					   (elapsed > 0) ? seconds / elapsed : 0.0);
+			}
+			else {
+				fprintf(stderr, "%s [%d]: %s failed after %.1f s of audio\n", input, slot, (frames < 0) ? "decoding" : "encoding", seconds);
+				remove(output);
+			}
+		}
+
+		closeTranscodeInput(&in);
+	}
+
+	freeupGlobals(g);
+	freeSlotConfig(g);
+	free(block);
+	free(parser);
+	return ok;
+}
+
+/* Jobs are numbered file by file, so the slots of one file run side by side */
+static void *transcodeWorker(void *arg) {
+	for(;;) {
+		int job;
+
+		pthread_mutex_lock(&jobMutex);
+		job = nextJob++;
+		pthread_mutex_unlock(&jobMutex);
+
+		if(job >= numInputFiles * numSlots) {
+			break;
+		}
+
+		if(!transcodeJob(inputFiles[job / numSlots], slots[job % numSlots])) {
+			pthread_mutex_lock(&jobMutex);
+			failedJobs++;
+			pthread_mutex_unlock(&jobMutex);
+		}
+	}
+
+	return NULL;
+}
+
+static int parseSlots(const char *list) {
+	const char	*p = list;
+
+	numSlots = 0;
+	while(*p && (numSlots < TRANSCODE_MAX_SLOTS)) {
+		int slot = atoi(p);
+
+		if(slot < 1) {
+			return 0;
+		}
+
+		slots[numSlots++] = slot;
+		p = strchr(p, ',');
+		if(!p) {
+			break;
+		}
+
+		p++;
+	}
+
+	return numSlots > 0;
+}
+
+/* All slots the encoder itself would run, from NumEncoders in <config>_0.yaml */
+static int defaultSlots(void) {
+	mcaster1Globals	*g = (mcaster1Globals *) malloc(sizeof(mcaster1Globals));
+	int				count = 0;
+
+	if(g && loadSlotConfig(g, 0)) {
+		count = g->gNumEncoders;
+	}
+
+	if(g) {
+		freeSlotConfig(g);
+	}
+
+	for(numSlots = 0; (numSlots < count) && (numSlots < TRANSCODE_MAX_SLOTS); numSlots++) {
+		slots[numSlots] = numSlots + 1;
+	}
+
+	return numSlots > 0;
+}
+
+int main(int argc, char **argv) {
+	int			workers = cpuCount();
+	int			i;
+
+	for(i = 1; i < argc; i++) {
+		if((argv[i][0] != '-') || !argv[i][1]) {
+			break;
+		}
+
+		if(i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+
+		switch(argv[i][1]) {
+			case 'c':
+				strncpy(configBase, argv[++i], sizeof(configBase) - 1);
+				break;
+
+			case 'e':
+				if(!parseSlots(argv[++i])) {
+					fprintf(stderr, "bad encoder list %s\n", argv[i]);
+					return 2;
+				}
+				break;
+
+			case 'j':
+				workers = atoi(argv[++i]);
+				break;
+
+			case 'o':
+				strncpy(outputDir, argv[++i], sizeof(outputDir) - 1);
+				break;
+
+			default:
+				usage();
+				return 2;
+		}
+	}
+
+	inputFiles = argv + i;
+	numInputFiles = argc - i;
+	if(numInputFiles <= 0) {
+		usage();
+		return 2;
+	}
+
+	if(!numSlots && !defaultSlots()) {
+		fprintf(stderr, "no encoders configured in %s_0.yaml, use -e\n", configBase);
+		return 2;
+	}
+
+	if(workers < 1) {
+		workers = 1;
+	}
+
+	if(workers > numInputFiles * numSlots) {
+		workers = numInputFiles * numSlots;
+	}
+
+	pthread_t	*threads = (pthread_t *) malloc(sizeof(pthread_t) * workers);
+	int			started = 0;
+
+	for(i = 0; threads && (i < workers); i++) {
+		if(pthread_create(&threads[started], NULL, transcodeWorker, NULL) == 0) {
+			started++;
+		}
+	}
+
+	/* no threads, do the work here */
+	if(!started) {
+		transcodeWorker(NULL);
+	}
+
+	for(i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	printf("%d of %d jobs done\n", numInputFiles * numSlots - failedJobs, numInputFiles * numSlots);
+	return failedJobs ? 1 : 0;
+}
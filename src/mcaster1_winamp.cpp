@@ -306,21 +306,8 @@ static signed int scale(int sample)
 }
 int encode_samples(struct winampDSPModule *this_mod, short int *short_samples, int numsamples, int bps, int nch, int srate)
 {
-	float	samples[8196*16];
-	static short lastSample = 0;
-	static signed int sample;
-
-  
-	int	samplecount = 0;
-	short int *psample = short_samples;
-
     if (!LiveRecordingCheck()) {
-        for (int i=0;i<numsamples*nch;i++) {
-            sample = *psample++;
-            samples[i] = sample/32767.f;
-        }
-    
-        int ret = handleAllOutput((float *)&samples, numsamples, nch, srate);
+        int ret = handleAllOutputInt16(short_samples, numsamples, nch, srate);
     }
 	return numsamples;
 }	